@@ -0,0 +1 @@
+/root/repo/tools/include/../../xen/include/public/event_channel.h
\ No newline at end of file
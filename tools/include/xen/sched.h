@@ -0,0 +1 @@
+/root/repo/tools/include/../../xen/include/public/sched.h
\ No newline at end of file
@@ -307,6 +307,10 @@ struct libxenvchan *libxenvchan_server_init(xentoollog_logger *logger, int domai
 
 	ctrl->ring = NULL;
 	ctrl->event = NULL;
+	ctrl->notify_batch = 0;
+	ctrl->notify_delay = 0;
+	ctrl->notify_bits = 0;
+	ctrl->notify_pending = 0;
 	ctrl->is_server = 1;
 	ctrl->server_persist = 0;
 
@@ -386,6 +390,10 @@ struct libxenvchan *libxenvchan_client_init(xentoollog_logger *logger, int domai
 		return 0;
 	ctrl->ring = NULL;
 	ctrl->event = NULL;
+	ctrl->notify_batch = 0;
+	ctrl->notify_delay = 0;
+	ctrl->notify_bits = 0;
+	ctrl->notify_pending = 0;
 	ctrl->gnttab = NULL;
 	ctrl->write.order = ctrl->read.order = 0;
 	ctrl->is_server = 0;
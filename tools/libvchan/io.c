@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <xenctrl.h>
@@ -111,6 +112,56 @@ static inline int send_notify(struct libxenvchan *ctrl, uint8_t bit)
 		return 0;
 }
 
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int libxenvchan_flush(struct libxenvchan *ctrl)
+{
+	uint8_t bits = ctrl->notify_bits;
+	ctrl->notify_bits = 0;
+	ctrl->notify_pending = 0;
+	if ((bits & VCHAN_NOTIFY_WRITE) && send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+		return -1;
+	if ((bits & VCHAN_NOTIFY_READ) && send_notify(ctrl, VCHAN_NOTIFY_READ))
+		return -1;
+	return 0;
+}
+
+/*
+ * We moved an index by size bytes: tell the peer, unless we are batching
+ * notifications and neither the byte nor the time limit has been reached.
+ */
+static int update_notify(struct libxenvchan *ctrl, uint8_t bit, size_t size)
+{
+	if (!ctrl->notify_batch)
+		return send_notify(ctrl, bit);
+
+	if (!ctrl->notify_bits && ctrl->notify_delay)
+		ctrl->notify_since = now_us();
+	ctrl->notify_bits |= bit;
+	ctrl->notify_pending += size;
+
+	if (ctrl->notify_pending >= ctrl->notify_batch ||
+	    (ctrl->notify_delay &&
+	     now_us() - ctrl->notify_since >= ctrl->notify_delay))
+		return libxenvchan_flush(ctrl);
+	return 0;
+}
+
+int libxenvchan_set_notify_batch(struct libxenvchan *ctrl, size_t bytes,
+		unsigned int usecs)
+{
+	if (!bytes && usecs)
+		return -1;
+	ctrl->notify_batch = bytes;
+	ctrl->notify_delay = usecs;
+	return libxenvchan_flush(ctrl);
+}
+
 /*
  * Get the amount of buffer space available, and do nothing about
  * notifications.
@@ -195,34 +246,105 @@ int libxenvchan_buffer_space(struct libxenvchan *ctrl)
 
 int libxenvchan_wait(struct libxenvchan *ctrl)
 {
-	int ret = xc_evtchn_pending(ctrl->event);
+	int ret;
+	/* The peer may be waiting for what we have not told it about yet. */
+	if (libxenvchan_flush(ctrl))
+		return -1;
+	ret = xc_evtchn_pending(ctrl->event);
 	if (ret < 0)
 		return -1;
 	xc_evtchn_unmask(ctrl->event, ret);
 	return 0;
 }
 
+static size_t iov_length(const struct iovec *iov, int iovcnt)
+{
+	size_t size = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++)
+		size += iov[i].iov_len;
+	return size;
+}
+
+/**
+ * Point iov[] at the size bytes of the ring from idx on: returns the number
+ * of segments used (1, or 2 if we roll across the end of the ring)
+ */
+static int ring_segments(void *ring, uint32_t ring_size, uint32_t idx,
+		size_t size, struct iovec iov[2])
+{
+	uint32_t real_idx = idx & (ring_size - 1);
+	size_t avail_contig = ring_size - real_idx;
+	iov[0].iov_base = ring + real_idx;
+	if (avail_contig >= size) {
+		iov[0].iov_len = size;
+		return 1;
+	}
+	iov[0].iov_len = avail_contig;
+	iov[1].iov_base = ring;
+	iov[1].iov_len = size - avail_contig;
+	return 2;
+}
+
+/**
+ * Copy size bytes between the ring segments and iov[], skipping the first
+ * skip bytes of iov[].  to_ring selects the direction.
+ */
+static void copy_iov(struct iovec *seg, int nseg, const struct iovec *iov,
+		size_t skip, size_t size, int to_ring)
+{
+	size_t seg_off = 0, len;
+	void *buf;
+
+	if (!size)
+		return;
+
+	while (skip >= iov->iov_len) {
+		skip -= iov->iov_len;
+		iov++;
+	}
+
+	while (size) {
+		len = iov->iov_len - skip;
+		if (len > seg->iov_len - seg_off)
+			len = seg->iov_len - seg_off;
+		if (len > size)
+			len = size;
+		buf = iov->iov_base + skip;
+		if (to_ring)
+			memcpy(seg->iov_base + seg_off, buf, len);
+		else
+			memcpy(buf, seg->iov_base + seg_off, len);
+		size -= len;
+		skip += len;
+		seg_off += len;
+		if (skip == iov->iov_len) {
+			iov++;
+			skip = 0;
+		}
+		if (seg_off == seg->iov_len && --nseg) {
+			seg++;
+			seg_off = 0;
+		}
+	}
+}
+
 /**
  * returns -1 on error, or size on success
  *
  * caller must have checked that enough space is available
  */
-static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
+static int do_send(struct libxenvchan *ctrl, const struct iovec *iov,
+		size_t skip, size_t size)
 {
-	int real_idx = wr_prod(ctrl) & (wr_ring_size(ctrl) - 1);
-	int avail_contig = wr_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
+	struct iovec seg[2];
+	int nseg = ring_segments(wr_ring(ctrl), wr_ring_size(ctrl),
+			wr_prod(ctrl), size, seg);
 	xen_mb(); /* read indexes /then/ write data */
-	memcpy(wr_ring(ctrl) + real_idx, data, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(wr_ring(ctrl), data + avail_contig, size - avail_contig);
-	}
+	copy_iov(seg, nseg, iov, skip, size, 1);
 	xen_wmb(); /* write data /then/ notify */
 	wr_prod(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_WRITE))
+	if (update_notify(ctrl, VCHAN_NOTIFY_WRITE, size))
 		return -1;
 	return size;
 }
@@ -230,17 +352,18 @@ static int do_send(struct libxenvchan *ctrl, const void *data, size_t size)
 /**
  * returns 0 if no buffer space is available, -1 on error, or size on success
  */
-int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
+int libxenvchan_sendv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+	size_t size = iov_length(iov, iovcnt);
 	int avail;
 	while (1) {
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
 		avail = fast_get_buffer_space(ctrl, size);
 		if (size <= avail)
-			return do_send(ctrl, data, size);
+			return do_send(ctrl, iov, 0, size);
 		if (!ctrl->blocking)
-			return 0;
+			return libxenvchan_flush(ctrl);
 		if (size > wr_ring_size(ctrl))
 			return -1;
 		if (libxenvchan_wait(ctrl))
@@ -248,8 +371,15 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
 	}
 }
 
-int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
+int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size)
 {
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+	return libxenvchan_sendv(ctrl, &iov, 1);
+}
+
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	size_t size = iov_length(iov, iovcnt);
 	int avail;
 	if (!libxenvchan_is_open(ctrl))
 		return -1;
@@ -260,7 +390,7 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 			if (pos + avail > size)
 				avail = size - pos;
 			if (avail)
-				pos += do_send(ctrl, data + pos, avail);
+				pos += do_send(ctrl, iov, pos, avail);
 			if (pos == size)
 				return pos;
 			if (libxenvchan_wait(ctrl))
@@ -273,32 +403,63 @@ int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
 		if (size > avail)
 			size = avail;
 		if (size == 0)
-			return 0;
-		return do_send(ctrl, data, size);
+			return libxenvchan_flush(ctrl);
+		return do_send(ctrl, iov, 0, size);
+	}
+}
+
+int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size)
+{
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+	return libxenvchan_writev(ctrl, &iov, 1);
+}
+
+int libxenvchan_reserve(struct libxenvchan *ctrl, size_t size, struct iovec iov[2])
+{
+	int avail;
+	while (1) {
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		avail = fast_get_buffer_space(ctrl, size);
+		if (size <= avail) {
+			xen_mb(); /* read indexes /then/ let the caller write data */
+			return ring_segments(wr_ring(ctrl), wr_ring_size(ctrl),
+					wr_prod(ctrl), size, iov);
+		}
+		if (!ctrl->blocking)
+			return libxenvchan_flush(ctrl);
+		if (size > wr_ring_size(ctrl))
+			return -1;
+		if (libxenvchan_wait(ctrl))
+			return -1;
 	}
 }
 
+int libxenvchan_commit(struct libxenvchan *ctrl, size_t size)
+{
+	xen_wmb(); /* write data /then/ notify */
+	wr_prod(ctrl) += size;
+	if (update_notify(ctrl, VCHAN_NOTIFY_WRITE, size))
+		return -1;
+	return size;
+}
+
 /**
  * returns -1 on error, or size on success
  *
  * caller must have checked that enough data is available
  */
-static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
+static int do_recv(struct libxenvchan *ctrl, const struct iovec *iov,
+		size_t size)
 {
-	int real_idx = rd_cons(ctrl) & (rd_ring_size(ctrl) - 1);
-	int avail_contig = rd_ring_size(ctrl) - real_idx;
-	if (avail_contig > size)
-		avail_contig = size;
+	struct iovec seg[2];
+	int nseg = ring_segments((void *)rd_ring(ctrl), rd_ring_size(ctrl),
+			rd_cons(ctrl), size, seg);
 	xen_rmb(); /* data read must happen /after/ rd_cons read */
-	memcpy(data, rd_ring(ctrl) + real_idx, avail_contig);
-	if (avail_contig < size)
-	{
-		// we rolled across the end of the ring
-		memcpy(data + avail_contig, rd_ring(ctrl), size - avail_contig);
-	}
+	copy_iov(seg, nseg, iov, 0, size, 0);
 	xen_mb(); /* consume /then/ notify */
 	rd_cons(ctrl) += size;
-	if (send_notify(ctrl, VCHAN_NOTIFY_READ))
+	if (update_notify(ctrl, VCHAN_NOTIFY_READ, size))
 		return -1;
 	return size;
 }
@@ -307,16 +468,17 @@ static int do_recv(struct libxenvchan *ctrl, void *data, size_t size)
  * reads exactly size bytes from the vchan.
  * returns 0 if insufficient data is available, -1 on error, or size on success
  */
-int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
+int libxenvchan_recvv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
 {
+	size_t size = iov_length(iov, iovcnt);
 	while (1) {
 		int avail = fast_get_data_ready(ctrl, size);
 		if (size <= avail)
-			return do_recv(ctrl, data, size);
+			return do_recv(ctrl, iov, size);
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
 		if (!ctrl->blocking)
-			return 0;
+			return libxenvchan_flush(ctrl);
 		if (size > rd_ring_size(ctrl))
 			return -1;
 		if (libxenvchan_wait(ctrl))
@@ -324,23 +486,65 @@ int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 	}
 }
 
-int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
+int libxenvchan_recv(struct libxenvchan *ctrl, void *data, size_t size)
 {
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	return libxenvchan_recvv(ctrl, &iov, 1);
+}
+
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt)
+{
+	size_t size = iov_length(iov, iovcnt);
 	while (1) {
 		int avail = fast_get_data_ready(ctrl, size);
 		if (avail && size > avail)
 			size = avail;
 		if (avail)
-			return do_recv(ctrl, data, size);
+			return do_recv(ctrl, iov, size);
 		if (!libxenvchan_is_open(ctrl))
 			return -1;
 		if (!ctrl->blocking)
-			return 0;
+			return libxenvchan_flush(ctrl);
 		if (libxenvchan_wait(ctrl))
 			return -1;
 	}
 }
 
+int libxenvchan_read(struct libxenvchan *ctrl, void *data, size_t size)
+{
+	struct iovec iov = { .iov_base = data, .iov_len = size };
+	return libxenvchan_readv(ctrl, &iov, 1);
+}
+
+int libxenvchan_peek(struct libxenvchan *ctrl, size_t size, struct iovec iov[2])
+{
+	while (1) {
+		int avail = fast_get_data_ready(ctrl, size);
+		if (size <= avail) {
+			xen_rmb(); /* data read must happen /after/ rd_cons read */
+			return ring_segments((void *)rd_ring(ctrl),
+					rd_ring_size(ctrl), rd_cons(ctrl), size, iov);
+		}
+		if (!libxenvchan_is_open(ctrl))
+			return -1;
+		if (!ctrl->blocking)
+			return libxenvchan_flush(ctrl);
+		if (size > rd_ring_size(ctrl))
+			return -1;
+		if (libxenvchan_wait(ctrl))
+			return -1;
+	}
+}
+
+int libxenvchan_consume(struct libxenvchan *ctrl, size_t size)
+{
+	xen_mb(); /* consume /then/ notify */
+	rd_cons(ctrl) += size;
+	if (update_notify(ctrl, VCHAN_NOTIFY_READ, size))
+		return -1;
+	return size;
+}
+
 int libxenvchan_is_open(struct libxenvchan* ctrl)
 {
 	if (ctrl->is_server)
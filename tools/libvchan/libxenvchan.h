@@ -43,6 +43,7 @@
  *  compile time, so the macros in ring.h cannot be used to access the rings.
  */
 
+#include <sys/uio.h>
 #include <xen/io/libxenvchan.h>
 #include <xen/sys/evtchn.h>
 #include <xenctrl.h>
@@ -82,6 +83,13 @@ struct libxenvchan {
 	int blocking:1;
 	/* communication rings */
 	struct libxenvchan_ring read, write;
+	/* notification batching: see libxenvchan_set_notify_batch() */
+	size_t notify_batch;
+	unsigned int notify_delay;
+	/* notifications we owe the peer, for how many bytes, since when (us) */
+	uint8_t notify_bits;
+	size_t notify_pending;
+	uint64_t notify_since;
 };
 
 /**
@@ -146,6 +154,61 @@ int libxenvchan_send(struct libxenvchan *ctrl, const void *data, size_t size);
  *         the vchan is nonblocking)
  */
 int libxenvchan_write(struct libxenvchan *ctrl, const void *data, size_t size);
+/**
+ * Scatter-gather versions of the calls above: data is gathered from or
+ * scattered to the iovcnt buffers of iov, as if they were one buffer.
+ * One notification is sent for the whole call.
+ */
+int libxenvchan_recvv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+int libxenvchan_readv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+int libxenvchan_sendv(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+int libxenvchan_writev(struct libxenvchan *ctrl, const struct iovec *iov, int iovcnt);
+/**
+ * Zero-copy send: reserve size bytes of the send ring, which the caller can
+ * then fill in directly, and commit them once they are written.
+ * @param ctrl The vchan control structure
+ * @param size Amount of space to reserve
+ * @param iov Set to the reserved space: the second segment is only used if
+ *        the space wraps around the end of the ring
+ * @return -1 on error, 0 if nonblocking and insufficient space is available,
+ *         or the number of segments of iov used (1 or 2)
+ */
+int libxenvchan_reserve(struct libxenvchan *ctrl, size_t size, struct iovec iov[2]);
+/**
+ * Send size bytes previously reserved by libxenvchan_reserve(): size must
+ * not be more than was reserved, and nothing else may be sent in between.
+ * @return -1 on error, or $size
+ */
+int libxenvchan_commit(struct libxenvchan *ctrl, size_t size);
+/**
+ * Zero-copy receive: find the next size bytes in the receive ring, which
+ * the caller can parse in place and then release with libxenvchan_consume().
+ * @return -1 on error, 0 if nonblocking and insufficient data is available,
+ *         or the number of segments of iov used (1 or 2)
+ */
+int libxenvchan_peek(struct libxenvchan *ctrl, size_t size, struct iovec iov[2]);
+/**
+ * Release size bytes found by libxenvchan_peek().
+ * @return -1 on error, or $size
+ */
+int libxenvchan_consume(struct libxenvchan *ctrl, size_t size);
+/**
+ * Batch notifications: rather than notifying the peer on every call which
+ * moves data, wait until at least $bytes have been sent or received, or
+ * the oldest pending notification is $usecs old (checked on the next
+ * call).  Notifications are always flushed before libxenvchan_wait() blocks
+ * and when a nonblocking call cannot make progress; callers which wait on
+ * libxenvchan_fd_for_select() must call libxenvchan_flush() first.
+ * @param bytes Byte threshold, or 0 to notify on every call (the default)
+ * @param usecs Time threshold, or 0 for none; requires a byte threshold
+ * @return -1 on error, 0 on success
+ */
+int libxenvchan_set_notify_batch(struct libxenvchan *ctrl, size_t bytes, unsigned int usecs);
+/**
+ * Send any notifications held back by libxenvchan_set_notify_batch()
+ * @return -1 on error, 0 on success
+ */
+int libxenvchan_flush(struct libxenvchan *ctrl);
 /**
  * Waits for reads or writes to unblock, or for a close
  */
@@ -38,6 +38,17 @@
 #include "xg_private.h"
 #include "xc_dom.h"
 
+/*
+ * Vectorised page diffing needs per-function target attributes and
+ * __builtin_cpu_supports(), i.e. gcc 4.9 or later.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) && !defined(__MINIOS__) && \
+    !defined(__clang__) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define COMPRESSION_SIMD
+#include <immintrin.h>
+#endif
+
 /* Page Cache for Delta Compression*/
 #define DELTA_CACHE_SIZE (XC_PAGE_SIZE * 8192)
 
@@ -75,6 +86,10 @@ struct compression_ctx
     struct cache_page *page_list_head;
     struct cache_page *page_list_tail;
     unsigned long dom_pfnlist_size;
+
+    /* Page diffing kernel, chosen at runtime for the host CPU */
+    void (*diff_page)(const uint32_t *old, const uint32_t *new,
+                      uint64_t *mask);
 };
 
 #define RUNFLAG 0
@@ -108,6 +123,101 @@ struct compression_ctx
 #define FULL_PAGE_SIZE (XC_PAGE_SIZE + 1)
 #define MAX_DELTAS (XC_PAGE_SIZE/sizeof(uint32_t))
 
+/*
+ * The diff of a page is a bitmap of MAX_DELTAS bits, with bit i set
+ * if the i'th 32-bit word of the page has changed.
+ */
+#define DIFF_MASK_WORDS (MAX_DELTAS/64)
+
+static void diff_page_generic(const uint32_t *old, const uint32_t *new,
+                              uint64_t *mask)
+{
+    unsigned int i, j;
+    uint64_t m;
+
+    for (i = 0; i < DIFF_MASK_WORDS; i++, old += 64, new += 64)
+    {
+        m = 0;
+        for (j = 0; j < 64; j++)
+            m |= (uint64_t)(old[j] != new[j]) << j;
+        mask[i] = m;
+    }
+}
+
+#ifdef COMPRESSION_SIMD
+__attribute__((target("sse2")))
+static void diff_page_sse2(const uint32_t *old, const uint32_t *new,
+                           uint64_t *mask)
+{
+    const __m128i *o = (const __m128i *)old, *n = (const __m128i *)new;
+    unsigned int i, j;
+    uint64_t eq;
+
+    for (i = 0; i < DIFF_MASK_WORDS; i++)
+    {
+        eq = 0;
+        for (j = 0; j < 64; j += 4, o++, n++)
+            eq |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(
+                      _mm_cmpeq_epi32(_mm_loadu_si128(o),
+                                      _mm_loadu_si128(n)))) << j;
+        mask[i] = ~eq;
+    }
+}
+
+__attribute__((target("avx2")))
+static void diff_page_avx2(const uint32_t *old, const uint32_t *new,
+                           uint64_t *mask)
+{
+    const __m256i *o = (const __m256i *)old, *n = (const __m256i *)new;
+    unsigned int i, j;
+    uint64_t eq;
+
+    for (i = 0; i < DIFF_MASK_WORDS; i++)
+    {
+        eq = 0;
+        for (j = 0; j < 64; j += 8, o++, n++)
+            eq |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(
+                      _mm256_cmpeq_epi32(_mm256_loadu_si256(o),
+                                         _mm256_loadu_si256(n)))) << j;
+        mask[i] = ~eq;
+    }
+}
+#endif
+
+static void (*select_diff_page(void))(const uint32_t *, const uint32_t *,
+                                      uint64_t *)
+{
+#ifdef COMPRESSION_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return diff_page_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return diff_page_sse2;
+#endif
+    return diff_page_generic;
+}
+
+/*
+ * Return the index of the first word at or after off whose changed bit
+ * is not 'copying', or MAX_DELTAS if the run extends to the end of page.
+ */
+static unsigned int diff_run_end(const uint64_t *mask, unsigned int off,
+                                 int copying)
+{
+    unsigned int i = off / 64;
+    uint64_t w;
+
+    w = (copying ? ~mask[i] : mask[i]) & (~0ULL << (off % 64));
+    while (!w)
+    {
+        if (++i == DIFF_MASK_WORDS)
+            return MAX_DELTAS;
+        w = copying ? ~mask[i] : mask[i];
+    }
+
+    return i * 64 + __builtin_ctzll(w);
+}
+
 /*
  * Add a pagetable page or a new page (uncached)
  * if srcpage is a pagetable page, cache_page is null.
@@ -134,13 +244,9 @@ static int add_full_page(comp_ctx *ctx, char *srcpage, char *cache_page)
 static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
 {
     char *dest = (ctx->compbuf + ctx->compbuf_pos);
-    uint32_t *new, *old;
-
-    int off, runptr = 0;
-    int wascopying = 0, copying = 0, bytes_skipped = 0;
-    int complen = 0, pageoff = 0, runbytes = 0;
-
-    char runlen = 0;
+    uint64_t mask[DIFF_MASK_WORDS], changed = 0;
+    unsigned int off, end, len, i;
+    int copying, complen = 0, pageoff, runbytes;
 
     if ( (ctx->compbuf_pos + WORST_COMP_PAGE_SIZE) > ctx->compbuf_size)
         return -1;
@@ -150,54 +256,47 @@ static int compress_page(comp_ctx *ctx, char *srcpage, char *cache_page)
      * domU's page passed from xc_domain_save and cache_page is
      * a ptr to cache page (cache is page aligned).
      */
-    new = (uint32_t*)srcpage;
-    old = (uint32_t*)cache_page;
-
-    for (off = 0; off <= MAX_DELTAS; off++)
-    {
-        /*
-         * At (off == MAX_DELTAS), we are processing the last run
-         * in the page. Since there is no XORing, make wascopying != copying
-         * to satisfy the if-block below.
-         */
-        copying = ((off < MAX_DELTAS) ? (old[off] != new[off]) : !wascopying);
-
-        if (runlen)
-        {
-            /* switching between run types or current run is full */
-            if ( (wascopying != copying) || (runlen == LENMASK) )
-            {
-                runbytes = runlen * sizeof(uint32_t);
-                runlen |= (wascopying ? RUNFLAG : SKIPFLAG);
-                dest[complen++] = runlen;
+    ctx->diff_page((uint32_t *)cache_page, (uint32_t *)srcpage, mask);
 
-                if (wascopying) /* RUNFLAG */
-                {
-                    pageoff = runptr * sizeof(uint32_t);
-                    memcpy(dest + complen, srcpage + pageoff, runbytes);
-                    memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
-                    complen += runbytes;
-                }
-                else /* SKIPFLAG */
-                {
-                    bytes_skipped += runbytes;
-                }
-
-                runlen = 0;
-                runptr = off;
-            }
-        }
-        runlen++;
-        wascopying = copying;
-    }
+    for (i = 0; i < DIFF_MASK_WORDS; i++)
+        changed |= mask[i];
 
     /*
      * Check for empty page.
      */
-    if (bytes_skipped == XC_PAGE_SIZE)
+    if (!changed)
     {
-        complen = 1;
         dest[0] = EMPTY_PAGE;
+        ctx->compbuf_pos++;
+        return 1;
+    }
+
+    /*
+     * Emit alternating runs of changed and unchanged words, splitting
+     * any run longer than LENMASK words.
+     */
+    for (off = 0; off < MAX_DELTAS; off = end)
+    {
+        copying = (mask[off / 64] >> (off % 64)) & 1;
+        end = diff_run_end(mask, off, copying);
+
+        for (; off < end; off += len)
+        {
+            len = end - off;
+            if (len > LENMASK)
+                len = LENMASK;
+
+            dest[complen++] = len | (copying ? RUNFLAG : SKIPFLAG);
+
+            if (copying) /* RUNFLAG */
+            {
+                pageoff = off * sizeof(uint32_t);
+                runbytes = len * sizeof(uint32_t);
+                memcpy(dest + complen, srcpage + pageoff, runbytes);
+                memcpy(cache_page + pageoff, srcpage + pageoff, runbytes);
+                complen += runbytes;
+            }
+        }
     }
     ctx->compbuf_pos += complen;
 
@@ -528,6 +627,7 @@ comp_ctx *xc_compression_create_context(xc_interface *xch,
     ctx->page_list_head = &(ctx->cache[0]);
     ctx->page_list_tail = &(ctx->cache[num_cache_pages -1]);
     ctx->dom_pfnlist_size = p2m_size;
+    ctx->diff_page = select_diff_page();
 
     return ctx;
 error:
@@ -389,6 +389,51 @@ int xc_domain_getinfolist(xc_interface *xch,
     return ret;
 }
 
+int xc_domain_getstats(xc_interface *xch,
+                       uint32_t first_domain,
+                       unsigned int max_domains,
+                       xc_domainstats_t *domains,
+                       unsigned int max_vcpus,
+                       xc_vcpustats_t *vcpus,
+                       unsigned int *nr_vcpus,
+                       uint32_t *next_domain)
+{
+    int ret = 0;
+    DECLARE_SYSCTL;
+    DECLARE_HYPERCALL_BOUNCE(domains, max_domains*sizeof(*domains), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+    DECLARE_HYPERCALL_BOUNCE(vcpus, max_vcpus*sizeof(*vcpus), XC_HYPERCALL_BUFFER_BOUNCE_OUT);
+
+    if ( xc_hypercall_bounce_pre(xch, domains) )
+        return -1;
+
+    if ( xc_hypercall_bounce_pre(xch, vcpus) )
+    {
+        xc_hypercall_bounce_post(xch, domains);
+        return -1;
+    }
+
+    sysctl.cmd = XEN_SYSCTL_getdomainstats;
+    sysctl.u.getdomainstats.first_domain = first_domain;
+    sysctl.u.getdomainstats.max_domains  = max_domains;
+    sysctl.u.getdomainstats.max_vcpus    = max_vcpus;
+    set_xen_guest_handle(sysctl.u.getdomainstats.domains, domains);
+    set_xen_guest_handle(sysctl.u.getdomainstats.vcpus, vcpus);
+
+    if ( xc_sysctl(xch, &sysctl) < 0 )
+        ret = -1;
+    else
+    {
+        ret = sysctl.u.getdomainstats.num_domains;
+        *nr_vcpus = sysctl.u.getdomainstats.num_vcpus;
+        *next_domain = sysctl.u.getdomainstats.next_domain;
+    }
+
+    xc_hypercall_bounce_post(xch, vcpus);
+    xc_hypercall_bounce_post(xch, domains);
+
+    return ret;
+}
+
 /* set broken page p2m */
 int xc_set_broken_page_p2m(xc_interface *xch,
                            uint32_t domid,
@@ -575,6 +620,40 @@ int xc_shadow_control(xc_interface *xch,
     return (rc == 0) ? domctl.u.shadow_op.pages : rc;
 }
 
+int xc_shadow_dirty_ranges(xc_interface *xch,
+                           uint32_t domid,
+                           unsigned int sop,
+                           xc_hypercall_buffer_t *ranges,
+                           unsigned int *nr_ranges,
+                           unsigned long pages,
+                           xc_shadow_op_stats_t *stats)
+{
+    int rc;
+    DECLARE_DOMCTL;
+    DECLARE_HYPERCALL_BUFFER_ARGUMENT(ranges);
+
+    memset(&domctl, 0, sizeof(domctl));
+
+    domctl.cmd = XEN_DOMCTL_shadow_op;
+    domctl.domain = (domid_t)domid;
+    domctl.u.shadow_op.op        = sop;
+    domctl.u.shadow_op.pages     = pages;
+    domctl.u.shadow_op.nr_ranges = *nr_ranges;
+    set_xen_guest_handle(domctl.u.shadow_op.dirty_ranges, ranges);
+
+    rc = do_domctl(xch, &domctl);
+
+    if ( stats )
+        memcpy(stats, &domctl.u.shadow_op.stats,
+               sizeof(xc_shadow_op_stats_t));
+
+    if ( rc )
+        return rc;
+
+    *nr_ranges = domctl.u.shadow_op.nr_ranges;
+    return domctl.u.shadow_op.pages;
+}
+
 int xc_domain_setmaxmem(xc_interface *xch,
                         uint32_t domid,
                         unsigned int max_memkb)
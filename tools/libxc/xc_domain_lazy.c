@@ -0,0 +1,643 @@
+/******************************************************************************
+ * xc_domain_lazy.c
+ *
+ * The lazy phase of a post-copy save: moving the memory a guest saved with
+ * XCFLAGS_LAZY left behind, while it already runs on the receiving side.
+ *
+ * The receiver marks every missing page as paged out, so that a guest
+ * access raises a request on the mem_paging ring.  The sender pushes pages
+ * in pfn order, and answers the requests the receiver forwards ahead of
+ * the others.  See the LAZY PHASE section of xg_save_restore.h.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+#include "xc_private.h"
+#include "xc_bitops.h"
+#include "xg_private.h"
+#include "xg_save_restore.h"
+
+#include <xen/hvm/params.h>
+#include <xen/mem_event.h>
+
+/* Pages pushed between two looks for requests. */
+#define LAZY_PUSH_PAGES     64
+
+/* A page record: pfn, then contents. */
+#define LAZY_REC_SIZE       (sizeof(uint64_t) + PAGE_SIZE)
+
+/* Is there something to read on fd, without waiting? */
+static int lazy_readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int rc;
+
+    do {
+        rc = poll(&pfd, 1, 0);
+    } while ( rc < 0 && errno == EINTR );
+
+    return rc;
+}
+
+static int lazy_send_pages(xc_interface *xch, int io_fd, uint32_t dom,
+                           xen_pfn_t *pfns, int *errs, unsigned int n,
+                           char *recs)
+{
+    char *region;
+    uint64_t pfn;
+    unsigned int i;
+    int rc = -1;
+
+    if ( !n )
+        return 0;
+
+    region = xc_map_foreign_bulk(xch, dom, PROT_READ, pfns, errs, n);
+    if ( !region )
+    {
+        PERROR("Failed to map %u pages", n);
+        return -1;
+    }
+
+    for ( i = 0; i < n; i++ )
+    {
+        if ( errs[i] )
+        {
+            errno = -errs[i];
+            PERROR("Failed to map pfn %#"PRIx64, (uint64_t)pfns[i]);
+            goto out;
+        }
+
+        pfn = pfns[i];
+        memcpy(recs + i * LAZY_REC_SIZE, &pfn, sizeof(pfn));
+        memcpy(recs + i * LAZY_REC_SIZE + sizeof(pfn),
+               region + i * PAGE_SIZE, PAGE_SIZE);
+    }
+
+    if ( write_exact(io_fd, recs, n * LAZY_REC_SIZE) )
+    {
+        PERROR("Error when writing lazy pages");
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    munmap(region, n * PAGE_SIZE);
+    return rc;
+}
+
+int xc_domain_lazy_save(xc_interface *xch, int io_fd, uint32_t dom)
+{
+    uint64_t nr_pfns, pfn;
+    unsigned long *present = NULL, *wanted = NULL;
+    unsigned long cursor, left = 0;
+    xen_pfn_t *pfns = NULL;
+    int *errs = NULL;
+    char *recs = NULL;
+    unsigned int i, n;
+    int rc = -1;
+
+    nr_pfns = xc_domain_maximum_gpfn(xch, dom) + 1;
+
+    present = bitmap_alloc(nr_pfns);
+    wanted = bitmap_alloc(nr_pfns);
+    pfns = malloc(MAX_BATCH_SIZE * sizeof(*pfns));
+    errs = malloc(MAX_BATCH_SIZE * sizeof(*errs));
+    recs = malloc(LAZY_PUSH_PAGES * LAZY_REC_SIZE);
+    if ( !present || !wanted || !pfns || !errs || !recs )
+    {
+        errno = ENOMEM;
+        ERROR("Couldn't allocate lazy save state");
+        goto out;
+    }
+
+    /* Tell the receiver which pfns exist... */
+    for ( cursor = 0; cursor < nr_pfns; cursor += n )
+    {
+        n = (nr_pfns - cursor < MAX_BATCH_SIZE) ? nr_pfns - cursor
+                                                : MAX_BATCH_SIZE;
+        for ( i = 0; i < n; i++ )
+            pfns[i] = cursor + i;
+
+        if ( xc_get_pfn_type_batch(xch, dom, n, pfns) )
+        {
+            PERROR("Failed to get types of pfns %#lx-%#lx",
+                   cursor, cursor + n - 1);
+            goto out;
+        }
+
+        for ( i = 0; i < n; i++ )
+            if ( (pfns[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+                     XEN_DOMCTL_PFINFO_XTAB &&
+                 (pfns[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+                     XEN_DOMCTL_PFINFO_BROKEN )
+                set_bit(cursor + i, present);
+    }
+
+    if ( write_exact(io_fd, &nr_pfns, sizeof(nr_pfns)) ||
+         write_exact(io_fd, present, (nr_pfns + 7) / 8) )
+    {
+        PERROR("Error when writing the lazy pfn map");
+        goto out;
+    }
+
+    /* ... and learn which of them it doesn't have yet. */
+    if ( read_exact(io_fd, wanted, (nr_pfns + 7) / 8) )
+    {
+        PERROR("Error when reading the lazy pfn map");
+        goto out;
+    }
+
+    for ( cursor = 0; cursor < nr_pfns; cursor++ )
+    {
+        if ( !test_bit(cursor, wanted) )
+            continue;
+        if ( !test_bit(cursor, present) )
+        {
+            ERROR("Receiver wants pfn %#lx, which doesn't exist", cursor);
+            errno = EINVAL;
+            goto out;
+        }
+        left++;
+    }
+
+    DPRINTF("Sending %lu pages lazily\n", left);
+
+    cursor = 0;
+    while ( left )
+    {
+        /* Pages the guest is waiting for come first. */
+        while ( (rc = lazy_readable(io_fd)) > 0 )
+        {
+            if ( read_exact(io_fd, &pfn, sizeof(pfn)) )
+            {
+                PERROR("Error when reading lazy page request");
+                goto err;
+            }
+
+            if ( pfn >= nr_pfns || !test_and_clear_bit(pfn, wanted) )
+                continue;
+
+            pfns[0] = pfn;
+            if ( lazy_send_pages(xch, io_fd, dom, pfns, errs, 1, recs) )
+                goto err;
+            left--;
+        }
+        if ( rc < 0 )
+        {
+            PERROR("Error polling for lazy page requests");
+            goto err;
+        }
+
+        for ( n = 0; n < LAZY_PUSH_PAGES && cursor < nr_pfns; cursor++ )
+            if ( test_and_clear_bit(cursor, wanted) )
+                pfns[n++] = cursor;
+
+        if ( lazy_send_pages(xch, io_fd, dom, pfns, errs, n, recs) )
+            goto err;
+        left -= n;
+    }
+
+    pfn = LAZY_END;
+    if ( write_exact(io_fd, &pfn, sizeof(pfn)) )
+    {
+        PERROR("Error when writing lazy end marker");
+        goto err;
+    }
+
+    /* Requests may still be in flight; the receiver's marker ends them. */
+    do {
+        if ( read_exact(io_fd, &pfn, sizeof(pfn)) )
+        {
+            PERROR("Error when waiting for the lazy end marker");
+            goto err;
+        }
+    } while ( pfn != LAZY_END );
+
+    rc = 0;
+    goto out;
+
+ err:
+    rc = -1;
+ out:
+    free(recs);
+    free(errs);
+    free(pfns);
+    free(wanted);
+    free(present);
+    return rc;
+}
+
+struct lazy_restore {
+    xc_interface *xch;
+    uint32_t dom;
+
+    /* The paging ring */
+    void *ring_page;
+    mem_event_back_ring_t back_ring;
+    xc_evtchn *xce;
+    evtchn_port_or_error_t port;
+
+    /* Pages not received yet */
+    unsigned long *wanted;
+    unsigned long nr_wanted;
+    uint64_t nr_pfns;
+
+    /* Requests blocked on a page which was asked for */
+    mem_event_request_t *waiting;
+    unsigned int nr_waiting;
+};
+
+static int lazy_paging_init(struct lazy_restore *lr)
+{
+    xc_interface *xch = lr->xch;
+    unsigned long ring_pfn;
+    xen_pfn_t mmap_pfn;
+    uint32_t port;
+
+    /* Map the ring page, populating it if the guest had none */
+    if ( xc_get_hvm_param(xch, lr->dom, HVM_PARAM_PAGING_RING_PFN,
+                          &ring_pfn) )
+    {
+        PERROR("Failed to get the paging ring pfn");
+        return -1;
+    }
+
+    mmap_pfn = ring_pfn;
+    lr->ring_page = xc_map_foreign_batch(xch, lr->dom, PROT_READ | PROT_WRITE,
+                                         &mmap_pfn, 1);
+    if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+    {
+        if ( lr->ring_page )
+            munmap(lr->ring_page, PAGE_SIZE);
+        lr->ring_page = NULL;
+
+        mmap_pfn = ring_pfn;
+        if ( xc_domain_populate_physmap_exact(xch, lr->dom, 1, 0, 0,
+                                              &mmap_pfn) )
+        {
+            PERROR("Failed to populate the paging ring");
+            return -1;
+        }
+
+        mmap_pfn = ring_pfn;
+        lr->ring_page = xc_map_foreign_batch(xch, lr->dom,
+                                             PROT_READ | PROT_WRITE,
+                                             &mmap_pfn, 1);
+        if ( mmap_pfn & XEN_DOMCTL_PFINFO_XTAB )
+        {
+            PERROR("Could not map the paging ring");
+            if ( lr->ring_page )
+                munmap(lr->ring_page, PAGE_SIZE);
+            lr->ring_page = NULL;
+            return -1;
+        }
+    }
+
+    if ( xc_mem_paging_enable(xch, lr->dom, &port) )
+    {
+        PERROR("Failed to enable paging for the lazy phase");
+        munmap(lr->ring_page, PAGE_SIZE);
+        lr->ring_page = NULL;
+        return -1;
+    }
+
+    lr->xce = xc_evtchn_open(NULL, 0);
+    if ( !lr->xce )
+    {
+        PERROR("Failed to open event channel");
+        return -1;
+    }
+
+    lr->port = xc_evtchn_bind_interdomain(lr->xce, lr->dom, port);
+    if ( lr->port < 0 )
+    {
+        PERROR("Failed to bind event channel");
+        return -1;
+    }
+
+    SHARED_RING_INIT((mem_event_sring_t *)lr->ring_page);
+    BACK_RING_INIT(&lr->back_ring, (mem_event_sring_t *)lr->ring_page,
+                   PAGE_SIZE);
+
+    /* Now that the ring is set, remove it from the guest's physmap */
+    mmap_pfn = ring_pfn;
+    if ( xc_domain_decrease_reservation_exact(xch, lr->dom, 1, 0, &mmap_pfn) )
+        PERROR("Failed to remove ring from guest physmap");
+
+    return 0;
+}
+
+static void lazy_paging_teardown(struct lazy_restore *lr)
+{
+    xc_interface *xch = lr->xch;
+
+    if ( lr->ring_page )
+    {
+        munmap(lr->ring_page, PAGE_SIZE);
+        if ( xc_mem_paging_disable(xch, lr->dom) )
+            PERROR("Failed to disable paging after the lazy phase");
+    }
+
+    if ( lr->xce )
+    {
+        if ( lr->port >= 0 )
+            xc_evtchn_unbind(lr->xce, lr->port);
+        xc_evtchn_close(lr->xce);
+    }
+}
+
+static void lazy_resume(struct lazy_restore *lr,
+                        const mem_event_request_t *req)
+{
+    mem_event_response_t rsp = {
+        .gfn = req->gfn,
+        .vcpu_id = req->vcpu_id,
+        .flags = req->flags,
+    };
+
+    memcpy(RING_GET_RESPONSE(&lr->back_ring, lr->back_ring.rsp_prod_pvt),
+           &rsp, sizeof(rsp));
+    lr->back_ring.rsp_prod_pvt++;
+    RING_PUSH_RESPONSES(&lr->back_ring);
+}
+
+/* Let everything blocked on gfn go. */
+static void lazy_release(struct lazy_restore *lr, uint64_t gfn)
+{
+    unsigned int i;
+
+    for ( i = 0; i < lr->nr_waiting; )
+    {
+        if ( lr->waiting[i].gfn != gfn )
+        {
+            i++;
+            continue;
+        }
+
+        lazy_resume(lr, &lr->waiting[i]);
+        lr->waiting[i] = lr->waiting[--lr->nr_waiting];
+    }
+}
+
+/*
+ * Ask the sender for the pages the guest touched, and answer at once the
+ * requests for pages which have arrived meanwhile.
+ */
+static int lazy_handle_requests(struct lazy_restore *lr, int io_fd)
+{
+    xc_interface *xch = lr->xch;
+    mem_event_request_t req, *waiting;
+    int notify = 0;
+    unsigned int i;
+
+    while ( RING_HAS_UNCONSUMED_REQUESTS(&lr->back_ring) )
+    {
+        memcpy(&req, RING_GET_REQUEST(&lr->back_ring, lr->back_ring.req_cons),
+               sizeof(req));
+        lr->back_ring.req_cons++;
+        lr->back_ring.sring->req_event = lr->back_ring.req_cons + 1;
+
+        if ( req.gfn >= lr->nr_pfns || !test_bit(req.gfn, lr->wanted) ||
+             (req.flags & MEM_EVENT_FLAG_DROP_PAGE) )
+        {
+            /* The page of a dropped gfn is discarded when it arrives. */
+            if ( req.gfn < lr->nr_pfns &&
+                 test_and_clear_bit(req.gfn, lr->wanted) )
+                lr->nr_wanted--;
+            lazy_resume(lr, &req);
+            notify = 1;
+            continue;
+        }
+
+        for ( i = 0; i < lr->nr_waiting; i++ )
+            if ( lr->waiting[i].gfn == req.gfn )
+                break;
+
+        if ( i == lr->nr_waiting &&
+             write_exact(io_fd, &req.gfn, sizeof(req.gfn)) )
+        {
+            PERROR("Error when requesting gfn %#"PRIx64, req.gfn);
+            return -1;
+        }
+
+        waiting = realloc(lr->waiting,
+                          (lr->nr_waiting + 1) * sizeof(*waiting));
+        if ( !waiting )
+        {
+            errno = ENOMEM;
+            ERROR("Couldn't queue the request for gfn %#"PRIx64, req.gfn);
+            return -1;
+        }
+        lr->waiting = waiting;
+        lr->waiting[lr->nr_waiting++] = req;
+    }
+
+    if ( notify && xc_evtchn_notify(lr->xce, lr->port) )
+    {
+        PERROR("Error notifying the paging ring");
+        return -1;
+    }
+
+    return 0;
+}
+
+int xc_domain_lazy_restore(xc_interface *xch, int io_fd, uint32_t dom,
+                           int (*ready)(void *data), void *data)
+{
+    struct lazy_restore _lr = { .xch = xch, .dom = dom, .port = -1 };
+    struct lazy_restore *lr = &_lr;
+    unsigned long *present = NULL;
+    struct pollfd fds[2];
+    uint64_t pfn;
+    void *page = NULL;
+    int done = 0, rc = -1;
+
+    if ( read_exact(io_fd, &lr->nr_pfns, sizeof(lr->nr_pfns)) )
+    {
+        PERROR("Error when reading the lazy pfn map size");
+        return -1;
+    }
+
+    if ( lr->nr_pfns > ~XEN_DOMCTL_PFINFO_LTAB_MASK )
+    {
+        errno = E2BIG;
+        ERROR("Lazy pfn map of %"PRIu64" pfns is too big", lr->nr_pfns);
+        return -1;
+    }
+
+    present = bitmap_alloc(lr->nr_pfns);
+    lr->wanted = bitmap_alloc(lr->nr_pfns);
+    page = xc_memalign(xch, PAGE_SIZE, PAGE_SIZE);
+    if ( !present || !lr->wanted || !page )
+    {
+        errno = ENOMEM;
+        ERROR("Couldn't allocate lazy restore state");
+        goto out;
+    }
+
+    if ( read_exact(io_fd, present, (lr->nr_pfns + 7) / 8) )
+    {
+        PERROR("Error when reading the lazy pfn map");
+        goto out;
+    }
+
+    if ( lazy_paging_init(lr) )
+        goto out;
+
+    /* Whatever the restore didn't populate, the sender still has. */
+    for ( pfn = 0; pfn < lr->nr_pfns; pfn++ )
+    {
+        if ( !test_bit(pfn, present) )
+            continue;
+
+        if ( xc_mem_paging_absent(xch, dom, pfn) == 0 )
+        {
+            set_bit(pfn, lr->wanted);
+            lr->nr_wanted++;
+        }
+        else if ( errno != EBUSY )
+        {
+            PERROR("Failed to mark gfn %#"PRIx64" as paged out", pfn);
+            goto out;
+        }
+    }
+
+    if ( write_exact(io_fd, lr->wanted, (lr->nr_pfns + 7) / 8) )
+    {
+        PERROR("Error when writing the wanted pfn map");
+        goto out;
+    }
+
+    DPRINTF("Receiving %lu pages lazily\n", lr->nr_wanted);
+
+    if ( ready && ready(data) )
+    {
+        ERROR("Lazy restore ready callback failed");
+        goto out;
+    }
+
+    fds[0].fd = io_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = xc_evtchn_fd(lr->xce);
+    fds[1].events = POLLIN;
+
+    while ( !done )
+    {
+        if ( poll(fds, 2, -1) < 0 )
+        {
+            if ( errno == EINTR )
+                continue;
+            PERROR("Error polling during the lazy phase");
+            goto out;
+        }
+
+        if ( fds[1].revents & POLLIN )
+        {
+            evtchn_port_or_error_t port = xc_evtchn_pending(lr->xce);
+
+            if ( port < 0 || xc_evtchn_unmask(lr->xce, port) )
+            {
+                PERROR("Error getting paging ring event");
+                goto out;
+            }
+        }
+
+        if ( lazy_handle_requests(lr, io_fd) )
+            goto out;
+
+        if ( !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) )
+            continue;
+
+        if ( read_exact(io_fd, &pfn, sizeof(pfn)) )
+        {
+            PERROR("Error when reading lazy page");
+            goto out;
+        }
+
+        if ( pfn == LAZY_END )
+        {
+            done = 1;
+            break;
+        }
+
+        if ( read_exact(io_fd, page, PAGE_SIZE) )
+        {
+            PERROR("Error when reading lazy page %#"PRIx64, pfn);
+            goto out;
+        }
+
+        if ( pfn >= lr->nr_pfns || !test_and_clear_bit(pfn, lr->wanted) )
+            continue;
+
+        /* The guest may have ballooned the page out from under us. */
+        if ( xc_mem_paging_load(xch, dom, pfn, page) && errno != ENOENT )
+        {
+            PERROR("Failed to load lazy page %#"PRIx64, pfn);
+            goto out;
+        }
+        lr->nr_wanted--;
+
+        lazy_release(lr, pfn);
+        if ( xc_evtchn_notify(lr->xce, lr->port) )
+        {
+            PERROR("Error notifying the paging ring");
+            goto out;
+        }
+    }
+
+    if ( lazy_handle_requests(lr, io_fd) )
+        goto out;
+
+    if ( lr->nr_wanted )
+    {
+        ERROR("Lazy stream ended with %lu pages missing", lr->nr_wanted);
+        errno = EIO;
+        goto out;
+    }
+
+    pfn = LAZY_END;
+    if ( write_exact(io_fd, &pfn, sizeof(pfn)) )
+    {
+        PERROR("Error when writing lazy end marker");
+        goto out;
+    }
+
+    rc = 0;
+
+ out:
+    lazy_paging_teardown(lr);
+    free(lr->waiting);
+    free(lr->wanted);
+    free(present);
+    free(page);
+    return rc;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
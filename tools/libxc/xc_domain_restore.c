@@ -38,6 +38,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "xg_private.h"
 #include "xg_save_restore.h"
@@ -60,6 +61,9 @@ struct restore_ctx {
     int completed; /* Set when a consistent image is available */
     int last_checkpoint; /* Set when we should commit to the current checkpoint when it completes. */
     int compressing; /* Set when sender signals that pages would be sent compressed (for Remus) */
+    int lz4; /* Set when sender signals that batches may be LZ4 compressed */
+    int elide; /* Set when sender signals that pages may be elided */
+    char *lz4buf; /* Compressed block being read */
     struct domain_info_context dinfo;
 };
 
@@ -725,6 +729,8 @@ typedef struct {
 
     /* Types of the pfns in the current region */
     unsigned long* pfn_types;
+    /* For XC_SAVE_PFINFO_DUP pfns, the index in pages of the contents */
+    unsigned int* dup_srcs;
 
     int verify;
 
@@ -764,6 +770,88 @@ static void pagebuf_free(pagebuf_t* buf)
         free(buf->pfn_types);
         buf->pfn_types = NULL;
     }
+    if (buf->dup_srcs) {
+        free(buf->dup_srcs);
+        buf->dup_srcs = NULL;
+    }
+}
+
+/*
+** Read the duplicate page sources of the chunk whose pfn types were just
+** appended to buf->pfn_types at index first, and record in buf->dup_srcs
+** where each XC_SAVE_PFINFO_DUP page will find its contents in buf->pages.
+*/
+static int pagebuf_get_dups(xc_interface *xch, struct restore_ctx *ctx,
+                            pagebuf_t* buf, int fd, int first)
+{
+    unsigned int physidx[MAX_BATCH_SIZE];
+    uint16_t srcs[MAX_BATCH_SIZE];
+    unsigned int phys = buf->nr_physpages;
+    unsigned long pagetype;
+    int i, ndups = 0;
+    void* ptmp;
+
+    for ( i = first; i < buf->nr_pages; i++ )
+        if ( (buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK) ==
+             XC_SAVE_PFINFO_DUP )
+            ndups++;
+
+    if ( !ndups )
+        return 0;
+
+    if ( buf->compressing )
+    {
+        ERROR("Duplicate pages in a compressed checkpoint");
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( !(ptmp = realloc(buf->dup_srcs,
+                          buf->nr_pages * sizeof(*buf->dup_srcs))) )
+    {
+        ERROR("Could not allocate duplicate page buffer");
+        return -1;
+    }
+    buf->dup_srcs = ptmp;
+
+    if ( RDEXACT(fd, srcs, ndups * sizeof(*srcs)) )
+    {
+        PERROR("Error when reading duplicate page sources");
+        return -1;
+    }
+
+    for ( i = 0, ndups = 0; i < buf->nr_pages - first; i++ )
+    {
+        pagetype = buf->pfn_types[first + i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        switch ( pagetype )
+        {
+        case XEN_DOMCTL_PFINFO_XTAB:
+        case XEN_DOMCTL_PFINFO_BROKEN:
+        case XEN_DOMCTL_PFINFO_XALLOC:
+        case XC_SAVE_PFINFO_ZERO:
+            break;
+
+        case XC_SAVE_PFINFO_DUP:
+            /* The source must be an earlier plain page of this chunk. */
+            if ( (srcs[ndups] >= i) ||
+                 ((buf->pfn_types[first + srcs[ndups]] &
+                   XEN_DOMCTL_PFINFO_LTAB_MASK) != XEN_DOMCTL_PFINFO_NOTAB) )
+            {
+                ERROR("Bad duplicate page source %u for entry %d",
+                      srcs[ndups], i);
+                errno = EINVAL;
+                return -1;
+            }
+            buf->dup_srcs[first + i] = physidx[srcs[ndups++]];
+            break;
+
+        default:
+            physidx[i] = phys++;
+            break;
+        }
+    }
+
+    return 0;
 }
 
 static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
@@ -955,6 +1043,16 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         // DPRINTF("compression flag received");
         return pagebuf_get_one(xch, ctx, buf, fd, dom);
 
+    case XC_SAVE_ID_ENABLE_LZ4:
+        DPRINTF("LZ4 compressed batches enabled\n");
+        ctx->lz4 = 1;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
+    case XC_SAVE_ID_ENABLE_ELIDE:
+        DPRINTF("Zero and duplicate page elision enabled\n");
+        ctx->elide = 1;
+        return pagebuf_get_one(xch, ctx, buf, fd, dom);
+
     case XC_SAVE_ID_COMPRESSED_DATA:
 
         /* read the length of compressed chunk coming in */
@@ -1024,12 +1122,24 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         unsigned long pagetype;
 
         pagetype = buf->pfn_types[i] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( (pagetype == XC_SAVE_PFINFO_ZERO ||
+              pagetype == XC_SAVE_PFINFO_DUP) && !ctx->elide )
+        {
+            ERROR("Elided page type %#lx without XC_SAVE_ID_ENABLE_ELIDE",
+                  pagetype);
+            return -1;
+        }
         if ( pagetype == XEN_DOMCTL_PFINFO_XTAB ||
              pagetype == XEN_DOMCTL_PFINFO_BROKEN ||
-             pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+             pagetype == XEN_DOMCTL_PFINFO_XALLOC ||
+             pagetype == XC_SAVE_PFINFO_ZERO ||
+             pagetype == XC_SAVE_PFINFO_DUP )
             --countpages;
     }
 
+    if ( pagebuf_get_dups(xch, ctx, buf, fd, oldcount) )
+        return -1;
+
     if (!countpages)
         return count;
 
@@ -1054,6 +1164,41 @@ static int pagebuf_get_one(xc_interface *xch, struct restore_ctx *ctx,
         }
         buf->pages = ptmp;
     }
+
+    if ( ctx->lz4 ) {
+        uint32_t lz4len;
+
+        if ( RDEXACT(fd, &lz4len, sizeof(lz4len)) ) {
+            PERROR("Error when reading LZ4 block size");
+            return -1;
+        }
+        if ( lz4len > countpages * PAGE_SIZE ) {
+            ERROR("LZ4 block too large (%u bytes for %d pages)",
+                  lz4len, countpages);
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if ( lz4len ) {
+            if ( !ctx->lz4buf &&
+                 !(ctx->lz4buf = malloc(MAX_BATCH_SIZE * PAGE_SIZE)) ) {
+                ERROR("Could not allocate LZ4 buffer");
+                return -1;
+            }
+            if ( RDEXACT(fd, ctx->lz4buf, lz4len) ) {
+                PERROR("Error when reading LZ4 block");
+                return -1;
+            }
+            if ( xc_lz4_decompress(ctx->lz4buf, lz4len,
+                                   buf->pages + oldcount * PAGE_SIZE,
+                                   countpages * PAGE_SIZE) ) {
+                ERROR("Corrupt LZ4 block for %d pages", countpages);
+                errno = EINVAL;
+                return -1;
+            }
+            return count;
+        }
+    }
+
     if ( RDEXACT(fd, buf->pages + oldcount * PAGE_SIZE, countpages * PAGE_SIZE) ) {
         PERROR("Error when reading pages");
         return -1;
@@ -1080,30 +1225,18 @@ static int pagebuf_get(xc_interface *xch, struct restore_ctx *ctx,
     return rc;
 }
 
-static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
-                       xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
-                       struct xc_mmu* mmu,
-                       pagebuf_t* pagebuf, int curbatch)
+/*
+** Allocate the frames of a batch which don't have an MFN yet, and fill in
+** region_mfn[] ready for load_batch().
+*/
+static int alloc_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+                       xen_pfn_t* region_mfn, pagebuf_t* pagebuf, int curbatch,
+                       int j)
 {
-    int i, j, curpage, nr_mfns;
+    int i, nr_mfns;
     int k, scount;
     unsigned long superpage_start=INVALID_P2M_ENTRY;
-    /* used by debug verify code */
-    unsigned long buf[PAGE_SIZE/sizeof(unsigned long)];
-    /* Our mapping of the current region (batch) */
-    char *region_base;
-    /* A temporary mapping, and a copy, of one frame of guest memory. */
-    unsigned long *page = NULL;
-    int nraces = 0;
-    struct domain_info_context *dinfo = &ctx->dinfo;
-    int* pfn_err = NULL;
-    int rc = -1;
-
-    unsigned long mfn, pfn, pagetype;
-
-    j = pagebuf->nr_pages - curbatch;
-    if (j > MAX_BATCH_SIZE)
-        j = MAX_BATCH_SIZE;
+    int rc;
 
     /* First pass for this batch: work out how much memory to alloc, and detect superpages */
     nr_mfns = scount = 0;
@@ -1248,6 +1381,35 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             region_mfn[i] = ctx->hvm ? pfn : ctx->p2m[pfn];
     }
 
+    return 0;
+}
+
+/*
+** Copy the pages of a batch allocated by alloc_batch() into the guest,
+** uncanonicalising page tables as we go.  If p2m_lock is non-NULL other
+** threads may be loading or allocating batches concurrently, and it is
+** held around everything that touches ctx->p2m or the mmu update queue.
+*/
+static int load_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+                      xen_pfn_t* region_mfn, unsigned long* pfn_type,
+                      int pae_extended_cr3, struct xc_mmu* mmu,
+                      pagebuf_t* pagebuf, int curbatch, int j,
+                      pthread_mutex_t *p2m_lock)
+{
+    int i, curpage, ok;
+    /* used by debug verify code */
+    unsigned long buf[PAGE_SIZE/sizeof(unsigned long)];
+    /* Our mapping of the current region (batch) */
+    char *region_base;
+    /* A temporary mapping, and a copy, of one frame of guest memory. */
+    unsigned long *page = NULL;
+    int nraces = 0;
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    int* pfn_err = NULL;
+    int rc = -1;
+
+    unsigned long mfn, pfn, pagetype, elided;
+
     /* Map relevant mfns */
     pfn_err = calloc(j, sizeof(*pfn_err));
     if ( pfn_err == NULL )
@@ -1293,7 +1455,18 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             goto err_mapped;
         }
 
-        ++curpage;
+        /* Elided pages have no data of their own in the page buffer. */
+        if ( (pagetype == XC_SAVE_PFINFO_ZERO) ||
+             (pagetype == XC_SAVE_PFINFO_DUP) )
+        {
+            elided = pagetype;
+            pagetype = XEN_DOMCTL_PFINFO_NOTAB;
+        }
+        else
+        {
+            elided = 0;
+            ++curpage;
+        }
 
         if ( pfn > dinfo->p2m_size )
         {
@@ -1308,8 +1481,14 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
         /* In verify mode, we use a copy; otherwise we work in place */
         page = pagebuf->verify ? (void *)buf : (region_base + i*PAGE_SIZE);
 
+        if ( elided == XC_SAVE_PFINFO_ZERO )
+            memset(page, 0, PAGE_SIZE);
+        else if ( elided == XC_SAVE_PFINFO_DUP )
+            memcpy(page, pagebuf->pages +
+                   (unsigned long)pagebuf->dup_srcs[i + curbatch] * PAGE_SIZE,
+                   PAGE_SIZE);
         /* Remus - page decompression */
-        if (pagebuf->compressing)
+        else if (pagebuf->compressing)
         {
             if (xc_compression_uncompress_page(xch, pagebuf->pages,
                                                pagebuf->compbuf_size,
@@ -1342,7 +1521,13 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
                 pae_extended_cr3 ||
                 (pagetype != XEN_DOMCTL_PFINFO_L1TAB)) {
 
-                if (!uncanonicalize_pagetable(xch, dom, ctx, page)) {
+                if ( p2m_lock )
+                    pthread_mutex_lock(p2m_lock);
+                ok = uncanonicalize_pagetable(xch, dom, ctx, page);
+                if ( p2m_lock )
+                    pthread_mutex_unlock(p2m_lock);
+
+                if (!ok) {
                     /*
                     ** Failing to uncanonicalize a page table can be ok
                     ** under live migration since the pages type may have
@@ -1384,13 +1569,21 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
             }
         }
 
-        if ( !ctx->hvm &&
-             xc_add_mmu_update(xch, mmu,
-                               (((unsigned long long)mfn) << PAGE_SHIFT)
-                               | MMU_MACHPHYS_UPDATE, pfn) )
+        if ( !ctx->hvm )
         {
-            PERROR("failed machpys update mfn=%lx pfn=%lx", mfn, pfn);
-            goto err_mapped;
+            if ( p2m_lock )
+                pthread_mutex_lock(p2m_lock);
+            ok = !xc_add_mmu_update(xch, mmu,
+                                    (((unsigned long long)mfn) << PAGE_SHIFT)
+                                    | MMU_MACHPHYS_UPDATE, pfn);
+            if ( p2m_lock )
+                pthread_mutex_unlock(p2m_lock);
+
+            if ( !ok )
+            {
+                PERROR("failed machpys update mfn=%lx pfn=%lx", mfn, pfn);
+                goto err_mapped;
+            }
         }
     } /* end of 'batch' for loop */
 
@@ -1403,6 +1596,353 @@ static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
     return rc;
 }
 
+static int apply_batch(xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+                       xen_pfn_t* region_mfn, unsigned long* pfn_type, int pae_extended_cr3,
+                       struct xc_mmu* mmu,
+                       pagebuf_t* pagebuf, int curbatch)
+{
+    int j;
+
+    j = pagebuf->nr_pages - curbatch;
+    if (j > MAX_BATCH_SIZE)
+        j = MAX_BATCH_SIZE;
+
+    if ( alloc_batch(xch, dom, ctx, region_mfn, pagebuf, curbatch, j) )
+        return -1;
+
+    return load_batch(xch, dom, ctx, region_mfn, pfn_type, pae_extended_cr3,
+                      mmu, pagebuf, curbatch, j, NULL);
+}
+
+#ifndef __MINIOS__
+/*
+** Pipelined page loading.
+**
+** The main thread keeps reading batches off the stream and allocating
+** their frames, then hands each batch through a ring of nr_slots slots to
+** nr_workers threads which map it and copy the pages into the guest.  The
+** wire format is untouched: the pipeline only overlaps reading with
+** copying on the receiving side.
+**
+** A frame may be sent more than once during a live migration, and the
+** later copy must win.  last_seq[pfn] remembers the batch which last
+** carried each frame, and a batch carrying a frame which is still being
+** loaded by an earlier batch is held back until that one is done.
+**
+** Batch n lives in slots[n % nr_slots]; it is queued while
+** taken <= n < produced and busy until a worker has loaded it.  The queue
+** is protected by the pipeline lock, while ctx->p2m, ctx->p2m_batch and
+** the mmu update queue are protected by p2m_lock.
+*/
+struct restore_batch {
+    pagebuf_t buf;              /* only pages, pfn_types and dup_srcs */
+    xen_pfn_t *region_mfn;
+    unsigned long seq;
+    int busy;
+};
+
+struct restore_pipeline {
+    xc_interface *xch;
+    uint32_t dom;
+    struct restore_ctx *ctx;
+    unsigned long *pfn_type;
+    int pae_extended_cr3;
+    struct xc_mmu *mmu;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* a batch was produced */
+    pthread_cond_t done_cond;   /* a batch was loaded */
+    pthread_mutex_t p2m_lock;
+
+    struct restore_batch *slots;
+    unsigned int nr_slots;
+    unsigned long produced, taken, loaded;
+
+    unsigned long *last_seq;    /* 1 + last batch carrying each pfn, or 0 */
+
+    int nraces;                 /* races seen since the last drain */
+    int error;                  /* errno of the first failure */
+    int shutdown;
+
+    pthread_t *workers;
+    unsigned int nr_workers;
+};
+
+/* Upper bound on the number of loader threads. */
+#define RESTORE_MAX_WORKERS 4
+
+static void *restore_pipeline_worker(void *arg)
+{
+    struct restore_pipeline *p = arg;
+    xc_interface *xch = p->xch;
+    struct restore_batch *b;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        while ( !p->shutdown && (p->taken == p->produced) )
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if ( p->shutdown )
+            break;
+
+        b = &p->slots[p->taken++ % p->nr_slots];
+        pthread_mutex_unlock(&p->lock);
+
+        rc = -1;
+        if ( !p->error )
+            rc = load_batch(xch, p->dom, p->ctx, b->region_mfn, p->pfn_type,
+                            p->pae_extended_cr3, p->mmu, &b->buf, 0,
+                            b->buf.nr_pages, &p->p2m_lock);
+
+        pthread_mutex_lock(&p->lock);
+        if ( rc < 0 )
+        {
+            if ( !p->error )
+                p->error = errno ? : EIO;
+        }
+        else
+            p->nraces += rc;
+        b->busy = 0;
+        p->loaded++;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void restore_pipeline_destroy(struct restore_pipeline *p)
+{
+    unsigned int i;
+
+    if ( !p )
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0; i < p->nr_workers; i++ )
+        pthread_join(p->workers[i], NULL);
+
+    if ( p->slots )
+        for ( i = 0; i < p->nr_slots; i++ )
+        {
+            pagebuf_free(&p->slots[i].buf);
+            free(p->slots[i].region_mfn);
+        }
+
+    pthread_mutex_destroy(&p->p2m_lock);
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+
+    free(p->last_seq);
+    free(p->slots);
+    free(p->workers);
+    free(p);
+}
+
+static struct restore_pipeline *restore_pipeline_create(
+    xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+    unsigned long *pfn_type, int pae_extended_cr3, struct xc_mmu *mmu)
+{
+    struct restore_pipeline *p;
+    unsigned int i, nr_workers;
+    long cpus;
+
+    /* The main thread reads the stream; leave it a CPU of its own. */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( cpus < 2 )
+        return NULL;
+    nr_workers = (cpus > RESTORE_MAX_WORKERS) ? RESTORE_MAX_WORKERS : cpus - 1;
+
+    p = calloc(1, sizeof(*p));
+    if ( !p )
+        goto nomem;
+
+    p->xch = xch;
+    p->dom = dom;
+    p->ctx = ctx;
+    p->pfn_type = pfn_type;
+    p->pae_extended_cr3 = pae_extended_cr3;
+    p->mmu = mmu;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    pthread_mutex_init(&p->p2m_lock, NULL);
+
+    p->nr_slots = 2 * nr_workers + 2;
+    p->slots = calloc(p->nr_slots, sizeof(*p->slots));
+    p->workers = calloc(nr_workers, sizeof(*p->workers));
+    p->last_seq = calloc(ctx->dinfo.p2m_size, sizeof(*p->last_seq));
+    if ( !p->slots || !p->workers || !p->last_seq )
+        goto nomem;
+
+    for ( i = 0; i < p->nr_slots; i++ )
+    {
+        p->slots[i].region_mfn = malloc(MAX_BATCH_SIZE * sizeof(xen_pfn_t));
+        if ( !p->slots[i].region_mfn )
+            goto nomem;
+    }
+
+    for ( ; p->nr_workers < nr_workers; p->nr_workers++ )
+        if ( (errno = pthread_create(&p->workers[p->nr_workers], NULL,
+                                     restore_pipeline_worker, p)) )
+        {
+            PERROR("Couldn't create restore worker thread");
+            goto err;
+        }
+
+    DPRINTF("Restoring with %u worker threads\n", nr_workers);
+
+    return p;
+
+ nomem:
+    ERROR("failed to alloc memory for restore pipeline");
+    errno = ENOMEM;
+ err:
+    restore_pipeline_destroy(p);
+    return NULL;
+}
+
+/*
+** Queue the batch just read into pagebuf for loading.  The page and pfn
+** type buffers are swapped with those of a free slot, so pagebuf can be
+** refilled straight away.  The frames are allocated here, in stream order.
+*/
+static int restore_pipeline_queue(struct restore_pipeline *p,
+                                  pagebuf_t *pagebuf)
+{
+    xc_interface *xch = p->xch;
+    struct restore_batch *b, *prev;
+    unsigned long pfn, seq, pagetype;
+    void *tmp;
+    int i, j = pagebuf->nr_pages, rc;
+
+    pthread_mutex_lock(&p->lock);
+
+    seq = p->produced;
+    b = &p->slots[seq % p->nr_slots];
+    while ( !p->error && b->busy )
+        pthread_cond_wait(&p->done_cond, &p->lock);
+
+    for ( i = 0; !p->error && (i < j); i++ )
+    {
+        pfn = pagebuf->pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( (pfn >= p->ctx->dinfo.p2m_size) || !p->last_seq[pfn] )
+            continue;
+
+        prev = &p->slots[(p->last_seq[pfn] - 1) % p->nr_slots];
+        while ( !p->error && prev->busy &&
+                (prev->seq == p->last_seq[pfn] - 1) )
+            pthread_cond_wait(&p->done_cond, &p->lock);
+    }
+
+    if ( p->error )
+    {
+        errno = p->error;
+        pthread_mutex_unlock(&p->lock);
+        return -1;
+    }
+
+    pthread_mutex_unlock(&p->lock);
+
+    tmp = b->buf.pages;
+    b->buf.pages = pagebuf->pages;
+    pagebuf->pages = tmp;
+    tmp = b->buf.pfn_types;
+    b->buf.pfn_types = pagebuf->pfn_types;
+    pagebuf->pfn_types = tmp;
+    tmp = b->buf.dup_srcs;
+    b->buf.dup_srcs = pagebuf->dup_srcs;
+    pagebuf->dup_srcs = tmp;
+    b->buf.nr_pages = pagebuf->nr_pages;
+    b->buf.nr_physpages = pagebuf->nr_physpages;
+
+    pthread_mutex_lock(&p->p2m_lock);
+    rc = alloc_batch(xch, p->dom, p->ctx, b->region_mfn, &b->buf, 0, j);
+    pthread_mutex_unlock(&p->p2m_lock);
+    if ( rc )
+        return -1;
+
+    for ( i = 0; i < j; i++ )
+    {
+        pfn      = b->buf.pfn_types[i] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = b->buf.pfn_types[i] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( (pagetype != XEN_DOMCTL_PFINFO_XTAB) &&
+             (pfn < p->ctx->dinfo.p2m_size) )
+            p->last_seq[pfn] = seq + 1;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    b->seq = seq;
+    b->busy = 1;
+    p->produced++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+/*
+** Wait until every queued batch has been loaded.  Adds the number of page
+** table races seen to *nraces, or returns -1 with errno set if any batch
+** failed.
+*/
+static int restore_pipeline_drain(struct restore_pipeline *p, int *nraces)
+{
+    int error;
+
+    if ( !p )
+        return 0;
+
+    pthread_mutex_lock(&p->lock);
+    while ( p->loaded != p->produced )
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    *nraces += p->nraces;
+    p->nraces = 0;
+    error = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    if ( error )
+    {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+#else /* __MINIOS__ */
+/* No threads in a stub domain: always load pages from the main loop. */
+struct restore_pipeline;
+
+static inline struct restore_pipeline *restore_pipeline_create(
+    xc_interface *xch, uint32_t dom, struct restore_ctx *ctx,
+    unsigned long *pfn_type, int pae_extended_cr3, struct xc_mmu *mmu)
+{
+    return NULL;
+}
+
+static inline void restore_pipeline_destroy(struct restore_pipeline *p) {}
+
+static inline int restore_pipeline_queue(struct restore_pipeline *p,
+                                         pagebuf_t *pagebuf)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+static inline int restore_pipeline_drain(struct restore_pipeline *p,
+                                         int *nraces)
+{
+    return 0;
+}
+#endif /* __MINIOS__ */
+
 int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
                       unsigned int store_evtchn, unsigned long *store_mfn,
                       domid_t store_domid, unsigned int console_evtchn,
@@ -1449,6 +1989,8 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
 
     struct xc_mmu *mmu = NULL;
 
+    struct restore_pipeline *pipeline = NULL;
+
     struct mmuext_op pin[MAX_PIN_BATCH];
     unsigned int nr_pins;
 
@@ -1588,6 +2130,10 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         goto out;
     }
 
+    /* Failing to start the loader threads just means loading serially. */
+    pipeline = restore_pipeline_create(xch, dom, ctx, pfn_type,
+                                       pae_extended_cr3, mmu);
+
     xc_report_progress_start(xch, "Reloading memory pages", dinfo->p2m_size);
 
     /*
@@ -1616,6 +2162,12 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
         DBGPRINTF("batch %d\n",j);
 
         if ( j == 0 ) {
+            /* All pages must be in place before we touch any of them. */
+            if ( restore_pipeline_drain(pipeline, &nraces) ) {
+                PERROR("Error when loading batch");
+                goto out;
+            }
+
             /* catch vcpu updates */
             if (pagebuf.new_ctxt_format) {
                 max_vcpu_id = pagebuf.max_vcpu_id;
@@ -1676,19 +2228,42 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
             break;  /* our work here is done */
         }
 
-        /* break pagebuf into batches */
-        curbatch = 0;
-        while ( curbatch < j ) {
-            int brc;
-
-            brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
-                              pae_extended_cr3, mmu, &pagebuf, curbatch);
-            if ( brc < 0 )
+        /*
+         * Batches read straight off the stream go to the loader threads.
+         * Buffered checkpoints, compressed pages and verify mode are all
+         * handled here, once the earlier batches have been loaded.
+         */
+        if ( pipeline && !ctx->completed && !pagebuf.compressing &&
+             !pagebuf.verify && (j <= MAX_BATCH_SIZE) )
+        {
+            if ( restore_pipeline_queue(pipeline, &pagebuf) )
+            {
+                PERROR("Error when queueing batch");
                 goto out;
+            }
+        }
+        else
+        {
+            if ( restore_pipeline_drain(pipeline, &nraces) )
+            {
+                PERROR("Error when loading batch");
+                goto out;
+            }
 
-            nraces += brc;
+            /* break pagebuf into batches */
+            curbatch = 0;
+            while ( curbatch < j ) {
+                int brc;
 
-            curbatch += MAX_BATCH_SIZE;
+                brc = apply_batch(xch, dom, ctx, region_mfn, pfn_type,
+                                  pae_extended_cr3, mmu, &pagebuf, curbatch);
+                if ( brc < 0 )
+                    goto out;
+
+                nraces += brc;
+
+                curbatch += MAX_BATCH_SIZE;
+            }
         }
 
         pagebuf.nr_physpages = pagebuf.nr_pages = 0;
@@ -2331,6 +2906,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     rc = 0;
 
  out:
+    restore_pipeline_destroy(pipeline);
     if ( (rc != 0) && (dom != 0) )
         xc_domain_destroy(xch, dom);
     xc_hypercall_buffer_free(xch, ctxt);
@@ -2339,6 +2915,7 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     free(pfn_type);
     free(region_mfn);
     free(ctx->p2m_batch);
+    free(ctx->lz4buf);
     pagebuf_free(&pagebuf);
     tailbuf_free(&tailbuf);
 
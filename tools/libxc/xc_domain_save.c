@@ -26,6 +26,7 @@
 #include <unistd.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "xc_private.h"
 #include "xc_bitops.h"
@@ -53,6 +54,7 @@ struct save_ctx {
     xen_pfn_t *live_m2p; /* Live mapping of system MFN to PFN table. */
     unsigned long m2p_mfn0;
     struct domain_info_context dinfo;
+    unsigned long zero_pages, dup_pages; /* elided pages written so far */
 };
 
 /* buffer for output */
@@ -277,6 +279,60 @@ static int write_compressed(xc_interface *xch, comp_ctx *compress_ctx,
     return 0;
 }
 
+/*
+** LZ4 compression of page batches (Format C, see xg_save_restore.h).
+**
+** A batch is only sent compressed if that saves at least 1/LZ4_MIN_GAIN
+** of its size.  Each batch which doesn't makes us skip trying on twice as
+** many following batches as last time, up to LZ4_MAX_BACKOFF, so a guest
+** full of incompressible data costs little CPU.
+*/
+#define LZ4_MIN_GAIN    8
+#define LZ4_MAX_BACKOFF 64
+
+struct save_lz4 {
+    char *stage;            /* the batch's pages, contiguous */
+    char *out;              /* the compressed block */
+    void *wrkmem;
+    unsigned int backoff;   /* batches skipped after the last failure */
+    unsigned int skip;      /* batches still to skip */
+
+    unsigned long compressed, raw;
+    unsigned long long bytes_in, bytes_out;
+};
+
+static void save_lz4_free(struct save_lz4 *lz4)
+{
+    if ( !lz4 )
+        return;
+
+    free(lz4->stage);
+    free(lz4->out);
+    free(lz4->wrkmem);
+    free(lz4);
+}
+
+static struct save_lz4 *save_lz4_create(xc_interface *xch)
+{
+    struct save_lz4 *lz4 = calloc(1, sizeof(*lz4));
+
+    if ( lz4 )
+    {
+        lz4->stage = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        lz4->out = malloc(MAX_BATCH_SIZE * PAGE_SIZE);
+        lz4->wrkmem = malloc(XC_LZ4_WORKMEM_SIZE);
+    }
+    if ( !lz4 || !lz4->stage || !lz4->out || !lz4->wrkmem )
+    {
+        ERROR("failed to alloc memory for LZ4 compression");
+        save_lz4_free(lz4);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return lz4;
+}
+
 struct time_stats {
     struct timeval wall;
     long long d0_cpu, d1_cpu;
@@ -324,6 +380,350 @@ static int print_stats(xc_interface *xch, uint32_t domid, int pages_sent,
     return 0;
 }
 
+/*
+** Adaptive iteration (XCFLAGS_DOWNTIME_MS()).
+**
+** At the end of every round of a live save, the pages sent and the time
+** taken give the rate at which pages go out, and the log-dirty stats the
+** pages dirtied meanwhile.  Suspending now would cost the time to send
+** those at that rate, so the last round starts as soon as the prediction
+** is within the target.
+**
+** A round which doesn't shrink the dirty set by a sixteenth, or in which
+** the guest dirtied pages faster than they were sent, is a stall.  With
+** XCFLAGS_AUTO_CONVERGE each stall takes another ADAPT_THROTTLE_STEP
+** percent of its CPU away from the guest through the credit scheduler's
+** cap, up to ADAPT_MAX_THROTTLE.  Past that, or without auto-converge,
+** ADAPT_MAX_STALLS stalls in a row end the save early: more rounds would
+** only resend the same pages.
+*/
+#define ADAPT_MIN_GAIN       16
+#define ADAPT_MAX_STALLS      3
+#define ADAPT_THROTTLE_STEP  20
+#define ADAPT_MAX_THROTTLE   80
+
+struct save_adapt {
+    unsigned int target_ms;     /* downtime target, 0 if not adaptive */
+    int converge;               /* throttle the guest if needed */
+    unsigned int nr_vcpus;
+    uint64_t round_start;       /* usecs */
+    double send_rate;           /* pages per second, smoothed */
+    unsigned long last_dirty;   /* dirty pages at the end of the last round */
+    unsigned int stalls;        /* consecutive stalls */
+    unsigned int throttle;      /* percentage of CPU taken from the guest */
+    int capped;                 /* orig_cap holds the cap to restore */
+    struct xen_domctl_sched_credit orig_cap;
+};
+
+static void adapt_init(struct save_adapt *a, uint32_t flags,
+                       unsigned int nr_vcpus)
+{
+    memset(a, 0, sizeof(*a));
+    a->target_ms = ((flags & XCFLAGS_DOWNTIME_MASK) >>
+                    XCFLAGS_DOWNTIME_SHIFT) * 10;
+    a->converge = !!(flags & XCFLAGS_AUTO_CONVERGE);
+    a->nr_vcpus = nr_vcpus;
+    a->last_dirty = ~0UL;
+}
+
+static void adapt_unthrottle(xc_interface *xch, uint32_t dom,
+                             struct save_adapt *a)
+{
+    if ( !a->capped )
+        return;
+
+    if ( xc_sched_credit_domain_set(xch, dom, &a->orig_cap) )
+        PERROR("Couldn't restore the scheduler cap of dom %u", dom);
+    else
+        DPRINTF("Restored scheduler cap %u\n", a->orig_cap.cap);
+    a->capped = 0;
+}
+
+/* Take another ADAPT_THROTTLE_STEP percent.  Returns 0 if at the limit. */
+static int adapt_throttle(xc_interface *xch, uint32_t dom,
+                          struct save_adapt *a)
+{
+    struct xen_domctl_sched_credit sdom;
+    unsigned int full;
+
+    if ( !a->converge || (a->throttle >= ADAPT_MAX_THROTTLE) )
+        return 0;
+
+    if ( !a->capped )
+    {
+        /* Only the credit scheduler has caps. */
+        if ( xc_sched_credit_domain_get(xch, dom, &a->orig_cap) )
+        {
+            DPRINTF("Can't throttle dom %u: no credit scheduler cap\n", dom);
+            a->converge = 0;
+            return 0;
+        }
+        a->capped = 1;
+    }
+
+    a->throttle += ADAPT_THROTTLE_STEP;
+
+    /* A cap of 0 means none; 100 is one physical CPU. */
+    full = a->orig_cap.cap ? : a->nr_vcpus * 100;
+    sdom = a->orig_cap;
+    sdom.cap = full * (100 - a->throttle) / 100 ? : 1;
+    if ( xc_sched_credit_domain_set(xch, dom, &sdom) )
+    {
+        PERROR("Couldn't throttle dom %u", dom);
+        a->converge = 0;
+        return 0;
+    }
+
+    DPRINTF("Throttled dom %u by %u%% (cap %u)\n",
+            dom, a->throttle, sdom.cap);
+
+    return 1;
+}
+
+/*
+** Called at the end of each live round which sent sent pages.  Returns 1
+** if the next round should be the last.
+*/
+static int adapt_last_round(xc_interface *xch, uint32_t dom,
+                            struct save_adapt *a, unsigned long sent)
+{
+    xc_shadow_op_stats_t stats;
+    uint64_t now = llgettimeofday();
+    double secs = (now - a->round_start) / 1e6, rate, dirty_rate;
+    unsigned long dirty, downtime_ms;
+    int stalled;
+
+    if ( xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                           NULL, 0, NULL, 0, &stats) < 0 )
+    {
+        PERROR("Couldn't get log-dirty stats");
+        return 0;
+    }
+    dirty = stats.dirty_count;
+
+    if ( secs < 1e-3 )
+        secs = 1e-3;
+    rate = sent / secs;
+    dirty_rate = dirty / secs;
+    a->send_rate = a->send_rate ? (a->send_rate + rate) / 2 : rate;
+    if ( a->send_rate < 1 )
+        a->send_rate = 1;
+
+    downtime_ms = dirty * 1000.0 / a->send_rate;
+
+    DPRINTF("Adaptive: sent %.0f pages/s, dirtied %.0f pages/s, "
+            "%lu dirty, predicted downtime %lums\n",
+            a->send_rate, dirty_rate, dirty, downtime_ms);
+
+    if ( downtime_ms <= a->target_ms )
+        return 1;
+
+    stalled = (dirty > a->last_dirty - a->last_dirty / ADAPT_MIN_GAIN) ||
+              (dirty_rate >= a->send_rate);
+    a->last_dirty = dirty;
+
+    if ( !stalled )
+    {
+        a->stalls = 0;
+        return 0;
+    }
+
+    if ( adapt_throttle(xch, dom, a) )
+        return 0;
+
+    if ( ++a->stalls < ADAPT_MAX_STALLS )
+        return 0;
+
+    DPRINTF("Adaptive: not converging, starting last iteration\n");
+    return 1;
+}
+
+
+/*
+** Lazy (post-copy) saves watch the guest for LAZY_SAMPLE_MS with log-dirty
+** enabled, then suspend it and send only the pages it wrote meanwhile.  The
+** rest follow in xc_domain_lazy_save(), once the guest runs on the other
+** side.  Pages which Xen or the restore code access on the guest's behalf
+** must be present before then, so lazy_pin_pages() adds them to the set.
+*/
+#define LAZY_SAMPLE_MS      200
+
+static void lazy_pin_pages(xc_interface *xch, uint32_t dom,
+                           unsigned long p2m_size, unsigned long *to_send,
+                           unsigned long vm_generationid_addr)
+{
+    static const struct {
+        int param;
+        int is_addr;            /* a guest physical address, not a pfn */
+    } pinned[] = {
+        { HVM_PARAM_IOREQ_PFN, 0 },
+        { HVM_PARAM_BUFIOREQ_PFN, 0 },
+        { HVM_PARAM_STORE_PFN, 0 },
+        { HVM_PARAM_CONSOLE_PFN, 0 },
+        { HVM_PARAM_PAGING_RING_PFN, 0 },
+        { HVM_PARAM_ACCESS_RING_PFN, 0 },
+        { HVM_PARAM_SHARING_RING_PFN, 0 },
+        { HVM_PARAM_IDENT_PT, 1 },
+        { HVM_PARAM_VM86_TSS, 1 },
+    };
+    unsigned long val, pfn;
+    unsigned int i;
+
+    for ( i = 0; i < sizeof(pinned) / sizeof(pinned[0]); i++ )
+    {
+        if ( xc_get_hvm_param(xch, dom, pinned[i].param, &val) || !val )
+            continue;
+
+        pfn = pinned[i].is_addr ? val >> PAGE_SHIFT : val;
+        if ( pfn < p2m_size )
+            set_bit(pfn, to_send);
+    }
+
+    pfn = vm_generationid_addr >> PAGE_SHIFT;
+    if ( vm_generationid_addr && pfn < p2m_size )
+        set_bit(pfn, to_send);
+}
+
+/*
+** Log-dirty state comes out of Xen as extents of dirty pfns when it can,
+** which on a large and mostly clean guest is far less to copy and to look
+** through than the bitmap.  Within a round PEEKs only ever add pages, so
+** they are ORed into to_skip, which each CLEAN resets.
+*/
+#define DIRTY_RANGES_MAX    (1 << 16)
+
+/* Set bits first to first + nr - 1, a word at a time. */
+static void bitmap_set_range(unsigned long *map, unsigned long first,
+                             unsigned long nr)
+{
+    unsigned long i = first / BITS_PER_LONG;
+    unsigned long last = (first + nr - 1) / BITS_PER_LONG;
+    unsigned long head = ~0UL << (first % BITS_PER_LONG);
+    unsigned long tail = ~0UL >> (BITS_PER_LONG - 1 -
+                                  (first + nr - 1) % BITS_PER_LONG);
+
+    if ( !nr )
+        return;
+
+    if ( i == last )
+    {
+        map[i] |= head & tail;
+        return;
+    }
+
+    map[i] |= head;
+    memset(&map[i + 1], 0xff, (last - i - 1) * sizeof(*map));
+    map[last] |= tail;
+}
+
+static void bitmap_set_ranges(unsigned long *map, unsigned long size,
+                              const xc_shadow_op_range_t *r, unsigned int nr)
+{
+    unsigned int i;
+
+    for ( i = 0; i < nr; i++ )
+        if ( r[i].first_pfn < size )
+            bitmap_set_range(map, r[i].first_pfn,
+                             (r[i].nr_pfns < size - r[i].first_pfn) ?
+                             r[i].nr_pfns : size - r[i].first_pfn);
+}
+
+/*
+** XEN_DOMCTL_SHADOW_OP_CLEAN into to_send, through ranges if non-NULL.
+** Returns the number of pfns covered, like xc_shadow_control().
+*/
+static int dirty_clean(xc_interface *xch, uint32_t dom,
+                       xc_hypercall_buffer_t *ranges,
+                       xc_hypercall_buffer_t *to_send,
+                       unsigned long *to_skip, unsigned long p2m_size,
+                       xc_shadow_op_stats_t *stats)
+{
+    unsigned int nr = DIRTY_RANGES_MAX;
+    int rc;
+
+    if ( !ranges )
+        return xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_CLEAN,
+                                 to_send, p2m_size, NULL, 0, stats);
+
+    rc = xc_shadow_dirty_ranges(xch, dom, XEN_DOMCTL_SHADOW_OP_CLEAN_RANGES,
+                                ranges, &nr, p2m_size, stats);
+    if ( rc < 0 )
+        return rc;
+
+    /* A full buffer's last extent runs to the end: sending more is safe. */
+    memset(to_send->hbuf, 0, bitmap_size(p2m_size));
+    bitmap_set_ranges(to_send->hbuf, p2m_size, ranges->hbuf, nr);
+    memset(to_skip, 0, bitmap_size(p2m_size));
+
+    return rc;
+}
+
+/* XEN_DOMCTL_SHADOW_OP_PEEK into to_skip, through ranges if non-NULL. */
+static int dirty_peek(xc_interface *xch, uint32_t dom,
+                      xc_hypercall_buffer_t *ranges,
+                      xc_hypercall_buffer_t *to_skip, unsigned long p2m_size)
+{
+    unsigned int nr = DIRTY_RANGES_MAX;
+    int rc;
+
+    if ( !ranges )
+        return xc_shadow_control(xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK,
+                                 to_skip, p2m_size, NULL, 0, NULL);
+
+    rc = xc_shadow_dirty_ranges(xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK_RANGES,
+                                ranges, &nr, p2m_size, NULL);
+    if ( rc < 0 )
+        return rc;
+
+    /* Skipping a page which isn't dirty would lose it: drop the catch-all. */
+    if ( nr == DIRTY_RANGES_MAX )
+        nr--;
+    bitmap_set_ranges(to_skip->hbuf, p2m_size, ranges->hbuf, nr);
+
+    return rc;
+}
+
+/*
+** The first pfn from n up to end which may need sending this round, found
+** a word of each bitmap at a time.  to_skip and to_fix may be NULL.  Pages
+** up to the one returned which were dirtied again are counted in *skipped,
+** as the caller would have.
+*/
+static unsigned long next_dirty(const unsigned long *to_send,
+                                const unsigned long *to_skip,
+                                const unsigned long *to_fix,
+                                unsigned long n, unsigned long end,
+                                int dont_skip, int last_iter,
+                                unsigned int *skipped)
+{
+    unsigned long i, first, send, again, cand, upto;
+
+    for ( i = n / BITS_PER_LONG, first = ~0UL << (n % BITS_PER_LONG);
+          i * BITS_PER_LONG < end;
+          i++, first = ~0UL )
+    {
+        if ( (i + 1) * BITS_PER_LONG > end )
+            first &= ~0UL >> ((i + 1) * BITS_PER_LONG - end);
+
+        send = to_send[i] & first;
+        again = (to_skip && !dont_skip) ? send & to_skip[i] : 0;
+        cand = send & ~again;
+        if ( last_iter && to_fix )
+            cand |= to_fix[i] & first;
+
+        if ( !cand )
+        {
+            *skipped += __builtin_popcountl(again);
+            continue;
+        }
+
+        upto = (2UL << __builtin_ctzl(cand)) - 1;
+        *skipped += __builtin_popcountl(again & upto);
+        return i * BITS_PER_LONG + __builtin_ctzl(cand);
+    }
+
+    return end;
+}
 
 static int analysis_phase(xc_interface *xch, uint32_t domid, struct save_ctx *ctx,
                           xc_hypercall_buffer_t *arr, int runs)
@@ -721,84 +1121,1030 @@ static xen_pfn_t *map_and_save_p2m_table(xc_interface *xch,
         uint32_t tot_sz;
         DECLARE_DOMCTL;
 
-        domctl.cmd = XEN_DOMCTL_getvcpuextstate;
-        domctl.domain = dom;
-        domctl.u.vcpuextstate.vcpu = 0;
-        domctl.u.vcpuextstate.size = 0;
-        domctl.u.vcpuextstate.xfeature_mask = 0;
-        if ( xc_domctl(xch, &domctl) < 0 )
+        domctl.cmd = XEN_DOMCTL_getvcpuextstate;
+        domctl.domain = dom;
+        domctl.u.vcpuextstate.vcpu = 0;
+        domctl.u.vcpuextstate.size = 0;
+        domctl.u.vcpuextstate.xfeature_mask = 0;
+        if ( xc_domctl(xch, &domctl) < 0 )
+        {
+            PERROR("No extended context for VCPU%d", i);
+            goto out;
+        }
+        xcnt_size = domctl.u.vcpuextstate.size + 2 * sizeof(uint64_t);
+
+        tot_sz = (chunk1_sz + 8) + (chunk2_sz + 8);
+        if ( domctl.u.vcpuextstate.xfeature_mask )
+            tot_sz += chunk3_sz + 8;
+
+        if ( write_exact(io_fd, &signature, sizeof(signature)) ||
+             write_exact(io_fd, &tot_sz, sizeof(tot_sz)) ||
+             write_exact(io_fd, "vcpu", 4) ||
+             write_exact(io_fd, &chunk1_sz, sizeof(chunk1_sz)) ||
+             write_exact(io_fd, &ctxt, chunk1_sz) ||
+             write_exact(io_fd, "extv", 4) ||
+             write_exact(io_fd, &chunk2_sz, sizeof(chunk2_sz)) ||
+             (domctl.u.vcpuextstate.xfeature_mask) ?
+                (write_exact(io_fd, "xcnt", 4) ||
+                write_exact(io_fd, &chunk3_sz, sizeof(chunk3_sz)) ||
+                write_exact(io_fd, &xcnt_size, 4)) :
+                0 )
+        {
+            PERROR("write: extended info");
+            goto out;
+        }
+    }
+
+    if ( write_exact(io_fd, p2m_frame_list, 
+                     P2M_FL_ENTRIES * sizeof(xen_pfn_t)) )
+    {
+        PERROR("write: p2m_frame_list");
+        goto out;
+    }
+
+    success = 1;
+
+ out:
+    
+    if ( !success && p2m )
+        munmap(p2m, P2M_FL_ENTRIES * PAGE_SIZE);
+
+    if ( live_p2m_frame_list_list )
+        munmap(live_p2m_frame_list_list, PAGE_SIZE);
+
+    if ( live_p2m_frame_list )
+        munmap(live_p2m_frame_list, P2M_FLL_ENTRIES * PAGE_SIZE);
+
+    free(p2m_frame_list_list);
+
+    free(p2m_frame_list);
+
+    return success ? p2m : NULL;
+}
+
+/* must be done AFTER suspend_and_state() */
+static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
+{
+    int marker = XC_SAVE_ID_TSC_INFO;
+    uint32_t tsc_mode, khz, incarn;
+    uint64_t nsec;
+
+    if ( xc_domain_get_tsc_info(xch, dom, &tsc_mode,
+                                &nsec, &khz, &incarn) < 0  ||
+         write_exact(io_fd, &marker, sizeof(marker)) ||
+         write_exact(io_fd, &tsc_mode, sizeof(tsc_mode)) ||
+         write_exact(io_fd, &nsec, sizeof(nsec)) ||
+         write_exact(io_fd, &khz, sizeof(khz)) ||
+         write_exact(io_fd, &incarn, sizeof(incarn)) )
+        return -1;
+    return 0;
+}
+
+/*
+** A batch of up to MAX_BATCH_SIZE frames on its way from the guest to the
+** stream.  The batch is filled in from the to_send/to_fix bitmaps, then
+** mapped and typed (map_batch()), its pagetables canonicalised into a
+** private copy (canonicalize_batch()), the contents of zero and duplicate
+** pages elided if requested (elide_batch()) and finally written out in
+** stream order (write_batch()).
+*/
+struct save_batch {
+    unsigned int batch;       /* number of frames in the batch */
+    unsigned int run;         /* number of frames that will be sent */
+    xen_pfn_t *pfn_type;      /* mfn (PV) or pfn (HVM) in, pfn|type out */
+    unsigned long *pfn_batch; /* pfn of each frame */
+    int *pfn_err;             /* per-frame mapping errors */
+    char *xalloc;             /* frames to be sent as alloc-only */
+    void *region_base;        /* mapping of the batch's frames */
+    char *pt_pages;           /* private copies of pagetable frames and
+                                 duplicate sources */
+    char *copied;             /* data frames to be sent from pt_pages */
+    uint16_t *dup_srcs;       /* source index of each duplicate frame */
+    uint16_t *dup_table;      /* page hash -> 1 + index of a data frame */
+    uint64_t *dup_hash;       /* hash of each data frame */
+    unsigned int nr_zero;     /* frames sent as XC_SAVE_PFINFO_ZERO */
+    unsigned int nr_dups;     /* frames sent as XC_SAVE_PFINFO_DUP */
+    int done;                 /* pipeline: ready to be written */
+    int rc;                   /* pipeline: errno of a failed stage */
+};
+
+static int save_batch_init(struct save_batch *b)
+{
+    memset(b, 0, sizeof(*b));
+
+    b->pfn_type  = calloc(1, ROUNDUP(MAX_BATCH_SIZE * sizeof(*b->pfn_type),
+                                     PAGE_SHIFT));
+    b->pfn_batch = calloc(MAX_BATCH_SIZE, sizeof(*b->pfn_batch));
+    b->pfn_err   = malloc(MAX_BATCH_SIZE * sizeof(*b->pfn_err));
+    b->xalloc    = calloc(MAX_BATCH_SIZE, sizeof(*b->xalloc));
+    b->copied    = calloc(MAX_BATCH_SIZE, sizeof(*b->copied));
+
+    if ( !b->pfn_type || !b->pfn_batch || !b->pfn_err || !b->xalloc ||
+         !b->copied )
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void save_batch_unmap(struct save_batch *b)
+{
+    if ( b->region_base )
+        munmap(b->region_base, b->batch * PAGE_SIZE);
+    b->region_base = NULL;
+}
+
+static void save_batch_free(struct save_batch *b)
+{
+    save_batch_unmap(b);
+    free(b->pfn_type);
+    free(b->pfn_batch);
+    free(b->pfn_err);
+    free(b->xalloc);
+    free(b->pt_pages);
+    free(b->copied);
+    free(b->dup_srcs);
+    free(b->dup_table);
+    free(b->dup_hash);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+** Map the frames of a batch and fetch their types, converting pfn_type[]
+** into the pfn|type form used on the wire.  On return b->run holds the
+** number of frames worth sending; if there are none the batch is unmapped.
+*/
+static int map_batch(xc_interface *xch, uint32_t dom, struct save_ctx *ctx,
+                     struct save_batch *b, int hvm, int iter, int debug)
+{
+    struct domain_info_context *dinfo = &ctx->dinfo;
+    xen_pfn_t *pfn_type = b->pfn_type;
+    unsigned long *pfn_batch = b->pfn_batch;
+    unsigned int j;
+
+    b->run = 0;
+    b->nr_zero = b->nr_dups = 0;
+    memset(b->copied, 0, b->batch * sizeof(*b->copied));
+    b->region_base = xc_map_foreign_bulk(
+        xch, dom, PROT_READ, pfn_type, b->pfn_err, b->batch);
+    if ( b->region_base == NULL )
+    {
+        PERROR("map batch failed");
+        return -1;
+    }
+
+    /* Get page types */
+    if ( xc_get_pfn_type_batch(xch, dom, b->batch, pfn_type) )
+    {
+        PERROR("get_pfn_type_batch failed");
+        return -1;
+    }
+
+    for ( j = 0; j < b->batch; j++ )
+    {
+        unsigned long gmfn = pfn_batch[j];
+
+        if ( !hvm )
+            gmfn = pfn_to_mfn(gmfn);
+
+        if ( pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
+        {
+            pfn_type[j] |= pfn_batch[j];
+            ++b->run;
+            continue;
+        }
+
+        if ( b->pfn_err[j] )
+        {
+            if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+                continue;
+
+            DPRINTF("map fail: page %i mfn %08lx err %d\n",
+                    j, gmfn, b->pfn_err[j]);
+            pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
+            continue;
+        }
+
+        if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
+        {
+            DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
+            continue;
+        }
+
+        if ( b->xalloc[j] )
+            pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
+
+        /* canonicalise mfn->pfn */
+        pfn_type[j] |= pfn_batch[j];
+        ++b->run;
+
+        if ( debug )
+        {
+            void *spage = (char *)b->region_base + (PAGE_SIZE*j);
+
+            if ( hvm )
+                DPRINTF("%d pfn=%08lx sum=%08lx\n",
+                        iter,
+                        pfn_type[j],
+                        csum_page(spage));
+            else
+                DPRINTF("%d pfn= %08lx mfn= %08lx [mfn]= %08lx"
+                        " sum= %08lx\n",
+                        iter,
+                        pfn_type[j],
+                        gmfn,
+                        mfn_to_pfn(gmfn),
+                        csum_page(spage));
+        }
+    }
+
+    if ( !b->run )
+        save_batch_unmap(b); /* bail on this batch: no valid pages */
+
+    return 0;
+}
+
+/*
+** Canonicalise every pagetable frame of a mapped batch into b->pt_pages.
+** A race (stale type info) is only fatal for a non-live save.
+*/
+static int canonicalize_batch(xc_interface *xch, struct save_ctx *ctx,
+                              struct save_batch *b, int live)
+{
+    unsigned long pfn, pagetype;
+    unsigned int j;
+
+    for ( j = 0; j < b->batch; j++ )
+    {
+        pfn      = b->pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = b->pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( (pagetype < XEN_DOMCTL_PFINFO_L1TAB) ||
+             (pagetype > XEN_DOMCTL_PFINFO_L4TAB) )
+            continue;
+
+        if ( !b->pt_pages &&
+             !(b->pt_pages = malloc(MAX_BATCH_SIZE * PAGE_SIZE)) )
+        {
+            ERROR("failed to alloc memory for pagetable buffer");
+            errno = ENOMEM;
+            return -1;
+        }
+
+        /* We have a pagetable page: need to rewrite it. */
+        if ( canonicalize_pagetable(ctx, pagetype, pfn,
+                                    (char *)b->region_base + (PAGE_SIZE*j),
+                                    b->pt_pages + (PAGE_SIZE*j)) && !live )
+        {
+            ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn, pagetype);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+** Zero and duplicate page elision.
+**
+** Duplicates are found through a hash table of the batch's data frames,
+** and candidates are confirmed with a full comparison.  Under live
+** migration the guest may change a duplicate's source after it was
+** compared, and the receiver would then rebuild the duplicate from the
+** wrong contents without the duplicate ever being dirtied again.  So the
+** source is first copied into pt_pages, the copy is what gets sent, and
+** the duplicate is compared against the copy.  A zero page which changes
+** after the check is dirty and will be sent again.
+*/
+#define DUP_TABLE_SIZE  (2 * MAX_BATCH_SIZE)
+
+static int page_is_zero(const uint64_t *page)
+{
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*page); i += 4 )
+        if ( page[i] | page[i + 1] | page[i + 2] | page[i + 3] )
+            return 0;
+
+    return 1;
+}
+
+static uint64_t page_hash(const uint64_t *page)
+{
+    /* Four independent lanes keep the multiplier busy. */
+    const uint64_t m = 0x9e3779b97f4a7c15ULL;
+    uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4;
+    unsigned int i;
+
+    for ( i = 0; i < PAGE_SIZE / sizeof(*page); i += 4 )
+    {
+        h0 = (h0 ^ page[i])     * m;
+        h1 = (h1 ^ page[i + 1]) * m;
+        h2 = (h2 ^ page[i + 2]) * m;
+        h3 = (h3 ^ page[i + 3]) * m;
+    }
+
+    h0 ^= (h1 << 16 | h1 >> 48) ^ (h2 << 32 | h2 >> 32) ^
+          (h3 << 48 | h3 >> 16);
+    h0 = (h0 ^ (h0 >> 32)) * m;
+    return h0 ^ (h0 >> 29);
+}
+
+/*
+** Retype the all-zero data frames of a mapped batch as XC_SAVE_PFINFO_ZERO
+** and, with XCFLAGS_DUP_PAGES, those repeating an earlier data frame of the
+** batch as XC_SAVE_PFINFO_DUP.  elide holds the XCFLAGS_*_PAGES to apply.
+*/
+static int elide_batch(xc_interface *xch, struct save_batch *b, int elide)
+{
+    unsigned int j, src = 0, slot;
+    const uint64_t *page;
+    uint64_t h;
+
+    if ( (elide & XCFLAGS_DUP_PAGES) &&
+         ((!b->pt_pages &&
+           !(b->pt_pages = malloc(MAX_BATCH_SIZE * PAGE_SIZE))) ||
+          (!b->dup_srcs &&
+           !(b->dup_srcs = malloc(MAX_BATCH_SIZE * sizeof(*b->dup_srcs)))) ||
+          (!b->dup_hash &&
+           !(b->dup_hash = malloc(MAX_BATCH_SIZE * sizeof(*b->dup_hash)))) ||
+          (!b->dup_table &&
+           !(b->dup_table = malloc(DUP_TABLE_SIZE * sizeof(*b->dup_table))))) )
+    {
+        ERROR("failed to alloc memory for duplicate page detection");
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ( elide & XCFLAGS_DUP_PAGES )
+        memset(b->dup_table, 0, DUP_TABLE_SIZE * sizeof(*b->dup_table));
+
+    for ( j = 0; j < b->batch; j++ )
+    {
+        if ( (b->pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK) !=
+             XEN_DOMCTL_PFINFO_NOTAB )
+            continue;
+
+        page = (const uint64_t *)((char *)b->region_base + (PAGE_SIZE*j));
+
+        if ( (elide & XCFLAGS_ZERO_PAGES) && page_is_zero(page) )
+        {
+            b->pfn_type[j] |= XC_SAVE_PFINFO_ZERO;
+            b->nr_zero++;
+            continue;
+        }
+
+        if ( !(elide & XCFLAGS_DUP_PAGES) )
+            continue;
+
+        h = b->dup_hash[j] = page_hash(page);
+        for ( slot = h % DUP_TABLE_SIZE; b->dup_table[slot];
+              slot = (slot + 1) % DUP_TABLE_SIZE )
+        {
+            src = b->dup_table[slot] - 1;
+            if ( b->dup_hash[src] != h )
+                continue;
+
+            if ( !b->copied[src] )
+            {
+                memcpy(b->pt_pages + (PAGE_SIZE*src),
+                       (char *)b->region_base + (PAGE_SIZE*src), PAGE_SIZE);
+                b->copied[src] = 1;
+            }
+            if ( !memcmp(b->pt_pages + (PAGE_SIZE*src), page, PAGE_SIZE) )
+                break;
+        }
+
+        if ( !b->dup_table[slot] )
+        {
+            b->dup_table[slot] = j + 1;
+            continue;
+        }
+
+        b->pfn_type[j] |= XC_SAVE_PFINFO_DUP;
+        b->dup_srcs[b->nr_dups++] = src;
+    }
+
+    return 0;
+}
+
+/*
+** Write out the page data of a batch as an LZ4 block if that pays off.
+** Returns 0 if the batch was sent compressed, 1 if the caller must follow
+** up with the raw pages, or -1 on error.
+*/
+static int write_lz4(xc_interface *xch, struct save_lz4 *lz4,
+                     struct save_batch *b, int io_fd, struct outbuf *ob,
+                     int dobuf)
+{
+    unsigned int j, nr_pages = 0;
+    unsigned long pagetype;
+    uint32_t len = 0;
+    size_t raw;
+    char *page;
+
+    for ( j = 0; j < b->batch; j++ )
+    {
+        pagetype = b->pfn_type[j] & XEN_DOMCTL_PFINFO_LTAB_MASK;
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC
+            || pagetype == XC_SAVE_PFINFO_ZERO
+            || pagetype == XC_SAVE_PFINFO_DUP )
+            continue;
+
+        if ( !lz4->skip )
+        {
+            pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+            if ( ((pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+                  (pagetype <= XEN_DOMCTL_PFINFO_L4TAB)) || b->copied[j] )
+                page = b->pt_pages + (PAGE_SIZE*j);
+            else
+                page = (char *)b->region_base + (PAGE_SIZE*j);
+
+            memcpy(lz4->stage + (PAGE_SIZE*nr_pages), page, PAGE_SIZE);
+        }
+        nr_pages++;
+    }
+
+    /* A batch without pages has no size field. */
+    if ( !nr_pages )
+        return 1;
+
+    raw = (size_t)nr_pages * PAGE_SIZE;
+    if ( lz4->skip )
+        lz4->skip--;
+    else
+    {
+        len = xc_lz4_compress(lz4->stage, raw, lz4->out,
+                              raw - raw / LZ4_MIN_GAIN, lz4->wrkmem);
+        if ( len )
+            lz4->backoff = 0;
+        else
+        {
+            lz4->backoff = lz4->backoff ? lz4->backoff * 2 : 1;
+            if ( lz4->backoff > LZ4_MAX_BACKOFF )
+                lz4->backoff = LZ4_MAX_BACKOFF;
+            lz4->skip = lz4->backoff;
+        }
+    }
+
+    if ( write_buffer(xch, dobuf, ob, io_fd, &len, sizeof(len)) )
+    {
+        PERROR("Error when writing LZ4 block size");
+        return -1;
+    }
+
+    lz4->bytes_in += raw;
+    if ( !len )
+    {
+        lz4->raw++;
+        lz4->bytes_out += raw;
+        return 1;
+    }
+
+    if ( write_uncached(xch, dobuf, ob, io_fd, lz4->out, len) != len )
+    {
+        PERROR("Error when writing LZ4 block (errno %d)", errno);
+        return -1;
+    }
+
+    lz4->compressed++;
+    lz4->bytes_out += len;
+
+    return 0;
+}
+
+/*
+** Write a mapped and canonicalised batch to the stream: the batch size,
+** the pfn_type array and then the page data, either raw or through the
+** checkpoint compression buffer.
+*/
+static int write_batch(xc_interface *xch, struct save_batch *b,
+                       int io_fd, struct outbuf *ob, int dobuf,
+                       comp_ctx *compress_ctx, int compressing,
+                       struct save_lz4 *lz4)
+{
+    xen_pfn_t *pfn_type = b->pfn_type;
+    char *region_base = b->region_base;
+    unsigned int batch = b->batch;
+    int j, run, rc;
+
+    if ( write_buffer(xch, dobuf, ob, io_fd, &batch, sizeof(unsigned int)) )
+    {
+        PERROR("Error when writing to state file (2)");
+        return -1;
+    }
+
+    if ( sizeof(unsigned long) < sizeof(*pfn_type) )
+        for ( j = 0; j < batch; j++ )
+            ((unsigned long *)pfn_type)[j] = pfn_type[j];
+    if ( write_buffer(xch, dobuf, ob, io_fd, pfn_type,
+                      sizeof(unsigned long)*batch) )
+    {
+        PERROR("Error when writing to state file (3)");
+        return -1;
+    }
+    if ( sizeof(unsigned long) < sizeof(*pfn_type) )
+        while ( --j >= 0 )
+            pfn_type[j] = ((unsigned long *)pfn_type)[j];
+
+    if ( b->nr_dups &&
+         write_buffer(xch, dobuf, ob, io_fd, b->dup_srcs,
+                      b->nr_dups * sizeof(*b->dup_srcs)) )
+    {
+        PERROR("Error when writing duplicate page sources");
+        return -1;
+    }
+
+    if ( lz4 && !compressing &&
+         (rc = write_lz4(xch, lz4, b, io_fd, ob, dobuf)) <= 0 )
+        return rc;
+
+    /* entering this loop, pfn_type is now in pfns (Not mfns) */
+    run = 0;
+    for ( j = 0; j < batch; j++ )
+    {
+        unsigned long pfn, pagetype;
+        void *spage = region_base + (PAGE_SIZE*j);
+
+        pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
+        pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
+
+        if ( pagetype != 0 || b->copied[j] )
+        {
+            /* If the page is not a normal data page, write out any
+               run of pages we may have previously acumulated */
+            if ( !compressing && run )
+            {
+                if ( write_uncached(xch, dobuf, ob, io_fd,
+                                    region_base+(PAGE_SIZE*(j-run)),
+                                    PAGE_SIZE*run) != PAGE_SIZE*run )
+                {
+                    PERROR("Error when writing to state file (4a)"
+                          " (errno %d)", errno);
+                    return -1;
+                }
+                run = 0;
+            }
+        }
+
+        /*
+         * skip pages that aren't present,
+         * or are broken, or are alloc-only, or were elided
+         */
+        if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
+            || pagetype == XEN_DOMCTL_PFINFO_BROKEN
+            || pagetype == XEN_DOMCTL_PFINFO_XALLOC
+            || pagetype == XC_SAVE_PFINFO_ZERO
+            || pagetype == XC_SAVE_PFINFO_DUP )
+            continue;
+
+        pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
+
+        if ( ((pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
+              (pagetype <= XEN_DOMCTL_PFINFO_L4TAB)) || b->copied[j] )
+        {
+            /*
+             * A pagetable page, already canonicalised into pt_pages, or
+             * the source of a duplicate, copied there by elide_batch().
+             */
+            char *page = b->pt_pages + (PAGE_SIZE*j);
+
+            if (compressing)
+            {
+                int c_err;
+                /* Mark pagetable page to be sent uncompressed */
+                c_err = xc_compression_add_page(xch, compress_ctx, page,
+                                                pfn, 1 /* raw page */);
+                if (c_err == -2) /* OOB PFN */
+                {
+                    ERROR("Could not add pagetable page "
+                          "(pfn:%" PRIpfn "to page buffer\n", pfn);
+                    return -1;
+                }
+
+                if (c_err == -1)
+                {
+                    /*
+                     * We are out of buffer space to hold dirty
+                     * pages. Compress and flush the current buffer
+                     * to make space. This is a corner case, that
+                     * slows down checkpointing as the compression
+                     * happens while domain is suspended. Happens
+                     * seldom and if you find this occuring
+                     * frequently, increase the PAGE_BUFFER_SIZE
+                     * in xc_compression.c.
+                     */
+                    if (write_compressed(xch, compress_ctx, dobuf,
+                                         ob, io_fd) < 0)
+                    {
+                        ERROR("Error when writing compressed"
+                              " data (4b)\n");
+                        return -1;
+                    }
+                }
+            }
+            else if ( write_uncached(xch, dobuf, ob, io_fd, page,
+                                     PAGE_SIZE) != PAGE_SIZE )
+            {
+                PERROR("Error when writing to state file (4b)"
+                      " (errno %d)", errno);
+                return -1;
+            }
+        }
+        else
+        {
+            /* We have a normal page: accumulate it for writing. */
+            if (compressing)
+            {
+                int c_err;
+                /* For checkpoint compression, accumulate the page in the
+                 * page buffer, to be compressed later.
+                 */
+                c_err = xc_compression_add_page(xch, compress_ctx, spage,
+                                                pfn, 0 /* not raw page */);
+
+                if (c_err == -2) /* OOB PFN */
+                {
+                    ERROR("Could not add page "
+                          "(pfn:%" PRIpfn "to page buffer\n", pfn);
+                    return -1;
+                }
+
+                if (c_err == -1)
+                {
+                    if (write_compressed(xch, compress_ctx, dobuf,
+                                         ob, io_fd) < 0)
+                    {
+                        ERROR("Error when writing compressed"
+                              " data (4c)\n");
+                        return -1;
+                    }
+                }
+            }
+            else
+                run++;
+        }
+    } /* end of the write out for this batch */
+
+    if ( run )
+    {
+        /* write out the last accumulated run of pages */
+        if ( write_uncached(xch, dobuf, ob, io_fd,
+                            region_base+(PAGE_SIZE*(j-run)),
+                            PAGE_SIZE*run) != PAGE_SIZE*run )
+        {
+            PERROR("Error when writing to state file (4c)"
+                  " (errno %d)", errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+#ifndef __MINIOS__
+/*
+** Pipelined page sending.
+**
+** The main thread keeps scanning the dirty bitmaps and filling in batches,
+** which are handed through a ring of nr_slots batches to nr_workers threads
+** that map, type and canonicalise them.  A single writer thread then emits
+** the finished batches strictly in the order they were produced, so the
+** stream is byte-for-byte what the serial loop would have written.
+**
+** Batch n lives in slots[n % nr_slots] and moves through the counters
+**   written <= n < taken:    being processed, or done and awaiting write
+**   taken <= n < produced:   queued for a worker
+** all of which are protected by the pipeline lock.
+*/
+struct save_pipeline {
+    xc_interface *xch;
+    uint32_t dom;
+    struct save_ctx *ctx;
+    int hvm;
+    int live;
+
+    /* Output parameters, only changed while the pipeline is drained. */
+    int io_fd;
+    struct outbuf *ob;
+    int dobuf;
+    comp_ctx *compress_ctx;
+    int compressing;
+    struct save_lz4 *lz4;
+    int elide;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   /* a batch was produced */
+    pthread_cond_t done_cond;   /* a batch was processed */
+    pthread_cond_t free_cond;   /* a batch was written */
+
+    struct save_batch *slots;
+    unsigned int nr_slots;
+    unsigned long produced, taken, written;
+
+    unsigned long sent;         /* frames written since the last drain */
+    int error;                  /* errno of the first failure */
+    int shutdown;
+
+    pthread_t *workers;
+    unsigned int nr_workers;
+    pthread_t writer;
+    int writer_started;
+};
+
+static void *save_pipeline_worker(void *arg)
+{
+    struct save_pipeline *p = arg;
+    xc_interface *xch = p->xch;
+    struct save_batch *b;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        while ( !p->shutdown && (p->taken == p->produced) )
+            pthread_cond_wait(&p->work_cond, &p->lock);
+        if ( p->shutdown )
+            break;
+
+        b = &p->slots[p->taken++ % p->nr_slots];
+        pthread_mutex_unlock(&p->lock);
+
+        rc = map_batch(xch, p->dom, p->ctx, b, p->hvm, 0, 0);
+        if ( !rc && b->run )
+            rc = canonicalize_batch(xch, p->ctx, b, p->live);
+        if ( !rc && b->run && p->elide )
+            rc = elide_batch(xch, b, p->elide);
+
+        pthread_mutex_lock(&p->lock);
+        b->rc = rc ? (errno ? : EIO) : 0;
+        b->done = 1;
+        pthread_cond_broadcast(&p->done_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void *save_pipeline_writer(void *arg)
+{
+    struct save_pipeline *p = arg;
+    xc_interface *xch = p->xch;
+    struct save_batch *b;
+    int rc;
+
+    pthread_mutex_lock(&p->lock);
+    for ( ; ; )
+    {
+        b = &p->slots[p->written % p->nr_slots];
+        while ( !p->shutdown &&
+                !((p->written != p->taken) && b->done) )
+            pthread_cond_wait(&p->done_cond, &p->lock);
+        if ( p->shutdown )
+            break;
+
+        rc = b->rc;
+        if ( !rc && !p->error && b->run )
         {
-            PERROR("No extended context for VCPU%d", i);
-            goto out;
+            pthread_mutex_unlock(&p->lock);
+            if ( write_batch(xch, b, p->io_fd, p->ob, p->dobuf,
+                             p->compress_ctx, p->compressing, p->lz4) )
+                rc = errno ? : EIO;
+            save_batch_unmap(b);
+            pthread_mutex_lock(&p->lock);
+            if ( !rc )
+            {
+                p->sent += b->batch;
+                p->ctx->zero_pages += b->nr_zero;
+                p->ctx->dup_pages += b->nr_dups;
+            }
         }
-        xcnt_size = domctl.u.vcpuextstate.size + 2 * sizeof(uint64_t);
+        else
+            save_batch_unmap(b);
 
-        tot_sz = (chunk1_sz + 8) + (chunk2_sz + 8);
-        if ( domctl.u.vcpuextstate.xfeature_mask )
-            tot_sz += chunk3_sz + 8;
+        if ( rc && !p->error )
+            p->error = rc;
 
-        if ( write_exact(io_fd, &signature, sizeof(signature)) ||
-             write_exact(io_fd, &tot_sz, sizeof(tot_sz)) ||
-             write_exact(io_fd, "vcpu", 4) ||
-             write_exact(io_fd, &chunk1_sz, sizeof(chunk1_sz)) ||
-             write_exact(io_fd, &ctxt, chunk1_sz) ||
-             write_exact(io_fd, "extv", 4) ||
-             write_exact(io_fd, &chunk2_sz, sizeof(chunk2_sz)) ||
-             (domctl.u.vcpuextstate.xfeature_mask) ?
-                (write_exact(io_fd, "xcnt", 4) ||
-                write_exact(io_fd, &chunk3_sz, sizeof(chunk3_sz)) ||
-                write_exact(io_fd, &xcnt_size, 4)) :
-                0 )
+        b->done = 0;
+        p->written++;
+        pthread_cond_broadcast(&p->free_cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+static void save_pipeline_destroy(struct save_pipeline *p)
+{
+    unsigned int i;
+
+    if ( !p )
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->work_cond);
+    pthread_cond_broadcast(&p->done_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for ( i = 0; i < p->nr_workers; i++ )
+        pthread_join(p->workers[i], NULL);
+    if ( p->writer_started )
+        pthread_join(p->writer, NULL);
+
+    if ( p->slots )
+        for ( i = 0; i < p->nr_slots; i++ )
+            save_batch_free(&p->slots[i]);
+
+    pthread_cond_destroy(&p->free_cond);
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->work_cond);
+    pthread_mutex_destroy(&p->lock);
+
+    free(p->slots);
+    free(p->workers);
+    free(p);
+}
+
+static struct save_pipeline *save_pipeline_create(
+    xc_interface *xch, uint32_t dom, struct save_ctx *ctx,
+    int hvm, int live, unsigned int nr_workers)
+{
+    struct save_pipeline *p;
+    unsigned int i;
+
+    p = calloc(1, sizeof(*p));
+    if ( !p )
+        goto nomem;
+
+    p->xch = xch;
+    p->dom = dom;
+    p->ctx = ctx;
+    p->hvm = hvm;
+    p->live = live;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    pthread_cond_init(&p->free_cond, NULL);
+
+    /* Enough batches in flight to keep every worker and the writer busy. */
+    p->nr_slots = 2 * nr_workers + 2;
+    p->slots = calloc(p->nr_slots, sizeof(*p->slots));
+    p->workers = calloc(nr_workers, sizeof(*p->workers));
+    if ( !p->slots || !p->workers )
+        goto nomem;
+
+    for ( i = 0; i < p->nr_slots; i++ )
+        if ( save_batch_init(&p->slots[i]) )
+            goto nomem;
+
+    for ( ; p->nr_workers < nr_workers; p->nr_workers++ )
+        if ( (errno = pthread_create(&p->workers[p->nr_workers], NULL,
+                                     save_pipeline_worker, p)) )
         {
-            PERROR("write: extended info");
-            goto out;
+            PERROR("Couldn't create save worker thread");
+            goto err;
         }
-    }
 
-    if ( write_exact(io_fd, p2m_frame_list, 
-                     P2M_FL_ENTRIES * sizeof(xen_pfn_t)) )
+    if ( (errno = pthread_create(&p->writer, NULL,
+                                 save_pipeline_writer, p)) )
     {
-        PERROR("write: p2m_frame_list");
-        goto out;
+        PERROR("Couldn't create save writer thread");
+        goto err;
     }
+    p->writer_started = 1;
 
-    success = 1;
+    DPRINTF("Saving with %u worker threads\n", nr_workers);
 
- out:
-    
-    if ( !success && p2m )
-        munmap(p2m, P2M_FL_ENTRIES * PAGE_SIZE);
+    return p;
 
-    if ( live_p2m_frame_list_list )
-        munmap(live_p2m_frame_list_list, PAGE_SIZE);
+ nomem:
+    ERROR("failed to alloc memory for save pipeline");
+    errno = ENOMEM;
+ err:
+    save_pipeline_destroy(p);
+    return NULL;
+}
 
-    if ( live_p2m_frame_list )
-        munmap(live_p2m_frame_list, P2M_FLL_ENTRIES * PAGE_SIZE);
+/*
+** Set the output parameters for the following batches.  Must only be
+** called while the pipeline is drained.
+*/
+static void save_pipeline_set_output(struct save_pipeline *p, int io_fd,
+                                     struct outbuf *ob, int dobuf,
+                                     comp_ctx *compress_ctx, int compressing,
+                                     struct save_lz4 *lz4, int elide)
+{
+    pthread_mutex_lock(&p->lock);
+    p->io_fd = io_fd;
+    p->ob = ob;
+    p->dobuf = dobuf;
+    p->compress_ctx = compress_ctx;
+    p->compressing = compressing;
+    p->lz4 = lz4;
+    p->elide = elide;
+    pthread_mutex_unlock(&p->lock);
+}
 
-    free(p2m_frame_list_list);
+/* Wait for a free batch to fill in.  Returns NULL if the pipeline failed. */
+static struct save_batch *save_pipeline_get_batch(struct save_pipeline *p)
+{
+    struct save_batch *b = NULL;
 
-    free(p2m_frame_list);
+    pthread_mutex_lock(&p->lock);
+    while ( !p->error && (p->produced - p->written >= p->nr_slots) )
+        pthread_cond_wait(&p->free_cond, &p->lock);
+    if ( p->error )
+        errno = p->error;
+    else
+        b = &p->slots[p->produced % p->nr_slots];
+    pthread_mutex_unlock(&p->lock);
 
-    return success ? p2m : NULL;
+    return b;
 }
 
-/* must be done AFTER suspend_and_state() */
-static int save_tsc_info(xc_interface *xch, uint32_t dom, int io_fd)
+/* Queue the batch returned by the last save_pipeline_get_batch(). */
+static void save_pipeline_submit(struct save_pipeline *p)
 {
-    int marker = XC_SAVE_ID_TSC_INFO;
-    uint32_t tsc_mode, khz, incarn;
-    uint64_t nsec;
+    pthread_mutex_lock(&p->lock);
+    p->produced++;
+    pthread_cond_signal(&p->work_cond);
+    pthread_mutex_unlock(&p->lock);
+}
 
-    if ( xc_domain_get_tsc_info(xch, dom, &tsc_mode,
-                                &nsec, &khz, &incarn) < 0  ||
-         write_exact(io_fd, &marker, sizeof(marker)) ||
-         write_exact(io_fd, &tsc_mode, sizeof(tsc_mode)) ||
-         write_exact(io_fd, &nsec, sizeof(nsec)) ||
-         write_exact(io_fd, &khz, sizeof(khz)) ||
-         write_exact(io_fd, &incarn, sizeof(incarn)) )
+/*
+** Wait until every queued batch has been written.  Returns the number of
+** frames sent since the last drain in *sent, or -1 with errno set if any
+** batch failed.
+*/
+static int save_pipeline_drain(struct save_pipeline *p, unsigned long *sent)
+{
+    int error;
+
+    pthread_mutex_lock(&p->lock);
+    while ( p->written != p->produced )
+        pthread_cond_wait(&p->free_cond, &p->lock);
+    *sent = p->sent;
+    p->sent = 0;
+    error = p->error;
+    pthread_mutex_unlock(&p->lock);
+
+    if ( error )
+    {
+        errno = error;
         return -1;
+    }
+
+    return 0;
+}
+#else /* __MINIOS__ */
+/* No threads in a stub domain: always send pages from the main loop. */
+struct save_pipeline;
+
+static inline struct save_pipeline *save_pipeline_create(
+    xc_interface *xch, uint32_t dom, struct save_ctx *ctx,
+    int hvm, int live, unsigned int nr_workers)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+static inline void save_pipeline_destroy(struct save_pipeline *p) {}
+
+static inline void save_pipeline_set_output(
+    struct save_pipeline *p, int io_fd, struct outbuf *ob, int dobuf,
+    comp_ctx *compress_ctx, int compressing, struct save_lz4 *lz4,
+    int elide) {}
+
+static inline struct save_batch *save_pipeline_get_batch(
+    struct save_pipeline *p)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+static inline void save_pipeline_submit(struct save_pipeline *p) {}
+
+static inline int save_pipeline_drain(struct save_pipeline *p,
+                                      unsigned long *sent)
+{
+    *sent = 0;
     return 0;
 }
+#endif /* __MINIOS__ */
 
 int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iters,
                    uint32_t max_factor, uint32_t flags,
@@ -812,7 +2158,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     int live  = (flags & XCFLAGS_LIVE);
     int debug = (flags & XCFLAGS_DEBUG);
     int superpages = !!hvm;
-    int race = 0, sent_last_iter, skip_this_iter = 0;
+    int sent_last_iter;
+    unsigned int skip_this_iter = 0;
     unsigned int sent_this_iter = 0;
     int tmem_saved = 0;
 
@@ -822,10 +2169,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* A copy of the CPU context of the guest. */
     vcpu_guest_context_any_t ctxt;
 
-    /* A table containing the type of each PFN (/not/ MFN!). */
-    xen_pfn_t *pfn_type = NULL;
-    unsigned long *pfn_batch = NULL;
-    int *pfn_err = NULL;
+    /* The batch being filled in, when not sending through the pipeline. */
+    struct save_batch serial_batch = { 0 }, *b;
+
+    /* Worker threads mapping, canonicalising and writing batches. */
+    struct save_pipeline *pipeline = NULL;
+    unsigned int nr_workers =
+        (flags & XCFLAGS_PIPELINE_MASK) >> XCFLAGS_PIPELINE_SHIFT;
+    unsigned long sent_by_pipeline;
 
     /* A copy of one frame of guest memory. */
     char page[PAGE_SIZE];
@@ -833,9 +2184,6 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     /* Live mapping of shared info structure */
     shared_info_any_t *live_shinfo = NULL;
 
-    /* base of the region in which domain memory is mapped */
-    unsigned char *region_base = NULL;
-
     /* A copy of the CPU eXtended States of the guest. */
     DECLARE_HYPERCALL_BUFFER(void, buffer);
 
@@ -847,6 +2195,10 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     DECLARE_HYPERCALL_BUFFER(unsigned long, to_send);
     unsigned long *to_fix = NULL;
 
+    /* Extents of dirty pages from Xen, NULL if it only does bitmaps */
+    DECLARE_HYPERCALL_BUFFER(xc_shadow_op_range_t, dirty_ranges);
+    xc_hypercall_buffer_t *ranges = NULL;
+
     struct time_stats time_stats;
     xc_shadow_op_stats_t shadow_stats;
 
@@ -893,6 +2245,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
      */
     int compressing = 0;
 
+    /* LZ4 compression of page batches, if requested */
+    struct save_lz4 *lz4 = NULL;
+
+    /* Zero and duplicate page elision, if requested */
+    int elide = flags & (XCFLAGS_ZERO_PAGES | XCFLAGS_DUP_PAGES);
+
+    /* Adaptive iteration, if a target downtime was given */
+    struct save_adapt adapt;
+
+    /* Post-copy: send only the pages the guest is writing */
+    int lazy = (flags & XCFLAGS_LAZY);
+
     int completed = 0;
 
     DPRINTF("%s: starting save of domid %u", __func__, dom);
@@ -904,6 +2268,14 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto exit;
     }
 
+    if ( lazy && (!hvm || !live || callbacks->checkpoint ||
+                  (flags & XCFLAGS_CHECKPOINT_COMPRESS)) )
+    {
+        ERROR("Lazy saves need a live, non-checkpointed HVM guest");
+        errno = EINVAL;
+        goto exit;
+    }
+
     outbuf_init(xch, &ob_pagebuf, OUTBUF_SIZE);
 
     memset(ctx, 0, sizeof(*ctx));
@@ -925,6 +2297,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto exit;
     }
 
+    adapt_init(&adapt, live ? flags : 0, info.max_vcpu_id + 1);
+
     shared_info_frame = info.shared_info_frame;
 
     /* Map the shared info frame */
@@ -1003,6 +2377,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         outbuf_init(xch, &ob_tailbuf, OUTBUF_SIZE/4);
     }
 
+    if ( (flags & XCFLAGS_LZ4) && !(lz4 = save_lz4_create(xch)) )
+        goto out;
+
     last_iter = !live;
 
     /* pretend we sent all the pages last iteration */
@@ -1022,6 +2399,23 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     memset(to_send, 0xff, bitmap_size(dinfo->p2m_size));
 
+    if ( live )
+    {
+        unsigned int nr = DIRTY_RANGES_MAX;
+
+        dirty_ranges = xc_hypercall_buffer_alloc_pages(
+            xch, dirty_ranges,
+            NRPAGES(DIRTY_RANGES_MAX * sizeof(*dirty_ranges)));
+        if ( dirty_ranges &&
+             xc_shadow_dirty_ranges(xch, dom,
+                                    XEN_DOMCTL_SHADOW_OP_PEEK_RANGES,
+                                    HYPERCALL_BUFFER(dirty_ranges), &nr,
+                                    dinfo->p2m_size, NULL) >= 0 )
+            ranges = HYPERCALL_BUFFER(dirty_ranges);
+        else
+            DPRINTF("Reading log-dirty bitmaps whole\n");
+    }
+
     if ( hvm )
     {
         /* Need another buffer for HVM context */
@@ -1042,17 +2436,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     analysis_phase(xch, dom, ctx, HYPERCALL_BUFFER(to_skip), 0);
 
-    pfn_type   = malloc(ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
-    pfn_batch  = calloc(MAX_BATCH_SIZE, sizeof(*pfn_batch));
-    pfn_err    = malloc(MAX_BATCH_SIZE * sizeof(*pfn_err));
-    if ( (pfn_type == NULL) || (pfn_batch == NULL) || (pfn_err == NULL) )
+    if ( save_batch_init(&serial_batch) )
     {
         ERROR("failed to alloc memory for pfn_type and/or pfn_batch arrays");
         errno = ENOMEM;
         goto out;
     }
-    memset(pfn_type, 0,
-           ROUNDUP(MAX_BATCH_SIZE * sizeof(*pfn_type), PAGE_SHIFT));
+
+    /* Debug mode relies on the batches being logged in order. */
+    if ( nr_workers && !debug &&
+         !(pipeline = save_pipeline_create(xch, dom, ctx, hvm, live,
+                                           nr_workers)) )
+        goto out;
 
     /* Setup the mfn_to_pfn table mapping */
     if ( !(ctx->live_m2p = xc_map_m2p(xch, ctx->max_mfn, PROT_READ, &ctx->m2p_mfn0)) )
@@ -1112,16 +2507,74 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         goto out;
     }
 
+    if ( lz4 )
+    {
+        i = XC_SAVE_ID_ENABLE_LZ4;
+        if ( write_exact(io_fd, &i, sizeof(int)) )
+        {
+            PERROR("Error when writing enable_lz4 marker");
+            goto out;
+        }
+    }
+
+    if ( elide )
+    {
+        i = XC_SAVE_ID_ENABLE_ELIDE;
+        if ( write_exact(io_fd, &i, sizeof(int)) )
+        {
+            PERROR("Error when writing enable_elide marker");
+            goto out;
+        }
+    }
+
+    if ( lazy )
+    {
+        /* Let the guest show which pages it is writing to. */
+        usleep(LAZY_SAMPLE_MS * 1000);
+
+        DPRINTF("Start lazy iteration\n");
+        last_iter = 1;
+
+        if ( suspend_and_state(callbacks->suspend, callbacks->data,
+                               xch, io_fd, dom, &info) )
+        {
+            ERROR("Domain appears not to have suspended");
+            goto out;
+        }
+
+        if ( (tmem_saved > 0) &&
+             (xc_tmem_save_extra(xch,dom,io_fd,XC_SAVE_ID_TMEM_EXTRA) == -1) )
+        {
+            PERROR("Error when writing to state file (tmem)");
+            goto out;
+        }
+
+        if ( save_tsc_info(xch, dom, io_fd) < 0 )
+        {
+            PERROR("Error when writing to state file (tsc)");
+            goto out;
+        }
+
+        if ( dirty_clean(xch, dom, ranges, HYPERCALL_BUFFER(to_send), to_skip,
+                         dinfo->p2m_size, &shadow_stats) != dinfo->p2m_size )
+        {
+            PERROR("Error flushing shadow PT");
+            goto out;
+        }
+
+        lazy_pin_pages(xch, dom, dinfo->p2m_size, to_send,
+                       vm_generationid_addr);
+    }
+
   copypages:
 #define wrexact(fd, buf, len) write_buffer(xch, last_iter, ob, (fd), (buf), (len))
-#define wruncached(fd, live, buf, len) write_uncached(xch, last_iter, ob, (fd), (buf), (len))
 #define wrcompressed(fd) write_compressed(xch, compress_ctx, last_iter, ob, (fd))
 
     ob = &ob_pagebuf; /* Holds pfn_types, pages/compressed pages */
     /* Now write out each data page, canonicalising page tables as we go... */
     for ( ; ; )
     {
-        unsigned int N, batch, run;
+        unsigned int N, batch;
         char reportbuf[80];
 
         snprintf(reportbuf, sizeof(reportbuf),
@@ -1134,6 +2587,12 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         sent_this_iter = 0;
         skip_this_iter = 0;
         N = 0;
+        adapt.round_start = llgettimeofday();
+
+        if ( pipeline )
+            save_pipeline_set_output(pipeline, io_fd, ob, last_iter,
+                                     compress_ctx, compressing, lz4,
+                                     compressing ? 0 : elide);
 
         while ( N < dinfo->p2m_size )
         {
@@ -1142,10 +2601,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( !last_iter )
             {
                 /* Slightly wasteful to peek the whole array every time,
-                   but this is fast enough for the moment. */
-                frc = xc_shadow_control(
-                    xch, dom, XEN_DOMCTL_SHADOW_OP_PEEK, HYPERCALL_BUFFER(to_skip),
-                    dinfo->p2m_size, NULL, 0, NULL);
+                   but cheap enough with extents. */
+                frc = dirty_peek(xch, dom, ranges, HYPERCALL_BUFFER(to_skip),
+                                 dinfo->p2m_size);
                 if ( frc != dinfo->p2m_size )
                 {
                     ERROR("Error peeking shadow bitmap");
@@ -1153,13 +2611,34 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                 }
             }
 
+            b = pipeline ? save_pipeline_get_batch(pipeline) : &serial_batch;
+            if ( b == NULL )
+            {
+                PERROR("Error when sending pages");
+                goto out;
+            }
+
             /* load pfn_type[] with the mfn of all the pages we're doing in
                this batch. */
             for  ( batch = 0;
                    (batch < MAX_BATCH_SIZE) && (N < dinfo->p2m_size);
                    N++ )
             {
-                int n = N;
+                int n;
+
+                if ( !debug )
+                {
+                    N = completed ?
+                        next_dirty(to_send, NULL, NULL, N, dinfo->p2m_size,
+                                   1, 0, &skip_this_iter) :
+                        next_dirty(to_send, to_skip, to_fix, N,
+                                   dinfo->p2m_size,
+                                   last_iter || (superpages && iter == 1),
+                                   last_iter, &skip_this_iter);
+                    if ( N >= dinfo->p2m_size )
+                        break;
+                }
+                n = N;
 
                 if ( debug )
                 {
@@ -1186,17 +2665,18 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     if ( !test_bit(n, to_send) )
                         continue;
 
-                    pfn_batch[batch] = n;
+                    b->pfn_batch[batch] = n;
+                    b->xalloc[batch] = 0;
                     if ( hvm )
-                        pfn_type[batch] = n;
+                        b->pfn_type[batch] = n;
                     else
-                        pfn_type[batch] = pfn_to_mfn(n);
+                        b->pfn_type[batch] = pfn_to_mfn(n);
                 }
                 else
                 {
                     int dont_skip = (last_iter || (superpages && iter==1));
 
-                    if ( !dont_skip &&
+                    if ( debug && !dont_skip &&
                          test_bit(n, to_send) &&
                          test_bit(n, to_skip) )
                         skip_this_iter++; /* stats keeping */
@@ -1219,16 +2699,20 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     **  3. add in pages that still need fixup (net bufs)
                     */
 
-                    pfn_batch[batch] = n;
+                    b->pfn_batch[batch] = n;
+
+                    /* Sent alloc-only if already dirty again */
+                    b->xalloc[batch] = superpages && iter == 1 &&
+                                       test_bit(n, to_skip);
 
                     /* Hypercall interfaces operate in PFNs for HVM guests
                      * and MFNs for PV guests */
                     if ( hvm )
-                        pfn_type[batch] = n;
+                        b->pfn_type[batch] = n;
                     else
-                        pfn_type[batch] = pfn_to_mfn(n);
+                        b->pfn_type[batch] = pfn_to_mfn(n);
                     
-                    if ( !is_mapped(pfn_type[batch]) )
+                    if ( !is_mapped(b->pfn_type[batch]) )
                     {
                         /*
                         ** not currently in psuedo-physical map -- set bit
@@ -1246,7 +2730,7 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     {
                         needed_to_fix++;
                         DPRINTF("Fix! iter %d, pfn %x. mfn %lx\n",
-                                iter, n, pfn_type[batch]);
+                                iter, n, b->pfn_type[batch]);
                     }
 
                     clear_bit(n, to_fix);
@@ -1258,250 +2742,45 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
             if ( batch == 0 )
                 goto skip; /* vanishingly unlikely... */
 
-            region_base = xc_map_foreign_bulk(
-                xch, dom, PROT_READ, pfn_type, pfn_err, batch);
-            if ( region_base == NULL )
-            {
-                PERROR("map batch failed");
-                goto out;
-            }
+            b->batch = batch;
 
-            /* Get page types */
-            if ( xc_get_pfn_type_batch(xch, dom, batch, pfn_type) )
+            if ( pipeline )
             {
-                PERROR("get_pfn_type_batch failed");
-                goto out;
+                save_pipeline_submit(pipeline);
+                continue;
             }
 
-            for ( run = j = 0; j < batch; j++ )
-            {
-                unsigned long gmfn = pfn_batch[j];
-
-                if ( !hvm )
-                    gmfn = pfn_to_mfn(gmfn);
-
-                if ( pfn_type[j] == XEN_DOMCTL_PFINFO_BROKEN )
-                {
-                    pfn_type[j] |= pfn_batch[j];
-                    ++run;
-                    continue;
-                }
-
-                if ( pfn_err[j] )
-                {
-                    if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
-                        continue;
-
-                    DPRINTF("map fail: page %i mfn %08lx err %d\n",
-                            j, gmfn, pfn_err[j]);
-                    pfn_type[j] = XEN_DOMCTL_PFINFO_XTAB;
-                    continue;
-                }
-
-                if ( pfn_type[j] == XEN_DOMCTL_PFINFO_XTAB )
-                {
-                    DPRINTF("type fail: page %i mfn %08lx\n", j, gmfn);
-                    continue;
-                }
-
-                if ( superpages && iter==1 && test_bit(gmfn, to_skip))
-                    pfn_type[j] = XEN_DOMCTL_PFINFO_XALLOC;
-
-                /* canonicalise mfn->pfn */
-                pfn_type[j] |= pfn_batch[j];
-                ++run;
-
-                if ( debug )
-                {
-                    if ( hvm )
-                        DPRINTF("%d pfn=%08lx sum=%08lx\n",
-                                iter,
-                                pfn_type[j],
-                                csum_page(region_base + (PAGE_SIZE*j)));
-                    else
-                        DPRINTF("%d pfn= %08lx mfn= %08lx [mfn]= %08lx"
-                                " sum= %08lx\n",
-                                iter,
-                                pfn_type[j],
-                                gmfn,
-                                mfn_to_pfn(gmfn),
-                                csum_page(region_base + (PAGE_SIZE*j)));
-                }
-            }
+            if ( map_batch(xch, dom, ctx, b, hvm, iter, debug) )
+                goto out;
 
-            if ( !run )
-            {
-                munmap(region_base, batch*PAGE_SIZE);
+            if ( !b->run )
                 continue; /* bail on this batch: no valid pages */
-            }
-
-            if ( wrexact(io_fd, &batch, sizeof(unsigned int)) )
-            {
-                PERROR("Error when writing to state file (2)");
-                goto out;
-            }
 
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                for ( j = 0; j < batch; j++ )
-                    ((unsigned long *)pfn_type)[j] = pfn_type[j];
-            if ( wrexact(io_fd, pfn_type, sizeof(unsigned long)*batch) )
-            {
-                PERROR("Error when writing to state file (3)");
+            if ( canonicalize_batch(xch, ctx, b, live) ||
+                 (!compressing && elide && elide_batch(xch, b, elide)) ||
+                 write_batch(xch, b, io_fd, ob, last_iter,
+                             compress_ctx, compressing, lz4) )
                 goto out;
-            }
-            if ( sizeof(unsigned long) < sizeof(*pfn_type) )
-                while ( --j >= 0 )
-                    pfn_type[j] = ((unsigned long *)pfn_type)[j];
-
-            /* entering this loop, pfn_type is now in pfns (Not mfns) */
-            run = 0;
-            for ( j = 0; j < batch; j++ )
-            {
-                unsigned long pfn, pagetype;
-                void *spage = (char *)region_base + (PAGE_SIZE*j);
-
-                pfn      = pfn_type[j] & ~XEN_DOMCTL_PFINFO_LTAB_MASK;
-                pagetype = pfn_type[j] &  XEN_DOMCTL_PFINFO_LTAB_MASK;
-
-                if ( pagetype != 0 )
-                {
-                    /* If the page is not a normal data page, write out any
-                       run of pages we may have previously acumulated */
-                    if ( !compressing && run )
-                    {
-                        if ( wruncached(io_fd, live,
-                                       (char*)region_base+(PAGE_SIZE*(j-run)), 
-                                       PAGE_SIZE*run) != PAGE_SIZE*run )
-                        {
-                            PERROR("Error when writing to state file (4a)"
-                                  " (errno %d)", errno);
-                            goto out;
-                        }                        
-                        run = 0;
-                    }
-                }
-
-                /*
-                 * skip pages that aren't present,
-                 * or are broken, or are alloc-only
-                 */
-                if ( pagetype == XEN_DOMCTL_PFINFO_XTAB
-                    || pagetype == XEN_DOMCTL_PFINFO_BROKEN
-                    || pagetype == XEN_DOMCTL_PFINFO_XALLOC )
-                    continue;
-
-                pagetype &= XEN_DOMCTL_PFINFO_LTABTYPE_MASK;
-
-                if ( (pagetype >= XEN_DOMCTL_PFINFO_L1TAB) &&
-                     (pagetype <= XEN_DOMCTL_PFINFO_L4TAB) )
-                {
-                    /* We have a pagetable page: need to rewrite it. */
-                    race = 
-                        canonicalize_pagetable(ctx, pagetype, pfn, spage, page); 
-
-                    if ( race && !live )
-                    {
-                        ERROR("Fatal PT race (pfn %lx, type %08lx)", pfn,
-                              pagetype);
-                        goto out;
-                    }
-
-                    if (compressing)
-                    {
-                        int c_err;
-                        /* Mark pagetable page to be sent uncompressed */
-                        c_err = xc_compression_add_page(xch, compress_ctx, page,
-                                                        pfn, 1 /* raw page */);
-                        if (c_err == -2) /* OOB PFN */
-                        {
-                            ERROR("Could not add pagetable page "
-                                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
-                            goto out;
-                        }
-
-                        if (c_err == -1)
-                        {
-                            /*
-                             * We are out of buffer space to hold dirty
-                             * pages. Compress and flush the current buffer
-                             * to make space. This is a corner case, that
-                             * slows down checkpointing as the compression
-                             * happens while domain is suspended. Happens
-                             * seldom and if you find this occuring
-                             * frequently, increase the PAGE_BUFFER_SIZE
-                             * in xc_compression.c.
-                             */
-                            if (wrcompressed(io_fd) < 0)
-                            {
-                                ERROR("Error when writing compressed"
-                                      " data (4b)\n");
-                                goto out;
-                            }
-                        }
-                    }
-                    else if ( wruncached(io_fd, live, page,
-                                         PAGE_SIZE) != PAGE_SIZE )
-                    {
-                        PERROR("Error when writing to state file (4b)"
-                              " (errno %d)", errno);
-                        goto out;
-                    }
-                }
-                else
-                {
-                    /* We have a normal page: accumulate it for writing. */
-                    if (compressing)
-                    {
-                        int c_err;
-                        /* For checkpoint compression, accumulate the page in the
-                         * page buffer, to be compressed later.
-                         */
-                        c_err = xc_compression_add_page(xch, compress_ctx, spage,
-                                                        pfn, 0 /* not raw page */);
-
-                        if (c_err == -2) /* OOB PFN */
-                        {
-                            ERROR("Could not add page "
-                                  "(pfn:%" PRIpfn "to page buffer\n", pfn);
-                            goto out;
-                        }
-
-                        if (c_err == -1)
-                        {
-                            if (wrcompressed(io_fd) < 0)
-                            {
-                                ERROR("Error when writing compressed"
-                                      " data (4c)\n");
-                                goto out;
-                            }
-                        }
-                    }
-                    else
-                        run++;
-                }
-            } /* end of the write out for this batch */
-
-            if ( run )
-            {
-                /* write out the last accumulated run of pages */
-                if ( wruncached(io_fd, live,
-                               (char*)region_base+(PAGE_SIZE*(j-run)), 
-                               PAGE_SIZE*run) != PAGE_SIZE*run )
-                {
-                    PERROR("Error when writing to state file (4c)"
-                          " (errno %d)", errno);
-                    goto out;
-                }                        
-            }
 
             sent_this_iter += batch;
+            ctx->zero_pages += b->nr_zero;
+            ctx->dup_pages += b->nr_dups;
 
-            munmap(region_base, batch*PAGE_SIZE);
-
+            save_batch_unmap(b);
         } /* end of this while loop for this iteration */
 
       skip:
 
+        if ( pipeline )
+        {
+            if ( save_pipeline_drain(pipeline, &sent_by_pipeline) )
+            {
+                PERROR("Error when sending pages");
+                goto out;
+            }
+            sent_this_iter += sent_by_pipeline;
+        }
+
         xc_report_progress_step(xch, dinfo->p2m_size, dinfo->p2m_size);
 
         total_sent += sent_this_iter;
@@ -1539,7 +2818,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         {
             if ( (iter >= max_iters) ||
                  (sent_this_iter+skip_this_iter < 50) ||
-                 (total_sent > dinfo->p2m_size*max_factor) )
+                 (total_sent > dinfo->p2m_size*max_factor) ||
+                 (adapt.target_ms &&
+                  adapt_last_round(xch, dom, &adapt, sent_this_iter)) )
             {
                 DPRINTF("Start last iteration\n");
                 last_iter = 1;
@@ -1551,6 +2832,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
                     goto out;
                 }
 
+                adapt_unthrottle(xch, dom, &adapt);
+
                 DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
                 if ( (tmem_saved > 0) &&
                      (xc_tmem_save_extra(xch,dom,io_fd,XC_SAVE_ID_TMEM_EXTRA) == -1) )
@@ -1568,9 +2851,9 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
             }
 
-            if ( xc_shadow_control(xch, dom,
-                                   XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                                   dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+            if ( dirty_clean(xch, dom, ranges, HYPERCALL_BUFFER(to_send),
+                             to_skip, dinfo->p2m_size,
+                             &shadow_stats) != dinfo->p2m_size )
             {
                 PERROR("Error flushing shadow PT");
                 goto out;
@@ -2046,6 +3329,13 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
  out_rc:
     completed = 1;
 
+    /* Stop any batches still in flight before touching the outbuf. */
+    if ( rc && pipeline )
+    {
+        save_pipeline_destroy(pipeline);
+        pipeline = NULL;
+    }
+
     if ( !rc && callbacks->postcopy )
         callbacks->postcopy(callbacks->data);
 
@@ -2097,9 +3387,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
         DPRINTF("SUSPEND shinfo %08lx\n", info.shared_info_frame);
         print_stats(xch, dom, 0, &time_stats, &shadow_stats, 1);
 
-        if ( xc_shadow_control(xch, dom,
-                               XEN_DOMCTL_SHADOW_OP_CLEAN, HYPERCALL_BUFFER(to_send),
-                               dinfo->p2m_size, NULL, 0, &shadow_stats) != dinfo->p2m_size )
+        if ( dirty_clean(xch, dom, ranges, HYPERCALL_BUFFER(to_send), to_skip,
+                         dinfo->p2m_size, &shadow_stats) != dinfo->p2m_size )
         {
             PERROR("Error flushing shadow PT");
         }
@@ -2110,6 +3399,8 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
     if ( tmem_saved != 0 && live )
         xc_tmem_save_done(xch, dom);
 
+    adapt_unthrottle(xch, dom, &adapt);
+
     if ( live )
     {
         if ( xc_shadow_control(xch, dom, 
@@ -2134,10 +3425,20 @@ int xc_domain_save(xc_interface *xch, int io_fd, uint32_t dom, uint32_t max_iter
 
     xc_hypercall_buffer_free_pages(xch, to_send, NRPAGES(bitmap_size(dinfo->p2m_size)));
     xc_hypercall_buffer_free_pages(xch, to_skip, NRPAGES(bitmap_size(dinfo->p2m_size)));
-
-    free(pfn_type);
-    free(pfn_batch);
-    free(pfn_err);
+    xc_hypercall_buffer_free_pages(xch, dirty_ranges,
+                                   NRPAGES(DIRTY_RANGES_MAX * sizeof(*dirty_ranges)));
+
+    save_pipeline_destroy(pipeline);
+    save_batch_free(&serial_batch);
+    if ( elide )
+        DPRINTF("Elided %lu zero and %lu duplicate pages\n",
+                ctx->zero_pages, ctx->dup_pages);
+    if ( lz4 )
+    {
+        DPRINTF("LZ4: %lu batches compressed, %lu sent raw, %llu -> %llu bytes\n",
+                lz4->compressed, lz4->raw, lz4->bytes_in, lz4->bytes_out);
+        save_lz4_free(lz4);
+    }
     free(to_fix);
     free(hvm_buf);
     outbuf_free(&ob_pagebuf);
@@ -18,6 +18,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <inttypes.h>
+#include <limits.h>
+
 #include "xc_private.h"
 
 void *xc_map_foreign_pages(xc_interface *xch, uint32_t dom, int prot,
@@ -80,6 +83,307 @@ void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
                                                 dom, prot, arr, err, num);
 }
 
+void *xc_map_foreign_superpages(xc_interface *xch, uint32_t dom, int prot,
+                                xen_pfn_t gfn, unsigned int nr, int *err)
+{
+    unsigned long i, num = (unsigned long)nr << XC_SUPERPAGE_SHIFT;
+    xen_pfn_t *arr;
+    void *res;
+
+    if ( nr == 0 || num > INT_MAX || (gfn & (XC_SUPERPAGE_NR_PFNS - 1)) )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    arr = malloc(num * sizeof(*arr));
+    if ( arr == NULL )
+        return NULL;
+
+    for ( i = 0; i < num; i++ )
+        arr[i] = gfn + i;
+
+    res = xc_map_foreign_bulk(xch, dom, prot, arr, err, num);
+
+    free(arr);
+    return res;
+}
+
+/*
+ * Foreign mapping cache.  Each entry maps one 2MB extent of the
+ * guest; entries are found through a hash on the extent number and
+ * kept on an LRU list, most recently used first.  Entries invalidated
+ * while referenced move to the stale list until released.
+ */
+struct map_cache_entry {
+    xen_pfn_t base;
+    uint8_t *addr;
+    unsigned int refs;
+    struct map_cache_entry *hash_next;
+    struct map_cache_entry *prev, *next;
+    int err[XC_SUPERPAGE_NR_PFNS];
+};
+
+struct xc_map_cache {
+    xc_interface *xch;
+    uint32_t dom;
+    int prot;
+
+    unsigned int hash_size;
+    struct map_cache_entry **hash;
+    struct map_cache_entry lru, stale;
+
+    unsigned int nr_extents, max_extents;
+    uint64_t hits, misses, evictions;
+};
+
+static void map_cache_list_del(struct map_cache_entry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void map_cache_list_add(struct map_cache_entry *head,
+                               struct map_cache_entry *e)
+{
+    e->next = head->next;
+    e->prev = head;
+    head->next->prev = e;
+    head->next = e;
+}
+
+static struct map_cache_entry **map_cache_bucket(xc_map_cache_t *cache,
+                                                 xen_pfn_t base)
+{
+    return &cache->hash[(base >> XC_SUPERPAGE_SHIFT) & (cache->hash_size - 1)];
+}
+
+static void map_cache_unhash(xc_map_cache_t *cache, struct map_cache_entry *e)
+{
+    struct map_cache_entry **pp = map_cache_bucket(cache, e->base);
+
+    while ( *pp != e )
+        pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+}
+
+static void map_cache_free(xc_map_cache_t *cache, struct map_cache_entry *e)
+{
+    map_cache_list_del(e);
+    cache->nr_extents--;
+    munmap(e->addr, XC_SUPERPAGE_NR_PFNS << PAGE_SHIFT);
+    free(e);
+}
+
+/* Evict an unreferenced entry, or move a referenced one to the stale list. */
+static void map_cache_evict(xc_map_cache_t *cache, struct map_cache_entry *e)
+{
+    map_cache_unhash(cache, e);
+
+    if ( e->refs )
+    {
+        map_cache_list_del(e);
+        map_cache_list_add(&cache->stale, e);
+        return;
+    }
+
+    map_cache_free(cache, e);
+}
+
+xc_map_cache_t *xc_map_cache_create(xc_interface *xch, uint32_t dom,
+                                    int prot, unsigned int max_extents)
+{
+    xc_map_cache_t *cache;
+
+    if ( max_extents == 0 )
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    if ( cache == NULL )
+        return NULL;
+
+    cache->xch = xch;
+    cache->dom = dom;
+    cache->prot = prot;
+    cache->max_extents = max_extents;
+    cache->lru.prev = cache->lru.next = &cache->lru;
+    cache->stale.prev = cache->stale.next = &cache->stale;
+
+    cache->hash_size = 1;
+    while ( cache->hash_size < 2 * max_extents )
+        cache->hash_size <<= 1;
+
+    cache->hash = calloc(cache->hash_size, sizeof(*cache->hash));
+    if ( cache->hash == NULL )
+    {
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+void *xc_map_cache_lookup(xc_map_cache_t *cache, xen_pfn_t gfn)
+{
+    xc_interface *xch = cache->xch;
+    xen_pfn_t base = gfn & ~(XC_SUPERPAGE_NR_PFNS - 1);
+    unsigned int idx = gfn & (XC_SUPERPAGE_NR_PFNS - 1);
+    struct map_cache_entry **pp = map_cache_bucket(cache, base), *e;
+
+    for ( e = *pp; e != NULL; e = e->hash_next )
+        if ( e->base == base )
+            break;
+
+    if ( e != NULL )
+    {
+        cache->hits++;
+        map_cache_list_del(e);
+    }
+    else
+    {
+        cache->misses++;
+
+        /* Make room, skipping extents which are still referenced. */
+        for ( e = cache->lru.prev;
+              e != &cache->lru && cache->nr_extents >= cache->max_extents; )
+        {
+            struct map_cache_entry *prev = e->prev;
+
+            if ( !e->refs )
+            {
+                map_cache_evict(cache, e);
+                cache->evictions++;
+            }
+            e = prev;
+        }
+
+        e = malloc(sizeof(*e));
+        if ( e == NULL )
+            return NULL;
+
+        e->addr = xc_map_foreign_superpages(xch, cache->dom, cache->prot,
+                                            base, 1, e->err);
+        if ( e->addr == NULL )
+        {
+            PERROR("Could not map extent %#"PRIx64" of domain %u",
+                   (uint64_t)base, cache->dom);
+            free(e);
+            return NULL;
+        }
+
+        e->base = base;
+        e->refs = 0;
+        e->hash_next = *pp;
+        *pp = e;
+        cache->nr_extents++;
+    }
+
+    map_cache_list_add(&cache->lru, e);
+
+    if ( e->err[idx] )
+    {
+        errno = -e->err[idx];
+        /* The frame may be paged back in: retry the mapping next time. */
+        if ( !e->refs )
+            map_cache_evict(cache, e);
+        return NULL;
+    }
+
+    e->refs++;
+    return e->addr + (idx << PAGE_SHIFT);
+}
+
+static int map_cache_holds(struct map_cache_entry *e, const void *page)
+{
+    const uint8_t *p = page;
+
+    return p >= e->addr && p < e->addr + (XC_SUPERPAGE_NR_PFNS << PAGE_SHIFT);
+}
+
+void xc_map_cache_release(xc_map_cache_t *cache, xen_pfn_t gfn, void *page)
+{
+    xen_pfn_t base = gfn & ~(XC_SUPERPAGE_NR_PFNS - 1);
+    struct map_cache_entry *e;
+
+    /*
+     * Match on the mapping handed out, not just the gfn: an extent
+     * invalidated and looked up again has a stale and a live entry.
+     */
+    for ( e = *map_cache_bucket(cache, base); e != NULL; e = e->hash_next )
+        if ( map_cache_holds(e, page) )
+            break;
+
+    if ( e == NULL )
+    {
+        for ( e = cache->stale.next; e != &cache->stale; e = e->next )
+            if ( map_cache_holds(e, page) )
+                break;
+        if ( e == &cache->stale )
+            abort();
+        if ( --e->refs == 0 )
+            map_cache_free(cache, e);
+        return;
+    }
+
+    e->refs--;
+}
+
+void xc_map_cache_invalidate(xc_map_cache_t *cache, xen_pfn_t gfn,
+                             unsigned long nr)
+{
+    xen_pfn_t base = gfn & ~(XC_SUPERPAGE_NR_PFNS - 1);
+    struct map_cache_entry *e, *next;
+
+    if ( nr == 0 )
+        return;
+
+    /* Walk whichever is smaller: the range or the cache. */
+    if ( ((gfn + nr - base) >> XC_SUPERPAGE_SHIFT) <= cache->nr_extents )
+    {
+        for ( ; base < gfn + nr; base += XC_SUPERPAGE_NR_PFNS )
+            for ( e = *map_cache_bucket(cache, base); e != NULL; e = e->hash_next )
+                if ( e->base == base )
+                {
+                    map_cache_evict(cache, e);
+                    break;
+                }
+        return;
+    }
+
+    for ( e = cache->lru.next; e != &cache->lru; e = next )
+    {
+        next = e->next;
+        if ( e->base + XC_SUPERPAGE_NR_PFNS > gfn && e->base < gfn + nr )
+            map_cache_evict(cache, e);
+    }
+}
+
+void xc_map_cache_stats(xc_map_cache_t *cache, xc_map_cache_stats_t *stats)
+{
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->evictions = cache->evictions;
+    stats->nr_extents = cache->nr_extents;
+    stats->max_extents = cache->max_extents;
+}
+
+void xc_map_cache_destroy(xc_map_cache_t *cache)
+{
+    if ( cache == NULL )
+        return;
+
+    while ( cache->lru.next != &cache->lru )
+        map_cache_free(cache, cache->lru.next);
+    while ( cache->stale.next != &cache->stale )
+        map_cache_free(cache, cache->stale.next);
+
+    free(cache->hash);
+    free(cache);
+}
+
 /* stub for all not yet converted OSes */
 void *xc_map_foreign_bulk_compat(xc_interface *xch, xc_osdep_handle h,
                                  uint32_t dom, int prot,
@@ -45,93 +45,492 @@ static void hypercall_buffer_cache_unlock(xc_interface *xch)
     pthread_mutex_unlock(&hypercall_buffer_cache_mutex);
 }
 
-static void *hypercall_buffer_cache_alloc(xc_interface *xch, int nr_pages)
+/*
+ * Buffers are handed out in power-of-two size classes so that a
+ * released buffer can satisfy any later request of the same class.
+ */
+#define HYPERCALL_BUFFER_POOL_MAX_PAGES (1 << (XC_HYPERCALL_BUFFER_POOL_ORDERS - 1))
+#define HYPERCALL_BUFFER_CACHE_DEFAULT_LIMIT 256 /* pages */
+
+/* Hugepage regions which small buffers are carved out of. */
+#define HYPERCALL_BUFFER_HUGE_PAGES ((2UL << 20) >> PAGE_SHIFT)
+
+/*
+ * A thread's private cache only holds small buffers, so that idle
+ * threads do not pin much memory.
+ */
+#define HYPERCALL_BUFFER_TCACHE_PAGES 16
+
+struct xc_hypercall_buffer_tcache {
+    xc_interface *xch;
+    struct xc_hypercall_buffer_tcache *next;
+    unsigned int nr_pages;
+    unsigned long hits;
+    void *free[XC_HYPERCALL_BUFFER_POOL_ORDERS];
+    unsigned int nr[XC_HYPERCALL_BUFFER_POOL_ORDERS];
+};
+
+static int hypercall_buffer_order(int nr_pages)
 {
-    void *p = NULL;
+    int order = 0;
 
-    hypercall_buffer_cache_lock(xch);
+    if ( nr_pages > HYPERCALL_BUFFER_POOL_MAX_PAGES )
+        return -1;
+
+    while ( (1 << order) < nr_pages )
+        order++;
+
+    return order;
+}
+
+static void *free_list_pop(void **head)
+{
+    void *p = *head;
 
-    xch->hypercall_buffer_total_allocations++;
-    xch->hypercall_buffer_current_allocations++;
-    if ( xch->hypercall_buffer_current_allocations > xch->hypercall_buffer_maximum_allocations )
-        xch->hypercall_buffer_maximum_allocations = xch->hypercall_buffer_current_allocations;
+    if ( p )
+        *head = *(void **)p;
 
-    if ( nr_pages > 1 )
+    return p;
+}
+
+static void free_list_push(void **head, void *p)
+{
+    *(void **)p = *head;
+    *head = p;
+}
+
+static int hypercall_buffer_is_huge(xc_interface *xch, void *p)
+{
+    unsigned int i;
+
+    for ( i = 0; i < xch->hypercall_buffer_huge_nr; i++ )
     {
-        xch->hypercall_buffer_cache_toobig++;
+        char *r = xch->hypercall_buffer_huge[i];
+
+        if ( (char *)p >= r && (char *)p < r + HYPERCALL_BUFFER_HUGE_PAGES * PAGE_SIZE )
+            return 1;
     }
-    else if ( xch->hypercall_buffer_cache_nr > 0 )
+
+    return 0;
+}
+
+/*
+ * Carve a buffer out of the newest hugepage region, allocating a new
+ * region once it is exhausted.  Called with the lock held.
+ */
+static void *hypercall_buffer_huge_alloc(xc_interface *xch, int order)
+{
+    unsigned int pages = 1U << order;
+    char *r;
+
+    if ( !(xch->hypercall_buffer_cache_flags & XC_HYPERCALL_BUFFER_POOL_HUGEPAGES) )
+        return NULL;
+
+    if ( xch->hypercall_buffer_huge_nr == 0 ||
+         xch->hypercall_buffer_huge_used + pages > HYPERCALL_BUFFER_HUGE_PAGES )
+    {
+        if ( xch->hypercall_buffer_huge_nr == HYPERCALL_BUFFER_HUGE_REGIONS )
+            return NULL;
+
+        /* Hand the tail of the old region out through the free lists. */
+        if ( xch->hypercall_buffer_huge_nr > 0 )
+        {
+            r = xch->hypercall_buffer_huge[xch->hypercall_buffer_huge_nr - 1];
+            while ( xch->hypercall_buffer_huge_used < HYPERCALL_BUFFER_HUGE_PAGES )
+            {
+                int o = XC_HYPERCALL_BUFFER_POOL_ORDERS - 1;
+
+                while ( xch->hypercall_buffer_huge_used + (1U << o) >
+                        HYPERCALL_BUFFER_HUGE_PAGES )
+                    o--;
+
+                free_list_push(&xch->hypercall_buffer_cache[o],
+                               r + xch->hypercall_buffer_huge_used * PAGE_SIZE);
+                xch->hypercall_buffer_cache_nr[o]++;
+                xch->hypercall_buffer_huge_used += 1U << o;
+            }
+        }
+
+        r = xch->ops->u.privcmd.alloc_hypercall_buffer_huge(
+            xch, xch->ops_handle, HYPERCALL_BUFFER_HUGE_PAGES);
+        if ( r == NULL )
+        {
+            /* Most likely no hugepages reserved: do not keep trying. */
+            DPRINTF("hypercall buffer: hugepage allocation failed, disabling");
+            xch->hypercall_buffer_cache_flags &= ~XC_HYPERCALL_BUFFER_POOL_HUGEPAGES;
+            return NULL;
+        }
+
+        xch->hypercall_buffer_huge[xch->hypercall_buffer_huge_nr++] = r;
+        xch->hypercall_buffer_huge_used = 0;
+    }
+
+    r = xch->hypercall_buffer_huge[xch->hypercall_buffer_huge_nr - 1];
+    r += xch->hypercall_buffer_huge_used * PAGE_SIZE;
+    xch->hypercall_buffer_huge_used += pages;
+    xch->hypercall_buffer_huge_hits++;
+
+    return r;
+}
+
+static void *hypercall_buffer_cache_alloc(xc_interface *xch, int order)
+{
+    void *p;
+
+    hypercall_buffer_cache_lock(xch);
+
+    p = free_list_pop(&xch->hypercall_buffer_cache[order]);
+    if ( p )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
+        xch->hypercall_buffer_cache_nr[order]--;
+        if ( !hypercall_buffer_is_huge(xch, p) )
+            xch->hypercall_buffer_cache_pages -= 1U << order;
         xch->hypercall_buffer_cache_hits++;
     }
     else
+        p = hypercall_buffer_huge_alloc(xch, order);
+
+    hypercall_buffer_cache_unlock(xch);
+
+    return p;
+}
+
+/*
+ * Returns 1 if the buffer was taken into the pool, 0 if the caller
+ * must release it to the OS.  Called with the lock held.
+ */
+static int hypercall_buffer_cache_put(xc_interface *xch, void *p, int order)
+{
+    if ( !hypercall_buffer_is_huge(xch, p) )
     {
-        xch->hypercall_buffer_cache_misses++;
+        if ( xch->hypercall_buffer_cache_pages + (1U << order) >
+             xch->hypercall_buffer_cache_limit )
+            return 0;
+        xch->hypercall_buffer_cache_pages += 1U << order;
     }
 
+    free_list_push(&xch->hypercall_buffer_cache[order], p);
+    xch->hypercall_buffer_cache_nr[order]++;
+
+    return 1;
+}
+
+static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int order)
+{
+    int rc;
+
+    hypercall_buffer_cache_lock(xch);
+    rc = hypercall_buffer_cache_put(xch, p, order);
     hypercall_buffer_cache_unlock(xch);
 
-    return p;
+    return rc;
 }
 
-static int hypercall_buffer_cache_free(xc_interface *xch, void *p, int nr_pages)
+/*
+ * Release buffers from the shared free lists, largest first, until no
+ * more than @limit OS pages remain cached.  Called with the lock held.
+ */
+static void hypercall_buffer_cache_trim(xc_interface *xch, unsigned int limit)
 {
-    int rc = 0;
+    void *keep[XC_HYPERCALL_BUFFER_POOL_ORDERS] = { NULL };
+    void *p;
+    int order;
+
+    for ( order = XC_HYPERCALL_BUFFER_POOL_ORDERS - 1; order >= 0; order-- )
+    {
+        while ( (p = free_list_pop(&xch->hypercall_buffer_cache[order])) )
+        {
+            if ( hypercall_buffer_is_huge(xch, p) ||
+                 xch->hypercall_buffer_cache_pages <= limit )
+            {
+                free_list_push(&keep[order], p);
+                continue;
+            }
+
+            xch->hypercall_buffer_cache_nr[order]--;
+            xch->hypercall_buffer_cache_pages -= 1U << order;
+            xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                      p, 1 << order);
+        }
+        xch->hypercall_buffer_cache[order] = keep[order];
+    }
+}
+
+static void hypercall_buffer_tcache_destroy(void *arg)
+{
+    struct xc_hypercall_buffer_tcache *tc = arg, **pp;
+    xc_interface *xch = tc->xch;
+    void *p;
+    int order;
 
     hypercall_buffer_cache_lock(xch);
 
-    xch->hypercall_buffer_total_releases++;
-    xch->hypercall_buffer_current_allocations--;
+    for ( pp = &xch->hypercall_buffer_tcaches; *pp; pp = &(*pp)->next )
+    {
+        if ( *pp == tc )
+        {
+            *pp = tc->next;
+            break;
+        }
+    }
+
+    xch->hypercall_buffer_tcache_hits += tc->hits;
 
-    if ( nr_pages == 1 && xch->hypercall_buffer_cache_nr < HYPERCALL_BUFFER_CACHE_SIZE )
+    for ( order = 0; order < XC_HYPERCALL_BUFFER_POOL_ORDERS; order++ )
+        while ( (p = free_list_pop(&tc->free[order])) )
+            if ( !hypercall_buffer_cache_put(xch, p, order) )
+                xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                          p, 1 << order);
+
+    hypercall_buffer_cache_unlock(xch);
+
+    free(tc);
+}
+
+/*
+ * Returns the calling thread's cache, creating it on first use, or
+ * NULL if per-thread caching is unavailable.
+ */
+static struct xc_hypercall_buffer_tcache *hypercall_buffer_tcache(xc_interface *xch)
+{
+    struct xc_hypercall_buffer_tcache *tc;
+
+    if ( xch->hypercall_buffer_tcache_enabled < 0 )
+        return NULL;
+
+    if ( xch->hypercall_buffer_tcache_enabled == 0 )
+    {
+        hypercall_buffer_cache_lock(xch);
+        if ( xch->hypercall_buffer_tcache_enabled == 0 )
+            xch->hypercall_buffer_tcache_enabled =
+                pthread_key_create(&xch->hypercall_buffer_tcache_key,
+                                   hypercall_buffer_tcache_destroy) ? -1 : 1;
+        hypercall_buffer_cache_unlock(xch);
+
+        if ( xch->hypercall_buffer_tcache_enabled < 0 )
+            return NULL;
+    }
+
+    tc = pthread_getspecific(xch->hypercall_buffer_tcache_key);
+    if ( tc )
+        return tc;
+
+    tc = calloc(1, sizeof(*tc));
+    if ( tc == NULL )
+        return NULL;
+    tc->xch = xch;
+
+    if ( pthread_setspecific(xch->hypercall_buffer_tcache_key, tc) )
     {
-        xch->hypercall_buffer_cache[xch->hypercall_buffer_cache_nr++] = p;
-        rc = 1;
+        free(tc);
+        return NULL;
     }
 
+    hypercall_buffer_cache_lock(xch);
+    tc->next = xch->hypercall_buffer_tcaches;
+    xch->hypercall_buffer_tcaches = tc;
     hypercall_buffer_cache_unlock(xch);
 
-    return rc;
+    return tc;
+}
+
+void xc__hypercall_buffer_cache_init(xc_interface *xch)
+{
+    int order;
+
+    for ( order = 0; order < XC_HYPERCALL_BUFFER_POOL_ORDERS; order++ )
+    {
+        xch->hypercall_buffer_cache[order] = NULL;
+        xch->hypercall_buffer_cache_nr[order] = 0;
+    }
+    xch->hypercall_buffer_cache_pages = 0;
+    xch->hypercall_buffer_cache_limit = HYPERCALL_BUFFER_CACHE_DEFAULT_LIMIT;
+    xch->hypercall_buffer_cache_flags = 0;
+
+    xch->hypercall_buffer_huge_nr = 0;
+    xch->hypercall_buffer_huge_used = 0;
+
+    /* Per-thread caches are pointless if only one thread may call us. */
+    xch->hypercall_buffer_tcache_enabled =
+        (xch->flags & XC_OPENFLAG_NON_REENTRANT) ? -1 : 0;
+    xch->hypercall_buffer_tcaches = NULL;
+
+    xch->hypercall_buffer_total_allocations = 0;
+    xch->hypercall_buffer_total_releases = 0;
+    xch->hypercall_buffer_current_allocations = 0;
+    xch->hypercall_buffer_maximum_allocations = 0;
+    xch->hypercall_buffer_cache_hits = 0;
+    xch->hypercall_buffer_tcache_hits = 0;
+    xch->hypercall_buffer_cache_misses = 0;
+    xch->hypercall_buffer_cache_toobig = 0;
+    xch->hypercall_buffer_huge_hits = 0;
 }
 
 void xc__hypercall_buffer_cache_release(xc_interface *xch)
 {
+    struct xc_hypercall_buffer_tcache *tc;
     void *p;
+    unsigned int i;
+    int order;
 
     hypercall_buffer_cache_lock(xch);
 
-    DBGPRINTF("hypercall buffer: total allocations:%d total releases:%d",
+    /*
+     * Other threads must have stopped using the handle by now, so
+     * their caches can be drained from here.
+     */
+    if ( xch->hypercall_buffer_tcache_enabled > 0 )
+        pthread_key_delete(xch->hypercall_buffer_tcache_key);
+    while ( (tc = xch->hypercall_buffer_tcaches) != NULL )
+    {
+        xch->hypercall_buffer_tcaches = tc->next;
+        xch->hypercall_buffer_tcache_hits += tc->hits;
+        for ( order = 0; order < XC_HYPERCALL_BUFFER_POOL_ORDERS; order++ )
+            while ( (p = free_list_pop(&tc->free[order])) )
+                if ( !hypercall_buffer_is_huge(xch, p) )
+                    xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                              p, 1 << order);
+        free(tc);
+    }
+
+    DBGPRINTF("hypercall buffer: total allocations:%lu total releases:%lu",
               xch->hypercall_buffer_total_allocations,
               xch->hypercall_buffer_total_releases);
     DBGPRINTF("hypercall buffer: current allocations:%d maximum allocations:%d",
               xch->hypercall_buffer_current_allocations,
               xch->hypercall_buffer_maximum_allocations);
-    DBGPRINTF("hypercall buffer: cache current size:%d",
-              xch->hypercall_buffer_cache_nr);
-    DBGPRINTF("hypercall buffer: cache hits:%d misses:%d toobig:%d",
+    DBGPRINTF("hypercall buffer: cache current size:%u pages, %u hugepage regions",
+              xch->hypercall_buffer_cache_pages,
+              xch->hypercall_buffer_huge_nr);
+    DBGPRINTF("hypercall buffer: cache hits:%lu thread cache hits:%lu",
               xch->hypercall_buffer_cache_hits,
+              xch->hypercall_buffer_tcache_hits);
+    DBGPRINTF("hypercall buffer: misses:%lu toobig:%lu huge:%lu",
               xch->hypercall_buffer_cache_misses,
-              xch->hypercall_buffer_cache_toobig);
+              xch->hypercall_buffer_cache_toobig,
+              xch->hypercall_buffer_huge_hits);
+
+    hypercall_buffer_cache_trim(xch, 0);
+
+    for ( i = 0; i < xch->hypercall_buffer_huge_nr; i++ )
+        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle,
+                                                  xch->hypercall_buffer_huge[i],
+                                                  HYPERCALL_BUFFER_HUGE_PAGES);
+    xch->hypercall_buffer_huge_nr = 0;
+
+    hypercall_buffer_cache_unlock(xch);
+}
+
+int xc_hypercall_buffer_pool_stats(xc_interface *xch,
+                                   xc_hypercall_buffer_pool_stats_t *stats)
+{
+    struct xc_hypercall_buffer_tcache *tc;
+    int order;
+
+    memset(stats, 0, sizeof(*stats));
+
+    hypercall_buffer_cache_lock(xch);
 
-    while ( xch->hypercall_buffer_cache_nr > 0 )
+    stats->total_allocations = xch->hypercall_buffer_total_allocations;
+    stats->total_releases = xch->hypercall_buffer_total_releases;
+    stats->current_allocations = xch->hypercall_buffer_current_allocations;
+    stats->maximum_allocations = xch->hypercall_buffer_maximum_allocations;
+    stats->cache_hits = xch->hypercall_buffer_cache_hits;
+    stats->thread_cache_hits = xch->hypercall_buffer_tcache_hits;
+    stats->cache_misses = xch->hypercall_buffer_cache_misses;
+    stats->cache_toobig = xch->hypercall_buffer_cache_toobig;
+    stats->hugepage_hits = xch->hypercall_buffer_huge_hits;
+    stats->cached_pages = xch->hypercall_buffer_cache_pages;
+    stats->cache_limit = xch->hypercall_buffer_cache_limit;
+    stats->hugepage_regions = xch->hypercall_buffer_huge_nr;
+    stats->flags = xch->hypercall_buffer_cache_flags;
+
+    for ( order = 0; order < XC_HYPERCALL_BUFFER_POOL_ORDERS; order++ )
+        stats->cached[order] = xch->hypercall_buffer_cache_nr[order];
+
+    /* Other threads' counters are read racily: good enough for stats. */
+    for ( tc = xch->hypercall_buffer_tcaches; tc; tc = tc->next )
     {
-        p = xch->hypercall_buffer_cache[--xch->hypercall_buffer_cache_nr];
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, p, 1);
+        stats->thread_cache_hits += tc->hits;
+        for ( order = 0; order < XC_HYPERCALL_BUFFER_POOL_ORDERS; order++ )
+            stats->cached[order] += tc->nr[order];
     }
 
     hypercall_buffer_cache_unlock(xch);
+
+    return 0;
+}
+
+int xc_hypercall_buffer_pool_tune(xc_interface *xch,
+                                  unsigned int max_cached_pages,
+                                  unsigned int flags)
+{
+    if ( flags & ~XC_HYPERCALL_BUFFER_POOL_HUGEPAGES )
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ( (flags & XC_HYPERCALL_BUFFER_POOL_HUGEPAGES) &&
+         xch->ops->u.privcmd.alloc_hypercall_buffer_huge == NULL )
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    hypercall_buffer_cache_lock(xch);
+    xch->hypercall_buffer_cache_limit = max_cached_pages;
+    xch->hypercall_buffer_cache_flags = flags;
+    hypercall_buffer_cache_trim(xch, max_cached_pages);
+    hypercall_buffer_cache_unlock(xch);
+
+    return 0;
 }
 
 void *xc__hypercall_buffer_alloc_pages(xc_interface *xch, xc_hypercall_buffer_t *b, int nr_pages)
 {
-    void *p = hypercall_buffer_cache_alloc(xch, nr_pages);
+    struct xc_hypercall_buffer_tcache *tc = NULL;
+    int order = hypercall_buffer_order(nr_pages);
+    int current;
+    void *p = NULL;
+
+    __sync_fetch_and_add(&xch->hypercall_buffer_total_allocations, 1);
+    current = __sync_add_and_fetch(&xch->hypercall_buffer_current_allocations, 1);
+    /* Racy, but only ever loses a concurrent high-water mark. */
+    if ( current > xch->hypercall_buffer_maximum_allocations )
+        xch->hypercall_buffer_maximum_allocations = current;
 
-    if ( !p )
+    if ( order < 0 )
+    {
+        __sync_fetch_and_add(&xch->hypercall_buffer_cache_toobig, 1);
         p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle, nr_pages);
+    }
+    else
+    {
+        tc = hypercall_buffer_tcache(xch);
+        if ( tc && (p = free_list_pop(&tc->free[order])) )
+        {
+            tc->nr[order]--;
+            tc->nr_pages -= 1U << order;
+            tc->hits++;
+        }
+
+        if ( !p )
+            p = hypercall_buffer_cache_alloc(xch, order);
+
+        if ( !p )
+        {
+            __sync_fetch_and_add(&xch->hypercall_buffer_cache_misses, 1);
+            p = xch->ops->u.privcmd.alloc_hypercall_buffer(xch, xch->ops_handle,
+                                                           1 << order);
+        }
+    }
 
     if (!p)
+    {
+        __sync_fetch_and_sub(&xch->hypercall_buffer_current_allocations, 1);
         return NULL;
+    }
 
     b->hbuf = p;
 
@@ -142,11 +541,33 @@ void *xc__hypercall_buffer_alloc_pages(xc_interface *xch, xc_hypercall_buffer_t
 
 void xc__hypercall_buffer_free_pages(xc_interface *xch, xc_hypercall_buffer_t *b, int nr_pages)
 {
-    if ( b->hbuf == NULL )
+    struct xc_hypercall_buffer_tcache *tc;
+    int order = hypercall_buffer_order(nr_pages);
+    void *p = b->hbuf;
+
+    if ( p == NULL )
         return;
 
-    if ( !hypercall_buffer_cache_free(xch, b->hbuf, nr_pages) )
-        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, b->hbuf, nr_pages);
+    __sync_fetch_and_add(&xch->hypercall_buffer_total_releases, 1);
+    __sync_fetch_and_sub(&xch->hypercall_buffer_current_allocations, 1);
+
+    if ( order < 0 )
+    {
+        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, p, nr_pages);
+        return;
+    }
+
+    tc = hypercall_buffer_tcache(xch);
+    if ( tc && tc->nr_pages + (1U << order) <= HYPERCALL_BUFFER_TCACHE_PAGES )
+    {
+        free_list_push(&tc->free[order], p);
+        tc->nr[order]++;
+        tc->nr_pages += 1U << order;
+        return;
+    }
+
+    if ( !hypercall_buffer_cache_free(xch, p, order) )
+        xch->ops->u.privcmd.free_hypercall_buffer(xch, xch->ops_handle, p, 1 << order);
 }
 
 struct allocation_header {
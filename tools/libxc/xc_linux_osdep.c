@@ -88,17 +88,19 @@ static int linux_privcmd_close(xc_interface *xch, xc_osdep_handle h)
     return close(fd);
 }
 
-static void *linux_privcmd_alloc_hypercall_buffer(xc_interface *xch, xc_osdep_handle h, int npages)
+static void *linux_privcmd_map_hypercall_buffer(xc_interface *xch, int npages, int flags)
 {
     size_t size = npages * XC_PAGE_SIZE;
     void *p;
     int rc, saved_errno;
 
     /* Address returned by mmap is page aligned. */
-    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED, -1, 0);
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_LOCKED|flags, -1, 0);
     if ( p == MAP_FAILED )
     {
-        PERROR("xc_alloc_hypercall_buffer: mmap failed");
+        /* Hugepage mappings fail routinely when none are reserved. */
+        if ( !flags )
+            PERROR("xc_alloc_hypercall_buffer: mmap failed");
         return NULL;
     }
 
@@ -120,6 +122,21 @@ out:
     return NULL;
 }
 
+static void *linux_privcmd_alloc_hypercall_buffer(xc_interface *xch, xc_osdep_handle h, int npages)
+{
+    return linux_privcmd_map_hypercall_buffer(xch, npages, 0);
+}
+
+static void *linux_privcmd_alloc_hypercall_buffer_huge(xc_interface *xch, xc_osdep_handle h, int npages)
+{
+#ifdef MAP_HUGETLB
+    return linux_privcmd_map_hypercall_buffer(xch, npages, MAP_HUGETLB);
+#else
+    errno = EOPNOTSUPP;
+    return NULL;
+#endif
+}
+
 static void linux_privcmd_free_hypercall_buffer(xc_interface *xch, xc_osdep_handle h, void *ptr, int npages)
 {
     /* Recover the VMA flags. Maybe it's not necessary */
@@ -441,6 +458,7 @@ static struct xc_osdep_ops linux_privcmd_ops = {
     .u.privcmd = {
         .alloc_hypercall_buffer = &linux_privcmd_alloc_hypercall_buffer,
         .free_hypercall_buffer = &linux_privcmd_free_hypercall_buffer,
+        .alloc_hypercall_buffer_huge = &linux_privcmd_alloc_hypercall_buffer_huge,
 
         .hypercall = &linux_privcmd_hypercall,
 
@@ -0,0 +1,307 @@
+/******************************************************************************
+ * xc_lz4.c
+ *
+ * LZ4 block compression of page batches in the migration stream.
+ *
+ * The decoder is the one the hypervisor uses for LZ4 kernels.  The encoder
+ * follows the reference "fast" LZ4 compressor by Yann Collet, as found in
+ * Linux's lib/lz4/lz4_compress.c, and emits plain LZ4 blocks.
+ *
+ * LZ4 - Fast LZ compression algorithm
+ * Copyright (C) 2011-2012, Yann Collet.
+ * BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation;
+ * version 2.1 of the License.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <stdint.h>
+
+#include "xg_private.h"
+#include "xg_save_restore.h"
+
+#define CONFIG_HAVE_EFFICIENT_UNALIGNED_ACCESS
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define likely(a) a
+#define unlikely(a) a
+
+static inline uint_fast16_t le16_to_cpup(const unsigned char *buf)
+{
+    return buf[0] | (buf[1] << 8);
+}
+
+static inline uint_fast32_t le32_to_cpup(const unsigned char *buf)
+{
+    return le16_to_cpup(buf) | ((uint32_t)le16_to_cpup(buf + 2) << 16);
+}
+
+/* The domain builder links in its own copy of the decoder. */
+#define lz4_decompress xc_lz4_decompress_known
+#define lz4_decompress_unknownoutputsize xc_lz4_decompress_unknownoutputsize
+
+#include "../../xen/include/xen/lz4.h"
+#include "../../xen/common/decompress.h"
+#include "../../xen/common/lz4/decompress.c"
+
+/*
+ * defs.h tests __BIG_ENDIAN, which the C library's <endian.h> defines
+ * on every host.  Only the encoder counts common bytes, so redo it here.
+ */
+#undef LZ4_NBCOMMONBYTES
+#if __BYTE_ORDER == __BIG_ENDIAN
+#if LZ4_ARCH64
+#define LZ4_NBCOMMONBYTES(val) (__builtin_clzll(val) >> 3)
+#else
+#define LZ4_NBCOMMONBYTES(val) (__builtin_clz(val) >> 3)
+#endif
+#else
+#if LZ4_ARCH64
+#define LZ4_NBCOMMONBYTES(val) (__builtin_ctzll(val) >> 3)
+#else
+#define LZ4_NBCOMMONBYTES(val) (__builtin_ctz(val) >> 3)
+#endif
+#endif
+
+size_t xc_lz4_compress(const void *src, size_t isize, void *dst,
+                       size_t maxoutputsize, void *wrkmem)
+{
+    HTYPE *hashtable = wrkmem;
+    const u8 *ip = src;
+#if LZ4_ARCH64
+    const u8 *const base = ip;
+#else
+    const int base = 0;
+#endif
+    const u8 *anchor = ip;
+    const u8 *const iend = ip + isize;
+    const u8 *const mflimit = iend - MFLIMIT;
+    const u8 *const matchlimit = iend - LASTLITERALS;
+    u8 *op = dst;
+    u8 *const oend = op + maxoutputsize;
+    const u8 *ref;
+    u8 *token;
+    u32 forwardh;
+    size_t length, lastrun;
+
+    if ( isize < MINLENGTH )
+        goto last_literals;
+
+    memset(hashtable, 0, XC_LZ4_WORKMEM_SIZE);
+
+    /* First byte */
+    hashtable[LZ4_HASH_VALUE(ip)] = ip - base;
+    ip++;
+    forwardh = LZ4_HASH_VALUE(ip);
+
+    for ( ; ; )
+    {
+        int findmatchattempts = (1U << SKIPSTRENGTH) + 3;
+        const u8 *forwardip = ip;
+
+        /* Find a match */
+        do {
+            u32 h = forwardh;
+            int step = findmatchattempts++ >> SKIPSTRENGTH;
+
+            ip = forwardip;
+            forwardip = ip + step;
+
+            if ( unlikely(forwardip > mflimit) )
+                goto last_literals;
+
+            forwardh = LZ4_HASH_VALUE(forwardip);
+            ref = base + hashtable[h];
+            hashtable[h] = ip - base;
+        } while ( (ref < ip - MAX_DISTANCE) || (A32(ref) != A32(ip)) );
+
+        /* Catch up */
+        while ( (ip > anchor) && (ref > (const u8 *)src) &&
+                unlikely(ip[-1] == ref[-1]) )
+        {
+            ip--;
+            ref--;
+        }
+
+        /* Encode literal length */
+        length = ip - anchor;
+        token = op++;
+        if ( unlikely(op + length + (2 + 1 + LASTLITERALS) +
+                      (length >> 8) > oend) )
+            return 0;
+
+        if ( length >= RUN_MASK )
+        {
+            size_t len = length - RUN_MASK;
+
+            *token = RUN_MASK << ML_BITS;
+            for ( ; len > 254; len -= 255 )
+                *op++ = 255;
+            *op++ = (u8)len;
+        }
+        else
+            *token = length << ML_BITS;
+
+        /* Copy literals */
+        memcpy(op, anchor, length);
+        op += length;
+
+ next_match:
+        /* Encode offset */
+        LZ4_WRITE_LITTLEENDIAN_16(op, (u16)(ip - ref));
+
+        /* Count the match; MINMATCH bytes are already known to match */
+        ip += MINMATCH;
+        ref += MINMATCH;
+        anchor = ip;
+        while ( likely(ip < matchlimit - (STEPSIZE - 1)) )
+        {
+#if LZ4_ARCH64
+            u64 diff = A64(ref) ^ A64(ip);
+#else
+            u32 diff = A32(ref) ^ A32(ip);
+#endif
+            if ( !diff )
+            {
+                ip += STEPSIZE;
+                ref += STEPSIZE;
+                continue;
+            }
+            ip += LZ4_NBCOMMONBYTES(diff);
+            goto endcount;
+        }
+#if LZ4_ARCH64
+        if ( (ip < matchlimit - 3) && (A32(ref) == A32(ip)) )
+        {
+            ip += 4;
+            ref += 4;
+        }
+#endif
+        if ( (ip < matchlimit - 1) && (A16(ref) == A16(ip)) )
+        {
+            ip += 2;
+            ref += 2;
+        }
+        if ( (ip < matchlimit) && (*ref == *ip) )
+            ip++;
+
+ endcount:
+        /* Encode match length */
+        length = ip - anchor;
+        if ( unlikely(op + (1 + LASTLITERALS) + (length >> 8) > oend) )
+            return 0;
+
+        if ( length >= ML_MASK )
+        {
+            *token += ML_MASK;
+            length -= ML_MASK;
+            for ( ; length > 509; length -= 510 )
+            {
+                *op++ = 255;
+                *op++ = 255;
+            }
+            if ( length > 254 )
+            {
+                length -= 255;
+                *op++ = 255;
+            }
+            *op++ = (u8)length;
+        }
+        else
+            *token += length;
+
+        /* Test end of block */
+        if ( ip > mflimit )
+        {
+            anchor = ip;
+            break;
+        }
+
+        /* Fill table */
+        hashtable[LZ4_HASH_VALUE(ip - 2)] = ip - 2 - base;
+
+        /* Test next position */
+        ref = base + hashtable[LZ4_HASH_VALUE(ip)];
+        hashtable[LZ4_HASH_VALUE(ip)] = ip - base;
+        if ( (ref > ip - (MAX_DISTANCE + 1)) && (A32(ref) == A32(ip)) )
+        {
+            token = op++;
+            *token = 0;
+            goto next_match;
+        }
+
+        /* Prepare next loop */
+        anchor = ip++;
+        forwardh = LZ4_HASH_VALUE(ip);
+    }
+
+ last_literals:
+    lastrun = iend - anchor;
+    if ( (op - (u8 *)dst) + lastrun + 1 +
+         ((lastrun + 255 - RUN_MASK) / 255) > maxoutputsize )
+        return 0;
+
+    if ( lastrun >= RUN_MASK )
+    {
+        *op++ = RUN_MASK << ML_BITS;
+        lastrun -= RUN_MASK;
+        for ( ; lastrun > 254; lastrun -= 255 )
+            *op++ = 255;
+        *op++ = (u8)lastrun;
+    }
+    else
+        *op++ = lastrun << ML_BITS;
+    memcpy(op, anchor, iend - anchor);
+    op += iend - anchor;
+
+    return op - (u8 *)dst;
+}
+
+int xc_lz4_decompress(const void *src, size_t src_len, void *dst,
+                      size_t dst_len)
+{
+#ifndef __MINIOS__
+    size_t out_len = dst_len;
+
+    if ( xc_lz4_decompress_unknownoutputsize(src, src_len, dst, &out_len) ||
+         (out_len != dst_len) )
+        return -1;
+#else
+    size_t in_len = 0;
+
+    if ( xc_lz4_decompress_known(src, &in_len, dst, dst_len) ||
+         (in_len != src_len) )
+        return -1;
+#endif
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
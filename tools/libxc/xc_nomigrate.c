@@ -43,6 +43,19 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
     return -1;
 }
 
+int xc_domain_lazy_save(xc_interface *xch, int io_fd, uint32_t dom)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int xc_domain_lazy_restore(xc_interface *xch, int io_fd, uint32_t dom,
+                           int (*ready)(void *data), void *data)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
 /*
  * Local variables:
  * mode: C
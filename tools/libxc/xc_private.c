@@ -138,16 +138,6 @@ static struct xc_interface_core *xc_interface_open_common(xentoollog_logger *log
     xch->error_handler   = logger;           xch->error_handler_tofree   = 0;
     xch->dombuild_logger = dombuild_logger;  xch->dombuild_logger_tofree = 0;
 
-    xch->hypercall_buffer_cache_nr = 0;
-
-    xch->hypercall_buffer_total_allocations = 0;
-    xch->hypercall_buffer_total_releases = 0;
-    xch->hypercall_buffer_current_allocations = 0;
-    xch->hypercall_buffer_maximum_allocations = 0;
-    xch->hypercall_buffer_cache_hits = 0;
-    xch->hypercall_buffer_cache_misses = 0;
-    xch->hypercall_buffer_cache_toobig = 0;
-
     xch->ops_handle = XC_OSDEP_OPEN_ERROR;
     xch->ops = NULL;
 
@@ -167,6 +157,8 @@ static struct xc_interface_core *xc_interface_open_common(xentoollog_logger *log
     }
     *xch = xch_buf;
 
+    xc__hypercall_buffer_cache_init(xch);
+
     if (!(open_flags & XC_OPENFLAG_DUMMY)) {
         if ( xc_osdep_get_info(xch, &xch->osdep) < 0 )
             goto err;
@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 
 #include "xenctrl.h"
 #include "xenctrlosdep.h"
@@ -67,25 +68,44 @@ struct xc_interface_core {
     const char *currently_progress_reporting;
 
     /*
-     * A simple cache of unused, single page, hypercall buffers
+     * Pool of unused hypercall buffers, one free list per size class
+     * (linked through the first word of each buffer), plus the
+     * hugepage regions buffers may be carved from.  See xc_hcall_buf.c.
      *
      * Protected by a global lock.
      */
-#define HYPERCALL_BUFFER_CACHE_SIZE 4
-    int hypercall_buffer_cache_nr;
-    void *hypercall_buffer_cache[HYPERCALL_BUFFER_CACHE_SIZE];
+    void *hypercall_buffer_cache[XC_HYPERCALL_BUFFER_POOL_ORDERS];
+    unsigned int hypercall_buffer_cache_nr[XC_HYPERCALL_BUFFER_POOL_ORDERS];
+    unsigned int hypercall_buffer_cache_pages;
+    unsigned int hypercall_buffer_cache_limit;
+    unsigned int hypercall_buffer_cache_flags;
+
+#define HYPERCALL_BUFFER_HUGE_REGIONS 8
+    unsigned int hypercall_buffer_huge_nr;
+    unsigned int hypercall_buffer_huge_used; /* pages carved from the newest region */
+    void *hypercall_buffer_huge[HYPERCALL_BUFFER_HUGE_REGIONS];
+
+    /*
+     * Per-thread caches.  Each is only used by its own thread; the
+     * list itself is protected by the global lock.
+     */
+    int hypercall_buffer_tcache_enabled;
+    pthread_key_t hypercall_buffer_tcache_key;
+    struct xc_hypercall_buffer_tcache *hypercall_buffer_tcaches;
 
     /*
-     * Hypercall buffer statistics. All protected by the global
-     * hypercall_buffer_cache lock.
+     * Hypercall buffer statistics.  Updated atomically since the
+     * per-thread cache fast path does not take the global lock.
      */
-    int hypercall_buffer_total_allocations;
-    int hypercall_buffer_total_releases;
+    unsigned long hypercall_buffer_total_allocations;
+    unsigned long hypercall_buffer_total_releases;
     int hypercall_buffer_current_allocations;
     int hypercall_buffer_maximum_allocations;
-    int hypercall_buffer_cache_hits;
-    int hypercall_buffer_cache_misses;
-    int hypercall_buffer_cache_toobig;
+    unsigned long hypercall_buffer_cache_hits;
+    unsigned long hypercall_buffer_tcache_hits;
+    unsigned long hypercall_buffer_cache_misses;
+    unsigned long hypercall_buffer_cache_toobig;
+    unsigned long hypercall_buffer_huge_hits;
 
     /* Low lovel OS interface */
     xc_osdep_info_t  osdep;
@@ -188,6 +208,7 @@ void xc__hypercall_bounce_post(xc_interface *xch, xc_hypercall_buffer_t *bounce)
 /*
  * Release hypercall buffer cache
  */
+void xc__hypercall_buffer_cache_init(xc_interface *xch);
 void xc__hypercall_buffer_cache_release(xc_interface *xch);
 
 /*
@@ -156,3 +156,27 @@ int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask)
     return do_sysctl(xch, &sysctl);
 }
 
+int xc_tbuf_add_filter(xc_interface *xch, uint32_t domid, uint32_t vcpu)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_add_filter;
+    sysctl.u.tbuf_op.filter_domid = domid;
+    sysctl.u.tbuf_op.filter_vcpu = vcpu;
+
+    return do_sysctl(xch, &sysctl);
+}
+
+int xc_tbuf_clear_filters(xc_interface *xch)
+{
+    DECLARE_SYSCTL;
+
+    sysctl.cmd = XEN_SYSCTL_tbuf_op;
+    sysctl.interface_version = XEN_SYSCTL_INTERFACE_VERSION;
+    sysctl.u.tbuf_op.cmd  = XEN_SYSCTL_TBUFOP_clear_filters;
+
+    return do_sysctl(xch, &sysctl);
+}
+
@@ -348,6 +348,49 @@ void *xc__hypercall_buffer_array_get(xc_interface *xch, xc_hypercall_buffer_arra
     xc__hypercall_buffer_array_get(_xch, _array, _index, HYPERCALL_BUFFER(_name))
 void xc_hypercall_buffer_array_destroy(xc_interface *xc, xc_hypercall_buffer_array_t *array);
 
+/*
+ * Hypercall buffer pool.
+ *
+ * Released hypercall buffers are kept on per-size-class free lists
+ * (1, 2, 4, ... 2^(XC_HYPERCALL_BUFFER_POOL_ORDERS-1) pages) so that
+ * they can be reused without another round of mmap/mlock.  Each
+ * thread additionally keeps a small private cache of buffers which
+ * can be reused without taking any lock.
+ *
+ * xc_hypercall_buffer_pool_tune() bounds the number of pages kept on
+ * the shared free lists; each thread's cache holds at most 16 pages
+ * on top of that.  Pages carved out of hugepages are never returned
+ * to the OS and do not count against the limit.  Passing
+ * XC_HYPERCALL_BUFFER_POOL_HUGEPAGES carves buffers out of locked
+ * 2MB hugepages where the OS supports it; it fails with EOPNOTSUPP
+ * otherwise.
+ */
+#define XC_HYPERCALL_BUFFER_POOL_ORDERS 8
+#define XC_HYPERCALL_BUFFER_POOL_HUGEPAGES (1U<<0)
+
+typedef struct xc_hypercall_buffer_pool_stats {
+    uint64_t total_allocations;
+    uint64_t total_releases;
+    uint32_t current_allocations;
+    uint32_t maximum_allocations;
+    uint64_t cache_hits;         /* reused from the shared free lists */
+    uint64_t thread_cache_hits;  /* reused from a per-thread cache */
+    uint64_t cache_misses;       /* freshly allocated from the OS */
+    uint64_t cache_toobig;       /* larger than the largest size class */
+    uint64_t hugepage_hits;      /* carved out of a hugepage region */
+    uint32_t cached_pages;       /* OS pages held on the shared free lists */
+    uint32_t cache_limit;
+    uint32_t hugepage_regions;
+    uint32_t flags;
+    uint32_t cached[XC_HYPERCALL_BUFFER_POOL_ORDERS]; /* buffers per size class */
+} xc_hypercall_buffer_pool_stats_t;
+
+int xc_hypercall_buffer_pool_stats(xc_interface *xch,
+                                   xc_hypercall_buffer_pool_stats_t *stats);
+int xc_hypercall_buffer_pool_tune(xc_interface *xch,
+                                  unsigned int max_cached_pages,
+                                  unsigned int flags);
+
 /*
  * CPUMAP handling
  */
@@ -420,6 +463,8 @@ typedef struct xc_dominfo {
 } xc_dominfo_t;
 
 typedef xen_domctl_getdomaininfo_t xc_domaininfo_t;
+typedef xen_sysctl_domainstats_t xc_domainstats_t;
+typedef xen_sysctl_vcpustats_t xc_vcpustats_t;
 
 typedef union 
 {
@@ -656,6 +701,33 @@ int xc_domain_getinfolist(xc_interface *xch,
                           unsigned int max_domains,
                           xc_domaininfo_t *info);
 
+/**
+ * This function returns the domain information of one or more domains
+ * together with the runstate of all of their vcpus, using a single
+ * hypercall.  Vcpu records for domain i are stored in @vcpus, starting
+ * at index domains[i].first_vcpu.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm first_domain the first domain to enumerate information from.
+ * @parm max_domains the number of elements in domains
+ * @parm domains an array of max_domains elements
+ * @parm max_vcpus the number of elements in vcpus
+ * @parm vcpus an array of max_vcpus elements
+ * @parm nr_vcpus returns the number of vcpu records filled in
+ * @parm next_domain returns the domain to continue from, or DOMID_INVALID
+ *                   once all domains have been returned
+ * @return the number of domains enumerated or -1 on error.  errno is
+ *         ENOBUFS if @vcpus cannot hold the vcpus of the first domain.
+ */
+int xc_domain_getstats(xc_interface *xch,
+                       uint32_t first_domain,
+                       unsigned int max_domains,
+                       xc_domainstats_t *domains,
+                       unsigned int max_vcpus,
+                       xc_vcpustats_t *vcpus,
+                       unsigned int *nr_vcpus,
+                       uint32_t *next_domain);
+
 /**
  * This function set p2m for broken page
  * &parm xch a handle to an open hypervisor interface
@@ -763,6 +835,20 @@ int xc_shadow_control(xc_interface *xch,
                       uint32_t mode,
                       xc_shadow_op_stats_t *stats);
 
+/*
+ * XEN_DOMCTL_SHADOW_OP_{CLEAN,PEEK}_RANGES: fill ranges with up to
+ * *nr_ranges extents of dirty pfns below pages, and set *nr_ranges to the
+ * number used.  Returns the number of pfns covered, or -1.
+ */
+typedef xen_domctl_shadow_op_range_t xc_shadow_op_range_t;
+int xc_shadow_dirty_ranges(xc_interface *xch,
+                           uint32_t domid,
+                           unsigned int sop,
+                           xc_hypercall_buffer_t *ranges,
+                           unsigned int *nr_ranges,
+                           unsigned long pages,
+                           xc_shadow_op_stats_t *stats);
+
 int xc_sedf_domain_set(xc_interface *xch,
                        uint32_t domid,
                        uint64_t period, uint64_t slice,
@@ -1369,6 +1455,57 @@ void *xc_map_foreign_batch(xc_interface *xch, uint32_t dom, int prot,
 void *xc_map_foreign_bulk(xc_interface *xch, uint32_t dom, int prot,
                           const xen_pfn_t *arr, int *err, unsigned int num);
 
+#define XC_SUPERPAGE_SHIFT  9
+#define XC_SUPERPAGE_NR_PFNS (1UL << XC_SUPERPAGE_SHIFT)
+
+/**
+ * Maps @nr 2MB extents of guest frames, starting at the 2MB aligned
+ * frame @gfn, with a single batch.  Like xc_map_foreign_bulk(), it can
+ * succeed partially: @err must have room for
+ * @nr * XC_SUPERPAGE_NR_PFNS entries.  The mapping is released with
+ * munmap().
+ */
+void *xc_map_foreign_superpages(xc_interface *xch, uint32_t dom, int prot,
+                                xen_pfn_t gfn, unsigned int nr, int *err);
+
+/*
+ * Foreign mapping cache.
+ *
+ * Keeps up to @max_extents 2MB extents of a domain's memory mapped,
+ * evicting the least recently used one when full, so that repeated
+ * accesses to the same frames do not go back to the hypervisor.
+ *
+ * xc_map_cache_lookup() returns a pointer to the page holding @gfn and
+ * takes a reference on its extent, which cannot be evicted until the
+ * reference is dropped by passing the same @gfn and pointer to
+ * xc_map_cache_release().  On failure NULL is returned with errno set
+ * to the error for that frame.
+ *
+ * xc_map_cache_invalidate() must be called when the domain's p2m may
+ * have changed (e.g. ballooning) for the given frames; extents still
+ * referenced are unmapped when their last reference is dropped.
+ *
+ * A cache is not thread safe; callers must serialise access.
+ */
+typedef struct xc_map_cache xc_map_cache_t;
+
+typedef struct xc_map_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint32_t nr_extents;
+    uint32_t max_extents;
+} xc_map_cache_stats_t;
+
+xc_map_cache_t *xc_map_cache_create(xc_interface *xch, uint32_t dom,
+                                    int prot, unsigned int max_extents);
+void *xc_map_cache_lookup(xc_map_cache_t *cache, xen_pfn_t gfn);
+void xc_map_cache_release(xc_map_cache_t *cache, xen_pfn_t gfn, void *page);
+void xc_map_cache_invalidate(xc_map_cache_t *cache, xen_pfn_t gfn,
+                             unsigned long nr);
+void xc_map_cache_stats(xc_map_cache_t *cache, xc_map_cache_stats_t *stats);
+void xc_map_cache_destroy(xc_map_cache_t *cache);
+
 /**
  * Translates a virtual address in the context of a given domain and
  * vcpu returning the GFN containing the address (that is, an MFN for 
@@ -1469,6 +1606,24 @@ int xc_tbuf_set_cpu_mask(xc_interface *xch, uint32_t mask);
 
 int xc_tbuf_set_evt_mask(xc_interface *xch, uint32_t mask);
 
+/**
+ * Only trace events raised while the given vcpu of domid is running.
+ * Several filters may be added; an event is traced if it matches any.
+ * Pass XEN_SYSCTL_TBUF_ANY_VCPU to match every vcpu of the domain, and
+ * DOMID_IDLE to keep events raised from the idle vcpus.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm domid the domain to trace
+ * @parm vcpu the vcpu to trace, or XEN_SYSCTL_TBUF_ANY_VCPU
+ * @return 0 on success, -1 on failure (errno ENOSPC if the table is full).
+ */
+int xc_tbuf_add_filter(xc_interface *xch, uint32_t domid, uint32_t vcpu);
+
+/*
+ * Drop all domain/vcpu filters, so that every domain is traced again.
+ */
+int xc_tbuf_clear_filters(xc_interface *xch);
+
 int xc_domctl(xc_interface *xch, struct xen_domctl *domctl);
 int xc_sysctl(xc_interface *xch, struct xen_sysctl *sysctl);
 
@@ -2035,6 +2190,9 @@ int xc_mem_paging_disable(xc_interface *xch, domid_t domain_id);
 int xc_mem_paging_nominate(xc_interface *xch, domid_t domain_id,
                            unsigned long gfn);
 int xc_mem_paging_evict(xc_interface *xch, domid_t domain_id, unsigned long gfn);
+/* Mark a gfn with no memory behind it as paged out, to be filled by prep */
+int xc_mem_paging_absent(xc_interface *xch, domid_t domain_id,
+                         unsigned long gfn);
 int xc_mem_paging_prep(xc_interface *xch, domid_t domain_id, unsigned long gfn);
 int xc_mem_paging_load(xc_interface *xch, domid_t domain_id, 
                         unsigned long gfn, void *buffer);
@@ -89,6 +89,12 @@ struct xc_osdep_ops
             void *(*map_foreign_ranges)(xc_interface *xch, xc_osdep_handle h, uint32_t dom, size_t size, int prot,
                                         size_t chunksize, privcmd_mmap_entry_t entries[],
                                         int nentries);
+
+            /*
+             * Optional: allocate hypercall buffer memory backed by
+             * hugepages.  Released with free_hypercall_buffer.
+             */
+            void *(*alloc_hypercall_buffer_huge)(xc_interface *xch, xc_osdep_handle h, int npages);
         } privcmd;
         struct {
             int (*fd)(xc_evtchn *xce, xc_osdep_handle h);
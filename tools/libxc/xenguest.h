@@ -28,6 +28,62 @@
 #define XCFLAGS_HVM       (1 << 2)
 #define XCFLAGS_STDVGA    (1 << 3)
 #define XCFLAGS_CHECKPOINT_COMPRESS    (1 << 4)
+/*
+ * Send page batches LZ4 compressed, falling back to raw pages for batches
+ * which don't compress well.  The receiver must understand the
+ * XC_SAVE_ID_ENABLE_LZ4 record.
+ */
+#define XCFLAGS_LZ4       (1 << 5)
+/*
+ * Don't send the contents of all-zero pages, or of pages identical to
+ * another page in the same batch; the receiver rebuilds them.  Duplicate
+ * detection hashes every page sent, so costs noticeably more CPU.  The
+ * receiver must understand the XC_SAVE_ID_ENABLE_ELIDE record.
+ */
+#define XCFLAGS_ZERO_PAGES (1 << 6)
+#define XCFLAGS_DUP_PAGES  (1 << 7)
+
+/*
+ * Number of worker threads xc_domain_save() uses to map, canonicalise and
+ * write out pages in parallel with scanning the dirty bitmap.  Zero (the
+ * default) sends every batch from the calling thread.  The stream format
+ * is the same either way.
+ */
+#define XCFLAGS_PIPELINE_SHIFT  8
+#define XCFLAGS_PIPELINE_MASK   (0xffU << XCFLAGS_PIPELINE_SHIFT)
+#define XCFLAGS_PIPELINE_WORKERS(n) \
+    (((uint32_t)(n) << XCFLAGS_PIPELINE_SHIFT) & XCFLAGS_PIPELINE_MASK)
+
+/*
+ * Target downtime for a live save, in units of 10ms.  When non-zero,
+ * xc_domain_save() estimates the guest's dirty rate and the rate at which
+ * pages go out after every round, and suspends the guest for the last
+ * round as soon as the predicted downtime is within the target, or once
+ * further rounds stop making progress.  max_iters and max_factor remain
+ * hard limits.  Targets above 2550ms are clamped to 2550ms.
+ */
+#define XCFLAGS_DOWNTIME_SHIFT  16
+#define XCFLAGS_DOWNTIME_MASK   (0xffU << XCFLAGS_DOWNTIME_SHIFT)
+#define XCFLAGS_DOWNTIME_MAX_MS 2550
+#define XCFLAGS_DOWNTIME_MS(ms)                                         \
+    (((uint32_t)(ms) >= XCFLAGS_DOWNTIME_MAX_MS                         \
+      ? XCFLAGS_DOWNTIME_MASK                                           \
+      : ((uint32_t)(ms) + 9) / 10 << XCFLAGS_DOWNTIME_SHIFT))
+/*
+ * With a target downtime, throttle a guest which dirties memory faster
+ * than it can be sent by lowering its credit scheduler cap, until the
+ * save converges.  The original cap is restored once the guest has been
+ * suspended, or if the save fails.
+ */
+#define XCFLAGS_AUTO_CONVERGE   (1 << 24)
+/*
+ * Post-copy ("lazy") live save of an HVM guest.  Rather than iterating,
+ * xc_domain_save() watches which pages the guest writes for a moment, then
+ * suspends it and sends only those with the vCPU state.  The receiver may
+ * start the guest as soon as it is restored: the rest of its memory follows
+ * through xc_domain_lazy_save() and xc_domain_lazy_restore().
+ */
+#define XCFLAGS_LAZY            (1 << 25)
 
 #define X86_64_B_SIZE   64 
 #define X86_32_B_SIZE   32
@@ -137,6 +193,30 @@ int xc_domain_restore(xc_interface *xch, int io_fd, uint32_t dom,
  */
 #define XC_DEVICE_MODEL_RESTORE_FILE "/var/lib/xen/qemu-resume"
 
+/**
+ * These functions move the memory of a guest saved with XCFLAGS_LAZY, once
+ * xc_domain_save() and xc_domain_restore() have returned and the device
+ * model state has been passed on.  io_fd must be the same connection, and
+ * must carry data both ways.
+ *
+ * The sender's guest stays suspended until xc_domain_lazy_save() returns,
+ * when the receiver has all of its memory.  xc_domain_lazy_restore() marks
+ * the missing pages as paged out, calls ready() (which should unpause the
+ * guest) and then loads pages as they arrive, fetching the ones the guest
+ * touches ahead of the others.  It needs a HAP guest without another pager.
+ * If either side fails after ready() was called, the guest is lost.
+ *
+ * @parm xch a handle to an open hypervisor interface
+ * @parm io_fd the connection used for the rest of the stream
+ * @parm dom the id of the domain
+ * @parm ready called once the guest may run, or NULL
+ * @parm data passed to ready()
+ * @return 0 on success, -1 on failure
+ */
+int xc_domain_lazy_save(xc_interface *xch, int io_fd, uint32_t dom);
+int xc_domain_lazy_restore(xc_interface *xch, int io_fd, uint32_t dom,
+                           int (*ready)(void *data), void *data);
+
 /**
  * This function will create a domain for a paravirtualized Linux
  * using file names pointing to kernel and ramdisk
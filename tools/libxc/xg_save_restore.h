@@ -78,10 +78,25 @@
  *
  *     unsigned long[]  : PFN array, length == number of pages in batch
  *                        Each entry consists of XEN_DOMCTL_PFINFO_*
- *                        in bits 31-28 and the PFN number in bits 27-0.
+ *                        or XC_SAVE_PFINFO_* in bits 31-28 and the PFN
+ *                        number in bits 27-0.
+ *     uint16_t[]       : Duplicate sources, one for each XC_SAVE_PFINFO_DUP
+ *                        entry of the PFN array, in order.  Absent if there
+ *                        are no such entries.
  *     page data        : PAGE_SIZE bytes for each page marked present in PFN
  *                        array
  *
+ * Pages of type XC_SAVE_PFINFO_ZERO (all zeroes) and XC_SAVE_PFINFO_DUP
+ * (identical to another page of the batch) are ordinary data pages which
+ * are present but have no page data.  The receiver rebuilds them itself: a
+ * duplicate takes a copy of the page data of the entry whose index in the
+ * PFN array is given by its duplicate source, which must be an earlier
+ * XEN_DOMCTL_PFINFO_NOTAB entry.  Senders only elide pages when asked to
+ * with XCFLAGS_ZERO_PAGES or XCFLAGS_DUP_PAGES, and only after sending
+ * XC_SAVE_ID_ENABLE_ELIDE ahead of any page data.  Older receivers would
+ * misparse these types, but fail on that record first; newer ones reject
+ * the types without it.
+ *
  * If the chunk type is -ve then chunk consists of one of a number of
  * metadata types.  See definitions of XC_SAVE_ID_* below.
  *
@@ -203,6 +218,24 @@
  *   always holds true until the end of BODY PHASE:
  *    num(PFN entries +ve chunks) >= num(pages received in compressed form)
  *
+ *
+ * BODY PHASE - Format C (for LZ4 compressed batches)
+ * ----------
+ *
+ * If the first chunk of the first body is XC_SAVE_ID_ENABLE_LZ4, every
+ * +ve chunk sent in Format A for the rest of the stream carries its page
+ * data as:
+ *
+ *     uint32_t         : Size of the LZ4 block to follow, or 0
+ *     bytes            : An LZ4 block which decompresses to exactly
+ *                        PAGE_SIZE bytes for each page marked present in
+ *                        the PFN array, or, if the size is 0, the page
+ *                        data uncompressed
+ *
+ * The size field is omitted for chunks with no pages present.  Senders
+ * fall back to uncompressed batches when LZ4 doesn't save enough space to
+ * be worthwhile.  Format B bodies are unaffected.
+ *
  * TAIL PHASE
  * ----------
  *
@@ -238,8 +271,34 @@
  *                        present in extended-info header)
  *
  *  Shared Info Page    : 4096 bytes of shared info page
+ *
+ * LAZY PHASE
+ * ----------
+ *
+ * After a save with XCFLAGS_LAZY, and after the device model record, the
+ * stream carries the memory left behind, in both directions.  Bitmaps have
+ * bit N in bit (N % 8) of byte (N / 8).
+ *
+ *  Sender:
+ *     uint64_t         : Number of pfns, P
+ *     bytes[(P+7)/8]   : Bitmap of the pfns backed by memory
+ *  Receiver:
+ *     bytes[(P+7)/8]   : Bitmap of the pfns it wants
+ *  Sender, repeated until every wanted pfn has been sent once:
+ *     uint64_t         : pfn
+ *     bytes[4096]      : Page contents
+ *  Sender:
+ *     uint64_t         : LAZY_END
+ *  Receiver:
+ *     uint64_t         : LAZY_END
+ *
+ *  Until it sees LAZY_END, the receiver may send any number of
+ *     uint64_t         : Wanted pfn the guest has touched
+ *  which the sender answers ahead of the others, in any order.
  */
 
+#define LAZY_END                ~0ULL
+
 #define XC_SAVE_ID_ENABLE_VERIFY_MODE -1 /* Switch to validation phase. */
 #define XC_SAVE_ID_VCPU_INFO          -2 /* Additional VCPU info */
 #define XC_SAVE_ID_HVM_IDENT_PT       -3 /* (HVM-only) */
@@ -259,6 +318,15 @@
 #define XC_SAVE_ID_HVM_ACCESS_RING_PFN  -16
 #define XC_SAVE_ID_HVM_SHARING_RING_PFN -17
 #define XC_SAVE_ID_TOOLSTACK          -18 /* Optional toolstack specific info */
+#define XC_SAVE_ID_ENABLE_LZ4         -19 /* Page data is in Format C */
+#define XC_SAVE_ID_ENABLE_ELIDE       -20 /* PFN arrays may hold XC_SAVE_PFINFO_ZERO/DUP */
+
+/*
+** Types of elided pages in Format A PFN arrays, alongside the
+** XEN_DOMCTL_PFINFO_* ones.  Both are never sent in Format B.
+*/
+#define XC_SAVE_PFINFO_ZERO (0x5U<<28) /* all-zero page, no data */
+#define XC_SAVE_PFINFO_DUP  (0x6U<<28) /* copy of a page of the batch */
 
 /*
 ** We process save/restore/migrate in batches of pages; the below
@@ -273,6 +341,21 @@
 #define XC_SR_MAX_VCPUS 4096
 #define vcpumap_sz(max_id) (((max_id)/64+1)*sizeof(uint64_t))
 
+/*
+** LZ4 block compression for Format C (xc_lz4.c).
+**
+** xc_lz4_compress() returns the size of the block written to dst, or 0
+** if the block wouldn't fit in maxoutputsize bytes.  wrkmem must hold
+** XC_LZ4_WORKMEM_SIZE bytes.  xc_lz4_decompress() returns 0 iff src
+** held a valid block of exactly dst_len bytes.
+*/
+#define XC_LZ4_WORKMEM_SIZE (4096 * sizeof(void *))
+
+size_t xc_lz4_compress(const void *src, size_t isize, void *dst,
+                       size_t maxoutputsize, void *wrkmem);
+int xc_lz4_decompress(const void *src, size_t src_len, void *dst,
+                      size_t dst_len);
+
 
 /*
 ** Determine various platform information required for save/restore, in
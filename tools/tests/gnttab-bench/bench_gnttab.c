@@ -0,0 +1,356 @@
+/*
+ * Measure grant map/unmap throughput as the number of mapping threads
+ * grows.
+ *
+ * Pages are granted by this domain to itself through gntalloc, then each
+ * thread repeatedly maps and unmaps its own share of them through its own
+ * gntdev handle.  Every map is one GNTTABOP_map_grant_ref hypercall (with
+ * -b operations in it) and every unmap one GNTTABOP_unmap_grant_ref, so
+ * with enough dom0 VCPUs this exercises the hypervisor's maptrack
+ * allocation and the grant table locking from several VCPUs at once.
+ *
+ * With -c, the threads instead issue GNTTABOP_copy batches of -b ops,
+ * each copying the given number of bytes from the first half of their
+ * grants to the second half.  Consecutive ops walk through each page
+ * before moving to the next grant, as netback does for packet fragments,
+ * so the hypervisor's per-batch statistics (see xenperf) show how often
+ * a frame could be reused within a batch.
+ *
+ * For each thread count, the benchmark reports the total number of grant
+ * mappings (or copies) per second and the mean cost of one map+unmap
+ * pair (or copy hypercall) per thread.
+ *
+ * Usage: bench_gnttab [-t thread counts] [-n grants per thread]
+ *                     [-b grants per map or copies per batch]
+ *                     [-i iterations per thread] [-c bytes per copy]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenstore.h>
+
+#define MAX_LIST 16
+
+static unsigned int threads[MAX_LIST] = { 1, 2, 4, 8 };
+static unsigned int nr_threads = 4;
+static unsigned int grants_per_thread = 64;
+static unsigned int batch = 1;
+static unsigned int iterations = 20000;
+static unsigned int copy_len;
+
+static uint32_t domid;
+static uint32_t *refs;
+static pthread_barrier_t barrier;
+
+struct worker {
+    pthread_t thread;
+    unsigned int index;
+    double elapsed;
+    int err;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void map_loop(struct worker *w)
+{
+    uint32_t *mine = refs + w->index * grants_per_thread;
+    unsigned int i, next = 0;
+    xc_gnttab *xcg;
+    double start;
+    void *map;
+
+    xcg = xc_gnttab_open(NULL, 0);
+    if ( !xcg || xc_gnttab_set_max_grants(xcg, batch) )
+    {
+        w->err = errno;
+        pthread_barrier_wait(&barrier);
+        return;
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = now();
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        map = xc_gnttab_map_domain_grant_refs(xcg, batch, domid,
+                                              mine + next,
+                                              PROT_READ | PROT_WRITE);
+        if ( !map || xc_gnttab_munmap(xcg, map, batch) )
+        {
+            w->err = errno;
+            break;
+        }
+        next += batch;
+        if ( next + batch > grants_per_thread )
+            next = 0;
+    }
+
+    w->elapsed = now() - start;
+    xc_gnttab_close(xcg);
+}
+
+static void copy_loop(struct worker *w)
+{
+    uint32_t *mine = refs + w->index * grants_per_thread;
+    unsigned int half = grants_per_thread / 2;
+    unsigned int per_page = XC_PAGE_SIZE / copy_len;
+    unsigned int i, j, pos = 0;
+    gnttab_copy_t *ops;
+    xc_interface *xch;
+    double start;
+
+    ops = calloc(batch, sizeof(*ops));
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !ops || !xch )
+    {
+        w->err = errno;
+        pthread_barrier_wait(&barrier);
+        free(ops);
+        return;
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = now();
+
+    for ( i = 0; i < iterations; i++ )
+    {
+        for ( j = 0; j < batch; j++, pos++ )
+        {
+            unsigned int ref = (pos / per_page) % half;
+            unsigned int offset = (pos % per_page) * copy_len;
+
+            ops[j].source.u.ref = mine[ref];
+            ops[j].source.domid = domid;
+            ops[j].source.offset = offset;
+            ops[j].dest.u.ref = mine[half + ref];
+            ops[j].dest.domid = domid;
+            ops[j].dest.offset = offset;
+            ops[j].len = copy_len;
+            ops[j].flags = GNTCOPY_source_gref | GNTCOPY_dest_gref;
+        }
+
+        if ( xc_gnttab_op(xch, GNTTABOP_copy, ops, sizeof(*ops), batch) )
+        {
+            w->err = errno;
+            break;
+        }
+        for ( j = 0; j < batch; j++ )
+            if ( ops[j].status != GNTST_okay )
+                break;
+        if ( j != batch )
+        {
+            fprintf(stderr, "copy failed with status %d\n", ops[j].status);
+            w->err = EIO;
+            break;
+        }
+    }
+
+    w->elapsed = now() - start;
+    xc_interface_close(xch);
+    free(ops);
+}
+
+static void *worker_fn(void *arg)
+{
+    struct worker *w = arg;
+
+    if ( copy_len )
+        copy_loop(w);
+    else
+        map_loop(w);
+
+    return NULL;
+}
+
+static void run(unsigned int nr)
+{
+    struct worker *workers = calloc(nr, sizeof(*workers));
+    double total = 0, longest = 0;
+    unsigned int i;
+
+    if ( !workers )
+        fail("calloc");
+    if ( pthread_barrier_init(&barrier, NULL, nr) )
+        fail("pthread_barrier_init");
+
+    for ( i = 0; i < nr; i++ )
+    {
+        workers[i].index = i;
+        errno = pthread_create(&workers[i].thread, NULL, worker_fn,
+                               &workers[i]);
+        if ( errno )
+            fail("pthread_create");
+    }
+
+    for ( i = 0; i < nr; i++ )
+    {
+        pthread_join(workers[i].thread, NULL);
+        if ( workers[i].err )
+        {
+            errno = workers[i].err;
+            fail(copy_len ? "grant copy" : "map/unmap");
+        }
+        total += workers[i].elapsed;
+        if ( workers[i].elapsed > longest )
+            longest = workers[i].elapsed;
+    }
+
+    printf("%7u %15.0f %15.2f\n", nr,
+           (double)nr * iterations * batch / longest,
+           total / nr / iterations * 1e6);
+
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+}
+
+static unsigned int parse_list(char *arg, unsigned int *list)
+{
+    unsigned int nr = 0;
+    char *tok;
+
+    for ( tok = strtok(arg, ","); tok && nr < MAX_LIST;
+          tok = strtok(NULL, ",") )
+        list[nr++] = strtoul(tok, NULL, 0);
+
+    return nr;
+}
+
+/* Our own domid, to grant pages to ourselves. */
+static int self_domid(void)
+{
+    struct xs_handle *xs = xs_domain_open();
+    char *id;
+    int ret;
+
+    if ( !xs )
+        fail("xs_domain_open");
+    id = xs_read(xs, XBT_NULL, "domid", NULL);
+    if ( !id )
+        fail("reading domid");
+    ret = atoi(id);
+    free(id);
+    xs_daemon_close(xs);
+
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-t thread counts] [-n grants per thread]\n"
+            "          [-b grants per map or copies per batch]\n"
+            "          [-i iterations per thread] [-c bytes per copy]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int i, max_threads = 0, nr_grants;
+    xc_gntshr *xgs;
+    void *pages;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "t:n:b:i:c:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 't':
+            nr_threads = parse_list(optarg, threads);
+            break;
+        case 'n':
+            grants_per_thread = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            copy_len = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( optind != argc || !nr_threads || !batch || !iterations )
+        usage(argv[0]);
+    if ( copy_len ? (copy_len > XC_PAGE_SIZE || grants_per_thread < 2)
+                  : batch > grants_per_thread )
+        usage(argv[0]);
+
+    for ( i = 0; i < nr_threads; i++ )
+    {
+        if ( !threads[i] )
+            usage(argv[0]);
+        if ( threads[i] > max_threads )
+            max_threads = threads[i];
+    }
+
+    domid = self_domid();
+
+    /* Each thread maps only its own grants, so threads never share one. */
+    nr_grants = max_threads * grants_per_thread;
+    refs = calloc(nr_grants, sizeof(*refs));
+    if ( !refs )
+        fail("calloc");
+
+    xgs = xc_gntshr_open(NULL, 0);
+    if ( !xgs )
+        fail("xc_gntshr_open");
+    pages = xc_gntshr_share_pages(xgs, domid, nr_grants, refs, 1);
+    if ( !pages )
+        fail("xc_gntshr_share_pages");
+
+    if ( copy_len )
+        printf("%u grants per thread, %u copies of %u bytes per batch, "
+               "%u iterations\n", grants_per_thread, batch, copy_len,
+               iterations);
+    else
+        printf("%u grants per thread, %u per map, %u iterations\n",
+               grants_per_thread, batch, iterations);
+    printf("%7s %15s %15s\n", "threads", copy_len ? "copies/s" : "maps/s",
+           "usecs/iter");
+
+    for ( i = 0; i < nr_threads; i++ )
+        run(threads[i]);
+
+    xc_gntshr_munmap(xgs, pages, nr_grants);
+    xc_gntshr_close(xgs);
+    free(refs);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,190 @@
+/*
+ * Check that a grant unmapped with GNTMAP_defer_unmap and mapped again
+ * before the deferred unmap completes ends up fully released.
+ *
+ * A page is granted by this domain to itself through gntalloc and mapped
+ * with GNTTABOP_map_grant_ref at an address in an unused part of our own
+ * address space.  The mapping is unmapped with deferral, mapped again,
+ * and only then are the deferred unmaps flushed.  Once the second mapping
+ * has been unmapped and flushed too, the grant entry (read through a
+ * mapping of our own grant table) must no longer be marked in use, and
+ * both handles must be gone.
+ *
+ * Domains whose grant mappings live in the p2m ignore GNTMAP_defer_unmap,
+ * so there the test only checks ordinary unmapping.
+ *
+ * Usage: test_gnttab_defer
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <xenctrl.h>
+#include <xenstore.h>
+
+static xc_interface *xch;
+static uint32_t domid;
+static uint32_t ref;
+static volatile grant_entry_v1_t *gnt;
+static int failures;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if ( !ok )
+        failures++;
+}
+
+/* Our own domid, to grant pages to ourselves. */
+static int self_domid(void)
+{
+    struct xs_handle *xs = xs_domain_open();
+    char *id;
+    int ret;
+
+    if ( !xs )
+        fail("xs_domain_open");
+    id = xs_read(xs, XBT_NULL, "domid", NULL);
+    if ( !id )
+        fail("reading domid");
+    ret = atoi(id);
+    free(id);
+    xs_daemon_close(xs);
+
+    return ret;
+}
+
+static int map_grant(void *addr, grant_handle_t *handle)
+{
+    gnttab_map_grant_ref_t op = {
+        .host_addr = (unsigned long)addr,
+        .flags = GNTMAP_host_map | GNTMAP_defer_unmap,
+        .ref = ref,
+        .dom = domid,
+    };
+
+    if ( xc_gnttab_op(xch, GNTTABOP_map_grant_ref, &op, sizeof(op), 1) )
+        fail("GNTTABOP_map_grant_ref");
+    *handle = op.handle;
+
+    return op.status;
+}
+
+static int unmap_grant(void *addr, grant_handle_t handle)
+{
+    gnttab_unmap_grant_ref_t op = {
+        .host_addr = (unsigned long)addr,
+        .handle = handle,
+    };
+
+    if ( xc_gnttab_op(xch, GNTTABOP_unmap_grant_ref, &op, sizeof(op), 1) )
+        fail("GNTTABOP_unmap_grant_ref");
+
+    return op.status;
+}
+
+static void flush_unmaps(void)
+{
+    if ( xc_gnttab_op(xch, GNTTABOP_flush_unmaps, NULL, 0, 0) )
+        fail("GNTTABOP_flush_unmaps");
+}
+
+int main(int argc, char **argv)
+{
+    size_t page_size = XC_PAGE_SIZE;
+    grant_handle_t first, second;
+    char *page, *area, *addr;
+    xc_gntshr *xgs;
+    int nr_entries;
+
+    if ( argc != 1 )
+    {
+        fprintf(stderr, "Usage: %s\n", argv[0]);
+        return 2;
+    }
+
+    domid = self_domid();
+
+    xch = xc_interface_open(NULL, NULL, 0);
+    if ( !xch )
+        fail("xc_interface_open");
+
+    xgs = xc_gntshr_open(NULL, 0);
+    if ( !xgs )
+        fail("xc_gntshr_open");
+    page = xc_gntshr_share_pages(xgs, domid, 1, &ref, 1);
+    if ( !page )
+        fail("xc_gntshr_share_pages");
+    memset(page, 0x5a, page_size);
+
+    gnt = xc_gnttab_map_table_v1(xch, domid, &nr_entries);
+    if ( !gnt || ref >= nr_entries )
+        fail("xc_gnttab_map_table_v1");
+
+    /*
+     * The grant is mapped over the middle of three pages.  Touching the
+     * outer two makes sure the page table covering it exists, while its
+     * own entry stays empty.
+     */
+    area = mmap(NULL, 3 * page_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if ( area == MAP_FAILED )
+        fail("mmap");
+    area[0] = 1;
+    area[2 * page_size] = 1;
+    addr = area + page_size;
+
+    check(map_grant(addr, &first) == GNTST_okay, "first map");
+    check(addr[0] == 0x5a && addr[page_size - 1] == 0x5a,
+          "first mapping shows the granted page");
+    check(unmap_grant(addr, first) == GNTST_okay, "deferred unmap");
+
+    /* Map the grant again while the first unmap may still be pending. */
+    check(map_grant(addr, &second) == GNTST_okay, "map before the flush");
+    check(addr[0] == 0x5a && addr[page_size - 1] == 0x5a,
+          "second mapping shows the granted page");
+
+    flush_unmaps();
+    check(gnt[ref].flags & GTF_writing,
+          "grant still in use by the second mapping");
+    check(unmap_grant(addr, first) == GNTST_bad_handle,
+          "first handle released");
+
+    check(unmap_grant(addr, second) == GNTST_okay, "second unmap");
+    flush_unmaps();
+    check(!(gnt[ref].flags & (GTF_reading | GTF_writing)),
+          "grant no longer in use");
+    check(unmap_grant(addr, second) == GNTST_bad_handle,
+          "second handle released");
+
+    munmap(area, 3 * page_size);
+    munmap((void *)gnt, (nr_entries * sizeof(*gnt) + page_size - 1) &
+                        ~(page_size - 1));
+    xc_gntshr_munmap(xgs, page, 1);
+    xc_gntshr_close(xgs);
+    xc_interface_close(xch);
+
+    printf("%s\n", failures ? "FAILED" : "OK");
+
+    return failures ? 1 : 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
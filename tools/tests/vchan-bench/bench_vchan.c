@@ -0,0 +1,404 @@
+/*
+ * Measure libvchan throughput and round-trip latency for a range of
+ * message sizes, ring sizes and notification modes.
+ *
+ * By default both ends run in this domain: a forked server grants its
+ * rings to its own domain and the client maps them back, so io.c can be
+ * measured with nothing more than dom0, gntalloc/gntdev and xenstored.
+ * To measure between two domains, run "-l <client domid>" in the server
+ * domain and "-c <server domid>" in the client one, with the same other
+ * options.
+ *
+ * For each ring size a new vchan is set up under <path>/<ring size>.  For
+ * each notification mode and message size, the client then streams
+ * messages to the server (throughput, client to server) and bounces
+ * messages off it (round trip latency).  The "batch" mode uses
+ * libxenvchan_set_notify_batch() with the -b parameters at both ends.
+ *
+ * Usage: bench_vchan [-l domid | -c domid] [-p path] [-s sizes]
+ *                    [-r ring sizes] [-m each,batch] [-b bytes[:usecs]]
+ *                    [-t bytes per throughput run] [-i round trips]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <xenstore.h>
+#include <libxenvchan.h>
+
+#define MAX_LIST 16
+
+enum { TEST_DONE, TEST_THROUGHPUT, TEST_LATENCY };
+
+/* Sent by the client to start each test. */
+struct test_hdr {
+    uint32_t test;
+    uint32_t size;
+    uint32_t count;
+    uint32_t batch_bytes;
+    uint32_t batch_usecs;
+};
+
+static unsigned int sizes[MAX_LIST] = { 64, 512, 4096, 16384 };
+static unsigned int nr_sizes = 4;
+static unsigned int rings[MAX_LIST] = { 1024, 8192, 65536 };
+static unsigned int nr_rings = 3;
+static int modes_each = 1, modes_batch = 1;
+static unsigned int batch_bytes = 32768, batch_usecs = 0;
+static unsigned long stream_bytes = 64 << 20;
+static unsigned int round_trips = 10000;
+static const char *path = "/local/domain/0/data/vchan-bench";
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static void write_all(struct libxenvchan *ctrl, const void *buf, size_t size)
+{
+    size_t pos = 0;
+    int ret;
+
+    while ( pos < size )
+    {
+        ret = libxenvchan_write(ctrl, buf + pos, size - pos);
+        if ( ret <= 0 )
+            fail("libxenvchan_write");
+        pos += ret;
+    }
+}
+
+static void read_all(struct libxenvchan *ctrl, void *buf, size_t size)
+{
+    size_t pos = 0;
+    int ret;
+
+    while ( pos < size )
+    {
+        ret = libxenvchan_read(ctrl, buf + pos, size - pos);
+        if ( ret <= 0 )
+            fail("libxenvchan_read");
+        pos += ret;
+    }
+}
+
+static void set_batch(struct libxenvchan *ctrl, const struct test_hdr *hdr)
+{
+    if ( libxenvchan_set_notify_batch(ctrl, hdr->batch_bytes,
+                                      hdr->batch_usecs) )
+        fail("libxenvchan_set_notify_batch");
+}
+
+/* Do whatever the client asks until it says it is done. */
+static void serve(struct libxenvchan *ctrl, char *buf)
+{
+    struct test_hdr hdr;
+    unsigned int i;
+    char ack = 0;
+
+    for ( ;; )
+    {
+        read_all(ctrl, &hdr, sizeof(hdr));
+        set_batch(ctrl, &hdr);
+
+        switch ( hdr.test )
+        {
+        case TEST_DONE:
+            return;
+
+        case TEST_THROUGHPUT:
+            for ( i = 0; i < hdr.count; i++ )
+                read_all(ctrl, buf, hdr.size);
+            write_all(ctrl, &ack, 1);
+            break;
+
+        case TEST_LATENCY:
+            for ( i = 0; i < hdr.count; i++ )
+            {
+                read_all(ctrl, buf, hdr.size);
+                write_all(ctrl, buf, hdr.size);
+            }
+            break;
+
+        default:
+            fprintf(stderr, "bad test %u\n", hdr.test);
+            exit(1);
+        }
+    }
+}
+
+static void run_tests(struct libxenvchan *ctrl, char *buf, unsigned int ring,
+                      int batch)
+{
+    struct test_hdr hdr = { 0 };
+    unsigned int s, i;
+    double start, elapsed, rtt, min_rtt;
+    char ack;
+
+    if ( batch )
+    {
+        hdr.batch_bytes = batch_bytes;
+        hdr.batch_usecs = batch_usecs;
+    }
+
+    for ( s = 0; s < nr_sizes; s++ )
+    {
+        hdr.size = sizes[s];
+
+        hdr.test = TEST_THROUGHPUT;
+        hdr.count = stream_bytes / hdr.size ?: 1;
+        write_all(ctrl, &hdr, sizeof(hdr));
+        set_batch(ctrl, &hdr);
+        start = now();
+        for ( i = 0; i < hdr.count; i++ )
+            write_all(ctrl, buf, hdr.size);
+        read_all(ctrl, &ack, 1);
+        elapsed = now() - start;
+
+        printf("%8u %-5s %8u %10.1f %10.0f", ring, batch ? "batch" : "each",
+               hdr.size, (double)hdr.count * hdr.size / elapsed / (1 << 20),
+               hdr.count / elapsed);
+
+        hdr.test = TEST_LATENCY;
+        hdr.count = round_trips;
+        write_all(ctrl, &hdr, sizeof(hdr));
+        set_batch(ctrl, &hdr);
+        min_rtt = 1e9;
+        start = now();
+        for ( i = 0; i < hdr.count; i++ )
+        {
+            rtt = now();
+            write_all(ctrl, buf, hdr.size);
+            read_all(ctrl, buf, hdr.size);
+            rtt = now() - rtt;
+            if ( rtt < min_rtt )
+                min_rtt = rtt;
+        }
+        elapsed = now() - start;
+
+        printf(" %10.2f %10.2f\n", elapsed / hdr.count * 1e6, min_rtt * 1e6);
+        fflush(stdout);
+    }
+
+    hdr.test = TEST_DONE;
+    write_all(ctrl, &hdr, sizeof(hdr));
+}
+
+static void client(int domid, char *buf)
+{
+    struct libxenvchan *ctrl;
+    unsigned int r, tries;
+    char xs_path[128];
+
+    printf("%8s %-5s %8s %10s %10s %10s %10s\n", "ring", "mode", "size",
+           "MiB/s", "msgs/s", "rtt us", "min us");
+
+    for ( r = 0; r < nr_rings; r++ )
+    {
+        snprintf(xs_path, sizeof(xs_path), "%s/%u", path, rings[r]);
+
+        /* The server may not have set this one up yet. */
+        for ( tries = 0; ; tries++ )
+        {
+            ctrl = libxenvchan_client_init(NULL, domid, xs_path);
+            if ( ctrl )
+                break;
+            if ( tries == 500 )
+                fail("libxenvchan_client_init");
+            usleep(10000);
+        }
+        ctrl->blocking = 1;
+
+        if ( modes_each )
+            run_tests(ctrl, buf, rings[r], 0);
+        if ( modes_batch )
+            run_tests(ctrl, buf, rings[r], 1);
+
+        libxenvchan_close(ctrl);
+    }
+}
+
+static void server(int domid, char *buf)
+{
+    struct libxenvchan *ctrl;
+    unsigned int r, runs;
+    char xs_path[128];
+
+    for ( r = 0; r < nr_rings; r++ )
+    {
+        snprintf(xs_path, sizeof(xs_path), "%s/%u", path, rings[r]);
+        ctrl = libxenvchan_server_init(NULL, domid, xs_path, rings[r],
+                                       rings[r]);
+        if ( !ctrl )
+            fail("libxenvchan_server_init");
+        ctrl->blocking = 1;
+
+        for ( runs = modes_each + modes_batch; runs; runs-- )
+            serve(ctrl, buf);
+
+        libxenvchan_close(ctrl);
+    }
+}
+
+static unsigned int parse_list(char *arg, unsigned int *list)
+{
+    unsigned int nr = 0;
+    char *tok;
+
+    for ( tok = strtok(arg, ","); tok; tok = strtok(NULL, ",") )
+    {
+        if ( nr == MAX_LIST )
+            break;
+        list[nr] = strtoul(tok, NULL, 0);
+        if ( list[nr] == 0 )
+        {
+            fprintf(stderr, "bad size %s\n", tok);
+            exit(2);
+        }
+        nr++;
+    }
+
+    return nr;
+}
+
+/* Our own domid, for a loopback vchan. */
+static int self_domid(void)
+{
+    struct xs_handle *xs = xs_domain_open();
+    char *domid;
+    int ret;
+
+    if ( !xs )
+        fail("xs_domain_open");
+    domid = xs_read(xs, XBT_NULL, "domid", NULL);
+    if ( !domid )
+        fail("reading domid");
+    ret = atoi(domid);
+    free(domid);
+    xs_daemon_close(xs);
+
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-l domid | -c domid] [-p path] [-s sizes]\n"
+            "          [-r ring sizes] [-m each,batch] [-b bytes[:usecs]]\n"
+            "          [-t bytes per throughput run] [-i round trips]\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, listen_domid = -1, connect_domid = -1, domid, status;
+    unsigned int i, max_size = 0;
+    char *buf, *p;
+    pid_t pid;
+
+    while ( (opt = getopt(argc, argv, "l:c:p:s:r:m:b:t:i:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'l':
+            listen_domid = atoi(optarg);
+            break;
+        case 'c':
+            connect_domid = atoi(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 's':
+            nr_sizes = parse_list(optarg, sizes);
+            break;
+        case 'r':
+            nr_rings = parse_list(optarg, rings);
+            break;
+        case 'm':
+            modes_each = strstr(optarg, "each") != NULL;
+            modes_batch = strstr(optarg, "batch") != NULL;
+            break;
+        case 'b':
+            batch_bytes = strtoul(optarg, &p, 0);
+            if ( *p == ':' )
+                batch_usecs = strtoul(p + 1, NULL, 0);
+            break;
+        case 't':
+            stream_bytes = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            round_trips = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if ( optind != argc || (listen_domid != -1 && connect_domid != -1) ||
+         !nr_sizes || !nr_rings || !(modes_each || modes_batch) ||
+         !batch_bytes )
+        usage(argv[0]);
+
+    for ( i = 0; i < nr_sizes; i++ )
+        if ( sizes[i] > max_size )
+            max_size = sizes[i];
+    buf = calloc(1, max_size);
+    if ( !buf )
+        fail("calloc");
+
+    if ( listen_domid != -1 )
+        server(listen_domid, buf);
+    else if ( connect_domid != -1 )
+        client(connect_domid, buf);
+    else
+    {
+        /* Loopback: we are both ends. */
+        domid = self_domid();
+        pid = fork();
+        if ( pid < 0 )
+            fail("fork");
+        if ( pid == 0 )
+        {
+            server(domid, buf);
+            exit(0);
+        }
+        client(domid, buf);
+        if ( waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+             WEXITSTATUS(status) != 0 )
+        {
+            fprintf(stderr, "server failed\n");
+            return 1;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -0,0 +1,268 @@
+/*
+ * Replay a synthetic stream of dirty pages through the checkpoint
+ * compression engine, once per page diffing kernel available on this
+ * host.  Each kernel must produce exactly the stream produced by the
+ * generic one, and the receiver's copy of memory, rebuilt with
+ * xc_compression_uncompress_page(), must match the sender's.
+ *
+ * Usage: test_xc_compression [-p pages] [-d dirty] [-r rounds] [-s seed]
+ */
+
+#include <getopt.h>
+#include <time.h>
+
+/* The kernels are static: build a private copy of the engine. */
+#include "xc_compression.c"
+
+typedef void diff_page_fn(const uint32_t *old, const uint32_t *new,
+                          uint64_t *mask);
+
+#ifdef COMPRESSION_SIMD
+static int has_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static int has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+
+static const struct {
+    const char *name;
+    int (*supported)(void);
+    diff_page_fn *fn;
+} kernels[] = {
+    { "generic", NULL, diff_page_generic },
+#ifdef COMPRESSION_SIMD
+    { "sse2", has_sse2, diff_page_sse2 },
+    { "avx2", has_avx2, diff_page_avx2 },
+#endif
+};
+
+#define NR_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static unsigned long nr_pages = 4096, nr_dirty = 2048, nr_rounds = 200;
+static uint64_t seed = 1;
+static uint64_t rng;
+
+static uint64_t next_rand(void)
+{
+    /* xorshift64 */
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/* Dirty a page the way a busy guest might. */
+static void mutate_page(uint32_t *page)
+{
+    unsigned int i, n, off, kind = next_rand() % 100;
+
+    if ( kind < 40 )
+    {
+        /* A handful of scattered words, e.g. counters and list heads. */
+        for ( n = 1 + next_rand() % 8; n; n-- )
+            page[next_rand() % MAX_DELTAS] = next_rand();
+    }
+    else if ( kind < 70 )
+    {
+        /* A contiguous region, e.g. a buffer being filled. */
+        off = next_rand() % MAX_DELTAS;
+        n = 1 + next_rand() % 256;
+        for ( i = off; (i < off + n) && (i < MAX_DELTAS); i++ )
+            page[i] = next_rand();
+    }
+    else if ( kind < 85 )
+    {
+        /* Written back with the same contents. */
+    }
+    else
+    {
+        for ( i = 0; i < MAX_DELTAS; i++ )
+            page[i] = next_rand();
+    }
+}
+
+static uint64_t hash_bytes(uint64_t h, const char *buf, unsigned long len)
+{
+    /* FNV-1a */
+    while ( len-- )
+        h = (h ^ (unsigned char)*buf++) * 0x100000001b3ULL;
+    return h;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run_kernel(xc_interface *xch, unsigned int k, uint64_t *hashes,
+                      int reference)
+{
+    comp_ctx *ctx;
+    char *mem, *recv, *compbuf, *sent;
+    unsigned long *pfns, compbuf_size, len, pos, i, r, total_pages = 0;
+    unsigned long long total_out = 0;
+    double elapsed = 0, start;
+    uint64_t h;
+    int rc = -1, crc;
+
+    compbuf_size = nr_dirty * WORST_COMP_PAGE_SIZE;
+    mem = malloc(nr_pages * XC_PAGE_SIZE);
+    recv = calloc(nr_pages, XC_PAGE_SIZE);
+    compbuf = malloc(compbuf_size);
+    pfns = malloc(nr_dirty * sizeof(*pfns));
+    sent = calloc(nr_pages, 1);
+    ctx = xc_compression_create_context(xch, nr_pages);
+    if ( !mem || !recv || !compbuf || !pfns || !sent || !ctx )
+    {
+        fprintf(stderr, "out of memory\n");
+        goto out;
+    }
+    ctx->diff_page = kernels[k].fn;
+
+    rng = seed;
+    for ( i = 0; i < nr_pages * XC_PAGE_SIZE / sizeof(uint64_t); i++ )
+        ((uint64_t *)mem)[i] = (i & 7) ? 0 : next_rand();
+
+    for ( r = 0; r < nr_rounds; r++ )
+    {
+        for ( i = 0; i < nr_dirty; i++ )
+        {
+            pfns[i] = next_rand() % nr_pages;
+            sent[pfns[i]] = 1;
+            mutate_page((uint32_t *)(mem + pfns[i] * XC_PAGE_SIZE));
+            if ( xc_compression_add_page(xch, ctx,
+                                         mem + pfns[i] * XC_PAGE_SIZE,
+                                         pfns[i], 0) )
+            {
+                fprintf(stderr, "%s: add_page failed\n", kernels[k].name);
+                goto out;
+            }
+        }
+
+        start = now();
+        crc = xc_compression_compress_pages(xch, ctx, compbuf, compbuf_size,
+                                            &len);
+        elapsed += now() - start;
+        xc_compression_reset_pagebuf(xch, ctx);
+        if ( crc != 1 )
+        {
+            fprintf(stderr, "%s: compress_pages returned %d\n",
+                    kernels[k].name, crc);
+            goto out;
+        }
+
+        h = hash_bytes(0xcbf29ce484222325ULL, compbuf, len);
+        if ( reference )
+            hashes[r] = h;
+        else if ( hashes[r] != h )
+        {
+            fprintf(stderr, "%s: stream differs from generic in round %lu\n",
+                    kernels[k].name, r);
+            goto out;
+        }
+
+        for ( i = 0, pos = 0; i < nr_dirty; i++ )
+            if ( xc_compression_uncompress_page(
+                     xch, compbuf, len, &pos,
+                     recv + pfns[i] * XC_PAGE_SIZE) )
+            {
+                fprintf(stderr, "%s: uncompress failed in round %lu\n",
+                        kernels[k].name, r);
+                goto out;
+            }
+
+        total_pages += nr_dirty;
+        total_out += len;
+    }
+
+    for ( i = 0; i < nr_pages; i++ )
+    {
+        /* Pages never dirtied were never sent. */
+        if ( !sent[i] )
+            continue;
+        if ( memcmp(mem + i * XC_PAGE_SIZE, recv + i * XC_PAGE_SIZE,
+                    XC_PAGE_SIZE) )
+        {
+            fprintf(stderr, "%s: receiver's pfn %lu differs\n",
+                    kernels[k].name, i);
+            goto out;
+        }
+    }
+
+    printf("%-8s %10.1f MB/s %12.0f pages/s   ratio %5.3f\n",
+           kernels[k].name,
+           total_pages * (double)XC_PAGE_SIZE / elapsed / (1 << 20),
+           total_pages / elapsed,
+           (double)total_out / ((double)total_pages * XC_PAGE_SIZE));
+    rc = 0;
+
+ out:
+    xc_compression_free_context(xch, ctx);
+    free(sent);
+    free(pfns);
+    free(compbuf);
+    free(recv);
+    free(mem);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    xc_interface *xch;
+    uint64_t *hashes;
+    unsigned int k;
+    int opt, rc = 0;
+
+    while ( (opt = getopt(argc, argv, "p:d:r:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'p': nr_pages = strtoul(optarg, NULL, 0); break;
+        case 'd': nr_dirty = strtoul(optarg, NULL, 0); break;
+        case 'r': nr_rounds = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoull(optarg, NULL, 0) ? : 1; break;
+        default:
+            fprintf(stderr, "usage: %s [-p pages] [-d dirty] [-r rounds]"
+                    " [-s seed]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if ( !nr_pages || !nr_dirty || (nr_dirty >= NRPAGES(PAGE_BUFFER_SIZE)) )
+    {
+        fprintf(stderr, "need 0 < dirty < %lu and pages > 0\n",
+                (unsigned long)NRPAGES(PAGE_BUFFER_SIZE));
+        return 2;
+    }
+
+    xch = xc_interface_open(NULL, NULL, XC_OPENFLAG_DUMMY);
+    hashes = calloc(nr_rounds, sizeof(*hashes));
+    if ( !xch || !hashes )
+    {
+        fprintf(stderr, "initialisation failed\n");
+        return 1;
+    }
+
+    printf("%lu pages, %lu dirtied per checkpoint, %lu checkpoints\n",
+           nr_pages, nr_dirty, nr_rounds);
+
+#ifdef COMPRESSION_SIMD
+    __builtin_cpu_init();
+#endif
+    for ( k = 0; k < NR_KERNELS; k++ )
+    {
+        if ( kernels[k].supported && !kernels[k].supported() )
+        {
+            printf("%-8s not supported by this CPU\n", kernels[k].name);
+            continue;
+        }
+        if ( run_kernel(xch, k, hashes, k == 0) )
+            rc = 1;
+    }
+
+    /* A dummy handle has no hypervisor interface to close. */
+    free(hashes);
+
+    return rc;
+}
@@ -0,0 +1,195 @@
+/*
+ * Measure how the cost of a xenstore write grows with the number of
+ * watches registered, by simulating the watches a host with N guests
+ * has set: every backend watches the frontend state of each of its
+ * devices plus its own backend directory, and every frontend watches
+ * its backend's state.  The watches are spread over a number of
+ * connections, as they would be over backend driver domains and
+ * guests.  Writes then go to nodes of random guests, only a few of
+ * which are watched, so a daemon which scales with the number of
+ * matching watches shows a flat write rate as N grows.
+ *
+ * Run against a scratch xenstored, e.g.
+ *   XENSTORED_RUNDIR=/tmp/xs xenstored -D -N --internal-db &
+ *   XENSTORED_PATH=/tmp/xs/socket bench_xenstore_watch
+ *
+ * Usage: bench_xenstore_watch [-d domains] [-c connections] [-w writes]
+ *                             [-s seed]
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <xenstore.h>
+
+static unsigned int nr_domains = 1000, nr_conns = 16, nr_writes = 20000;
+static unsigned long seed = 1;
+
+static const char *const devices[] = { "vif/0", "vbd/51712" };
+#define NR_DEVICES (sizeof(devices) / sizeof(devices[0]))
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Throw away queued watch events, so that they do not pile up. */
+static void drain(struct xs_handle **xsh)
+{
+    unsigned int i;
+    char **ev;
+
+    for ( i = 0; i < nr_conns; i++ )
+        while ( (ev = xs_check_watch(xsh[i])) != NULL )
+            free(ev);
+}
+
+static void watch(struct xs_handle *xsh, const char *path)
+{
+    if ( !xs_watch(xsh, path, "bench") )
+    {
+        fprintf(stderr, "watch %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+static void write_node(struct xs_handle *xsh, const char *path,
+                       const char *val)
+{
+    if ( !xs_write(xsh, XBT_NULL, path, val, strlen(val)) )
+    {
+        fprintf(stderr, "write %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct xs_handle **xsh;
+    unsigned int d, i, n, nr_watches = 0;
+    char path[128];
+    double start, elapsed;
+    int opt;
+
+    while ( (opt = getopt(argc, argv, "d:c:w:s:")) != -1 )
+    {
+        switch ( opt )
+        {
+        case 'd': nr_domains = strtoul(optarg, NULL, 0); break;
+        case 'c': nr_conns = strtoul(optarg, NULL, 0); break;
+        case 'w': nr_writes = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Usage: %s [-d domains] [-c connections] "
+                    "[-w writes] [-s seed]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ( !nr_domains || !nr_conns )
+        return 1;
+
+    xsh = calloc(nr_conns, sizeof(*xsh));
+    if ( !xsh )
+        return 1;
+
+    for ( i = 0; i < nr_conns; i++ )
+    {
+        xsh[i] = xs_open(0);
+        if ( !xsh[i] )
+        {
+            perror("xs_open");
+            return 1;
+        }
+    }
+
+    /* Populate the store, then set every guest's watches. */
+    start = now();
+    for ( d = 1; d <= nr_domains; d++ )
+    {
+        for ( n = 0; n < NR_DEVICES; n++ )
+        {
+            snprintf(path, sizeof(path), "/local/domain/%u/device/%s/state",
+                     d, devices[n]);
+            write_node(xsh[0], path, "1");
+            snprintf(path, sizeof(path),
+                     "/local/domain/0/backend/%.3s/%u/%s/state",
+                     devices[n], d, strchr(devices[n], '/') + 1);
+            write_node(xsh[0], path, "1");
+        }
+        snprintf(path, sizeof(path), "/local/domain/%u/data/bench", d);
+        write_node(xsh[0], path, "0");
+    }
+
+    for ( d = 1; d <= nr_domains; d++ )
+    {
+        struct xs_handle *backend = xsh[d % nr_conns];
+        struct xs_handle *frontend = xsh[(d * 7 + 1) % nr_conns];
+
+        for ( n = 0; n < NR_DEVICES; n++ )
+        {
+            snprintf(path, sizeof(path), "/local/domain/%u/device/%s/state",
+                     d, devices[n]);
+            watch(backend, path);
+            snprintf(path, sizeof(path),
+                     "/local/domain/0/backend/%.3s/%u/%s",
+                     devices[n], d, strchr(devices[n], '/') + 1);
+            watch(backend, path);
+            strcat(path, "/state");
+            watch(frontend, path);
+            nr_watches += 3;
+        }
+        if ( d % 64 == 0 )
+            drain(xsh);
+    }
+    drain(xsh);
+    elapsed = now() - start;
+    printf("%u domains, %u watches on %u connections: setup %.2fs\n",
+           nr_domains, nr_watches, nr_conns, elapsed);
+
+    /* Time writes to random guests' nodes. */
+    srandom(seed);
+    start = now();
+    for ( i = 0; i < nr_writes; i++ )
+    {
+        d = 1 + random() % nr_domains;
+        if ( i % 16 == 0 )
+            /* Now and then, something somebody is waiting for. */
+            snprintf(path, sizeof(path),
+                     "/local/domain/%u/device/vif/0/state", d);
+        else
+            snprintf(path, sizeof(path), "/local/domain/%u/data/bench", d);
+        write_node(xsh[i % nr_conns], path, "4");
+        if ( i % 256 == 0 )
+            drain(xsh);
+    }
+    drain(xsh);
+    elapsed = now() - start;
+
+    printf("%u writes in %.2fs: %.1f us/write, %.0f writes/s\n",
+           nr_writes, elapsed, elapsed * 1e6 / nr_writes,
+           nr_writes / elapsed);
+
+    for ( i = 0; i < nr_conns; i++ )
+        xs_close(xsh[i]);
+    free(xsh);
+
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "BSD"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -24,8 +24,10 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "xenstat_priv.h"
+#include <xen/vcpu.h>
 
 /*
  * Data-collection types
@@ -62,6 +64,7 @@ static void xenstat_uninit_vcpus(xenstat_handle * handle);
 static void xenstat_uninit_xen_version(xenstat_handle * handle);
 static char *xenstat_get_domain_name(xenstat_handle * handle, unsigned int domain_id);
 static void xenstat_prune_domain(xenstat_node *node, unsigned int entry);
+static void xenstat_free_cached_domains(xenstat_handle * handle);
 
 static xenstat_collector collectors[] = {
 	{ XENSTAT_VCPU, xenstat_collect_vcpus,
@@ -126,6 +129,9 @@ void xenstat_uninit(xenstat_handle * handle)
 			collectors[i].uninit(handle);
 		xc_interface_close(handle->xc_handle);
 		xs_daemon_close(handle->xshandle);
+		xenstat_free_cached_domains(handle);
+		free(handle->domainstats);
+		free(handle->vcpustats);
 		free(handle->priv);
 		free(handle);
 	}
@@ -158,14 +164,314 @@ void domain_get_tmem_stats(xenstat_handle * handle, xenstat_domain * domain)
 	domain->tmem_stats.succ_pers_gets = parse(buffer,"Gp");
 }
 
+#define DOMAIN_CHUNK_SIZE 256
+#define VCPU_CHUNK_SIZE (8 * DOMAIN_CHUNK_SIZE)
+
+static int xenstat_compare_domains(const void *key, const void *elem)
+{
+	unsigned int id = ((const xenstat_domain *)key)->id;
+	unsigned int elem_id = ((const xenstat_domain *)elem)->id;
+
+	return id < elem_id ? -1 : id > elem_id;
+}
+
+/* Find the previous snapshot of domain, provided nothing has changed
+ * since. */
+static xenstat_domain *xenstat_cached_domain(xenstat_handle * handle,
+					     xenstat_domain * domain)
+{
+	xenstat_domain *cached;
+
+	cached = bsearch(domain, handle->cached_domains,
+			 handle->num_cached_domains, sizeof(xenstat_domain),
+			 xenstat_compare_domains);
+	if (cached == NULL ||
+	    memcmp(cached->uuid, domain->uuid, sizeof(domain->uuid)) ||
+	    cached->state != domain->state ||
+	    cached->cpu_ns != domain->cpu_ns ||
+	    cached->num_vcpus != domain->num_vcpus ||
+	    cached->cur_mem != domain->cur_mem ||
+	    cached->max_mem != domain->max_mem)
+		return NULL;
+
+	return cached;
+}
+
+static void xenstat_free_cached_domains(xenstat_handle * handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < handle->num_cached_domains; i++)
+		free(handle->cached_domains[i].name);
+	free(handle->cached_domains);
+	handle->cached_domains = NULL;
+	handle->num_cached_domains = 0;
+}
+
+/* Remember the domains of node for the next XENSTAT_INCREMENTAL call.
+ * Failing to do so only costs the next call some extra lookups. */
+static void xenstat_cache_domains(xenstat_node * node)
+{
+	xenstat_handle *handle = node->handle;
+	xenstat_domain *cached;
+	unsigned int i;
+
+	xenstat_free_cached_domains(handle);
+
+	if (node->num_domains == 0)
+		return;
+
+	cached = calloc(node->num_domains, sizeof(xenstat_domain));
+	if (cached == NULL)
+		return;
+
+	for (i = 0; i < node->num_domains; i++) {
+		cached[i].id = node->domains[i].id;
+		memcpy(cached[i].uuid, node->domains[i].uuid,
+		       sizeof(cached[i].uuid));
+		cached[i].state = node->domains[i].state;
+		cached[i].cpu_ns = node->domains[i].cpu_ns;
+		cached[i].num_vcpus = node->domains[i].num_vcpus;
+		cached[i].cur_mem = node->domains[i].cur_mem;
+		cached[i].max_mem = node->domains[i].max_mem;
+		cached[i].tmem_stats = node->domains[i].tmem_stats;
+		cached[i].name = strdup(node->domains[i].name);
+		if (cached[i].name == NULL) {
+			handle->cached_domains = cached;
+			handle->num_cached_domains = i;
+			xenstat_free_cached_domains(handle);
+			return;
+		}
+	}
+
+	handle->cached_domains = cached;
+	handle->num_cached_domains = node->num_domains;
+}
+
+/* Fill in domain using info.  Returns 1 on success, 0 if the domain is
+ * being destroyed and should be ignored, -1 on fatal error. */
+static int xenstat_fill_domain(xenstat_node * node, xenstat_domain * domain,
+			       const xc_domaininfo_t * info, unsigned int flags)
+{
+	xenstat_handle *handle = node->handle;
+	xenstat_domain *cached = NULL;
+
+	domain->id = info->domain;
+	memcpy(domain->uuid, info->handle, sizeof(domain->uuid));
+	domain->state = info->flags;
+	domain->cpu_ns = info->cpu_time;
+	domain->num_vcpus = (info->max_vcpu_id+1);
+	domain->vcpus = NULL;
+	domain->cur_mem =
+	    ((unsigned long long)info->tot_pages)
+	    * handle->page_size;
+	domain->max_mem =
+	    info->max_pages == UINT_MAX
+	    ? (unsigned long long)-1
+	    : (unsigned long long)(info->max_pages
+				   * handle->page_size);
+	domain->ssid = info->ssidref;
+	domain->num_networks = 0;
+	domain->networks = NULL;
+	domain->num_vbds = 0;
+	domain->vbds = NULL;
+
+	if (flags & XENSTAT_INCREMENTAL)
+		cached = xenstat_cached_domain(handle, domain);
+
+	if (cached != NULL) {
+		domain->name = strdup(cached->name);
+		if (domain->name == NULL)
+			return -1;
+		domain->tmem_stats = cached->tmem_stats;
+		return 1;
+	}
+
+	domain->name = xenstat_get_domain_name(handle, domain->id);
+	if (domain->name == NULL) {
+		/* failed to get name -- this means the domain is being
+		   destroyed so simply ignore this entry, unless we ran out
+		   of memory */
+		return errno == ENOMEM ? -1 : 0;
+	}
+
+	/* Per-domain tmem queries are pointless if tmem is not in use */
+	if (node->freeable_mb >= 0)
+		domain_get_tmem_stats(handle, domain);
+
+	return 1;
+}
+
+/* Make room for count more domains in node.  Returns the first new
+ * entry, zeroed, or NULL on failure. */
+static xenstat_domain *xenstat_grow_domains(xenstat_node * node,
+					    unsigned int count)
+{
+	xenstat_domain *tmp;
+
+	tmp = realloc(node->domains,
+		      (node->num_domains + count) * sizeof(xenstat_domain));
+	if (tmp == NULL)
+		return NULL;
+
+	node->domains = tmp;
+
+	/* zero out newly allocated memory in case error occurs below */
+	memset(tmp + node->num_domains, 0, count * sizeof(xenstat_domain));
+
+	return tmp + node->num_domains;
+}
+
+/* Throw away the domains collected so far */
+static void xenstat_reset_domains(xenstat_node * node)
+{
+	unsigned int i;
+
+	for (i = 0; i < node->num_domains; i++) {
+		free(node->domains[i].name);
+		free(node->domains[i].vcpus);
+	}
+	node->num_domains = 0;
+	node->flags = 0;
+}
+
+/* Collect the domains with xc_domain_getinfolist.  Returns 0 on success,
+ * -1 on fatal error. */
+static int xenstat_get_domains(xenstat_node * node, unsigned int flags)
+{
+	xenstat_handle *handle = node->handle;
+	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
+	xenstat_domain *domain;
+	int new_domains, rc;
+	unsigned int i;
+
+	do {
+		new_domains = xc_domain_getinfolist(handle->xc_handle,
+						    node->num_domains, 
+						    DOMAIN_CHUNK_SIZE, 
+						    domaininfo);
+		if (new_domains < 0)
+			return -1;
+
+		domain = xenstat_grow_domains(node, new_domains);
+		if (domain == NULL)
+			return -1;
+
+		for (i = 0; i < new_domains; i++) {
+			rc = xenstat_fill_domain(node, domain, &domaininfo[i],
+						 flags);
+			if (rc < 0)
+				return -1;
+			if (rc == 0)
+				continue;
+
+			domain++;
+			node->num_domains++;
+		}
+	} while (new_domains == DOMAIN_CHUNK_SIZE);
+
+	return 0;
+}
+
+/* Collect the domains, and their vcpus if requested, with a single
+ * XEN_SYSCTL_getdomainstats snapshot per chunk of domains.  Returns 0
+ * on success, -1 on failure; handle->no_domainstats is set if the
+ * hypervisor does not support it. */
+static int xenstat_get_domains_bulk(xenstat_node * node, unsigned int flags)
+{
+	xenstat_handle *handle = node->handle;
+	xenstat_domain *domain;
+	xc_domainstats_t *ds;
+	xc_vcpustats_t *vs;
+	uint32_t first = 0;
+	unsigned int i, v, nr_vcpus;
+	int new_domains, rc;
+
+	if (handle->domainstats == NULL) {
+		handle->domainstats = calloc(DOMAIN_CHUNK_SIZE,
+					     sizeof(xc_domainstats_t));
+		handle->vcpustats = calloc(VCPU_CHUNK_SIZE,
+					   sizeof(xc_vcpustats_t));
+		if (handle->domainstats == NULL || handle->vcpustats == NULL)
+			return -1;
+		handle->max_vcpustats = VCPU_CHUNK_SIZE;
+	}
+
+	/* vcpus are filled in here rather than by xenstat_collect_vcpus */
+	if (flags & XENSTAT_VCPU)
+		node->flags |= XENSTAT_VCPU;
+
+	while (first != DOMID_INVALID) {
+		new_domains = xc_domain_getstats(handle->xc_handle, first,
+						 DOMAIN_CHUNK_SIZE,
+						 handle->domainstats,
+						 handle->max_vcpustats,
+						 handle->vcpustats,
+						 &nr_vcpus, &first);
+		if (new_domains < 0 && errno == ENOBUFS) {
+			/* A single domain has more vcpus than fit */
+			vs = realloc(handle->vcpustats,
+				     2 * handle->max_vcpustats
+				     * sizeof(xc_vcpustats_t));
+			if (vs == NULL)
+				return -1;
+			handle->vcpustats = vs;
+			handle->max_vcpustats *= 2;
+			continue;
+		}
+		if (new_domains < 0) {
+			if (errno == ENOSYS)
+				handle->no_domainstats = 1;
+			return -1;
+		}
+
+		domain = xenstat_grow_domains(node, new_domains);
+		if (domain == NULL)
+			return -1;
+
+		for (i = 0; i < new_domains; i++) {
+			ds = &handle->domainstats[i];
+
+			rc = xenstat_fill_domain(node, domain, &ds->info, flags);
+			if (rc < 0)
+				return -1;
+			if (rc == 0)
+				continue;
+
+			if (flags & XENSTAT_VCPU) {
+				domain->vcpus = calloc(domain->num_vcpus,
+						       sizeof(xenstat_vcpu));
+				if (domain->vcpus == NULL) {
+					free(domain->name);
+					domain->name = NULL;
+					return -1;
+				}
+
+				for (v = 0; v < ds->nr_vcpus; v++) {
+					vs = &handle->vcpustats[ds->first_vcpu + v];
+					if (vs->vcpu >= domain->num_vcpus)
+						continue;
+					domain->vcpus[vs->vcpu].online =
+					    !!(vs->flags & XEN_VCPUSTATS_online);
+					domain->vcpus[vs->vcpu].ns =
+					    vs->time[RUNSTATE_running];
+				}
+			}
+
+			domain++;
+			node->num_domains++;
+		}
+	}
+
+	return 0;
+}
+
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 {
-#define DOMAIN_CHUNK_SIZE 256
 	xenstat_node *node;
 	xc_physinfo_t physinfo = { 0 };
-	xc_domaininfo_t domaininfo[DOMAIN_CHUNK_SIZE];
-	int new_domains;
 	unsigned int i;
+	int rc = -1;
 
 	/* Create the node */
 	node = (xenstat_node *) calloc(1, sizeof(xenstat_node));
@@ -201,74 +507,22 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 	}
 
 	node->num_domains = 0;
-	do {
-		xenstat_domain *domain, *tmp;
-
-		new_domains = xc_domain_getinfolist(handle->xc_handle,
-						    node->num_domains, 
-						    DOMAIN_CHUNK_SIZE, 
-						    domaininfo);
-		if (new_domains < 0)
-			goto err;
-
-		tmp = realloc(node->domains,
-			      (node->num_domains + new_domains)
-			      * sizeof(xenstat_domain));
-		if (tmp == NULL)
-			goto err;
-
-		node->domains = tmp;
-
-		domain = node->domains + node->num_domains;
-
-		/* zero out newly allocated memory in case error occurs below */
-		memset(domain, 0, new_domains * sizeof(xenstat_domain));
-
-		for (i = 0; i < new_domains; i++) {
-			/* Fill in domain using domaininfo[i] */
-			domain->id = domaininfo[i].domain;
-			domain->name = xenstat_get_domain_name(handle, 
-							       domain->id);
-			if (domain->name == NULL) {
-				if (errno == ENOMEM) {
-					/* fatal error */
-					xenstat_free_node(node);
-					return NULL;
-				}
-				else {
-					/* failed to get name -- this means the
-					   domain is being destroyed so simply
-					   ignore this entry */
-					continue;
-				}
-			}
-			domain->state = domaininfo[i].flags;
-			domain->cpu_ns = domaininfo[i].cpu_time;
-			domain->num_vcpus = (domaininfo[i].max_vcpu_id+1);
-			domain->vcpus = NULL;
-			domain->cur_mem =
-			    ((unsigned long long)domaininfo[i].tot_pages)
-			    * handle->page_size;
-			domain->max_mem =
-			    domaininfo[i].max_pages == UINT_MAX
-			    ? (unsigned long long)-1
-			    : (unsigned long long)(domaininfo[i].max_pages
-						   * handle->page_size);
-			domain->ssid = domaininfo[i].ssidref;
-			domain->num_networks = 0;
-			domain->networks = NULL;
-			domain->num_vbds = 0;
-			domain->vbds = NULL;
-			domain_get_tmem_stats(handle,domain);
-
-			domain++;
-			node->num_domains++;
+	if (!handle->no_domainstats) {
+		rc = xenstat_get_domains_bulk(node, flags);
+		if (rc < 0) {
+			if (errno == ENOMEM)
+				goto err;
+			/* Start over with the per-domain interfaces */
+			xenstat_reset_domains(node);
 		}
-	} while (new_domains == DOMAIN_CHUNK_SIZE);
+	}
+	if (rc < 0 && xenstat_get_domains(node, flags) < 0)
+		goto err;
 
+	if (flags & XENSTAT_INCREMENTAL)
+		xenstat_cache_domains(node);
 
 	/* Run all the extra data collectors requested */
-	node->flags = 0;
 	for (i = 0; i < NUM_COLLECTORS; i++) {
 		if ((flags & collectors[i].flag) == collectors[i].flag) {
 			node->flags |= collectors[i].flag;
@@ -281,8 +535,7 @@ xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags)
 
 	return node;
 err:
-	free(node->domains);
-	free(node);
+	xenstat_free_node(node);
 	return NULL;
 }
 
@@ -488,6 +741,10 @@ static int xenstat_collect_vcpus(xenstat_node * node)
 	for (i = 0; i < node->num_domains; i+=inc_index) {
 		inc_index = 1; /* default is to increment to next domain */
 
+		/* already filled in from a getdomainstats snapshot */
+		if (node->domains[i].vcpus != NULL)
+			continue;
+
 		node->domains[i].vcpus = malloc(node->domains[i].num_vcpus
 						* sizeof(xenstat_vcpu));
 		if (node->domains[i].vcpus == NULL)
@@ -42,6 +42,11 @@ void xenstat_uninit(xenstat_handle * handle);
 #define XENSTAT_XEN_VERSION 0x4
 #define XENSTAT_VBD 0x8
 #define XENSTAT_ALL (XENSTAT_VCPU|XENSTAT_NETWORK|XENSTAT_XEN_VERSION|XENSTAT_VBD)
+/* Reuse the name and tmem statistics from the previous xenstat_get_node
+ * call for domains whose state, memory, vcpus and cpu time are unchanged,
+ * instead of querying xenstore and the hypervisor for each of them.
+ * A renamed domain shows its old name until one of those changes. */
+#define XENSTAT_INCREMENTAL 0x10
 
 /* Get all available information about a node */
 xenstat_node *xenstat_get_node(xenstat_handle * handle, unsigned int flags);
@@ -38,6 +38,14 @@ struct xenstat_handle {
 	int page_size;
 	void *priv;
 	char xen_version[VERSION_SIZE]; /* xen version running on this node */
+	/* Buffers for XEN_SYSCTL_getdomainstats snapshots */
+	xc_domainstats_t *domainstats;
+	xc_vcpustats_t *vcpustats;
+	unsigned int max_vcpustats;
+	int no_domainstats;		/* hypervisor lacks getdomainstats */
+	/* Domains from the previous node, for XENSTAT_INCREMENTAL */
+	xenstat_domain *cached_domains;	/* sorted by id */
+	unsigned int num_cached_domains;
 };
 
 struct xenstat_node {
@@ -61,6 +69,7 @@ struct xenstat_tmem {
 
 struct xenstat_domain {
 	unsigned int id;
+	xen_domain_handle_t uuid;
 	char *name;
 	unsigned int state;
 	unsigned long long cpu_ns;
@@ -1063,7 +1063,7 @@ static void top(void)
 	if (prev_node != NULL)
 		xenstat_free_node(prev_node);
 	prev_node = cur_node;
-	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL);
+	cur_node = xenstat_get_node(xhandle, XENSTAT_ALL | XENSTAT_INCREMENTAL);
 	if (cur_node == NULL)
 		fail("Failed to retrieve statistics from libxenstat\n");
 
@@ -8,15 +8,17 @@
 int main(int argc, char **argv)
 {
   struct xs_handle * xsh;
+  char *ret;
 
-  if (argc < 2 ||
-      strcmp(argv[1], "check"))
+  if (!(argc == 2 && !strcmp(argv[1], "check")) &&
+      !((argc == 2 || argc == 3) && !strcmp(argv[1], "stats")))
   {
     fprintf(stderr,
             "Usage:\n"
             "\n"
             "       %s check\n"
-            "\n", argv[0]);
+            "       %s stats [ops|domains|transactions|watches|reset]\n"
+            "\n", argv[0], argv[0]);
     return 2;
   }
 
@@ -27,7 +29,17 @@ int main(int argc, char **argv)
     return 1;
   }
 
-  xs_debug_command(xsh, argv[1], NULL, 0);
+  ret = xs_debug_command(xsh, argv[1], argv[2],
+                         argc == 3 ? strlen(argv[2]) + 1 : 0);
+  if (ret == NULL) {
+    perror(argv[1]);
+    xs_daemon_close(xsh);
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "stats") && !(argc == 3 && !strcmp(argv[2], "reset")))
+    fputs(ret, stdout);
+  free(ret);
 
   xs_daemon_close(xsh);
 
@@ -20,6 +20,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #ifndef NO_SOCKETS
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -49,18 +52,21 @@
 #include "xenstored_watch.h"
 #include "xenstored_transaction.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
+#include "xenstored_stats.h"
 #include "xenctrl.h"
 #include "tdb.h"
 
 #include "hashtable.h"
 
 extern xc_evtchn *xce_handle; /* in xenstored_domain.c */
-static int xce_pollfd_idx = -1;
-static struct pollfd *fds;
-static unsigned int current_array_size;
-static unsigned int nr_fds;
+static struct event_source xce_src = { .fd = -1 };
 
-#define ROUNDUP(_x, _w) (((unsigned long)(_x)+(1UL<<(_w))-1) & ~((1UL<<(_w))-1))
+/* Connections with input, output or errors to look at. */
+static LIST_HEAD(ready_connections);
+
+/* Requests we take from a domain's ring before moving on to the next. */
+#define DOMAIN_BATCH 16
 
 static bool verbose = false;
 LIST_HEAD(connections);
@@ -68,9 +74,8 @@ static int tracefd = -1;
 static bool recovery = true;
 static bool remove_local = true;
 static int reopen_log_pipe[2];
-static int reopen_log_pipe0_pollfd_idx = -1;
+static struct event_source reopen_log_src = { .fd = -1 };
 static char *tracefile = NULL;
-static TDB_CONTEXT *tdb_ctx = NULL;
 
 static void corrupt(struct connection *conn, const char *fmt, ...);
 static void check_store(void);
@@ -89,25 +94,23 @@ int quota_nb_watch_per_domain = 128;
 int quota_max_entry_size = 2048; /* 2K */
 int quota_max_transaction = 10;
 
-TDB_CONTEXT *tdb_context(struct connection *conn)
+/* Next generation to stamp on a record written to the database. */
+static uint64_t generation;
+
+bool store_record(const char *name, TDB_DATA data)
 {
-	/* conn = NULL used in manual_node at setup. */
-	if (!conn || !conn->transaction)
-		return tdb_ctx;
-	return tdb_transaction_context(conn->transaction);
+	((struct xs_tdb_record_hdr *)data.dptr)->generation = generation++;
+	return store_write(name, data);
 }
 
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb)
+/* Transactions keep their own view of the nodes they touch. */
+static struct transaction *transaction_of(struct connection *conn)
 {
-	if (!(tdb_ctx->flags & TDB_INTERNAL))
-		if (rename(newname, xs_daemon_tdb()) != 0)
-			return false;
-	tdb_close(tdb_ctx);
-	tdb_ctx = talloc_steal(talloc_autofree_context(), newtdb);
-	return true;
+	/* conn = NULL used in manual_node at setup. */
+	return conn ? conn->transaction : NULL;
 }
 
-static char *sockmsg_string(enum xsd_sockmsg_type type)
+char *sockmsg_string(enum xsd_sockmsg_type type)
 {
 	switch (type) {
 	case XS_DEBUG: return "DEBUG";
@@ -280,6 +283,156 @@ static bool write_messages(struct connection *conn)
 	return true;
 }
 
+/*
+ * The main loop waits on file descriptors which stay registered from one
+ * iteration to the next: in an epoll set on Linux, so that the cost of a
+ * wakeup does not depend on the number of connections, and in a pollfd
+ * array which is handed to poll() as it stands elsewhere.
+ */
+#ifdef __linux__
+static int epoll_fd = -1;
+
+/* EPOLLIN etc. have the same values as POLLIN etc. */
+static bool watch_fd(struct event_source *src, int fd, short events,
+		     void (*handle)(struct event_source *src))
+{
+	struct epoll_event ev = { .events = events, .data.ptr = src };
+
+	if (epoll_fd == -1) {
+		epoll_fd = epoll_create(64);
+		if (epoll_fd == -1)
+			barf_perror("Could not create epoll set");
+		fcntl(epoll_fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+		return false;
+
+	src->fd = fd;
+	src->events = events;
+	src->revents = 0;
+	src->handle = handle;
+	return true;
+}
+
+static void unwatch_fd(struct event_source *src)
+{
+	struct epoll_event ev = { 0 };
+
+	if (src->fd == -1)
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src->fd, &ev);
+	src->fd = -1;
+}
+
+static void change_fd(struct event_source *src, short events)
+{
+	struct epoll_event ev = { .events = events, .data.ptr = src };
+
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, src->fd, &ev) != 0)
+		barf_perror("Could not change events for fd %d", src->fd);
+	src->events = events;
+}
+
+static void wait_fds(int timeout)
+{
+	struct epoll_event ev[64];
+	struct event_source *src;
+	int i, n;
+
+	n = epoll_wait(epoll_fd, ev, ARRAY_SIZE(ev), timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("epoll_wait failed");
+	}
+
+	for (i = 0; i < n; i++) {
+		src = ev[i].data.ptr;
+		src->revents = ev[i].events;
+		src->handle(src);
+	}
+}
+#else
+static struct pollfd *fds;
+static struct event_source **fd_sources;
+static unsigned int current_array_size;
+static unsigned int nr_fds;
+
+static bool watch_fd(struct event_source *src, int fd, short events,
+		     void (*handle)(struct event_source *src))
+{
+	if (current_array_size < nr_fds + 1) {
+		unsigned int newsize = current_array_size + 64;
+		struct pollfd *new_fds;
+		struct event_source **new_sources;
+
+		new_fds = realloc(fds, sizeof(*fds) * newsize);
+		if (!new_fds)
+			return false;
+		fds = new_fds;
+		new_sources = realloc(fd_sources, sizeof(*fd_sources) * newsize);
+		if (!new_sources)
+			return false;
+		fd_sources = new_sources;
+		current_array_size = newsize;
+	}
+
+	fds[nr_fds].fd = fd;
+	fds[nr_fds].events = events;
+	fds[nr_fds].revents = 0;
+	fd_sources[nr_fds] = src;
+
+	src->fd = fd;
+	src->events = events;
+	src->revents = 0;
+	src->idx = nr_fds++;
+	src->handle = handle;
+	return true;
+}
+
+static void unwatch_fd(struct event_source *src)
+{
+	if (src->fd == -1)
+		return;
+
+	/* Move the last entry into the hole. */
+	nr_fds--;
+	fds[src->idx] = fds[nr_fds];
+	fd_sources[src->idx] = fd_sources[nr_fds];
+	fd_sources[src->idx]->idx = src->idx;
+	src->fd = -1;
+}
+
+static void change_fd(struct event_source *src, short events)
+{
+	fds[src->idx].events = events;
+	src->events = events;
+}
+
+static void wait_fds(int timeout)
+{
+	struct event_source *src;
+	unsigned int i;
+
+	if (poll(fds, nr_fds, timeout) < 0) {
+		if (errno == EINTR)
+			return;
+		barf_perror("Poll failed");
+	}
+
+	/* Handlers may add entries at the end, or move them from there. */
+	for (i = nr_fds; i-- > 0; ) {
+		if (i >= nr_fds || !fds[i].revents)
+			continue;
+		src = fd_sources[i];
+		src->revents = fds[i].revents;
+		fds[i].revents = 0;
+		src->handle(src);
+	}
+}
+#endif
+
 static int destroy_conn(void *_conn)
 {
 	struct connection *conn = _conn;
@@ -294,86 +447,26 @@ static int destroy_conn(void *_conn)
 		       && poll(&pfd, 1, 0) == 1)
 			if (!write_messages(conn))
 				break;
+		unwatch_fd(&conn->src);
 		close(conn->fd);
 	}
         if (conn->target)
                 talloc_unlink(conn, conn->target);
 	list_del(&conn->list);
+	list_del(&conn->ready_list);
 	trace_destroy(conn, "connection");
 	return 0;
 }
 
-/* This function returns index inside the array if succeed, -1 if fail */
-static int set_fd(int fd, short events)
+void conn_ready(struct connection *conn)
 {
-	int ret;
-	if (current_array_size < nr_fds + 1) {
-		struct pollfd *new_fds = NULL;
-		unsigned long newsize;
-
-		/* Round up to 2^8 boundary, in practice this just
-		 * make newsize larger than current_array_size.
-		 */
-		newsize = ROUNDUP(nr_fds + 1, 8);
-
-		new_fds = realloc(fds, sizeof(struct pollfd)*newsize);
-		if (!new_fds)
-			goto fail;
-		fds = new_fds;
-
-		memset(&fds[0] + current_array_size, 0,
-		       sizeof(struct pollfd ) * (newsize-current_array_size));
-		current_array_size = newsize;
-	}
-
-	fds[nr_fds].fd = fd;
-	fds[nr_fds].events = events;
-	ret = nr_fds;
-	nr_fds++;
-
-	return ret;
-fail:
-	syslog(LOG_ERR, "realloc failed, ignoring fd %d\n", fd);
-	return -1;
+	if (list_empty(&conn->ready_list))
+		list_add_tail(&conn->ready_list, &ready_connections);
 }
 
-static void initialize_fds(int sock, int *p_sock_pollfd_idx,
-			   int ro_sock, int *p_ro_sock_pollfd_idx,
-			   int *ptimeout)
+static void conn_event(struct event_source *src)
 {
-	struct connection *conn;
-
-	if (fds)
-		memset(fds, 0, sizeof(struct pollfd) * current_array_size);
-	nr_fds = 0;
-
-	*ptimeout = -1;
-
-	if (sock != -1)
-		*p_sock_pollfd_idx = set_fd(sock, POLLIN|POLLPRI);
-	if (ro_sock != -1)
-		*p_ro_sock_pollfd_idx = set_fd(ro_sock, POLLIN|POLLPRI);
-	if (reopen_log_pipe[0] != -1)
-		reopen_log_pipe0_pollfd_idx =
-			set_fd(reopen_log_pipe[0], POLLIN|POLLPRI);
-
-	if (xce_handle != NULL)
-		xce_pollfd_idx = set_fd(xc_evtchn_fd(xce_handle),
-					POLLIN|POLLPRI);
-
-	list_for_each_entry(conn, &connections, list) {
-		if (conn->domain) {
-			if (domain_can_read(conn) ||
-			    (domain_can_write(conn) &&
-			     !list_empty(&conn->out_list)))
-				*ptimeout = 0;
-		} else {
-			short events = POLLIN|POLLPRI;
-			if (!list_empty(&conn->out_list))
-				events |= POLLOUT;
-			conn->pollfd_idx = set_fd(conn->fd, events);
-		}
-	}
+	conn_ready(container_of(src, struct connection, src));
 }
 
 /* Is child a subnode of parent, or equal? */
@@ -395,39 +488,35 @@ bool is_child(const char *child, const char *parent)
 /* If it fails, returns NULL and sets errno. */
 static struct node *read_node(struct connection *conn, const char *name)
 {
-	TDB_DATA key, data;
-	uint32_t *p;
+	TDB_DATA data;
+	struct xs_tdb_record_hdr *hdr;
 	struct node *node;
-	TDB_CONTEXT * context = tdb_context(conn);
-
-	key.dptr = (void *)name;
-	key.dsize = strlen(name);
-	data = tdb_fetch(context, key);
+	struct transaction *trans = transaction_of(conn);
 
-	if (data.dptr == NULL) {
-		if (tdb_error(context) == TDB_ERR_NOEXIST)
-			errno = ENOENT;
-		else {
-			log("TDB error on read: %s", tdb_errorstr(context));
-			errno = EIO;
-		}
-		return NULL;
+	if (trans) {
+		data = transaction_fetch(trans, name);
+		if (data.dptr == NULL)
+			return NULL;
+	} else {
+		data = store_fetch(name, name);
+		if (data.dptr == NULL)
+			return NULL;
 	}
 
 	node = talloc(name, struct node);
 	node->name = talloc_strdup(node, name);
 	node->parent = NULL;
-	node->tdb = tdb_context(conn);
+	node->trans = trans;
 	talloc_steal(node, data.dptr);
 
 	/* Datalen, childlen, number of permissions */
-	p = (uint32_t *)data.dptr;
-	node->num_perms = p[0];
-	node->datalen = p[1];
-	node->childlen = p[2];
+	hdr = (void *)data.dptr;
+	node->num_perms = hdr->num_perms;
+	node->datalen = hdr->datalen;
+	node->childlen = hdr->childlen;
 
 	/* Permissions are struct xs_permissions. */
-	node->perms = (void *)&p[3];
+	node->perms = hdr->perms;
 	/* Data is binary blob (usually ascii, no nul). */
 	node->data = node->perms + node->num_perms;
 	/* Children is strings, nul separated. */
@@ -440,16 +529,18 @@ static bool write_node(struct connection *conn, const struct node *node)
 {
 	/*
 	 * conn will be null when this is called from manual_node.
-	 * tdb_context copes with this.
+	 * transaction_of copes with this.
 	 */
 
 	TDB_DATA key, data;
+	struct xs_tdb_record_hdr *hdr;
+	struct transaction *trans = transaction_of(conn);
 	void *p;
 
 	key.dptr = (void *)node->name;
 	key.dsize = strlen(node->name);
 
-	data.dsize = 3*sizeof(uint32_t)
+	data.dsize = sizeof(*hdr)
 		+ node->num_perms*sizeof(node->perms[0])
 		+ node->datalen + node->childlen;
 
@@ -457,10 +548,12 @@ static bool write_node(struct connection *conn, const struct node *node)
 		goto error;
 
 	data.dptr = talloc_size(node, data.dsize);
-	((uint32_t *)data.dptr)[0] = node->num_perms;
-	((uint32_t *)data.dptr)[1] = node->datalen;
-	((uint32_t *)data.dptr)[2] = node->childlen;
-	p = data.dptr + 3 * sizeof(uint32_t);
+	hdr = (void *)data.dptr;
+	hdr->generation = NO_GENERATION;
+	hdr->num_perms = node->num_perms;
+	hdr->datalen = node->datalen;
+	hdr->childlen = node->childlen;
+	p = hdr->perms;
 
 	memcpy(p, node->perms, node->num_perms*sizeof(node->perms[0]));
 	p += node->num_perms*sizeof(node->perms[0]);
@@ -468,8 +561,14 @@ static bool write_node(struct connection *conn, const struct node *node)
 	p += node->datalen;
 	memcpy(p, node->children, node->childlen);
 
+	if (trans) {
+		if (!transaction_store(trans, node->name, data))
+			goto error;
+		return true;
+	}
+
 	/* TDB should set errno, but doesn't even set ecode AFAICT. */
-	if (tdb_store(tdb_context(conn), key, data, TDB_REPLACE) != 0) {
+	if (!store_record(node->name, data)) {
 		corrupt(conn, "Write of %s failed", key.dptr);
 		goto error;
 	}
@@ -653,6 +752,7 @@ void send_reply(struct connection *conn, enum xsd_sockmsg_type type,
 
 	/* Queue for later transmission. */
 	list_add_tail(&bdata->list, &conn->out_list);
+	conn_ready(conn);
 }
 
 /* Some routines (write, mkdir, etc) just need a non-error return */
@@ -784,14 +884,17 @@ static void do_read(struct connection *conn, const char *name)
 	send_reply(conn, XS_READ, node->data, node->datalen);
 }
 
-static void delete_node_single(struct connection *conn, struct node *node)
+static bool delete_record(struct transaction *trans, const char *name)
 {
-	TDB_DATA key;
+	if (!trans)
+		return store_delete(name);
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
+	return transaction_delete(trans, name);
+}
 
-	if (tdb_delete(tdb_context(conn), key) != 0) {
+static void delete_node_single(struct connection *conn, struct node *node)
+{
+	if (!delete_record(transaction_of(conn), node->name)) {
 		corrupt(conn, "Could not delete '%s'", node->name);
 		return;
 	}
@@ -832,7 +935,7 @@ static struct node *construct_node(struct connection *conn, const char *name)
 
 	/* Allocate node */
 	node = talloc(name, struct node);
-	node->tdb = tdb_context(conn);
+	node->trans = transaction_of(conn);
 	node->name = talloc_strdup(node, name);
 
 	/* Inherit permissions, except unprivileged domains own what they create */
@@ -853,15 +956,11 @@ static struct node *construct_node(struct connection *conn, const char *name)
 static int destroy_node(void *_node)
 {
 	struct node *node = _node;
-	TDB_DATA key;
 
 	if (streq(node->name, "/"))
 		corrupt(NULL, "Destroying root node!");
 
-	key.dptr = (void *)node->name;
-	key.dsize = strlen(node->name);
-
-	tdb_delete(node->tdb, key);
+	delete_record(node->trans, node->name);
 	return 0;
 }
 
@@ -1184,6 +1283,26 @@ static void do_debug(struct connection *conn, struct buffered_data *in)
 	if (streq(in->buffer, "check"))
 		check_store();
 
+	if (streq(in->buffer, "stats")) {
+		const char *section = num > 1 ? in->buffer + get_string(in, 0)
+					      : NULL;
+		char *s;
+
+		if (section && streq(section, "reset"))
+			stats_reset();
+		else if (section && !streq(section, "ops") &&
+			 !streq(section, "domains") &&
+			 !streq(section, "transactions") &&
+			 !streq(section, "watches")) {
+			send_error(conn, EINVAL);
+			return;
+		} else {
+			s = stats_dump(in, section);
+			send_reply(conn, XS_DEBUG, s, strlen(s) + 1);
+			return;
+		}
+	}
+
 	send_ack(conn, XS_DEBUG);
 }
 
@@ -1291,12 +1410,17 @@ static void process_message(struct connection *conn, struct buffered_data *in)
 
 static void consider_message(struct connection *conn)
 {
+	enum xsd_sockmsg_type type = conn->in->hdr.msg.type;
+	struct timeval start;
+
 	if (verbose)
 		xprintf("Got message %s len %i from %p\n",
 			sockmsg_string(conn->in->hdr.msg.type),
 			conn->in->hdr.msg.len, conn);
 
+	gettimeofday(&start, NULL);
 	process_message(conn, conn->in);
+	stats_request(conn->id, type, &start);
 
 	talloc_free(conn->in);
 	conn->in = new_buffer(conn);
@@ -1356,6 +1480,92 @@ static void handle_output(struct connection *conn)
 		talloc_free(conn);
 }
 
+/*
+ * Take a batch of requests off a domain's ring, writing out replies as we
+ * go, and tell the domain about all of it with a single event.
+ */
+static void handle_domain(struct connection *conn)
+{
+	unsigned int n;
+
+	for (n = 0; ; n++) {
+		while (domain_can_write(conn) && !list_empty(&conn->out_list)) {
+			talloc_increase_ref_count(conn);
+			handle_output(conn);
+			if (talloc_free(conn) == 0)
+				return;
+		}
+
+		if (!domain_can_read(conn))
+			break;
+		if (n == DOMAIN_BATCH) {
+			/* Give the others a go: we'll be back. */
+			conn_ready(conn);
+			break;
+		}
+
+		talloc_increase_ref_count(conn);
+		handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+	}
+
+	domain_notify(conn);
+}
+
+static void handle_socket(struct connection *conn)
+{
+	short revents = conn->src.revents, events;
+
+	conn->src.revents = 0;
+
+	if (revents & ~(POLLIN|POLLOUT)) {
+		talloc_free(conn);
+		return;
+	}
+
+	if (revents & POLLIN) {
+		talloc_increase_ref_count(conn);
+		handle_input(conn);
+		if (talloc_free(conn) == 0)
+			return;
+	}
+
+	if (revents & POLLOUT) {
+		talloc_increase_ref_count(conn);
+		handle_output(conn);
+		if (talloc_free(conn) == 0)
+			return;
+	}
+
+	/* Only wait for the socket to drain while we have output. */
+	events = POLLIN|POLLPRI;
+	if (!list_empty(&conn->out_list))
+		events |= POLLOUT;
+	if (events != conn->src.events)
+		change_fd(&conn->src, events);
+}
+
+static void handle_ready_connections(void)
+{
+	LIST_HEAD(ready);
+	struct connection *conn;
+
+	/* Anything which becomes ready meanwhile waits for the next pass. */
+	list_splice_init(&ready_connections, &ready);
+
+	/* Handling one connection can free others, so pick them off. */
+	while (!list_empty(&ready)) {
+		conn = list_entry(ready.next, struct connection, ready_list);
+		list_del_init(&conn->ready_list);
+
+		if (conn->domain)
+			handle_domain(conn);
+		else
+			handle_socket(conn);
+	}
+}
+
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 {
 	struct connection *new;
@@ -1365,7 +1575,8 @@ struct connection *new_connection(connwritefn_t *write, connreadfn_t *read)
 		return NULL;
 
 	new->fd = -1;
-	new->pollfd_idx = -1;
+	new->src.fd = -1;
+	INIT_LIST_HEAD(&new->ready_list);
 	new->write = write;
 	new->read = read;
 	new->can_write = true;
@@ -1439,15 +1650,20 @@ static void accept_connection(int sock, bool canwrite)
 		return;
 
 	conn = new_connection(writefd, readfd);
-	if (conn) {
-		conn->fd = fd;
-		conn->can_write = canwrite;
-	} else
+	if (!conn) {
 		close(fd);
+		return;
+	}
+
+	conn->fd = fd;
+	conn->can_write = canwrite;
+	if (!watch_fd(&conn->src, fd, POLLIN|POLLPRI, conn_event))
+		talloc_free(conn);
 }
 #endif
 
-static int tdb_flags;
+/* Seconds between snapshots of the store to disk (0: never). */
+static unsigned int snapshot_interval = 5;
 
 /* We create initial nodes manually. */
 static void manual_node(const char *name, const char *child)
@@ -1468,15 +1684,22 @@ static void manual_node(const char *name, const char *child)
 	talloc_free(node);
 }
 
+/* Carry on numbering generations after the highest one in the store. */
+static void seed_generation_(const char *name, TDB_DATA val, void *private)
+{
+	struct xs_tdb_record_hdr *hdr = (void *)val.dptr;
+
+	if (val.dsize >= sizeof(*hdr) && hdr->generation != NO_GENERATION &&
+	    hdr->generation >= generation)
+		generation = hdr->generation + 1;
+}
+
 static void setup_structure(void)
 {
 	char *tdbname;
 	tdbname = talloc_strdup(talloc_autofree_context(), xs_daemon_tdb());
 
-	if (!(tdb_flags & TDB_INTERNAL))
-		tdb_ctx = tdb_open(tdbname, 0, tdb_flags, O_RDWR, 0);
-
-	if (tdb_ctx) {
+	if (snapshot_interval && store_load(tdbname)) {
 		/* XXX When we make xenstored able to restart, this will have
 		   to become cleverer, checking for existing domains and not
 		   removing the corresponding entries, but for now xenstored
@@ -1493,6 +1716,7 @@ static void setup_structure(void)
 		*/
 		char *tlocal = talloc_strdup(NULL, "/local");
 
+		store_traverse(&seed_generation_, NULL);
 		check_store();
 
 		if (remove_local) {
@@ -1505,21 +1729,19 @@ static void setup_structure(void)
 		talloc_free(tlocal);
 	}
 	else {
-		tdb_ctx = tdb_open(tdbname, 7919, tdb_flags, O_RDWR|O_CREAT,
-				   0640);
-		if (!tdb_ctx)
-			barf_perror("Could not create tdb file %s", tdbname);
-
 		manual_node("/", "tool");
 		manual_node("/tool", "xenstored");
 		manual_node("/tool/xenstored", NULL);
 
 		check_store();
 	}
+
+	if (snapshot_interval)
+		store_snapshot_enable(tdbname, snapshot_interval);
 }
 
 
-static unsigned int hash_from_key_fn(void *k)
+unsigned int hash_from_key_fn(void *k)
 {
 	char *str = k;
 	unsigned int hash = 5381;
@@ -1532,7 +1754,7 @@ static unsigned int hash_from_key_fn(void *k)
 }
 
 
-static int keys_equal_fn(void *key1, void *key2)
+int keys_equal_fn(void *key1, void *key2)
 {
 	return 0 == strcmp((char *)key1, (char *)key2);
 }
@@ -1636,22 +1858,16 @@ static void check_store_(const char *name, struct hashtable *reachable)
 /**
  * Helper to clean_store below.
  */
-static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
-			void *private)
+static void clean_store_(const char *name, TDB_DATA val, void *private)
 {
 	struct hashtable *reachable = private;
-	char * name = talloc_strndup(NULL, key.dptr, key.dsize);
 
-	if (!hashtable_search(reachable, name)) {
+	if (!hashtable_search(reachable, (void *)name)) {
 		log("clean_store: '%s' is orphaned!", name);
 		if (recovery) {
-			tdb_delete(tdb, key);
+			store_delete(name);
 		}
 	}
-
-	talloc_free(name);
-
-	return 0;
 }
 
 
@@ -1661,7 +1877,7 @@ static int clean_store_(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
  */
 static void clean_store(struct hashtable *reachable)
 {
-	tdb_traverse(tdb_ctx, &clean_store_, reachable);
+	store_traverse(&clean_store_, reachable);
 }
 
 
@@ -1785,11 +2001,75 @@ static void usage(void)
 "  --no-recovery       to request that no recovery should be attempted when\n"
 "                      the store is corrupted (debug only),\n"
 "  --internal-db       store database in memory, not on disk\n"
+"  --snapshot-interval <secs>\n"
+"                      write the database to disk at most this often,\n"
 "  --preserve-local    to request that /local is preserved on start-up,\n"
 "  --verbose           to request verbose execution.\n");
 }
 
 
+static struct event_source sock_src = { .fd = -1 };
+static struct event_source ro_sock_src = { .fd = -1 };
+
+static void sock_event(struct event_source *src)
+{
+	if (src->revents & ~POLLIN)
+		barf_perror("%s poll failed",
+			    src == &sock_src ? "sock" : "ro sock");
+	accept_connection(src->fd, src == &sock_src);
+}
+
+static void reopen_log_event(struct event_source *src);
+
+static void watch_reopen_log_pipe(void)
+{
+	if (reopen_log_pipe[0] != -1 &&
+	    !watch_fd(&reopen_log_src, reopen_log_pipe[0], POLLIN|POLLPRI,
+		      reopen_log_event))
+		barf_perror("Could not watch log pipe");
+}
+
+static void reopen_log_event(struct event_source *src)
+{
+	char c;
+
+	if (src->revents & ~POLLIN) {
+		unwatch_fd(src);
+		close(reopen_log_pipe[0]);
+		close(reopen_log_pipe[1]);
+		init_pipe(reopen_log_pipe);
+		watch_reopen_log_pipe();
+	} else {
+		if (read(reopen_log_pipe[0], &c, 1) != 1)
+			barf_perror("read failed");
+		reopen_log();
+	}
+}
+
+static void xce_event(struct event_source *src)
+{
+	if (src->revents & ~POLLIN)
+		barf_perror("xce_handle poll failed");
+	handle_event();
+}
+
+static void initialize_fds(int sock, int ro_sock)
+{
+	if (sock != -1 &&
+	    !watch_fd(&sock_src, sock, POLLIN|POLLPRI, sock_event))
+		barf_perror("Could not watch socket");
+	if (ro_sock != -1 &&
+	    !watch_fd(&ro_sock_src, ro_sock, POLLIN|POLLPRI, sock_event))
+		barf_perror("Could not watch ro socket");
+
+	watch_reopen_log_pipe();
+
+	if (xce_handle != NULL &&
+	    !watch_fd(&xce_src, xc_evtchn_fd(xce_handle), POLLIN|POLLPRI,
+		      xce_event))
+		barf_perror("Could not watch event channel");
+}
+
 static struct option options[] = {
 	{ "no-domain-init", 0, NULL, 'D' },
 	{ "entry-nb", 1, NULL, 'E' },
@@ -1806,6 +2086,7 @@ static struct option options[] = {
 	{ "no-recovery", 0, NULL, 'R' },
 	{ "preserve-local", 0, NULL, 'L' },
 	{ "internal-db", 0, NULL, 'I' },
+	{ "snapshot-interval", 1, NULL, 'i' },
 	{ "verbose", 0, NULL, 'V' },
 	{ "watch-nb", 1, NULL, 'W' },
 	{ NULL, 0, NULL, 0 } };
@@ -1818,12 +2099,10 @@ int priv_domid = 0;
 int main(int argc, char *argv[])
 {
 	int opt, *sock, *ro_sock;
-	int sock_pollfd_idx = -1, ro_sock_pollfd_idx = -1;
 	bool dofork = true;
 	bool outputpid = false;
 	bool no_domain_init = false;
 	const char *pidfile = NULL;
-	int timeout;
 
 	while ((opt = getopt_long(argc, argv, "DE:F:HNPS:t:T:RLVW:", options,
 				  NULL)) != -1) {
@@ -1862,7 +2141,12 @@ int main(int argc, char *argv[])
 			tracefile = optarg;
 			break;
 		case 'I':
-			tdb_flags = TDB_INTERNAL|TDB_NOLOCK;
+			snapshot_interval = 0;
+			break;
+		case 'i':
+			snapshot_interval = strtoul(optarg, NULL, 10);
+			if (snapshot_interval == 0)
+				barf("--snapshot-interval must be positive");
 			break;
 		case 'V':
 			verbose = true;
@@ -1908,6 +2192,8 @@ int main(int argc, char *argv[])
 	init_sockets(&sock, &ro_sock);
 	init_pipe(reopen_log_pipe);
 
+	stats_reset();
+
 	/* Setup the database */
 	setup_structure();
 
@@ -1930,122 +2216,17 @@ int main(int argc, char *argv[])
 	signal(SIGHUP, trigger_reopen_log);
 
 	/* Get ready to listen to the tools. */
-	initialize_fds(*sock, &sock_pollfd_idx, *ro_sock, &ro_sock_pollfd_idx,
-		       &timeout);
+	initialize_fds(*sock, *ro_sock);
 
 	/* Tell the kernel we're up and running. */
 	xenbus_notify_running();
 
 	/* Main loop. */
 	for (;;) {
-		struct connection *conn, *next;
-
-		if (poll(fds, nr_fds, timeout) < 0) {
-			if (errno == EINTR)
-				continue;
-			barf_perror("Poll failed");
-		}
-
-		if (reopen_log_pipe0_pollfd_idx != -1) {
-			if (fds[reopen_log_pipe0_pollfd_idx].revents
-			    & ~POLLIN) {
-				close(reopen_log_pipe[0]);
-				close(reopen_log_pipe[1]);
-				init_pipe(reopen_log_pipe);
-			} else if (fds[reopen_log_pipe0_pollfd_idx].revents
-				   & POLLIN) {
-				char c;
-				if (read(reopen_log_pipe[0], &c, 1) != 1)
-					barf_perror("read failed");
-				reopen_log();
-			}
-			reopen_log_pipe0_pollfd_idx = -1;
-		}
-
-		if (sock_pollfd_idx != -1) {
-			if (fds[sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("sock poll failed");
-				break;
-			} else if (fds[sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*sock, true);
-				sock_pollfd_idx = -1;
-			}
-		}
-
-		if (ro_sock_pollfd_idx != -1) {
-			if (fds[ro_sock_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("ro sock poll failed");
-				break;
-			} else if (fds[ro_sock_pollfd_idx].revents & POLLIN) {
-				accept_connection(*ro_sock, false);
-				ro_sock_pollfd_idx = -1;
-			}
-		}
-
-		if (xce_pollfd_idx != -1) {
-			if (fds[xce_pollfd_idx].revents & ~POLLIN) {
-				barf_perror("xce_handle poll failed");
-				break;
-			} else if (fds[xce_pollfd_idx].revents & POLLIN) {
-				handle_event();
-				xce_pollfd_idx = -1;
-			}
-		}
-
-		next = list_entry(connections.next, typeof(*conn), list);
-		if (&next->list != &connections)
-			talloc_increase_ref_count(next);
-		while (&next->list != &connections) {
-			conn = next;
-
-			next = list_entry(conn->list.next,
-					  typeof(*conn), list);
-			if (&next->list != &connections)
-				talloc_increase_ref_count(next);
-
-			if (conn->domain) {
-				if (domain_can_read(conn))
-					handle_input(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-				if (domain_can_write(conn) &&
-				    !list_empty(&conn->out_list))
-					handle_output(conn);
-				if (talloc_free(conn) == 0)
-					continue;
-			} else {
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLIN)
-						handle_input(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				talloc_increase_ref_count(conn);
-
-				if (conn->pollfd_idx != -1) {
-					if (fds[conn->pollfd_idx].revents
-					    & ~(POLLIN|POLLOUT))
-						talloc_free(conn);
-					else if (fds[conn->pollfd_idx].revents
-						 & POLLOUT)
-						handle_output(conn);
-				}
-				if (talloc_free(conn) == 0)
-					continue;
-
-				conn->pollfd_idx = -1;
-			}
-		}
-
-		initialize_fds(*sock, &sock_pollfd_idx, *ro_sock,
-			       &ro_sock_pollfd_idx, &timeout);
+		wait_fds(list_empty(&ready_connections) ?
+			 store_snapshot_timeout() : 0);
+		store_snapshot_check();
+		handle_ready_connections();
 	}
 }
 
@@ -54,14 +54,33 @@ struct connection;
 typedef int connwritefn_t(struct connection *, const void *, unsigned int);
 typedef int connreadfn_t(struct connection *, void *, unsigned int);
 
+/* A file descriptor the main loop waits on. */
+struct event_source
+{
+	/* -1 if not being waited on. */
+	int fd;
+
+	/* What we wait for, and what happened (POLLIN etc.) */
+	short events;
+	short revents;
+
+	/* Index in the pollfd array, if we are using poll(). */
+	int idx;
+
+	/* Called from the main loop when revents is set. */
+	void (*handle)(struct event_source *src);
+};
+
 struct connection
 {
 	struct list_head list;
 
 	/* The file descriptor we came in on. */
 	int fd;
-	/* The index of pollfd in global pollfd array */
-	int pollfd_idx;
+	struct event_source src;
+
+	/* On the list of connections with work to do, if not empty. */
+	struct list_head ready_list;
 
 	/* Who am I? 0 for socket connections. */
 	unsigned int id;
@@ -101,8 +120,8 @@ extern struct list_head connections;
 struct node {
 	const char *name;
 
-	/* Database I came from */
-	TDB_CONTEXT *tdb;
+	/* Transaction I came from (NULL for the database proper) */
+	struct transaction *trans;
 
 	/* Parent (optional) */
 	struct node *parent;
@@ -147,18 +166,44 @@ struct node *get_node(struct connection *conn,
 		      const char *name,
 		      enum xs_perm_type perm);
 
-/* Get TDB context for this connection */
-TDB_CONTEXT *tdb_context(struct connection *conn);
+/* Layout of a node's record in the tdb. */
+struct xs_tdb_record_hdr {
+	/* Bumped on every write of the record, for transactions. */
+	uint64_t generation;
+	uint32_t num_perms;
+	uint32_t datalen;
+	uint32_t childlen;
+	struct xs_permissions perms[0];
+};
+
+/* Generation of a node which does not exist. */
+#define NO_GENERATION (~(uint64_t)0)
+
+/* Write a record to the database proper under a new generation. */
+bool store_record(const char *name, TDB_DATA data);
+
+/* Hash table helpers for tables keyed on (malloced) node names. */
+unsigned int hash_from_key_fn(void *k);
+int keys_equal_fn(void *key1, void *key2);
+
+/* Run write() on a copy of the daemon, so that the store can be written
+ * out while we carry on changing it.  (Synchronously if we cannot.) */
+bool snapshot_start(bool (*write)(void));
+
+/* Is a snapshot started by snapshot_start() still being written? */
+bool snapshot_running(void);
 
 /* Destructor for tdbs: required for transaction code */
 int destroy_tdb(void *_tdb);
 
-/* Replace the tdb: required for transaction code */
-bool replace_tdb(const char *newname, TDB_CONTEXT *newtdb);
-
 struct connection *new_connection(connwritefn_t *write, connreadfn_t *read);
 
 
+char *sockmsg_string(enum xsd_sockmsg_type type);
+
+/* Look at this connection next time round the main loop. */
+void conn_ready(struct connection *conn);
+
 /* Is this a valid node name? */
 bool is_valid_nodename(const char *node);
 
@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <sys/mman.h>
+#include <poll.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -69,6 +70,9 @@ struct domain
 	/* Have we noticed that this domain is shutdown? */
 	int shutdown;
 
+	/* Have we used the ring since we last sent an event? */
+	bool notify;
+
 	/* number of entry from this domain in the store */
 	int nbentry;
 
@@ -78,6 +82,46 @@ struct domain
 
 static LIST_HEAD(domains);
 
+/* Domains indexed by local event channel port, to route events. */
+static struct domain **port_domains;
+static unsigned int nr_port_domains;
+
+static void set_port_domain(evtchn_port_t port, struct domain *domain)
+{
+	struct domain **new;
+	unsigned int nr;
+
+	if (port >= nr_port_domains) {
+		if (!domain)
+			return;
+		nr = (port + 64) & ~63;
+		new = realloc(port_domains, nr * sizeof(*new));
+		/* find_domain_by_port() copes. */
+		if (!new)
+			return;
+		memset(new + nr_port_domains, 0,
+		       (nr - nr_port_domains) * sizeof(*new));
+		port_domains = new;
+		nr_port_domains = nr;
+	}
+
+	port_domains[port] = domain;
+}
+
+static struct domain *find_domain_by_port(evtchn_port_t port)
+{
+	struct domain *i;
+
+	if (port < nr_port_domains && port_domains[port])
+		return port_domains[port];
+
+	list_for_each_entry(i, &domains, list) {
+		if (i->port == port)
+			return i;
+	}
+	return NULL;
+}
+
 static bool check_indexes(XENSTORE_RING_IDX cons, XENSTORE_RING_IDX prod)
 {
 	return ((prod - cons) <= XENSTORE_RING_SIZE);
@@ -129,7 +173,7 @@ static int writechn(struct connection *conn,
 	xen_mb();
 	intf->rsp_prod += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -159,7 +203,7 @@ static int readchn(struct connection *conn, void *data, unsigned int len)
 	xen_mb();
 	intf->req_cons += len;
 
-	xc_evtchn_notify(xce_handle, conn->domain->port);
+	conn->domain->notify = true;
 
 	return len;
 }
@@ -191,6 +235,7 @@ static int destroy_domain(void *_domain)
 	list_del(&domain->list);
 
 	if (domain->port) {
+		set_port_domain(domain->port, NULL);
 		if (xc_evtchn_unbind(xce_handle, domain->port) == -1)
 			eprintf("> Unbinding port %i failed!\n", domain->port);
 	}
@@ -235,19 +280,35 @@ static void domain_cleanup(void)
 		fire_watches(NULL, "@releaseDomain", false);
 }
 
-/* We scan all domains rather than use the information given here. */
+/* Take all pending events, and mark the domains they are for as ready. */
 void handle_event(void)
 {
+	struct pollfd pfd = { .fd = xc_evtchn_fd(xce_handle), .events = POLLIN };
+	struct domain *domain;
 	evtchn_port_t port;
 
-	if ((port = xc_evtchn_pending(xce_handle)) == -1)
-		barf_perror("Failed to read from event fd");
+	do {
+		if ((port = xc_evtchn_pending(xce_handle)) == -1)
+			barf_perror("Failed to read from event fd");
 
-	if (port == virq_port)
-		domain_cleanup();
+		if (port == virq_port)
+			domain_cleanup();
+		else if ((domain = find_domain_by_port(port)) != NULL)
+			conn_ready(domain->conn);
 
-	if (xc_evtchn_unmask(xce_handle, port) == -1)
-		barf_perror("Failed to write to event fd");
+		if (xc_evtchn_unmask(xce_handle, port) == -1)
+			barf_perror("Failed to write to event fd");
+	} while (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN));
+}
+
+void domain_notify(struct connection *conn)
+{
+	struct domain *domain = conn->domain;
+
+	if (domain->notify) {
+		domain->notify = false;
+		xc_evtchn_notify(xce_handle, domain->port);
+	}
 }
 
 bool domain_can_read(struct connection *conn)
@@ -281,6 +342,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	domain = talloc(context, struct domain);
 	domain->port = 0;
 	domain->shutdown = 0;
+	domain->notify = false;
 	domain->domid = domid;
 	domain->path = talloc_domain_path(domain, domid);
 
@@ -292,6 +354,7 @@ static struct domain *new_domain(void *context, unsigned int domid,
 	if (rc == -1)
 	    return NULL;
 	domain->port = rc;
+	set_port_domain(domain->port, domain);
 
 	domain->conn = new_connection(writechn, readchn);
 	domain->conn->domain = domain;
@@ -392,10 +455,14 @@ void do_introduce(struct connection *conn, struct buffered_data *in)
 		fire_watches(NULL, "@introduceDomain", false);
 	} else if ((domain->mfn == mfn) && (domain->conn != conn)) {
 		/* Use XS_INTRODUCE for recreating the xenbus event-channel. */
-		if (domain->port)
+		if (domain->port) {
+			set_port_domain(domain->port, NULL);
 			xc_evtchn_unbind(xce_handle, domain->port);
+		}
 		rc = xc_evtchn_bind_interdomain(xce_handle, domid, port);
 		domain->port = (rc == -1) ? 0 : rc;
+		if (domain->port)
+			set_port_domain(domain->port, domain);
 		domain->remote_port = port;
 	} else {
 		send_error(conn, EINVAL);
@@ -617,6 +684,9 @@ static int dom0_init(void)
 
 	xc_evtchn_notify(xce_handle, dom0->port); 
 
+	/* Pick up anything already waiting on the ring. */
+	conn_ready(dom0->conn);
+
 	return 0; 
 }
 
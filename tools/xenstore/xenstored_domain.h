@@ -22,6 +22,9 @@
 
 void handle_event(void);
 
+/* Send the domain an event if we used its ring since the last one. */
+void domain_notify(struct connection *conn);
+
 /* domid, mfn, eventchn, path */
 void do_introduce(struct connection *conn, struct buffered_data *in);
 
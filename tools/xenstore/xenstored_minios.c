@@ -60,3 +60,13 @@ void unmap_xenbus(void *interface)
 	xc_gnttab_munmap(*xcg_handle, interface, 1);
 }
 
+bool snapshot_start(bool (*write)(void))
+{
+	return write();
+}
+
+bool snapshot_running(void)
+{
+	return false;
+}
+
@@ -19,6 +19,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -99,3 +100,35 @@ void unmap_xenbus(void *interface)
 {
 	munmap(interface, getpagesize());
 }
+
+static pid_t snapshot_pid = -1;
+
+bool snapshot_start(bool (*write)(void))
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		return false;
+	if (pid == 0) {
+		/* The child sees the store as it was at the fork. */
+		_exit(write() ? 0 : 1);
+	}
+
+	snapshot_pid = pid;
+	return true;
+}
+
+bool snapshot_running(void)
+{
+	int status;
+
+	if (snapshot_pid == -1)
+		return false;
+	if (waitpid(snapshot_pid, &status, WNOHANG) == 0)
+		return true;
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		eprintf("xenstored: snapshot failed (status %d)", status);
+	snapshot_pid = -1;
+	return false;
+}
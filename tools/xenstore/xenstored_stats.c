@@ -0,0 +1,269 @@
+/*
+    Statistics for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * Always-on counters, cheap enough to keep on the request path: a
+ * histogram of processing times per request type, request counts per
+ * domain, transaction outcomes and the number of watch events each change
+ * fires.  Histogram bucket b counts values below 2^b (bucket 0: zero).
+ * "xenstore-control stats [section]" prints them, "stats reset" clears
+ * them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "talloc.h"
+#include "utils.h"
+#include "xenstored_stats.h"
+
+#define NR_BUCKETS 24
+
+struct histogram
+{
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t bucket[NR_BUCKETS];
+};
+
+/* Request types we know about, plus one for anything else. */
+#define NR_TYPES (XS_RESET_WATCHES + 2)
+
+static struct histogram latency[NR_TYPES];	/* us */
+static uint64_t txn_events[STATS_TXN_NR];
+static struct histogram watch_fanout;		/* events */
+
+/* Requests per domain, indexed by domid. */
+static uint64_t *domain_requests;
+static unsigned int nr_domain_requests;
+
+static time_t stats_since;
+
+static void histogram_add(struct histogram *h, uint64_t val)
+{
+	unsigned int b = 0;
+	uint64_t v;
+
+	for (v = val; v && b < NR_BUCKETS - 1; v >>= 1)
+		b++;
+
+	h->count++;
+	h->total += val;
+	if (val > h->max)
+		h->max = val;
+	h->bucket[b]++;
+}
+
+/* Upper bound of the bucket holding the pct'th percentile. */
+static uint64_t histogram_pct(const struct histogram *h, unsigned int pct)
+{
+	uint64_t seen = 0, want = (h->count * pct + 99) / 100;
+	unsigned int b;
+
+	for (b = 0; b < NR_BUCKETS - 1; b++) {
+		seen += h->bucket[b];
+		if (seen >= want)
+			break;
+	}
+
+	return b ? 1ULL << b : 1;
+}
+
+void stats_request(unsigned int domid, enum xsd_sockmsg_type type,
+		   const struct timeval *start)
+{
+	struct timeval now;
+	int64_t us;
+	unsigned int nr;
+	uint64_t *new;
+
+	gettimeofday(&now, NULL);
+	us = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+	     (now.tv_usec - start->tv_usec);
+	/* The clock may have been stepped. */
+	if (us < 0)
+		us = 0;
+
+	if ((unsigned int)type >= NR_TYPES - 1)
+		type = NR_TYPES - 1;
+	histogram_add(&latency[type], us);
+
+	if (domid >= nr_domain_requests) {
+		nr = (domid + 64) & ~63;
+		new = realloc(domain_requests, nr * sizeof(*new));
+		if (!new)
+			return;
+		memset(new + nr_domain_requests, 0,
+		       (nr - nr_domain_requests) * sizeof(*new));
+		domain_requests = new;
+		nr_domain_requests = nr;
+	}
+	domain_requests[domid]++;
+}
+
+void stats_transaction(enum stats_txn_event event)
+{
+	txn_events[event]++;
+}
+
+void stats_watch_events(unsigned int events)
+{
+	histogram_add(&watch_fanout, events);
+}
+
+static char *dump_histogram(char *s, const struct histogram *h)
+{
+	unsigned int b;
+
+	s = talloc_asprintf_append(s, " hist");
+	for (b = 0; b < NR_BUCKETS; b++)
+		if (h->bucket[b])
+			s = talloc_asprintf_append(s, " <%llu:%llu",
+				b ? 1ULL << b : 1ULL,
+				(unsigned long long)h->bucket[b]);
+	return talloc_asprintf_append(s, "\n");
+}
+
+static char *dump_ops(char *s)
+{
+	const struct histogram *h;
+	unsigned int type;
+
+	s = talloc_asprintf_append(s, "ops (us):\n");
+	for (type = 0; type < NR_TYPES; type++) {
+		h = &latency[type];
+		if (!h->count)
+			continue;
+		s = talloc_asprintf_append(s,
+			"%s: n=%llu avg=%llu max=%llu p50<%llu p99<%llu",
+			type < NR_TYPES - 1 ? sockmsg_string(type) : "OTHER",
+			(unsigned long long)h->count,
+			(unsigned long long)(h->total / h->count),
+			(unsigned long long)h->max,
+			(unsigned long long)histogram_pct(h, 50),
+			(unsigned long long)histogram_pct(h, 99));
+		s = dump_histogram(s, h);
+	}
+	return s;
+}
+
+static int cmp_domain_requests(const void *a, const void *b)
+{
+	uint64_t ra = domain_requests[*(const unsigned int *)a];
+	uint64_t rb = domain_requests[*(const unsigned int *)b];
+
+	return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+/* Busiest first: the output is truncated to fit a reply. */
+static char *dump_domains(char *s)
+{
+	unsigned int *domids, nr = 0, i;
+	time_t secs = time(NULL) - stats_since;
+
+	if (secs <= 0)
+		secs = 1;
+
+	domids = talloc_array(s, unsigned int, nr_domain_requests + 1);
+	for (i = 0; i < nr_domain_requests; i++)
+		if (domain_requests[i])
+			domids[nr++] = i;
+	qsort(domids, nr, sizeof(*domids), cmp_domain_requests);
+
+	s = talloc_asprintf_append(s, "domains (requests, per second):\n");
+	for (i = 0; i < nr; i++)
+		s = talloc_asprintf_append(s, "%u: %llu %llu\n", domids[i],
+			(unsigned long long)domain_requests[domids[i]],
+			(unsigned long long)domain_requests[domids[i]] / secs);
+	talloc_free(domids);
+	return s;
+}
+
+static char *dump_transactions(char *s)
+{
+	return talloc_asprintf_append(s,
+		"transactions: started=%llu committed=%llu aborted=%llu "
+		"conflicts=%llu quota=%llu errors=%llu\n",
+		(unsigned long long)txn_events[STATS_TXN_START],
+		(unsigned long long)txn_events[STATS_TXN_COMMIT],
+		(unsigned long long)txn_events[STATS_TXN_ABORT],
+		(unsigned long long)txn_events[STATS_TXN_CONFLICT],
+		(unsigned long long)txn_events[STATS_TXN_QUOTA],
+		(unsigned long long)txn_events[STATS_TXN_ERROR]);
+}
+
+static char *dump_watches(char *s)
+{
+	const struct histogram *h = &watch_fanout;
+
+	s = talloc_asprintf_append(s,
+		"watch events per change: n=%llu total=%llu max=%llu",
+		(unsigned long long)h->count, (unsigned long long)h->total,
+		(unsigned long long)h->max);
+	return dump_histogram(s, h);
+}
+
+char *stats_dump(const void *ctx, const char *section)
+{
+	char *s = talloc_asprintf(ctx, "since %lu seconds ago\n",
+				  (unsigned long)(time(NULL) - stats_since));
+	size_t len;
+
+	if (!section || streq(section, "ops"))
+		s = dump_ops(s);
+	if (!section || streq(section, "transactions"))
+		s = dump_transactions(s);
+	if (!section || streq(section, "watches"))
+		s = dump_watches(s);
+	if (!section || streq(section, "domains"))
+		s = dump_domains(s);
+
+	/* Keep whole lines which fit in a reply. */
+	len = strlen(s);
+	if (len >= XENSTORE_PAYLOAD_MAX) {
+		len = XENSTORE_PAYLOAD_MAX - sizeof("...\n");
+		while (len && s[len - 1] != '\n')
+			len--;
+		strcpy(s + len, "...\n");
+	}
+
+	return s;
+}
+
+void stats_reset(void)
+{
+	memset(latency, 0, sizeof(latency));
+	memset(txn_events, 0, sizeof(txn_events));
+	memset(&watch_fanout, 0, sizeof(watch_fanout));
+	if (domain_requests)
+		memset(domain_requests, 0,
+		       nr_domain_requests * sizeof(*domain_requests));
+	stats_since = time(NULL);
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,51 @@
+/*
+    Statistics for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_STATS_H
+#define _XENSTORED_STATS_H
+
+#include <sys/time.h>
+#include "xenstored_core.h"
+
+enum stats_txn_event
+{
+	STATS_TXN_START,
+	STATS_TXN_COMMIT,
+	STATS_TXN_ABORT,
+	STATS_TXN_CONFLICT,	/* Commit failed with EAGAIN. */
+	STATS_TXN_QUOTA,	/* Start failed: too many transactions. */
+	STATS_TXN_ERROR,	/* Commit failed otherwise. */
+	STATS_TXN_NR
+};
+
+/* A request from domid of type took the time since start to process. */
+void stats_request(unsigned int domid, enum xsd_sockmsg_type type,
+		   const struct timeval *start);
+
+void stats_transaction(enum stats_txn_event event);
+
+/* A change fired this many watch events. */
+void stats_watch_events(unsigned int events);
+
+/* Print section ("ops", "domains", "transactions", "watches", or NULL
+ * for all of them) for XS_DEBUG, allocated off ctx. */
+char *stats_dump(const void *ctx, const char *section);
+
+void stats_reset(void);
+
+#endif /* _XENSTORED_STATS_H */
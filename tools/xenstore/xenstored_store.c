@@ -0,0 +1,299 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/*
+ * The records of all nodes live in a hash table keyed on the node name,
+ * in the same format they would have in a tdb.  The tdb file is only
+ * used to persist the store: it is read on start-up, and is rewritten in
+ * the background (see snapshot_start()) a few seconds after the store
+ * changed, so that it can be inspected with xs_tdb_dump.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "talloc.h"
+#include "list.h"
+#include "hashtable.h"
+#include "utils.h"
+#include "xenstored_store.h"
+
+struct record
+{
+	/* List of all records, for traversal. */
+	struct list_head list;
+
+	/* The node's name: owned by the hash table. */
+	char *name;
+
+	/* The record itself (malloced). */
+	TDB_DATA data;
+
+	/* Size of the buffer behind data.dptr. */
+	size_t size;
+};
+
+static struct hashtable *records;
+static LIST_HEAD(record_list);
+
+/* Snapshot file (NULL if we do not persist the store) and schedule. */
+static const char *snapshot_file;
+static unsigned int snapshot_interval;
+static time_t last_snapshot;
+static bool dirty;
+
+static struct record *find_record(const char *name)
+{
+	if (!records)
+		return NULL;
+	return hashtable_search(records, (void *)name);
+}
+
+TDB_DATA store_fetch(const void *ctx, const char *name)
+{
+	struct record *r = find_record(name);
+	TDB_DATA data = { NULL, 0 };
+
+	if (!r) {
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dptr = talloc_memdup(ctx, r->data.dptr, r->data.dsize);
+	if (!data.dptr) {
+		errno = ENOMEM;
+		return data;
+	}
+	data.dsize = r->data.dsize;
+	return data;
+}
+
+/* Find or create the record for name, with room for size bytes. */
+static struct record *get_record(const char *name, size_t size)
+{
+	struct record *r = find_record(name);
+	char *p;
+
+	if (!records) {
+		records = create_hashtable(1024, hash_from_key_fn,
+					   keys_equal_fn);
+		if (!records)
+			goto nomem;
+	}
+
+	if (r) {
+		/* Buffers only grow, so most updates reuse the old one. */
+		if (r->size < size) {
+			p = realloc(r->data.dptr, size);
+			if (!p)
+				goto nomem;
+			r->data.dptr = p;
+			r->size = size;
+		}
+		return r;
+	}
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		goto nomem;
+	r->name = strdup(name);
+	r->data.dptr = malloc(size ? size : 1);
+	if (!r->name || !r->data.dptr ||
+	    !hashtable_insert(records, r->name, r)) {
+		free(r->data.dptr);
+		free(r->name);
+		free(r);
+		goto nomem;
+	}
+	r->data.dsize = 0;
+	r->size = size;
+	list_add_tail(&r->list, &record_list);
+	dirty = true;
+	return r;
+
+ nomem:
+	errno = ENOMEM;
+	return NULL;
+}
+
+bool store_reserve(const char *name, size_t size)
+{
+	return get_record(name, size) != NULL;
+}
+
+bool store_write(const char *name, TDB_DATA data)
+{
+	struct record *r = get_record(name, data.dsize);
+
+	if (!r)
+		return false;
+
+	memcpy(r->data.dptr, data.dptr, data.dsize);
+	r->data.dsize = data.dsize;
+	dirty = true;
+	return true;
+}
+
+bool store_delete(const char *name)
+{
+	struct record *r = find_record(name);
+
+	if (!r) {
+		errno = ENOENT;
+		return false;
+	}
+
+	list_del(&r->list);
+	/* Frees r->name. */
+	hashtable_remove(records, r->name);
+	free(r->data.dptr);
+	free(r);
+	dirty = true;
+	return true;
+}
+
+void store_traverse(void (*fn)(const char *name, TDB_DATA data, void *priv),
+		    void *priv)
+{
+	struct record *r, *next;
+
+	list_for_each_entry_safe(r, next, &record_list, list)
+		fn(r->name, r->data, priv);
+}
+
+static int load_record(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA val,
+		       void *private)
+{
+	char *name = talloc_strndup(NULL, (char *)key.dptr, key.dsize);
+	bool *ok = private;
+
+	if (!name || !store_write(name, val))
+		*ok = false;
+	talloc_free(name);
+
+	return *ok ? 0 : -1;
+}
+
+bool store_load(const char *file)
+{
+	TDB_CONTEXT *tdb;
+	bool ok = true;
+
+	tdb = tdb_open(talloc_strdup(NULL, file), 0, 0, O_RDONLY, 0);
+	if (!tdb)
+		return false;
+
+	tdb_traverse(tdb, load_record, &ok);
+	tdb_close(tdb);
+	if (!ok)
+		barf_perror("Could not load %s", file);
+
+	return true;
+}
+
+/* Runs in the child started by snapshot_start(). */
+static bool write_snapshot(void)
+{
+	char *tmp = talloc_asprintf(NULL, "%s.snapshot", snapshot_file);
+	struct record *r;
+	TDB_CONTEXT *tdb;
+	TDB_DATA key;
+
+	tdb = tdb_open(tmp, 7919, TDB_NOLOCK, O_RDWR|O_CREAT|O_TRUNC, 0640);
+	if (!tdb) {
+		eprintf("xenstored: could not create snapshot %s", tmp);
+		return false;
+	}
+
+	list_for_each_entry(r, &record_list, list) {
+		key.dptr = (void *)r->name;
+		key.dsize = strlen(r->name);
+		if (tdb_store(tdb, key, r->data, TDB_INSERT) != 0) {
+			eprintf("xenstored: could not write %s to snapshot",
+				r->name);
+			tdb_close(tdb);
+			return false;
+		}
+	}
+
+	if (tdb_close(tdb) != 0 || rename(tmp, snapshot_file) != 0) {
+		eprintf("xenstored: could not write snapshot %s",
+			snapshot_file);
+		return false;
+	}
+
+	return true;
+}
+
+void store_snapshot_enable(const char *file, unsigned int interval)
+{
+	snapshot_file = file;
+	snapshot_interval = interval;
+	/* Write the initial state out straight away. */
+	last_snapshot = 0;
+	dirty = true;
+}
+
+int store_snapshot_timeout(void)
+{
+	time_t now;
+
+	/* Come back now and then to reap the last one. */
+	if (snapshot_running())
+		return 100;
+
+	if (!snapshot_file || !dirty)
+		return -1;
+
+	now = time(NULL);
+	if (now >= last_snapshot + snapshot_interval)
+		return 0;
+	return (last_snapshot + snapshot_interval - now) * 1000;
+}
+
+void store_snapshot_check(void)
+{
+	time_t now;
+
+	if (snapshot_running() || !snapshot_file || !dirty)
+		return;
+
+	now = time(NULL);
+	if (now < last_snapshot + snapshot_interval)
+		return;
+
+	last_snapshot = now;
+	dirty = false;
+	if (!snapshot_start(write_snapshot)) {
+		eprintf("xenstored: could not start snapshot");
+		dirty = true;
+	}
+}
+
+/*
+ * Local variables:
+ *  c-file-style: "linux"
+ *  indent-tabs-mode: t
+ *  c-indent-level: 8
+ *  c-basic-offset: 8
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,55 @@
+/*
+    In-memory node store for Xen Store Daemon.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _XENSTORED_STORE_H
+#define _XENSTORED_STORE_H
+
+#include "xenstored_core.h"
+
+/* Copy of a node's record, allocated off ctx: sets errno on failure. */
+TDB_DATA store_fetch(const void *ctx, const char *name);
+
+/* Create or replace a node's record. */
+bool store_write(const char *name, TDB_DATA data);
+
+/*
+ * Make sure a store_write() of up to size bytes to name cannot fail.  A
+ * node which did not exist is created with an empty record until then.
+ */
+bool store_reserve(const char *name, size_t size);
+
+/* Remove a node's record: fails with ENOENT if there was none. */
+bool store_delete(const char *name);
+
+/* Call fn for each record: fn may delete the record it is passed. */
+void store_traverse(void (*fn)(const char *name, TDB_DATA data, void *priv),
+		    void *priv);
+
+/* Read the records of a tdb file into the store: false if there is none. */
+bool store_load(const char *file);
+
+/* Snapshot the store into a tdb file, interval seconds after changes. */
+void store_snapshot_enable(const char *file, unsigned int interval);
+
+/* How long poll() may sleep before a snapshot is due (ms, or -1). */
+int store_snapshot_timeout(void);
+
+/* Start a snapshot if one is due. */
+void store_snapshot_check(void);
+
+#endif /* _XENSTORED_STORE_H */
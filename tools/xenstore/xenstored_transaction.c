@@ -18,6 +18,7 @@
 */
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -30,9 +31,12 @@
 #include <unistd.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_transaction.h"
 #include "xenstored_watch.h"
 #include "xenstored_domain.h"
+#include "xenstored_store.h"
+#include "xenstored_stats.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 
@@ -48,6 +52,33 @@ struct changed_node
 	bool recurse;
 };
 
+/*
+ * Transactions do not copy the store.  Instead, every node a transaction
+ * reads or writes is remembered here, together with the generation it had
+ * in the store when the transaction first looked at it.  Reads and writes
+ * within the transaction are then served from these entries.  On commit,
+ * the transaction only succeeds if none of the nodes it looked at have
+ * changed generation in the meantime, in which case its modifications are
+ * written to the store.
+ */
+struct accessed_node
+{
+	/* List of all nodes accessed by this transaction. */
+	struct list_head list;
+
+	/* The name of the node. */
+	char *node;
+
+	/* Generation in the store when first accessed (or NO_GENERATION). */
+	uint64_t generation;
+
+	/* The transaction's copy of the record (dptr NULL if none). */
+	TDB_DATA data;
+
+	/* Has the transaction changed (or deleted) the node? */
+	bool modified;
+};
+
 struct changed_domain
 {
 	/* List of all changed domains in the context of this transaction. */
@@ -68,12 +99,9 @@ struct transaction
 	/* Connection-local identifier for this transaction. */
 	uint32_t id;
 
-	/* Generation when transaction started. */
-	unsigned int generation;
-
-	/* TDB to work on, and filename */
-	TDB_CONTEXT *tdb;
-	char *tdb_name;
+	/* List of nodes read or written, and the same hashed on name. */
+	struct list_head accessed;
+	struct hashtable *accessed_hash;
 
 	/* List of changed nodes. */
 	struct list_head changes;
@@ -83,12 +111,154 @@ struct transaction
 };
 
 extern int quota_max_transaction;
-static unsigned int generation;
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans)
+/* First access to a node: remember what the store says about it now. */
+static struct accessed_node *access_node(struct transaction *trans,
+					 const char *name)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	char *key;
+
+	i = hashtable_search(trans->accessed_hash, (void *)name);
+	if (i)
+		return i;
+
+	i = talloc_zero(trans, struct accessed_node);
+	i->node = talloc_strdup(i, name);
+	i->data = store_fetch(i, i->node);
+	if (i->data.dptr) {
+		hdr = (void *)i->data.dptr;
+		i->generation = hdr->generation;
+	} else if (errno == ENOENT) {
+		i->generation = NO_GENERATION;
+	} else {
+		talloc_free(i);
+		errno = EIO;
+		return NULL;
+	}
+
+	/* The hash table frees its keys. */
+	key = strdup(i->node);
+	if (!key || !hashtable_insert(trans->accessed_hash, key, i)) {
+		free(key);
+		talloc_free(i);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list_add_tail(&i->list, &trans->accessed);
+	return i;
+}
+
+TDB_DATA transaction_fetch(struct transaction *trans, const char *name)
 {
-	return trans->tdb;
+	struct accessed_node *i = access_node(trans, name);
+	TDB_DATA data = { NULL, 0 };
+
+	if (!i)
+		return data;
+
+	if (!i->data.dptr) {
+		errno = ENOENT;
+		return data;
+	}
+
+	data.dsize = i->data.dsize;
+	data.dptr = talloc_memdup(NULL, i->data.dptr, data.dsize);
+	return data;
+}
+
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data)
+{
+	struct accessed_node *i = access_node(trans, name);
+
+	if (!i)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dsize = data.dsize;
+	i->data.dptr = talloc_memdup(i, data.dptr, data.dsize);
+	i->modified = true;
+	return true;
+}
+
+bool transaction_delete(struct transaction *trans, const char *name)
+{
+	struct accessed_node *i = access_node(trans, name);
+
+	if (!i)
+		return false;
+
+	talloc_free(i->data.dptr);
+	i->data.dptr = NULL;
+	i->data.dsize = 0;
+	i->modified = true;
+	return true;
+}
+
+/* Has anything the transaction looked at been changed under its feet? */
+static bool transaction_conflicts(struct transaction *trans)
+{
+	struct accessed_node *i;
+	struct xs_tdb_record_hdr *hdr;
+	uint64_t generation;
+	TDB_DATA data;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		data = store_fetch(NULL, i->node);
+		if (data.dptr) {
+			hdr = (void *)data.dptr;
+			generation = hdr->generation;
+			talloc_free(data.dptr);
+		} else
+			generation = NO_GENERATION;
+
+		if (generation != i->generation)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Other connections must see all of the transaction or none of it, so
+ * make room for every record before writing any: after that neither
+ * writes nor deletes can fail.  Must follow transaction_conflicts().
+ */
+static bool transaction_commit(struct transaction *trans)
+{
+	struct accessed_node *i, *j;
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified || !i->data.dptr)
+			continue;
+		if (!store_reserve(i->node, i->data.dsize))
+			goto undo;
+	}
+
+	list_for_each_entry(i, &trans->accessed, list) {
+		if (!i->modified)
+			continue;
+		if (i->data.dptr)
+			store_record(i->node, i->data);
+		else
+			store_delete(i->node);
+	}
+
+	return true;
+
+ undo:
+	/* Remove the empty records made for nodes the store lacked. */
+	list_for_each_entry(j, &trans->accessed, list) {
+		if (j == i)
+			break;
+		if (j->modified && j->data.dptr &&
+		    j->generation == NO_GENERATION)
+			store_delete(j->node);
+	}
+	return false;
 }
 
 /* Callers get a change node (which can fail) and only commit after they've
@@ -97,11 +267,9 @@ void add_change_node(struct transaction *trans, const char *node, bool recurse)
 {
 	struct changed_node *i;
 
-	if (!trans) {
-		/* They're changing the global database. */
-		generation++;
+	/* They're changing the global database. */
+	if (!trans)
 		return;
-	}
 
 	list_for_each_entry(i, &trans->changes, list)
 		if (streq(i->node, node))
@@ -117,10 +285,9 @@ static int destroy_transaction(void *_transaction)
 {
 	struct transaction *trans = _transaction;
 
+	/* The accessed nodes themselves belong to trans. */
+	hashtable_destroy(trans->accessed_hash, 0);
 	trace_destroy(trans, "transaction");
-	if (trans->tdb)
-		tdb_close(trans->tdb);
-	unlink(trans->tdb_name);
 	return 0;
 }
 
@@ -150,24 +317,22 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	}
 
 	if (conn->id && conn->transaction_started > quota_max_transaction) {
+		stats_transaction(STATS_TXN_QUOTA);
 		send_error(conn, ENOSPC);
 		return;
 	}
 
 	/* Attach transaction to input for autofree until it's complete */
 	trans = talloc(in, struct transaction);
+	INIT_LIST_HEAD(&trans->accessed);
 	INIT_LIST_HEAD(&trans->changes);
 	INIT_LIST_HEAD(&trans->changed_domains);
-	trans->generation = generation;
-	trans->tdb_name = talloc_asprintf(trans, "%s.%p",
-					  xs_daemon_tdb(), trans);
-	trans->tdb = tdb_copy(tdb_context(conn), trans->tdb_name);
-	if (!trans->tdb) {
-		send_error(conn, errno);
+	trans->accessed_hash = create_hashtable(16, hash_from_key_fn,
+						keys_equal_fn);
+	if (!trans->accessed_hash) {
+		send_error(conn, ENOMEM);
 		return;
 	}
-	/* Make it close if we go away. */
-	talloc_steal(trans, trans->tdb);
 
 	/* Pick an unused transaction identifier. */
 	do {
@@ -180,6 +345,7 @@ void do_transaction_start(struct connection *conn, struct buffered_data *in)
 	talloc_steal(conn, trans);
 	talloc_set_destructor(trans, destroy_transaction);
 	conn->transaction_started++;
+	stats_transaction(STATS_TXN_START);
 
 	snprintf(id_str, sizeof(id_str), "%u", trans->id);
 	send_reply(conn, XS_TRANSACTION_START, id_str, strlen(id_str)+1);
@@ -209,17 +375,17 @@ void do_transaction_end(struct connection *conn, const char *arg)
 	talloc_steal(arg, trans);
 
 	if (streq(arg, "T")) {
-		/* FIXME: Merge, rather failing on any change. */
-		if (trans->generation != generation) {
+		if (transaction_conflicts(trans)) {
+			stats_transaction(STATS_TXN_CONFLICT);
 			send_error(conn, EAGAIN);
 			return;
 		}
-		if (!replace_tdb(trans->tdb_name, trans->tdb)) {
-			send_error(conn, errno);
+		if (!transaction_commit(trans)) {
+			stats_transaction(STATS_TXN_ERROR);
+			send_error(conn, EIO);
 			return;
 		}
-		/* Don't close this: we won! */
-		trans->tdb = NULL;
+		stats_transaction(STATS_TXN_COMMIT);
 
 		/* fix domain entry for each changed domain */
 		list_for_each_entry(d, &trans->changed_domains, list)
@@ -228,8 +394,8 @@ void do_transaction_end(struct connection *conn, const char *arg)
 		/* Fire off the watches for everything that changed. */
 		list_for_each_entry(i, &trans->changes, list)
 			fire_watches(conn, i->node, i->recurse);
-		generation++;
-	}
+	} else
+		stats_transaction(STATS_TXN_ABORT);
 	send_ack(conn, XS_TRANSACTION_END);
 }
 
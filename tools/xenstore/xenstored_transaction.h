@@ -35,8 +35,13 @@ void transaction_entry_dec(struct transaction *trans, unsigned int domid);
 void add_change_node(struct transaction *trans, const char *node,
                      bool recurse);
 
-/* Return tdb context to use for this connection. */
-TDB_CONTEXT *tdb_transaction_context(struct transaction *trans);
+/* The transaction's view of a node: can fail, setting errno. */
+TDB_DATA transaction_fetch(struct transaction *trans, const char *name);
+
+/* Change a node within the transaction only. */
+bool transaction_store(struct transaction *trans, const char *name,
+		       TDB_DATA data);
+bool transaction_delete(struct transaction *trans, const char *name);
 
 void conn_delete_all_transactions(struct connection *conn);
 
@@ -21,15 +21,18 @@
 #include <sys/types.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <time.h>
 #include <assert.h>
 #include "talloc.h"
 #include "list.h"
+#include "hashtable.h"
 #include "xenstored_watch.h"
 #include "xenstore_lib.h"
 #include "utils.h"
 #include "xenstored_domain.h"
+#include "xenstored_stats.h"
 
 extern int quota_nb_watch_per_domain;
 
@@ -38,6 +41,12 @@ struct watch
 	/* Watches on this connection */
 	struct list_head list;
 
+	/* Watches on the same path, in the watch index. */
+	struct list_head node_list;
+
+	/* Connection which set this watch. */
+	struct connection *conn;
+
 	/* Current outstanding events applying to this watch. */
 	struct list_head events;
 
@@ -48,6 +57,113 @@ struct watch
 	char *node;
 };
 
+/*
+ * Watches are indexed by path, so that firing only visits the watches
+ * which can match.  There is a watch_node for every path which is watched,
+ * and for each of its parents; event paths ("@...") hang off "/", which
+ * matches everything.  All watch_nodes are also kept in a hash table on
+ * their full path.  A node only exists while there are watches on it or
+ * below it.
+ */
+struct watch_node
+{
+	/* Full path: also our key in watch_index, which owns it. */
+	char *path;
+
+	struct watch_node *parent;
+
+	/* Our siblings, and our children. */
+	struct list_head list;
+	struct list_head children;
+
+	/* Watches on exactly this path. */
+	struct list_head watches;
+};
+
+static struct hashtable *watch_index;
+
+static struct watch_node *find_watch_node(const char *path)
+{
+	if (!watch_index)
+		return NULL;
+	return hashtable_search(watch_index, (void *)path);
+}
+
+static char *watch_parent_path(const char *path)
+{
+	const char *slash = strrchr(path + 1, '/');
+
+	if (!slash)
+		return strdup("/");
+	return strndup(path, slash - path);
+}
+
+/* Find or create the watch_node for path, and any missing parents. */
+static struct watch_node *get_watch_node(const char *path)
+{
+	struct watch_node *node, *parent = NULL;
+	char *parent_path;
+
+	node = find_watch_node(path);
+	if (node)
+		return node;
+
+	if (!watch_index) {
+		watch_index = create_hashtable(64, hash_from_key_fn, keys_equal_fn);
+		if (!watch_index)
+			return NULL;
+	}
+
+	if (!streq(path, "/")) {
+		parent_path = watch_parent_path(path);
+		if (!parent_path)
+			return NULL;
+		parent = get_watch_node(parent_path);
+		free(parent_path);
+		if (!parent)
+			return NULL;
+	}
+
+	node = malloc(sizeof(*node));
+	if (node)
+		node->path = strdup(path);
+	if (!node || !node->path ||
+	    !hashtable_insert(watch_index, node->path, node)) {
+		if (node)
+			free(node->path);
+		free(node);
+		return NULL;
+	}
+
+	node->parent = parent;
+	INIT_LIST_HEAD(&node->children);
+	INIT_LIST_HEAD(&node->watches);
+	if (parent)
+		list_add_tail(&node->list, &parent->children);
+
+	return node;
+}
+
+/* Drop node and any parents which are no longer needed. */
+static void put_watch_node(struct watch_node *node)
+{
+	struct watch_node *parent;
+
+	while (node && list_empty(&node->watches) &&
+	       list_empty(&node->children)) {
+		parent = node->parent;
+		if (parent)
+			list_del(&node->list);
+		/* Frees node->path. */
+		hashtable_remove(watch_index, node->path);
+		free(node);
+		node = parent;
+	}
+}
+
+/* Events sent by the current fire_watches(). */
+static unsigned int events_sent;
+
 static void add_event(struct connection *conn,
 		      struct watch *watch,
 		      const char *name)
@@ -84,36 +200,83 @@ static void add_event(struct connection *conn,
 	strcpy(data + strlen(name) + 1, watch->token);
 	send_reply(conn, XS_WATCH_EVENT, data, len);
 	talloc_free(data);
+	events_sent++;
+}
+
+/* Fire the watches on node and on everything below it. */
+static void fire_watch_subtree(struct watch_node *node)
+{
+	struct watch_node *child;
+	struct watch *watch;
+
+	list_for_each_entry(watch, &node->watches, node_list)
+		add_event(watch->conn, watch, watch->node);
+
+	list_for_each_entry(child, &node->children, list)
+		fire_watch_subtree(child);
 }
 
 void fire_watches(struct connection *conn, const char *name, bool recurse)
 {
-	struct connection *i;
+	struct watch_node *node, *child;
 	struct watch *watch;
+	char *path, *p, c;
 
 	/* During transactions, don't fire watches. */
 	if (conn && conn->transaction)
 		return;
 
-	/* Create an event for each watch. */
-	list_for_each_entry(i, &connections, list) {
-		list_for_each_entry(watch, &i->watches, list) {
-			if (is_child(name, watch->node))
-				add_event(i, watch, name);
-			else if (recurse && is_child(watch->node, name))
-				add_event(i, watch, watch->node);
-		}
+	events_sent = 0;
+
+	/* Create an event for each watch on name, or on one of its parents. */
+	node = find_watch_node("/");
+	if (!node)
+		goto out;
+
+	list_for_each_entry(watch, &node->watches, node_list)
+		add_event(watch->conn, watch, name);
+
+	path = talloc_strdup(NULL, name);
+	for (p = path + 1; !streq(path, "/"); p++) {
+		p += strcspn(p, "/");
+		c = *p;
+		*p = '\0';
+		node = find_watch_node(path);
+		*p = c;
+		if (!node)
+			break;
+
+		list_for_each_entry(watch, &node->watches, node_list)
+			add_event(watch->conn, watch, name);
+
+		if (!c)
+			break;
 	}
+	talloc_free(path);
+
+	/* And, when removing, for each watch below it. */
+	if (recurse && node)
+		list_for_each_entry(child, &node->children, list)
+			fire_watch_subtree(child);
+
+ out:
+	stats_watch_events(events_sent);
 }
 
 static int destroy_watch(void *_watch)
 {
+	struct watch *watch = _watch;
+	struct watch_node *node = find_watch_node(watch->node);
+
+	list_del(&watch->node_list);
+	put_watch_node(node);
 	trace_destroy(_watch, "watch");
 	return 0;
 }
 
 void do_watch(struct connection *conn, struct buffered_data *in)
 {
+	struct watch_node *node;
 	struct watch *watch;
 	char *vec[2];
 	bool relative;
@@ -153,7 +316,14 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 		return;
 	}
 
+	node = get_watch_node(vec[0]);
+	if (!node) {
+		send_error(conn, ENOMEM);
+		return;
+	}
+
 	watch = talloc(conn, struct watch);
+	watch->conn = conn;
 	watch->node = talloc_strdup(watch, vec[0]);
 	watch->token = talloc_strdup(watch, vec[1]);
 	if (relative)
@@ -165,6 +335,7 @@ void do_watch(struct connection *conn, struct buffered_data *in)
 
 	domain_watch_inc(conn);
 	list_add_tail(&watch->list, &conn->watches);
+	list_add_tail(&watch->node_list, &node->watches);
 	trace_create(watch, "watch");
 	talloc_set_destructor(watch, destroy_watch);
 	send_ack(conn, XS_WATCH);
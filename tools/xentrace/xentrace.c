@@ -25,12 +25,20 @@
 #include <assert.h>
 #include <sys/poll.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include <xen/xen.h>
 #include <xen/trace.h>
 
 #include <xenctrl.h>
 
+/* *BSD has no O_LARGEFILE */
+#ifndef O_LARGEFILE
+#define O_LARGEFILE	0
+#endif
+
 #define PERROR(_m, _a...)                                       \
 do {                                                            \
     int __saved_errno = errno;                                  \
@@ -57,9 +65,15 @@ typedef struct settings_st {
     unsigned long disk_rsvd;
     unsigned long timeout;
     unsigned long memory_buffer;
+    char *merge_index;
+    unsigned int nr_filters;
+    struct {
+        uint32_t domid, vcpu;
+    } filters[XEN_SYSCTL_TBUF_MAX_FILTERS];
     uint8_t discard:1,
         disable_tracing:1,
-        start_disabled:1;
+        start_disabled:1,
+        per_cpu:1;
 } settings_t;
 
 struct t_struct {
@@ -329,6 +343,37 @@ fail:
     return;
 }
 
+/**
+ * check_disk_space - exit if writing @size more bytes to @fd would eat
+ *                    into the reserved disk space (--reserve-disk-space)
+ */
+static void check_disk_space(int fd, unsigned long size)
+{
+    struct statvfs stat;
+    unsigned long long freespace;
+
+    if ( opts.disk_rsvd == 0 )
+        return;
+
+    /* Check that filesystem has enough space. */
+    if ( fstatvfs (fd, &stat) )
+    {
+        fprintf(stderr, "Statfs failed!\n");
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
+
+    freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
+    freespace -= size;
+    freespace >>= 20; /* Convert to MB */
+
+    if ( freespace <= opts.disk_rsvd )
+    {
+        fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
+        exit (EXIT_FAILURE);
+    }
+}
+
 /**
  * write_buffer - write a section of the trace buffer
  * @cpu      - source buffer CPU ID
@@ -343,35 +388,10 @@ fail:
 static void write_buffer(unsigned int cpu, unsigned char *start, int size,
                          int total_size)
 {
-    struct statvfs stat;
     size_t written = 0;
     
-    if ( opts.memory_buffer == 0 && opts.disk_rsvd != 0 )
-    {
-        unsigned long long freespace;
-
-        /* Check that filesystem has enough space. */
-        if ( fstatvfs (outfd, &stat) )
-        {
-            fprintf(stderr, "Statfs failed!\n");
-            goto fail;
-        }
-
-        freespace = stat.f_frsize * (unsigned long long)stat.f_bfree;
-
-        if ( total_size )
-            freespace -= total_size;
-        else
-            freespace -= size;
-
-        freespace >>= 20; /* Convert to MB */
-
-        if ( freespace <= opts.disk_rsvd )
-        {
-            fprintf(stderr, "Disk space limit reached (free space: %lluMB, limit: %luMB).\n", freespace, opts.disk_rsvd);
-            exit (EXIT_FAILURE);
-        }
-    }
+    if ( opts.memory_buffer == 0 )
+        check_disk_space(outfd, total_size ? total_size : size);
 
     /* Write a CPU_BUF record on each buffer "window" written.  Wrapped
      * windows may involve two writes, so only write the record on the
@@ -546,6 +566,35 @@ static void set_mask(uint32_t mask, int type)
     }
 }
 
+/**
+ * set_filters - replace the domain/vcpu filters in HV with ours (if any)
+ */
+static void set_filters(void)
+{
+    unsigned int i;
+
+    if ( xc_tbuf_clear_filters(xc_handle) != 0 )
+    {
+        PERROR("Failure to clear domain filters");
+        exit(EXIT_FAILURE);
+    }
+
+    for ( i = 0; i < opts.nr_filters; i++ )
+    {
+        if ( xc_tbuf_add_filter(xc_handle, opts.filters[i].domid,
+                                opts.filters[i].vcpu) != 0 )
+        {
+            PERROR("Failure to add domain filter");
+            exit(EXIT_FAILURE);
+        }
+        if ( opts.filters[i].vcpu == XEN_SYSCTL_TBUF_ANY_VCPU )
+            fprintf(stderr, "tracing domain %u\n", opts.filters[i].domid);
+        else
+            fprintf(stderr, "tracing domain %u vcpu %u\n",
+                    opts.filters[i].domid, opts.filters[i].vcpu);
+    }
+}
+
 /**
  * get_num_cpus - get the number of logical CPUs
  */
@@ -625,6 +674,371 @@ static void wait_for_event_or_timeout(unsigned long milliseconds)
     }
 }
 
+/******************************************************************************
+ * Per-CPU consumers
+ *
+ * With --per-cpu, each trace buffer is drained by its own thread straight
+ * from the shared mapping into FILE.cpuN, so one busy CPU can no longer hold
+ * up the others while its window is copied out.  Every window written is
+ * announced by a fixed size record in FILE, the index; index slots are
+ * claimed with an atomic add and filled with pwrite(), so readers never
+ * serialise on each other.  Each FILE.cpuN is a valid trace on its own;
+ * xentrace --merge=FILE turns the set back into a single ordinary trace.
+ *****************************************************************************/
+
+#define PCPU_INDEX_MAGIC   0x69707478 /* "xtpi" */
+#define PCPU_INDEX_VERSION 1
+
+struct pcpu_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nr_cpus;
+    uint32_t pad;
+};
+
+struct pcpu_index_record {
+    uint32_t cpu;
+    uint32_t size;      /* bytes, including the cpu change record */
+    uint64_t offset;    /* of the window in FILE.cpuN */
+};
+
+struct pcpu_reader {
+    pthread_t thread;
+    unsigned int cpu;
+    int fd;
+    uint64_t offset;    /* end of FILE.cpuN */
+    struct t_buf *meta;
+    unsigned char *data;
+    unsigned long data_size;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned long kicks;    /* bumped on every VIRQ_TBUF or poll timeout */
+    int stop;
+    uint64_t index_tail;    /* next free byte in the index */
+} pcpu = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void pcpu_file_name(char *buf, size_t len, const char *index,
+                           unsigned int cpu)
+{
+    if ( snprintf(buf, len, "%s.cpu%u", index, cpu) >= len )
+    {
+        fprintf(stderr, "Output file name too long: %s\n", index);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * pcpu_drain - copy one window out of a CPU's trace buffer
+ *
+ * Returns non-zero if there was anything to copy.
+ */
+static int pcpu_drain(struct pcpu_reader *r)
+{
+    unsigned long start_offset, end_offset, window_size, cons, prod;
+    struct cpu_change_record rec;
+    struct pcpu_index_record idx;
+    struct iovec iov[3];
+    int iovcnt;
+    ssize_t written;
+    uint64_t pos;
+
+    cons = r->meta->cons;
+    prod = r->meta->prod;
+    xen_rmb(); /* read prod, then read item. */
+
+    if ( cons == prod )
+        return 0;
+
+    assert(cons < 2*r->data_size);
+    assert(prod < 2*r->data_size);
+
+    if ( prod < cons )
+        window_size = (prod + 2*r->data_size) - cons;
+    else
+        window_size = prod - cons;
+    assert(window_size > 0);
+    assert(window_size <= r->data_size);
+
+    start_offset = cons % r->data_size;
+    end_offset = prod % r->data_size;
+
+    rec.header = CPU_CHANGE_HEADER;
+    rec.data.cpu = r->cpu;
+    rec.data.window_size = window_size;
+
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = r->data + start_offset;
+    if ( end_offset > start_offset )
+    {
+        iov[1].iov_len = window_size;
+        iovcnt = 2;
+    }
+    else
+    {
+        iov[1].iov_len = r->data_size - start_offset;
+        iov[2].iov_base = r->data;
+        iov[2].iov_len = end_offset;
+        iovcnt = 3;
+    }
+
+    check_disk_space(r->fd, sizeof(rec) + window_size);
+
+    written = writev(r->fd, iov, iovcnt);
+    if ( written != sizeof(rec) + window_size )
+    {
+        fprintf(stderr, "Write failed on cpu%u! (size %zu, returned %zd)\n",
+                r->cpu, sizeof(rec) + window_size, written);
+        PERROR("Failed to write trace data");
+        exit(EXIT_FAILURE);
+    }
+
+    xen_mb(); /* read buffer, then update cons. */
+    r->meta->cons = prod;
+
+    idx.cpu = r->cpu;
+    idx.size = written;
+    idx.offset = r->offset;
+    r->offset += written;
+
+    pos = __sync_fetch_and_add(&pcpu.index_tail, sizeof(idx));
+    if ( pwrite(outfd, &idx, sizeof(idx), pos) != sizeof(idx) )
+    {
+        PERROR("Failed to write trace index");
+        exit(EXIT_FAILURE);
+    }
+
+    return 1;
+}
+
+static void *pcpu_reader_thread(void *arg)
+{
+    struct pcpu_reader *r = arg;
+    unsigned long seen = 0;
+    int stop;
+
+    for ( ; ; )
+    {
+        pthread_mutex_lock(&pcpu.lock);
+        while ( pcpu.kicks == seen && !pcpu.stop )
+            pthread_cond_wait(&pcpu.cond, &pcpu.lock);
+        seen = pcpu.kicks;
+        stop = pcpu.stop;
+        pthread_mutex_unlock(&pcpu.lock);
+
+        /*
+         * Keep draining while the producer keeps up with us, but take
+         * exactly one last pass once we have been told to stop.
+         */
+        while ( pcpu_drain(r) && !stop && !*(volatile int *)&pcpu.stop )
+            continue;
+
+        if ( stop )
+            break;
+    }
+
+    return NULL;
+}
+
+static void pcpu_kick(int stop)
+{
+    pthread_mutex_lock(&pcpu.lock);
+    pcpu.kicks++;
+    if ( stop )
+        pcpu.stop = 1;
+    pthread_cond_broadcast(&pcpu.cond);
+    pthread_mutex_unlock(&pcpu.lock);
+}
+
+/**
+ * monitor_tbufs_per_cpu - the --per-cpu flavour of monitor_tbufs()
+ */
+static int monitor_tbufs_per_cpu(struct t_struct *tbufs, unsigned int num,
+                                 unsigned long data_size)
+{
+    struct pcpu_index_header hdr = {
+        .magic = PCPU_INDEX_MAGIC,
+        .version = PCPU_INDEX_VERSION,
+        .nr_cpus = num,
+    };
+    struct pcpu_reader *readers;
+    char name[PATH_MAX];
+    sigset_t set, old;
+    unsigned int i;
+    int rc;
+
+    readers = calloc(num, sizeof(*readers));
+    if ( readers == NULL )
+    {
+        PERROR("Failed to allocate per-cpu readers");
+        exit(EXIT_FAILURE);
+    }
+
+    if ( write(outfd, &hdr, sizeof(hdr)) != sizeof(hdr) )
+    {
+        PERROR("Failed to write trace index");
+        exit(EXIT_FAILURE);
+    }
+    pcpu.index_tail = sizeof(hdr);
+
+    for ( i = 0; i < num; i++ )
+    {
+        pcpu_file_name(name, sizeof(name), opts.outfile, i);
+        readers[i].fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                             0644);
+        if ( readers[i].fd < 0 )
+        {
+            PERROR("Could not open output file %s", name);
+            exit(EXIT_FAILURE);
+        }
+        readers[i].cpu = i;
+        readers[i].meta = tbufs->meta[i];
+        readers[i].data = tbufs->data[i];
+        readers[i].data_size = data_size;
+    }
+
+    /* Leave signals to this thread, so that poll() notices them. */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    for ( i = 0; i < num; i++ )
+    {
+        rc = pthread_create(&readers[i].thread, NULL, pcpu_reader_thread,
+                            &readers[i]);
+        if ( rc )
+        {
+            errno = rc;
+            PERROR("Failed to start reader for cpu%u", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* Prime the readers, then wake them on every VIRQ_TBUF or timeout. */
+    pcpu_kick(0);
+    while ( !interrupted )
+    {
+        wait_for_event_or_timeout(opts.poll_sleep);
+        pcpu_kick(0);
+    }
+
+    /* Disable tracing, then have the readers go through everything once more */
+    if ( opts.disable_tracing )
+        disable_tbufs();
+    pcpu_kick(1);
+
+    for ( i = 0; i < num; i++ )
+    {
+        pthread_join(readers[i].thread, NULL);
+        close(readers[i].fd);
+    }
+
+    free(readers);
+    free(tbufs->meta);
+    free(tbufs->data);
+    close(outfd);
+
+    return 0;
+}
+
+/**
+ * merge_per_cpu - rebuild a single trace from a --per-cpu index
+ * @index:         name of the index written by --per-cpu
+ *
+ * Windows are copied to the output in the order the readers announced
+ * them, which is the order a single consumer would have written them in.
+ */
+static int merge_per_cpu(const char *index)
+{
+    struct pcpu_index_header hdr;
+    struct pcpu_index_record rec;
+    static char buf[1 << 16];
+    char name[PATH_MAX];
+    unsigned int i;
+    int ifd, *fds;
+    ssize_t len;
+
+    ifd = open(index, O_RDONLY | O_LARGEFILE);
+    if ( ifd < 0 )
+    {
+        PERROR("Could not open index %s", index);
+        return 1;
+    }
+
+    if ( read(ifd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+         hdr.magic != PCPU_INDEX_MAGIC || hdr.version != PCPU_INDEX_VERSION )
+    {
+        fprintf(stderr, "%s is not a per-cpu trace index\n", index);
+        return 1;
+    }
+
+    fds = calloc(hdr.nr_cpus, sizeof(*fds));
+    if ( fds == NULL )
+    {
+        PERROR("Failed to allocate file descriptors");
+        return 1;
+    }
+
+    for ( i = 0; i < hdr.nr_cpus; i++ )
+    {
+        pcpu_file_name(name, sizeof(name), index, i);
+        fds[i] = open(name, O_RDONLY | O_LARGEFILE);
+        if ( fds[i] < 0 )
+        {
+            PERROR("Could not open %s", name);
+            return 1;
+        }
+    }
+
+    while ( read(ifd, &rec, sizeof(rec)) == sizeof(rec) )
+    {
+        uint64_t offset = rec.offset;
+        uint32_t left = rec.size;
+
+        /* A hole left behind by a reader which never filled its slot. */
+        if ( rec.size == 0 )
+            break;
+
+        if ( rec.cpu >= hdr.nr_cpus )
+        {
+            fprintf(stderr, "Bad cpu %u in index\n", rec.cpu);
+            return 1;
+        }
+
+        while ( left )
+        {
+            len = pread(fds[rec.cpu], buf,
+                        left < sizeof(buf) ? left : sizeof(buf), offset);
+            if ( len <= 0 )
+            {
+                fprintf(stderr, "Short read from cpu%u at %"PRIu64"\n",
+                        rec.cpu, offset);
+                return 1;
+            }
+            if ( write(outfd, buf, len) != len )
+            {
+                PERROR("Failed to write trace data");
+                return 1;
+            }
+            offset += len;
+            left -= len;
+        }
+    }
+
+    for ( i = 0; i < hdr.nr_cpus; i++ )
+        close(fds[i]);
+    free(fds);
+    close(ifd);
+    close(outfd);
+
+    return 0;
+}
+
 
 /**
  * monitor_tbufs - monitor the contents of tbufs and output to a file
@@ -672,6 +1086,9 @@ static int monitor_tbufs(void)
         for ( i = 0; i < num; i++ )
             meta[i]->cons = meta[i]->prod;
 
+    if ( opts.per_cpu )
+        return monitor_tbufs_per_cpu(tbufs, num, data_size);
+
     /* now, scan buffers for events */
     while ( 1 )
     {
@@ -776,6 +1193,9 @@ static void usage(void)
 "\n" \
 "  -c, --cpu-mask=c        Set cpu-mask\n" \
 "  -e, --evt-mask=e        Set evt-mask\n" \
+"  -d, --domain=d[:v]      Only trace events raised while domain d (vcpu v\n" \
+"                          only, if given) is running.  May be repeated, up\n" \
+"                          to " xstr(XEN_SYSCTL_TBUF_MAX_FILTERS) " times.  Use \"idle\" for the idle vcpus.\n" \
 "  -s, --poll-sleep=p      Set sleep time, p, in milliseconds between\n" \
 "                          polling the trace buffer for new data\n" \
 "                          (default " xstr(POLL_SLEEP_MILLIS) ").\n" \
@@ -802,6 +1222,11 @@ static void usage(void)
 "  -r  --reserve-disk-space=n Before writing trace records to disk, check to see\n" \
 "                          that after the write there will be at least n space\n" \
 "                          left on the disk.\n" \
+"  -P, --per-cpu           Drain each CPU's buffer from its own thread into\n" \
+"                          FILE.cpuN, and write an index of the windows to\n" \
+"                          FILE.  Needs an output file; see --merge.\n" \
+"  -m, --merge=index       Rebuild a single trace in FILE from an index and\n" \
+"                          the per-cpu files written by --per-cpu.\n" \
 "\n" \
 "This tool is used to capture trace buffer data from Xen. The\n" \
 "data is output in a binary format, in the following order:\n" \
@@ -886,6 +1311,27 @@ static long argtol(const char *restrict arg, int base)
     return val;
 }
 
+static void parse_filter(char *arg)
+{
+    char *vcpu = strchr(arg, ':');
+
+    if ( opts.nr_filters == XEN_SYSCTL_TBUF_MAX_FILTERS )
+    {
+        fprintf(stderr, "At most %u domain filters are supported\n",
+                XEN_SYSCTL_TBUF_MAX_FILTERS);
+        exit(EXIT_FAILURE);
+    }
+
+    if ( vcpu )
+        *vcpu++ = '\0';
+
+    opts.filters[opts.nr_filters].domid =
+        strcmp(arg, "idle") ? argtol(arg, 0) : DOMID_IDLE;
+    opts.filters[opts.nr_filters].vcpu =
+        vcpu ? argtol(vcpu, 0) : XEN_SYSCTL_TBUF_ANY_VCPU;
+    opts.nr_filters++;
+}
+
 static int parse_evtmask(char *arg)
 {
     /* search filtering class */
@@ -915,6 +1361,7 @@ static void parse_args(int argc, char **argv)
         { "poll-sleep",     required_argument, 0, 's' },
         { "cpu-mask",       required_argument, 0, 'c' },
         { "evt-mask",       required_argument, 0, 'e' },
+        { "domain",         required_argument, 0, 'd' },
         { "trace-buf-size", required_argument, 0, 'S' },
         { "reserve-disk-space", required_argument, 0, 'r' },
         { "time-interval",  required_argument, 0, 'T' },
@@ -922,12 +1369,14 @@ static void parse_args(int argc, char **argv)
         { "discard-buffers", no_argument,      0, 'D' },
         { "dont-disable-tracing", no_argument, 0, 'x' },
         { "start-disabled", no_argument,       0, 'X' },
+        { "per-cpu",        no_argument,       0, 'P' },
+        { "merge",          required_argument, 0, 'm' },
         { "help",           no_argument,       0, '?' },
         { "version",        no_argument,       0, 'V' },
         { 0, 0, 0, 0 }
     };
 
-    while ( (option = getopt_long(argc, argv, "t:s:c:e:S:r:T:M:DxX?V",
+    while ( (option = getopt_long(argc, argv, "t:s:c:e:d:S:r:T:M:m:DxXP?V",
                     long_options, NULL)) != -1) 
     {
         switch ( option )
@@ -943,6 +1392,10 @@ static void parse_args(int argc, char **argv)
         case 'e': /* set new event mask for filtering*/
             parse_evtmask(optarg);
             break;
+
+        case 'd': /* add a domain/vcpu filter */
+            parse_filter(optarg);
+            break;
         
         case 'S': /* set tbuf size (given in pages) */
             opts.tbuf_size = argtol(optarg, 0);
@@ -977,6 +1430,14 @@ static void parse_args(int argc, char **argv)
             opts.memory_buffer = sargtol(optarg, 0);
             break;
 
+        case 'P':
+            opts.per_cpu = 1;
+            break;
+
+        case 'm':
+            opts.merge_index = optarg;
+            break;
+
         default:
             usage();
         }
@@ -987,12 +1448,13 @@ static void parse_args(int argc, char **argv)
         usage();
 
     opts.outfile = argv[optind];
-}
 
-/* *BSD has no O_LARGEFILE */
-#ifndef O_LARGEFILE
-#define O_LARGEFILE	0
-#endif
+    if ( opts.per_cpu && opts.memory_buffer )
+    {
+        fprintf(stderr, "--per-cpu and --memory-buffer are mutually exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
 int main(int argc, char **argv)
 {
@@ -1010,6 +1472,18 @@ int main(int argc, char **argv)
 
     parse_args(argc, argv);
 
+    if ( opts.merge_index )
+    {
+        outfd = open(opts.outfile, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE,
+                     0644);
+        if ( outfd < 0 )
+        {
+            perror("Could not open output file");
+            exit(EXIT_FAILURE);
+        }
+        return merge_per_cpu(opts.merge_index);
+    }
+
     xc_handle = xc_interface_open(0,0,0);
     if ( !xc_handle ) 
     {
@@ -1023,6 +1497,9 @@ int main(int argc, char **argv)
     if ( opts.cpu_mask != 0 )
         set_mask(opts.cpu_mask, 1);
 
+    /* Don't inherit the filters of an earlier run. */
+    set_filters();
+
     if ( opts.timeout != 0 ) 
         alarm(opts.timeout);
 
@@ -1057,6 +1534,9 @@ int main(int argc, char **argv)
 
     ret = monitor_tbufs();
 
+    if ( opts.nr_filters != 0 && xc_tbuf_clear_filters(xc_handle) != 0 )
+        PERROR("Failure to clear domain filters");
+
     return ret;
 }
 /*
@@ -53,6 +53,13 @@ int mem_paging_memop(struct domain *d, xen_mem_event_op_t *mec)
     }
     break;
 
+    case XENMEM_paging_op_absent:
+    {
+        unsigned long gfn = mec->gfn;
+        return p2m_mem_paging_absent(d, gfn);
+    }
+    break;
+
     default:
         return -ENOSYS;
         break;
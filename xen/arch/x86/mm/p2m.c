@@ -1050,6 +1050,46 @@ int p2m_mem_paging_evict(struct domain *d, unsigned long gfn)
     return ret;
 }
 
+/**
+ * p2m_mem_paging_absent - Mark an unpopulated gfn as paged-out
+ * @d: guest domain
+ * @gfn: guest page which has no memory behind it yet
+ *
+ * Returns 0 for success or negative errno values if the gfn is in use.
+ *
+ * p2m_mem_paging_absent() is called by a pager which will supply the contents
+ * of a gfn which was never populated, such as the receiver of a post-copy
+ * migration.  The gfn becomes p2m_ram_paged without a page being allocated,
+ * so that a guest access raises a paging request and the pager can fill it
+ * with p2m_mem_paging_prep() as for an evicted page.
+ */
+int p2m_mem_paging_absent(struct domain *d, unsigned long gfn)
+{
+    p2m_type_t p2mt;
+    p2m_access_t a;
+    mfn_t mfn;
+    struct p2m_domain *p2m = p2m_get_hostp2m(d);
+    int ret = -EBUSY;
+
+    gfn_lock(p2m, gfn, 0);
+
+    mfn = p2m->get_entry(p2m, gfn, &p2mt, &a, 0, NULL);
+
+    /* Only gfns with nothing behind them, not even MMIO */
+    if ( mfn_valid(mfn) ||
+         ((p2mt != p2m_invalid) && (p2mt != p2m_mmio_dm)) )
+        goto out;
+
+    ret = p2m_set_entry(p2m, gfn, _mfn(INVALID_MFN), PAGE_ORDER_4K,
+                        p2m_ram_paged, p2m->default_access);
+    if ( ret == 0 )
+        atomic_inc(&d->paged_pages);
+
+ out:
+    gfn_unlock(p2m, gfn, 0);
+    return ret;
+}
+
 /**
  * p2m_mem_paging_drop_page - Tell pager to drop its reference to a paged page
  * @d: guest domain
@@ -324,6 +324,101 @@ int paging_mfn_is_dirty(struct domain *d, mfn_t gmfn)
 }
 
 
+/* Extents of dirty pfns being gathered for the _RANGES log-dirty ops. */
+struct log_dirty_ranges {
+    XEN_GUEST_HANDLE_64(xen_domctl_shadow_op_range_t) buf;
+    unsigned int nr, max;                /* extents written, room in buf */
+    unsigned long limit;                 /* pfns to report on */
+    xen_domctl_shadow_op_range_t cur;    /* extent being grown, if nr_pfns */
+    bool_t full;                         /* cur covers everything to limit */
+};
+
+static int log_dirty_add_range(struct log_dirty_ranges *r,
+                               unsigned long pfn, unsigned long nr)
+{
+    if ( r->full )
+        return 0;
+
+    if ( r->cur.nr_pfns )
+    {
+        if ( r->cur.first_pfn + r->cur.nr_pfns == pfn )
+        {
+            r->cur.nr_pfns += nr;
+            return 0;
+        }
+
+        /* Keep the last slot for cur, and let it run to the end. */
+        if ( r->nr + 1 >= r->max )
+        {
+            r->cur.nr_pfns = r->limit - r->cur.first_pfn;
+            r->full = 1;
+            return 0;
+        }
+
+        if ( copy_to_guest_offset(r->buf, r->nr, &r->cur, 1) )
+            return -EFAULT;
+        r->nr++;
+    }
+
+    r->cur.first_pfn = pfn;
+    r->cur.nr_pfns = nr;
+    return 0;
+}
+
+/* Turn the runs of set bits in the first nr bits of a leaf into extents. */
+static int log_dirty_leaf_ranges(struct log_dirty_ranges *r,
+                                 const unsigned long *l1,
+                                 unsigned long base, unsigned long nr)
+{
+    unsigned int i, start, len;
+    unsigned long word, inv;
+    int rv;
+
+    for ( i = 0; i < BITS_TO_LONGS(nr); i++ )
+    {
+        word = l1[i];
+        if ( likely(!word) )
+            continue;
+
+        if ( (i + 1) * BITS_PER_LONG > nr )
+            word &= (1UL << (nr % BITS_PER_LONG)) - 1;
+
+        while ( word )
+        {
+            start = find_first_set_bit(word);
+            inv = ~(word >> start);
+            len = inv ? find_first_set_bit(inv) : BITS_PER_LONG;
+
+            rv = log_dirty_add_range(r, base + i * BITS_PER_LONG + start, len);
+            if ( rv )
+                return rv;
+
+            if ( start + len == BITS_PER_LONG )
+                break;
+            word &= ~0UL << (start + len);
+        }
+    }
+
+    return 0;
+}
+
+/* Account for nr pfns from *pages on which have no leaf, all clean. */
+static int log_dirty_skip(struct xen_domctl_shadow_op *sc, int peek,
+                          unsigned long *pages, unsigned long nr)
+{
+    unsigned long bytes;
+
+    if ( nr > sc->pages - *pages )
+        nr = sc->pages - *pages;
+    bytes = (nr + 7) >> 3;
+
+    if ( peek && clear_guest_offset(sc->dirty_bitmap, *pages >> 3, bytes) )
+        return -EFAULT;
+
+    *pages += bytes << 3;
+    return 0;
+}
+
 /* Read a domain's log-dirty bitmap and stats.  If the operation is a CLEAN,
  * clear the bitmap and stats as well. */
 int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
@@ -333,11 +428,23 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     mfn_t *l4 = NULL, *l3 = NULL, *l2 = NULL;
     unsigned long *l1 = NULL;
     int i4, i3, i2;
+    struct log_dirty_ranges ranges = { .max = 0 };
+
+    if ( (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN_RANGES) ||
+         (sc->op == XEN_DOMCTL_SHADOW_OP_PEEK_RANGES) )
+    {
+        if ( !sc->nr_ranges )
+            return -EINVAL;
+        ranges.buf = sc->dirty_ranges;
+        ranges.max = sc->nr_ranges;
+        ranges.limit = sc->pages;
+    }
 
     domain_pause(d);
     paging_lock(d);
 
-    clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN);
+    clean = (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN) ||
+            (sc->op == XEN_DOMCTL_SHADOW_OP_CLEAN_RANGES);
 
     PAGING_DEBUG(LOGDIRTY, "log-dirty %s: dom %u faults=%u dirty=%u\n",
                  (clean) ? "clean" : "peek",
@@ -354,7 +461,7 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
         d->arch.paging.log_dirty.dirty_count = 0;
     }
 
-    if ( guest_handle_is_null(sc->dirty_bitmap) )
+    if ( ranges.max || guest_handle_is_null(sc->dirty_bitmap) )
         /* caller may have wanted just to clean the state or access stats. */
         peek = 0;
 
@@ -373,19 +480,36 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
           i4++ )
     {
         l3 = (l4 && mfn_valid(l4[i4])) ? map_domain_page(mfn_x(l4[i4])) : NULL;
+        if ( !l3 )
+        {
+            /* Deal with a whole missing subtree at once. */
+            rv = log_dirty_skip(sc, peek, &pages,
+                                (unsigned long)LOGDIRTY_NODE_ENTRIES *
+                                LOGDIRTY_NODE_ENTRIES * PAGE_SIZE * 8);
+            if ( rv )
+                goto out;
+            continue;
+        }
         for ( i3 = 0;
               (pages < sc->pages) && (i3 < LOGDIRTY_NODE_ENTRIES);
               i3++ )
         {
-            l2 = ((l3 && mfn_valid(l3[i3])) ?
-                  map_domain_page(mfn_x(l3[i3])) : NULL);
+            l2 = mfn_valid(l3[i3]) ? map_domain_page(mfn_x(l3[i3])) : NULL;
+            if ( !l2 )
+            {
+                rv = log_dirty_skip(sc, peek, &pages,
+                                    LOGDIRTY_NODE_ENTRIES * PAGE_SIZE * 8);
+                if ( rv )
+                    goto out;
+                continue;
+            }
             for ( i2 = 0;
                   (pages < sc->pages) && (i2 < LOGDIRTY_NODE_ENTRIES);
                   i2++ )
             {
                 unsigned int bytes = PAGE_SIZE;
-                l1 = ((l2 && mfn_valid(l2[i2])) ?
-                      map_domain_page(mfn_x(l2[i2])) : NULL);
+                l1 = (mfn_valid(l2[i2]) ? map_domain_page(mfn_x(l2[i2]))
+                                        : NULL);
                 if ( unlikely(((sc->pages - pages + 7) >> 3) < bytes) )
                     bytes = (unsigned int)((sc->pages - pages + 7) >> 3);
                 if ( likely(peek) )
@@ -400,19 +524,29 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
                         goto out;
                     }
                 }
+                else if ( ranges.max && l1 )
+                {
+                    rv = log_dirty_leaf_ranges(&ranges, l1, pages,
+                                               min_t(unsigned long,
+                                                     sc->pages - pages,
+                                                     PAGE_SIZE * 8));
+                    if ( rv )
+                        goto out;
+                }
                 pages += bytes << 3;
                 if ( l1 )
                 {
                     if ( clean )
                         clear_page(l1);
                     unmap_domain_page(l1);
+                    l1 = NULL;
                 }
             }
-            if ( l2 )
-                unmap_domain_page(l2);
+            unmap_domain_page(l2);
+            l2 = NULL;
         }
-        if ( l3 )
-            unmap_domain_page(l3);
+        unmap_domain_page(l3);
+        l3 = NULL;
     }
     if ( l4 )
         unmap_domain_page(l4);
@@ -420,6 +554,19 @@ int paging_log_dirty_op(struct domain *d, struct xen_domctl_shadow_op *sc)
     if ( pages < sc->pages )
         sc->pages = pages;
 
+    if ( ranges.cur.nr_pfns )
+    {
+        if ( copy_to_guest_offset(ranges.buf, ranges.nr, &ranges.cur, 1) )
+        {
+            /* The bitmap may be clean already; the caller must resync. */
+            rv = -EFAULT;
+            l4 = NULL;
+            goto out;
+        }
+        ranges.nr++;
+    }
+    sc->nr_ranges = ranges.nr;
+
     paging_unlock(d);
 
     if ( clean )
@@ -597,6 +744,8 @@ int paging_domctl(struct domain *d, xen_domctl_shadow_op_t *sc,
 
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_RANGES:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_RANGES:
         return paging_log_dirty_op(d, sc);
     }
 
@@ -123,6 +123,8 @@ struct vcpu *alloc_vcpu(
 
     spin_lock_init(&v->virq_lock);
 
+    grant_table_init_vcpu(v);
+
     tasklet_init(&v->continue_hypercall_tasklet, NULL, 0);
 
     if ( !zalloc_cpumask_var(&v->cpu_affinity) ||
@@ -79,11 +79,26 @@ struct gnttab_unmap_common {
     unsigned long frame;
     struct grant_mapping *map;
     struct domain *rd;
+    /* Host pin kept for *_unmap_complete to drop (GNTMAP_defer_unmap). */
+    u32 held_pin;
 };
 
 /* Number of unmap operations that are done between each tlb flush */
 #define GNTTAB_UNMAP_BATCH_SIZE 32
 
+/* Number of GNTMAP_defer_unmap unmaps a domain may have outstanding. */
+#define GNTTAB_DEFERRED_UNMAPS 256
+
+/*
+ * Longest a deferred unmap waits for the mapping domain to flush: each
+ * holds a reference on the granting domain, which would otherwise stay
+ * a zombie for as long as an idle backend makes no further unmaps.
+ */
+#define GNTTAB_DEFERRED_UNMAP_DELAY MILLISECS(10)
+
+/* Scratch space for gnttab_deferred_unmaps_flushed(). */
+static DEFINE_PER_CPU(cpumask_t, gnttab_flush_mask);
+
 
 #define PIN_FAIL(_lbl, _rc, _f, _a...)          \
     do {                                        \
@@ -141,12 +156,41 @@ struct active_grant_entry {
                                in the page.                           */
     unsigned      length:16; /* For sub-page grants, the length of the
                                 grant.                                */
+    spinlock_t    lock;      /* Protects the fields above.            */
 };
 
 #define ACGNT_PER_PAGE (PAGE_SIZE / sizeof(struct active_grant_entry))
 #define active_entry(t, e) \
     ((t)->active[(e)/ACGNT_PER_PAGE][(e)%ACGNT_PER_PAGE])
 
+/* Lock an active entry.  Caller must hold t's grant table lock. */
+static inline struct active_grant_entry *
+active_entry_acquire(struct grant_table *t, grant_ref_t e)
+{
+    struct active_grant_entry *act;
+
+    ASSERT(rw_is_locked(&t->lock));
+
+    act = &active_entry(t, e);
+    spin_lock(&act->lock);
+
+    return act;
+}
+
+static inline void active_entry_release(struct active_grant_entry *act)
+{
+    spin_unlock(&act->lock);
+}
+
+static void init_active_frame(struct active_grant_entry *frame)
+{
+    unsigned int i;
+
+    clear_page(frame);
+    for ( i = 0; i < ACGNT_PER_PAGE; i++ )
+        spin_lock_init(&frame[i].lock);
+}
+
 static inline void gnttab_flush_tlb(const struct domain *d)
 {
     if ( !paging_mode_external(d) )
@@ -217,85 +261,134 @@ double_gt_lock(struct grant_table *lgt, struct grant_table *rgt)
 {
     if ( lgt < rgt )
     {
-        spin_lock(&lgt->lock);
-        spin_lock(&rgt->lock);
+        write_lock(&lgt->lock);
+        write_lock(&rgt->lock);
     }
     else
     {
         if ( lgt != rgt )
-            spin_lock(&rgt->lock);
-        spin_lock(&lgt->lock);
+            write_lock(&rgt->lock);
+        write_lock(&lgt->lock);
     }
 }
 
 static inline void
 double_gt_unlock(struct grant_table *lgt, struct grant_table *rgt)
 {
-    spin_unlock(&lgt->lock);
+    write_unlock(&lgt->lock);
     if ( lgt != rgt )
-        spin_unlock(&rgt->lock);
+        write_unlock(&rgt->lock);
 }
 
+/*
+ * Free maptrack handles live on per-VCPU lists, so that map and unmap
+ * operations issued from different VCPUs of a backend domain do not all
+ * serialise on one lock.  Each handle records the VCPU whose list owns
+ * it and is always returned to that list.  The table itself grows a
+ * page at a time under maptrack_lock, the new page going to the VCPU
+ * which ran out.  Once the table cannot grow any further, a VCPU whose
+ * list is empty steals a free handle from one of its siblings.
+ */
 static inline int
 __get_maptrack_handle(
-    struct grant_table *t)
+    struct grant_table *t, struct vcpu *v)
 {
     unsigned int h;
-    if ( unlikely((h = t->maptrack_head) == MAPTRACK_TAIL) )
+
+    spin_lock(&v->maptrack_freelist_lock);
+    if ( unlikely((h = v->maptrack_head) == MAPTRACK_TAIL) )
+    {
+        spin_unlock(&v->maptrack_freelist_lock);
         return -1;
-    t->maptrack_head = maptrack_entry(t, h).ref;
+    }
+    v->maptrack_head = maptrack_entry(t, h).ref;
+    spin_unlock(&v->maptrack_freelist_lock);
+
     return h;
 }
 
+static int
+steal_maptrack_handle(
+    struct grant_table *t, struct vcpu *curr)
+{
+    const struct domain *d = curr->domain;
+    unsigned int i = curr->vcpu_id;
+    int handle;
+
+    while ( (i = (i + 1) % d->max_vcpus) != curr->vcpu_id )
+    {
+        if ( d->vcpu[i] == NULL )
+            continue;
+        handle = __get_maptrack_handle(t, d->vcpu[i]);
+        if ( handle != -1 )
+        {
+            maptrack_entry(t, handle).vcpu = curr->vcpu_id;
+            return handle;
+        }
+    }
+
+    return -1;
+}
+
 static inline void
 put_maptrack_handle(
-    struct grant_table *t, int handle)
+    struct domain *d, int handle)
 {
-    spin_lock(&t->lock);
-    maptrack_entry(t, handle).ref = t->maptrack_head;
-    t->maptrack_head = handle;
-    spin_unlock(&t->lock);
+    struct grant_table *t = d->grant_table;
+    struct vcpu *v = d->vcpu[maptrack_entry(t, handle).vcpu];
+
+    spin_lock(&v->maptrack_freelist_lock);
+    maptrack_entry(t, handle).ref = v->maptrack_head;
+    v->maptrack_head = handle;
+    spin_unlock(&v->maptrack_freelist_lock);
 }
 
 static inline int
 get_maptrack_handle(
     struct grant_table *lgt)
 {
-    int                   i;
-    grant_handle_t        handle;
+    struct vcpu          *curr = current;
+    int                   handle;
+    unsigned int          i, nr_frames;
     struct grant_mapping *new_mt;
-    unsigned int          new_mt_limit, nr_frames;
 
-    spin_lock(&lgt->lock);
+    handle = __get_maptrack_handle(lgt, curr);
+    if ( likely(handle != -1) )
+        return handle;
 
-    while ( unlikely((handle = __get_maptrack_handle(lgt)) == -1) )
-    {
-        nr_frames = nr_maptrack_frames(lgt);
-        if ( nr_frames >= max_nr_maptrack_frames() )
-            break;
+    spin_lock(&lgt->maptrack_lock);
 
-        new_mt = alloc_xenheap_page();
-        if ( !new_mt )
-            break;
+    nr_frames = nr_maptrack_frames(lgt);
+    if ( nr_frames >= max_nr_maptrack_frames() ||
+         (new_mt = alloc_xenheap_page()) == NULL )
+    {
+        spin_unlock(&lgt->maptrack_lock);
+        return steal_maptrack_handle(lgt, curr);
+    }
 
-        clear_page(new_mt);
+    clear_page(new_mt);
 
-        new_mt_limit = lgt->maptrack_limit + MAPTRACK_PER_PAGE;
+    /* Hand out the first new entry; the rest go to this VCPU's list. */
+    handle = lgt->maptrack_limit;
+    for ( i = 0; i < MAPTRACK_PER_PAGE; i++ )
+    {
+        new_mt[i].ref  = handle + i + 1;
+        new_mt[i].vcpu = curr->vcpu_id;
+    }
 
-        for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
-            new_mt[i - 1].ref = lgt->maptrack_limit + i;
-        new_mt[i - 1].ref = lgt->maptrack_head;
-        lgt->maptrack_head = lgt->maptrack_limit;
+    lgt->maptrack[nr_frames] = new_mt;
+    smp_wmb();
+    lgt->maptrack_limit      = handle + MAPTRACK_PER_PAGE;
 
-        lgt->maptrack[nr_frames] = new_mt;
-        smp_wmb();
-        lgt->maptrack_limit      = new_mt_limit;
+    spin_unlock(&lgt->maptrack_lock);
 
-        gdprintk(XENLOG_INFO, "Increased maptrack size to %u frames\n",
-                 nr_frames + 1);
-    }
+    spin_lock(&curr->maptrack_freelist_lock);
+    new_mt[MAPTRACK_PER_PAGE - 1].ref = curr->maptrack_head;
+    curr->maptrack_head = handle + 1;
+    spin_unlock(&curr->maptrack_freelist_lock);
 
-    spin_unlock(&lgt->lock);
+    gdprintk(XENLOG_INFO, "Increased maptrack size to %u frames\n",
+             nr_frames + 1);
 
     return handle;
 }
@@ -525,6 +618,7 @@ __gnttab_map_grant_ref(
     u32            old_pin;
     u32            act_pin;
     unsigned int   cache_flags;
+    bool_t         need_iommu_map;
     struct active_grant_entry *act = NULL;
     struct grant_mapping *mt;
     grant_entry_v1_t *sha1;
@@ -576,7 +670,7 @@ __gnttab_map_grant_ref(
     }
 
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -586,7 +680,7 @@ __gnttab_map_grant_ref(
     if ( unlikely(op->ref >= nr_grant_entries(rgt)))
         PIN_FAIL(unlock_out, GNTST_bad_gntref, "Bad ref (%d).\n", op->ref);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
     shah = shared_entry_header(rgt, op->ref);
     if (rgt->gt_version == 1) {
         sha1 = &shared_entry_v1(rgt, op->ref);
@@ -603,7 +697,7 @@ __gnttab_map_grant_ref(
          ((act->domid != ld->domain_id) ||
           (act->pin & 0x80808080U) != 0 ||
           (act->is_sub_page)) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x, or subpage %d\n",
                  act->domid, ld->domain_id, act->pin, act->is_sub_page);
 
@@ -614,7 +708,7 @@ __gnttab_map_grant_ref(
         if ( (rc = _set_status(rgt->gt_version, ld->domain_id,
                                op->flags & GNTMAP_readonly,
                                1, shah, act, status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         if ( !act->pin )
         {
@@ -649,7 +743,8 @@ __gnttab_map_grant_ref(
 
     cache_flags = (shah->flags & (GTF_PAT | GTF_PWT | GTF_PCD) );
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
 
     /* pg may be set, with a refcount included, from __get_paged_frame */
     if ( !pg )
@@ -725,12 +820,14 @@ __gnttab_map_grant_ref(
         goto undo_out;
     }
 
-    double_gt_lock(lgt, rgt);
-
-    if ( !paging_mode_translate(ld) && need_iommu(ld) )
+    need_iommu_map = !paging_mode_translate(ld) && need_iommu(ld);
+    if ( need_iommu_map )
     {
         unsigned int wrc, rdc;
         int err = 0;
+
+        double_gt_lock(lgt, rgt);
+
         /* We're not translated, so we know that gmfns and mfns are
            the same things, so the IOMMU entry is always 1-to-1. */
         mapcount(lgt, rd, frame, &wrc, &rdc);
@@ -756,12 +853,19 @@ __gnttab_map_grant_ref(
 
     TRACE_1D(TRC_MEM_PAGE_GRANT_MAP, op->dom);
 
+    /*
+     * Users of a maptrack entry check its flags before looking at the
+     * other fields, so it is enough to store the flags last.  mapcount()
+     * looks at all of them though, hence the lock when it may run.
+     */
     mt = &maptrack_entry(lgt, handle);
     mt->domid = op->dom;
     mt->ref   = op->ref;
-    mt->flags = op->flags;
+    smp_wmb();
+    write_atomic(&mt->flags, op->flags);
 
-    double_gt_unlock(lgt, rgt);
+    if ( need_iommu_map )
+        double_gt_unlock(lgt, rgt);
 
     op->dev_bus_addr = (u64)frame << PAGE_SHIFT;
     op->handle       = handle;
@@ -784,9 +888,9 @@ __gnttab_map_grant_ref(
         put_page(pg);
     }
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
-    act = &active_entry(rgt, op->ref);
+    act = active_entry_acquire(rgt, op->ref);
 
     if ( op->flags & GNTMAP_device_map )
         act->pin -= (op->flags & GNTMAP_readonly) ?
@@ -803,10 +907,13 @@ __gnttab_map_grant_ref(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     op->status = rc;
-    put_maptrack_handle(lgt, handle);
+    put_maptrack_handle(ld, handle);
     rcu_unlock_domain(rd);
 }
 
@@ -839,12 +946,15 @@ __gnttab_unmap_common(
     struct domain   *ld, *rd;
     struct grant_table *lgt, *rgt;
     struct active_grant_entry *act;
+    grant_ref_t      ref;
+    u32              pin;
     s16              rc = 0;
 
     ld = current->domain;
     lgt = ld->grant_table;
 
     op->frame = (unsigned long)(op->dev_bus_addr >> PAGE_SHIFT);
+    op->held_pin = 0;
 
     if ( unlikely(op->handle >= lgt->maptrack_limit) )
     {
@@ -854,18 +964,19 @@ __gnttab_unmap_common(
     }
 
     op->map = &maptrack_entry(lgt, op->handle);
-    spin_lock(&lgt->lock);
+    read_lock(&lgt->lock);
 
-    if ( unlikely(!op->map->flags) )
+    if ( unlikely(!read_atomic(&op->map->flags)) )
     {
-        spin_unlock(&lgt->lock);
+        read_unlock(&lgt->lock);
         gdprintk(XENLOG_INFO, "Zero flags for handle (%d).\n", op->handle);
         op->status = GNTST_bad_handle;
         return;
     }
 
     dom = op->map->domid;
-    spin_unlock(&lgt->lock);
+    ref = op->map->ref;
+    read_unlock(&lgt->lock);
 
     if ( unlikely((rd = rcu_lock_domain_by_id(dom)) == NULL) )
     {
@@ -886,18 +997,32 @@ __gnttab_unmap_common(
     TRACE_1D(TRC_MEM_PAGE_GRANT_UNMAP, dom);
 
     rgt = rd->grant_table;
-    double_gt_lock(lgt, rgt);
+    read_lock(&rgt->lock);
 
-    op->flags = op->map->flags;
-    if ( unlikely(!op->flags) || unlikely(op->map->domid != dom) )
+    if ( unlikely(rgt->gt_version == 0) ||
+         unlikely(ref >= nr_grant_entries(rgt)) )
     {
         gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
         rc = GNTST_bad_handle;
         goto unmap_out;
     }
 
+    /*
+     * The mapping's flags only change under the active entry lock of the
+     * grant it refers to, so recheck the handle once we hold it.
+     */
+    act = active_entry_acquire(rgt, ref);
+
+    op->flags = op->map->flags;
+    if ( unlikely(!(op->flags & (GNTMAP_device_map|GNTMAP_host_map))) ||
+         unlikely(op->map->domid != dom) || unlikely(op->map->ref != ref) )
+    {
+        gdprintk(XENLOG_WARNING, "Unstable handle %u\n", op->handle);
+        rc = GNTST_bad_handle;
+        goto act_release_out;
+    }
+
     op->rd = rd;
-    act = &active_entry(rgt, op->map->ref);
 
     if ( op->frame == 0 )
     {
@@ -906,7 +1031,7 @@ __gnttab_unmap_common(
     else
     {
         if ( unlikely(op->frame != act->frame) )
-            PIN_FAIL(unmap_out, GNTST_general_error,
+            PIN_FAIL(act_release_out, GNTST_general_error,
                      "Bad frame number doesn't match gntref. (%lx != %lx)\n",
                      op->frame, act->frame);
         if ( op->flags & GNTMAP_device_map )
@@ -925,46 +1050,58 @@ __gnttab_unmap_common(
         if ( (rc = replace_grant_host_mapping(op->host_addr,
                                               op->frame, op->new_addr, 
                                               op->flags)) < 0 )
-            goto unmap_out;
+            goto act_release_out;
 
         ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
         op->map->flags &= ~GNTMAP_host_map;
-        if ( op->flags & GNTMAP_readonly )
-            act->pin -= GNTPIN_hstr_inc;
+        pin = (op->flags & GNTMAP_readonly) ? GNTPIN_hstr_inc
+                                            : GNTPIN_hstw_inc;
+        /*
+         * An unmap which may be deferred keeps its pin, so that the grant
+         * can't be pointed at another frame before the completion has
+         * released this one.
+         */
+        if ( (op->flags & GNTMAP_defer_unmap) && !paging_mode_external(ld) )
+            op->held_pin = pin;
         else
-            act->pin -= GNTPIN_hstw_inc;
+            act->pin -= pin;
     }
 
-    if ( !paging_mode_translate(ld) && need_iommu(ld) )
+ act_release_out:
+    active_entry_release(act);
+ unmap_out:
+    read_unlock(&rgt->lock);
+
+    if ( rc == GNTST_okay && !paging_mode_translate(ld) && need_iommu(ld) )
     {
         unsigned int wrc, rdc;
         int err = 0;
+
+        double_gt_lock(lgt, rgt);
         mapcount(lgt, rd, op->frame, &wrc, &rdc);
         if ( (wrc + rdc) == 0 )
             err = iommu_unmap_page(ld, op->frame);
         else if ( wrc == 0 )
             err = iommu_map_page(ld, op->frame, op->frame, IOMMUF_readable);
+        double_gt_unlock(lgt, rgt);
+
         if ( err )
-        {
             rc = GNTST_general_error;
-            goto unmap_out;
-        }
     }
 
     /* If just unmapped a writable mapping, mark as dirtied */
-    if ( !(op->flags & GNTMAP_readonly) )
+    if ( rc == GNTST_okay && !(op->flags & GNTMAP_readonly) )
          gnttab_mark_dirty(rd, op->frame);
 
- unmap_out:
-    double_gt_unlock(lgt, rgt);
     op->status = rc;
     rcu_unlock_domain(rd);
 }
 
 static void
-__gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
+__gnttab_unmap_common_complete(struct domain *ld,
+                               struct gnttab_unmap_common *op)
 {
-    struct domain *ld, *rd = op->rd;
+    struct domain *rd = op->rd;
     struct grant_table *rgt;
     struct active_grant_entry *act;
     grant_entry_header_t *sha;
@@ -982,18 +1119,22 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
         return;
     }
 
-    ld = current->domain;
-
     rcu_lock_domain(rd);
     rgt = rd->grant_table;
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
-        goto unmap_out;
+        goto unlock_out;
 
-    act = &active_entry(rgt, op->map->ref);
+    act = active_entry_acquire(rgt, op->map->ref);
     sha = shared_entry_header(rgt, op->map->ref);
 
+    if ( op->held_pin )
+    {
+        ASSERT(act->pin & (GNTPIN_hstw_mask | GNTPIN_hstr_mask));
+        act->pin -= op->held_pin;
+    }
+
     if ( rgt->gt_version == 1 )
         status = &sha->flags;
     else
@@ -1005,7 +1146,7 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
          * Suggests that __gntab_unmap_common failed early and so
          * nothing further to do
          */
-        goto unmap_out;
+        goto act_release_out;
     }
 
     pg = mfn_to_page(op->frame);
@@ -1029,7 +1170,7 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
              * Suggests that __gntab_unmap_common failed in
              * replace_grant_host_mapping() so nothing further to do
              */
-            goto unmap_out;
+            goto act_release_out;
         }
 
         if ( !is_iomem_page(op->frame) ) 
@@ -1050,16 +1191,187 @@ __gnttab_unmap_common_complete(struct gnttab_unmap_common *op)
     if ( act->pin == 0 )
         gnttab_clear_flag(_GTF_reading, status);
 
- unmap_out:
-    spin_unlock(&rgt->lock);
+ act_release_out:
+    active_entry_release(act);
+ unlock_out:
+    read_unlock(&rgt->lock);
     if ( put_handle )
     {
         op->map->flags = 0;
-        put_maptrack_handle(ld->grant_table, op->handle);
+        put_maptrack_handle(ld, op->handle);
     }
     rcu_unlock_domain(rd);
 }
 
+/*
+ * Deferred unmaps.  The PTE of a GNTMAP_defer_unmap mapping is cleared as
+ * usual, but the rest of its unmap (dropping the page references, clearing
+ * GTF_reading/GTF_writing and freeing the handle) waits in the domain's
+ * queue until no CPU can still hold a stale translation for the frame.
+ * Until then the frame cannot be reused, so a stale translation is
+ * harmless; the mapping's pin is kept too, so that the grant stays on the
+ * same frame if it is mapped again meanwhile.  The queue is completed
+ * along with the next unmap batch that flushes the TLBs anyway, when it
+ * fills up, on GNTTABOP_flush_unmaps, or without any IPI at all once the
+ * TLB flush clock shows that every other CPU the domain has run on has
+ * flushed since the newest entry was queued.
+ */
+static bool_t
+gnttab_unmap_deferrable(const struct domain *ld,
+                        const struct gnttab_unmap_common *op)
+{
+    return op->rd != NULL && op->status == GNTST_okay &&
+           (op->flags & GNTMAP_defer_unmap) &&
+           (op->flags & GNTMAP_host_map) && op->host_addr != 0 &&
+           !paging_mode_external(ld);
+}
+
+/* Queue an unmap's completion.  Caller must hold lgt->unmap_lock. */
+static bool_t
+gnttab_defer_unmap(struct grant_table *lgt,
+                   const struct gnttab_unmap_common *op)
+{
+    ASSERT(spin_is_locked(&lgt->unmap_lock));
+
+    if ( lgt->deferred_unmaps == NULL )
+    {
+        lgt->deferred_unmaps = xmalloc_array(struct gnttab_unmap_common,
+                                             GNTTAB_DEFERRED_UNMAPS);
+        if ( lgt->deferred_unmaps == NULL )
+            return 0;
+    }
+
+    /* The granting domain must outlive the queued entry. */
+    if ( lgt->nr_deferred_unmaps == GNTTAB_DEFERRED_UNMAPS ||
+         !get_domain(op->rd) )
+        return 0;
+
+    if ( lgt->nr_deferred_unmaps == 0 )
+        set_timer(&lgt->unmap_timer, NOW() + GNTTAB_DEFERRED_UNMAP_DELAY);
+    lgt->deferred_unmaps[lgt->nr_deferred_unmaps++] = *op;
+    lgt->deferred_unmap_stamp = tlbflush_current_time();
+    perfc_incr(gnttab_unmap_deferred);
+
+    return 1;
+}
+
+/*
+ * Complete all queued unmaps.  Caller must hold ld's unmap_lock and have
+ * flushed the TLBs since the newest entry was queued.
+ */
+static void
+gnttab_complete_deferred_unmaps(struct domain *ld)
+{
+    struct grant_table *lgt = ld->grant_table;
+    struct gnttab_unmap_common *op;
+    unsigned int i;
+
+    ASSERT(spin_is_locked(&lgt->unmap_lock));
+
+    for ( i = 0; i < lgt->nr_deferred_unmaps; i++ )
+    {
+        op = &lgt->deferred_unmaps[i];
+        __gnttab_unmap_common_complete(ld, op);
+        put_domain(op->rd);
+    }
+    lgt->nr_deferred_unmaps = 0;
+}
+
+/* Can the queued unmaps be completed with no more than a local flush? */
+static bool_t
+gnttab_deferred_unmaps_flushed(const struct domain *ld)
+{
+    cpumask_t *mask = &this_cpu(gnttab_flush_mask);
+
+    cpumask_andnot(mask, ld->domain_dirty_cpumask,
+                   cpumask_of(smp_processor_id()));
+    tlbflush_filter(*mask, ld->grant_table->deferred_unmap_stamp);
+
+    return cpumask_empty(mask);
+}
+
+/* Flush the TLBs and complete all of ld's queued unmaps. */
+static void
+gnttab_flush_deferred_unmaps(struct domain *ld)
+{
+    struct grant_table *lgt = ld->grant_table;
+
+    spin_lock(&lgt->unmap_lock);
+    if ( lgt->nr_deferred_unmaps )
+    {
+        gnttab_flush_tlb(ld);
+        perfc_incr(gnttab_unmap_flush_ipi);
+        gnttab_complete_deferred_unmaps(ld);
+    }
+    spin_unlock(&lgt->unmap_lock);
+}
+
+static void
+gnttab_unmap_timer_fn(void *data)
+{
+    gnttab_flush_deferred_unmaps(data);
+}
+
+/*
+ * Complete a batch of unmaps of the current domain.  Those that may be
+ * deferred are queued; the rest need the TLBs flushed first, which lets
+ * the queue be completed too.
+ */
+static void
+gnttab_unmap_batch_complete(struct gnttab_unmap_common *common,
+                            unsigned int nr)
+{
+    struct domain *ld = current->domain;
+    struct grant_table *lgt = ld->grant_table;
+    unsigned int i, nr_now = 0;
+
+    for ( i = 0; i < nr; i++ )
+        if ( gnttab_unmap_deferrable(ld, &common[i]) )
+            break;
+
+    /* Fast path: nothing to defer and (probably) nothing queued. */
+    if ( i == nr && !read_atomic(&lgt->nr_deferred_unmaps) )
+    {
+        gnttab_flush_tlb(ld);
+        for ( i = 0; i < nr; i++ )
+            __gnttab_unmap_common_complete(ld, &common[i]);
+        return;
+    }
+
+    spin_lock(&lgt->unmap_lock);
+
+    for ( i = 0; i < nr; i++ )
+        if ( !gnttab_unmap_deferrable(ld, &common[i]) ||
+             !gnttab_defer_unmap(lgt, &common[i]) )
+            common[nr_now++] = common[i];
+
+    if ( nr_now )
+    {
+        gnttab_flush_tlb(ld);
+        if ( lgt->nr_deferred_unmaps )
+            perfc_incr(gnttab_unmap_flush_ipi);
+        gnttab_complete_deferred_unmaps(ld);
+    }
+    else if ( gnttab_deferred_unmaps_flushed(ld) )
+    {
+        flush_tlb_local();
+        perfc_incr(gnttab_unmap_flush_elided);
+        gnttab_complete_deferred_unmaps(ld);
+    }
+
+    spin_unlock(&lgt->unmap_lock);
+
+    for ( i = 0; i < nr_now; i++ )
+        __gnttab_unmap_common_complete(ld, &common[i]);
+}
+
+static long
+gnttab_flush_unmaps(void)
+{
+    gnttab_flush_deferred_unmaps(current->domain);
+    return 0;
+}
+
 static void
 __gnttab_unmap_grant_ref(
     struct gnttab_unmap_grant_ref *op,
@@ -1102,10 +1414,7 @@ gnttab_unmap_grant_ref(
             guest_handle_add_offset(uop, 1);
         }
 
-        gnttab_flush_tlb(current->domain);
-
-        for ( i = 0; i < partial_done; i++ )
-            __gnttab_unmap_common_complete(&(common[i]));
+        gnttab_unmap_batch_complete(common, partial_done);
 
         count -= c;
         done += c;
@@ -1117,10 +1426,7 @@ gnttab_unmap_grant_ref(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
-
-    for ( i = 0; i < partial_done; i++ )
-        __gnttab_unmap_common_complete(&(common[i]));
+    gnttab_unmap_batch_complete(common, partial_done);
     return -EFAULT;
 }
 
@@ -1165,10 +1471,7 @@ gnttab_unmap_and_replace(
             guest_handle_add_offset(uop, 1);
         }
         
-        gnttab_flush_tlb(current->domain);
-        
-        for ( i = 0; i < partial_done; i++ )
-            __gnttab_unmap_common_complete(&(common[i]));
+        gnttab_unmap_batch_complete(common, partial_done);
 
         count -= c;
         done += c;
@@ -1180,10 +1483,7 @@ gnttab_unmap_and_replace(
     return 0;
 
 fault:
-    gnttab_flush_tlb(current->domain);
-
-    for ( i = 0; i < partial_done; i++ )
-        __gnttab_unmap_common_complete(&(common[i]));
+    gnttab_unmap_batch_complete(common, partial_done);
     return -EFAULT;    
 }
 
@@ -1240,7 +1540,7 @@ gnttab_unpopulate_status_frames(struct domain *d, struct grant_table *gt)
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
 {
-    /* d's grant table lock must be held by the caller */
+    /* d's grant table lock must be write-locked by the caller */
 
     struct grant_table *gt = d->grant_table;
     unsigned int i;
@@ -1257,7 +1557,7 @@ gnttab_grow_table(struct domain *d, unsigned int req_nr_frames)
     {
         if ( (gt->active[i] = alloc_xenheap_page()) == NULL )
             goto active_alloc_failed;
-        clear_page(gt->active[i]);
+        init_active_frame(gt->active[i]);
     }
 
     /* Shared */
@@ -1345,7 +1645,7 @@ gnttab_setup_table(
     }
 
     gt = d->grant_table;
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
 
     if ( gt->gt_version == 0 )
         gt->gt_version = 1;
@@ -1373,7 +1673,7 @@ gnttab_setup_table(
     }
 
  out3:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
  out2:
     rcu_unlock_domain(d);
  out1:
@@ -1415,13 +1715,13 @@ gnttab_query_size(
         goto query_out_unlock;
     }
 
-    spin_lock(&d->grant_table->lock);
+    read_lock(&d->grant_table->lock);
 
     op.nr_frames     = nr_grant_frames(d->grant_table);
     op.max_nr_frames = max_nr_grant_frames;
     op.status        = GNTST_okay;
 
-    spin_unlock(&d->grant_table->lock);
+    read_unlock(&d->grant_table->lock);
 
  
  query_out_unlock:
@@ -1447,7 +1747,7 @@ gnttab_prepare_for_transfer(
     union grant_combo   scombo, prev_scombo, new_scombo;
     int                 retries = 0;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
     {
@@ -1498,11 +1798,11 @@ gnttab_prepare_for_transfer(
         scombo = prev_scombo;
     }
 
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return 1;
 
  fail:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return 0;
 }
 
@@ -1513,6 +1813,7 @@ gnttab_transfer(
     struct domain *d = current->domain;
     struct domain *e;
     struct page_info *page;
+    struct active_grant_entry *act;
     int i;
     struct gnttab_transfer gop;
     unsigned long mfn;
@@ -1694,7 +1995,8 @@ gnttab_transfer(
         TRACE_1D(TRC_MEM_PAGE_GRANT_TRANSFER, e->domain_id);
 
         /* Tell the guest about its new page frame. */
-        spin_lock(&e->grant_table->lock);
+        read_lock(&e->grant_table->lock);
+        act = active_entry_acquire(e->grant_table, gop.ref);
 
         if ( e->grant_table->gt_version == 1 )
         {
@@ -1712,7 +2014,8 @@ gnttab_transfer(
         shared_entry_header(e->grant_table, gop.ref)->flags |=
             GTF_transfer_completed;
 
-        spin_unlock(&e->grant_table->lock);
+        active_entry_release(act);
+        read_unlock(&e->grant_table->lock);
 
         rcu_unlock_domain(e);
 
@@ -1750,9 +2053,9 @@ __release_grant_for_copy(
     released_read = 0;
     released_write = 0;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     sha = shared_entry_header(rgt, gref);
     r_frame = act->frame;
 
@@ -1791,7 +2094,8 @@ __release_grant_for_copy(
         released_read = 1;
     }
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
 
     if ( td != rd )
     {
@@ -1808,7 +2112,7 @@ __release_grant_for_copy(
 
 /* The status for a grant indicates that we're taking more access than
    the pin requires.  Fix up the status to match the pin.  Called
-   under the domain's grant table lock. */
+   with the active entry locked. */
 /* Only safe on transitive grants.  Even then, note that we don't
    attempt to drop any pin on the referent grant. */
 static void __fixup_status_for_copy_pin(const struct active_grant_entry *act,
@@ -1849,7 +2153,7 @@ __acquire_grant_for_copy(
 
     *page = NULL;
 
-    spin_lock(&rgt->lock);
+    read_lock(&rgt->lock);
 
     if ( rgt->gt_version == 0 )
         PIN_FAIL(unlock_out, GNTST_general_error,
@@ -1859,7 +2163,7 @@ __acquire_grant_for_copy(
         PIN_FAIL(unlock_out, GNTST_bad_gntref,
                  "Bad grant reference %ld\n", gref);
 
-    act = &active_entry(rgt, gref);
+    act = active_entry_acquire(rgt, gref);
     shah = shared_entry_header(rgt, gref);
     if ( rgt->gt_version == 1 )
     {
@@ -1876,7 +2180,7 @@ __acquire_grant_for_copy(
 
     /* If already pinned, check the active domid and avoid refcnt overflow. */
     if ( act->pin && ((act->domid != ldom) || (act->pin & 0x80808080U) != 0) )
-        PIN_FAIL(unlock_out, GNTST_general_error,
+        PIN_FAIL(act_release_out, GNTST_general_error,
                  "Bad domain (%d != %d), or risk of counter overflow %08x\n",
                  act->domid, ldom, act->pin);
 
@@ -1887,7 +2191,7 @@ __acquire_grant_for_copy(
         if ( (rc = _set_status(rgt->gt_version, ldom,
                                readonly, 0, shah, act,
                                status) ) != GNTST_okay )
-             goto unlock_out;
+             goto act_release_out;
 
         td = rd;
         trans_gref = gref;
@@ -1918,21 +2222,24 @@ __acquire_grant_for_copy(
                 PIN_FAIL(unlock_out_clear, GNTST_general_error,
                          "transitive grant referenced bad domain %d\n",
                          trans_domid);
-            spin_unlock(&rgt->lock);
+            active_entry_release(act);
+            read_unlock(&rgt->lock);
 
             rc = __acquire_grant_for_copy(td, trans_gref, rd->domain_id,
                                           readonly, &grant_frame, page,
                                           &trans_page_off, &trans_length, 0);
 
-            spin_lock(&rgt->lock);
+            read_lock(&rgt->lock);
+            act = active_entry_acquire(rgt, gref);
             if ( rc != GNTST_okay ) {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                read_unlock(&rgt->lock);
                 return rc;
             }
 
-            /* We dropped the lock, so we have to check that nobody
+            /* We dropped the locks, so we have to check that nobody
                else tried to pin (or, for that matter, unpin) the
                reference in *this* domain.  If they did, just give up
                and try again. */
@@ -1940,7 +2247,8 @@ __acquire_grant_for_copy(
             {
                 __fixup_status_for_copy_pin(act, status);
                 rcu_unlock_domain(td);
-                spin_unlock(&rgt->lock);
+                active_entry_release(act);
+                read_unlock(&rgt->lock);
                 put_page(*page);
                 return __acquire_grant_for_copy(rd, gref, ldom, readonly,
                                                 frame, page, page_off, length,
@@ -2008,7 +2316,8 @@ __acquire_grant_for_copy(
     *length = act->length;
     *frame = act->frame;
 
-    spin_unlock(&rgt->lock);
+    active_entry_release(act);
+    read_unlock(&rgt->lock);
     return rc;
  
  unlock_out_clear:
@@ -2019,157 +2328,336 @@ __acquire_grant_for_copy(
     if ( !act->pin )
         gnttab_clear_flag(_GTF_reading, status);
 
+ act_release_out:
+    active_entry_release(act);
+
  unlock_out:
-    spin_unlock(&rgt->lock);
+    read_unlock(&rgt->lock);
     return rc;
 }
 
-static void
-__gnttab_copy(
-    struct gnttab_copy *op)
-{
-    struct domain *sd = NULL, *dd = NULL;
-    unsigned long s_frame, d_frame;
-    struct page_info *s_pg = NULL, *d_pg = NULL;
-    char *sp, *dp;
-    s16 rc = GNTST_okay;
-    int have_d_grant = 0, have_s_grant = 0;
-    int src_is_gref, dest_is_gref;
+/*
+ * One side of a grant copy.  Consecutive copy ops in a batch usually
+ * refer to the same domains and often to the same frames, so the domain
+ * reference, the grant pin, the page references and the mapping are kept
+ * across ops and only dropped when an op refers to something else or at
+ * the end of the batch.
+ */
+struct gnttab_copy_buf {
+    /* Guest provided. */
+    struct gnttab_copy_ptr ptr;
+    uint16_t len;
 
-    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
-         ((op->dest.offset + op->len) > PAGE_SIZE) )
-        PIN_FAIL(error_out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+    /* Mapped etc. */
+    struct domain *domain;
+    unsigned long frame;
+    struct page_info *page;
+    void *virt;
+    bool_t read_only;
+    bool_t have_grant;
+    bool_t have_type;
+};
 
-    src_is_gref = op->flags & GNTCOPY_source_gref;
-    dest_is_gref = op->flags & GNTCOPY_dest_gref;
+static int gnttab_copy_lock_domain(domid_t domid, unsigned int gref_flag,
+                                   struct gnttab_copy_buf *buf)
+{
+    int rc;
 
-    if ( (op->source.domid != DOMID_SELF && !src_is_gref ) ||
-         (op->dest.domid   != DOMID_SELF && !dest_is_gref)   )
-        PIN_FAIL(error_out, GNTST_permission_denied,
+    if ( domid != DOMID_SELF && !gref_flag )
+        PIN_FAIL(out, GNTST_permission_denied,
                  "only allow copy-by-mfn for DOMID_SELF.\n");
 
-    if ( op->source.domid == DOMID_SELF )
-        sd = rcu_lock_current_domain();
-    else if ( (sd = rcu_lock_domain_by_id(op->source.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->source.domid);
+    if ( domid == DOMID_SELF )
+        buf->domain = rcu_lock_current_domain();
+    else
+    {
+        buf->domain = rcu_lock_domain_by_id(domid);
+        if ( buf->domain == NULL )
+            PIN_FAIL(out, GNTST_bad_domain, "couldn't find %d\n", domid);
+    }
 
-    if ( op->dest.domid == DOMID_SELF )
-        dd = rcu_lock_current_domain();
-    else if ( (dd = rcu_lock_domain_by_id(op->dest.domid)) == NULL )
-        PIN_FAIL(error_out, GNTST_bad_domain,
-                 "couldn't find %d\n", op->dest.domid);
+    perfc_incr(gnttab_copy_domain_locks);
+    buf->ptr.domid = domid;
+    rc = GNTST_okay;
+ out:
+    return rc;
+}
 
-    rc = xsm_grant_copy(XSM_HOOK, sd, dd);
-    if ( rc )
+static void gnttab_copy_unlock_domains(struct gnttab_copy_buf *src,
+                                       struct gnttab_copy_buf *dest)
+{
+    if ( src->domain )
+    {
+        rcu_unlock_domain(src->domain);
+        src->domain = NULL;
+    }
+    if ( dest->domain )
+    {
+        rcu_unlock_domain(dest->domain);
+        dest->domain = NULL;
+    }
+}
+
+static int gnttab_copy_lock_domains(const struct gnttab_copy *op,
+                                    struct gnttab_copy_buf *src,
+                                    struct gnttab_copy_buf *dest)
+{
+    int rc;
+
+    rc = gnttab_copy_lock_domain(op->source.domid,
+                                 op->flags & GNTCOPY_source_gref, src);
+    if ( rc < 0 )
+        goto error;
+    rc = gnttab_copy_lock_domain(op->dest.domid,
+                                 op->flags & GNTCOPY_dest_gref, dest);
+    if ( rc < 0 )
+        goto error;
+
+    rc = xsm_grant_copy(XSM_HOOK, src->domain, dest->domain);
+    if ( rc < 0 )
     {
         rc = GNTST_permission_denied;
-        goto error_out;
+        goto error;
     }
+    return 0;
 
-    if ( src_is_gref )
+ error:
+    gnttab_copy_unlock_domains(src, dest);
+    return rc;
+}
+
+static void gnttab_copy_release_buf(struct gnttab_copy_buf *buf)
+{
+    if ( buf->virt )
     {
-        unsigned source_off, source_len;
-        rc = __acquire_grant_for_copy(sd, op->source.u.ref,
-                                      current->domain->domain_id, 1,
-                                      &s_frame, &s_pg,
-                                      &source_off, &source_len, 1);
-        if ( rc != GNTST_okay )
-            goto error_out;
-        have_s_grant = 1;
-        if ( op->source.offset < source_off ||
-             op->len > source_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy source out of bounds: %d < %d || %d > %d\n",
-                     op->source.offset, source_off,
-                     op->len, source_len);
+        unmap_domain_page(buf->virt);
+        buf->virt = NULL;
     }
-    else
+    if ( buf->have_type )
     {
-        rc = __get_paged_frame(op->source.u.gmfn, &s_frame, &s_pg, 1, sd);
-        if ( rc != GNTST_okay )
-            PIN_FAIL(error_out, rc,
-                     "source frame %lx invalid.\n", s_frame);
+        put_page_type(buf->page);
+        buf->have_type = 0;
+    }
+    if ( buf->page )
+    {
+        put_page(buf->page);
+        buf->page = NULL;
+    }
+    if ( buf->have_grant )
+    {
+        __release_grant_for_copy(buf->domain, buf->ptr.u.ref, buf->read_only);
+        buf->have_grant = 0;
     }
+}
+
+static int gnttab_copy_claim_buf(const struct gnttab_copy *op,
+                                 const struct gnttab_copy_ptr *ptr,
+                                 struct gnttab_copy_buf *buf,
+                                 unsigned int gref_flag)
+{
+    int rc;
+
+    buf->read_only = gref_flag == GNTCOPY_source_gref;
 
-    if ( dest_is_gref )
+    if ( op->flags & gref_flag )
     {
-        unsigned dest_off, dest_len;
-        rc = __acquire_grant_for_copy(dd, op->dest.u.ref,
-                                      current->domain->domain_id, 0,
-                                      &d_frame, &d_pg, &dest_off, &dest_len, 1);
+        unsigned int off, len;
+
+        rc = __acquire_grant_for_copy(buf->domain, ptr->u.ref,
+                                      current->domain->domain_id,
+                                      buf->read_only,
+                                      &buf->frame, &buf->page,
+                                      &off, &len, 1);
         if ( rc != GNTST_okay )
-            goto error_out;
-        have_d_grant = 1;
-        if ( op->dest.offset < dest_off ||
-             op->len > dest_len )
-            PIN_FAIL(error_out, GNTST_general_error,
-                     "copy dest out of bounds: %d < %d || %d > %d\n",
-                     op->dest.offset, dest_off,
-                     op->len, dest_len);
+            goto out;
+        buf->ptr.u.ref = ptr->u.ref;
+        buf->ptr.offset = off;
+        buf->len = len;
+        buf->have_grant = 1;
     }
     else
     {
-        rc = __get_paged_frame(op->dest.u.gmfn, &d_frame, &d_pg, 0, dd);
+        rc = __get_paged_frame(ptr->u.gmfn, &buf->frame, &buf->page,
+                               buf->read_only, buf->domain);
         if ( rc != GNTST_okay )
-            PIN_FAIL(error_out, rc,
-                     "destination frame %lx invalid.\n", d_frame);
+            PIN_FAIL(out, rc,
+                     "frame %"PRI_xen_pfn" invalid.\n", ptr->u.gmfn);
+
+        buf->ptr.u.gmfn = ptr->u.gmfn;
+        buf->ptr.offset = 0;
+        buf->len = PAGE_SIZE;
     }
 
-    if ( !get_page_type(d_pg, PGT_writable_page) )
+    if ( !buf->read_only )
     {
-        if ( !dd->is_dying )
-            gdprintk(XENLOG_WARNING, "Could not get dst frame %lx\n", d_frame);
-        rc = GNTST_general_error;
-        goto error_out;
+        if ( !get_page_type(buf->page, PGT_writable_page) )
+        {
+            if ( !buf->domain->is_dying )
+                gdprintk(XENLOG_WARNING, "Could not get writable frame %lx\n",
+                         buf->frame);
+            rc = GNTST_general_error;
+            goto out;
+        }
+        buf->have_type = 1;
     }
 
-    sp = map_domain_page(s_frame);
-    dp = map_domain_page(d_frame);
+    buf->virt = map_domain_page(buf->frame);
+    perfc_incr(gnttab_copy_buf_claims);
+    rc = GNTST_okay;
 
-    memcpy(dp + op->dest.offset, sp + op->source.offset, op->len);
+ out:
+    return rc;
+}
 
-    unmap_domain_page(dp);
-    unmap_domain_page(sp);
+static bool_t gnttab_copy_buf_valid(const struct gnttab_copy_ptr *p,
+                                    const struct gnttab_copy_buf *b,
+                                    bool_t has_gref)
+{
+    if ( !b->virt )
+        return 0;
+    if ( has_gref )
+        return b->have_grant && p->u.ref == b->ptr.u.ref;
+    return !b->have_grant && p->u.gmfn == b->ptr.u.gmfn;
+}
 
-    gnttab_mark_dirty(dd, d_frame);
+static int gnttab_copy_buf(const struct gnttab_copy *op,
+                           struct gnttab_copy_buf *dest,
+                           const struct gnttab_copy_buf *src)
+{
+    int rc;
 
-    put_page_type(d_pg);
- error_out:
-    if ( d_pg )
-        put_page(d_pg);
-    if ( s_pg )
-        put_page(s_pg);
-    if ( have_s_grant )
-        __release_grant_for_copy(sd, op->source.u.ref, 1);
-    if ( have_d_grant )
-        __release_grant_for_copy(dd, op->dest.u.ref, 0);
-    if ( sd )
-        rcu_unlock_domain(sd);
-    if ( dd )
-        rcu_unlock_domain(dd);
-    op->status = rc;
+    if ( ((op->source.offset + op->len) > PAGE_SIZE) ||
+         ((op->dest.offset + op->len) > PAGE_SIZE) )
+        PIN_FAIL(out, GNTST_bad_copy_arg, "copy beyond page area.\n");
+
+    if ( op->source.offset < src->ptr.offset ||
+         op->source.offset + op->len > src->ptr.offset + src->len )
+        PIN_FAIL(out, GNTST_general_error,
+                 "copy source out of bounds: %d < %d || %d > %d\n",
+                 op->source.offset, src->ptr.offset,
+                 op->len, src->len);
+
+    if ( op->dest.offset < dest->ptr.offset ||
+         op->dest.offset + op->len > dest->ptr.offset + dest->len )
+        PIN_FAIL(out, GNTST_general_error,
+                 "copy dest out of bounds: %d < %d || %d > %d\n",
+                 op->dest.offset, dest->ptr.offset,
+                 op->len, dest->len);
+
+    memcpy(dest->virt + op->dest.offset, src->virt + op->source.offset,
+           op->len);
+    gnttab_mark_dirty(dest->domain, dest->frame);
+    rc = GNTST_okay;
+ out:
+    return rc;
+}
+
+static int gnttab_copy_one(const struct gnttab_copy *op,
+                           struct gnttab_copy_buf *dest,
+                           struct gnttab_copy_buf *src)
+{
+    int rc;
+
+    if ( !src->domain || op->source.domid != src->ptr.domid ||
+         !dest->domain || op->dest.domid != dest->ptr.domid )
+    {
+        gnttab_copy_release_buf(src);
+        gnttab_copy_release_buf(dest);
+        gnttab_copy_unlock_domains(src, dest);
+
+        rc = gnttab_copy_lock_domains(op, src, dest);
+        if ( rc < 0 )
+            goto out;
+    }
+
+    /* Copy from src to dest, reusing whichever side is unchanged. */
+    if ( !gnttab_copy_buf_valid(&op->source, src,
+                                op->flags & GNTCOPY_source_gref) )
+    {
+        gnttab_copy_release_buf(src);
+        rc = gnttab_copy_claim_buf(op, &op->source, src, GNTCOPY_source_gref);
+        if ( rc < 0 )
+            goto out;
+    }
+    else
+        perfc_incr(gnttab_copy_buf_reuses);
+
+    if ( !gnttab_copy_buf_valid(&op->dest, dest,
+                                op->flags & GNTCOPY_dest_gref) )
+    {
+        gnttab_copy_release_buf(dest);
+        rc = gnttab_copy_claim_buf(op, &op->dest, dest, GNTCOPY_dest_gref);
+        if ( rc < 0 )
+            goto out;
+    }
+    else
+        perfc_incr(gnttab_copy_buf_reuses);
+
+    rc = gnttab_copy_buf(op, dest, src);
+ out:
+    return rc;
+}
+
+static void gnttab_copy_release_bufs(struct gnttab_copy_buf *src,
+                                     struct gnttab_copy_buf *dest)
+{
+    gnttab_copy_release_buf(src);
+    gnttab_copy_release_buf(dest);
+    gnttab_copy_unlock_domains(src, dest);
 }
 
 static long
 gnttab_copy(
     XEN_GUEST_HANDLE_PARAM(gnttab_copy_t) uop, unsigned int count)
 {
-    int i;
+    unsigned int i;
     struct gnttab_copy op;
+    struct gnttab_copy_buf src = {};
+    struct gnttab_copy_buf dest = {};
+    long rc = 0;
+
+    if ( count )
+    {
+        perfc_incr(gnttab_copy_batches);
+        /* By power of two; the last bucket also takes larger batches. */
+        perfc_incra(gnttab_copy_batch_size, min(fls(count) - 1, 7));
+    }
 
     for ( i = 0; i < count; i++ )
     {
-        if (i && hypercall_preempt_check())
-            return i;
+        if ( i && hypercall_preempt_check() )
+        {
+            rc = i;
+            break;
+        }
+
         if ( unlikely(__copy_from_guest(&op, uop, 1)) )
-            return -EFAULT;
-        __gnttab_copy(&op);
+        {
+            rc = -EFAULT;
+            break;
+        }
+
+        op.status = gnttab_copy_one(&op, &dest, &src);
+        if ( op.status != GNTST_okay )
+        {
+            /* Start afresh after a failure rather than keep a bad buffer. */
+            gnttab_copy_release_buf(&src);
+            gnttab_copy_release_buf(&dest);
+        }
+
+        perfc_incr(gnttab_copy_ops);
+
         if ( unlikely(__copy_field_to_guest(uop, &op, status)) )
-            return -EFAULT;
+        {
+            rc = -EFAULT;
+            break;
+        }
         guest_handle_add_offset(uop, 1);
     }
-    return 0;
+
+    gnttab_copy_release_bufs(&src, &dest);
+
+    return rc;
 }
 
 static long
@@ -2194,7 +2682,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     if ( gt->gt_version == op.version )
         goto out;
 
-    spin_lock(&gt->lock);
+    write_lock(&gt->lock);
     /* Make sure that the grant table isn't currently in use when we
        change the version number, except for the first 8 entries which
        are allowed to be in use (xenstore/xenconsole keeps them mapped).
@@ -2280,7 +2768,7 @@ gnttab_set_version(XEN_GUEST_HANDLE_PARAM(gnttab_set_version_t) uop)
     gt->gt_version = op.version;
 
 out_unlock:
-    spin_unlock(&gt->lock);
+    write_unlock(&gt->lock);
 
 out:
     op.version = gt->gt_version;
@@ -2336,7 +2824,7 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
 
     op.status = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    read_lock(&gt->lock);
 
     for ( i = 0; i < op.nr_frames; i++ )
     {
@@ -2345,7 +2833,7 @@ gnttab_get_status_frames(XEN_GUEST_HANDLE_PARAM(gnttab_get_status_frames_t) uop,
             op.status = GNTST_bad_virt_addr;
     }
 
-    spin_unlock(&gt->lock);
+    read_unlock(&gt->lock);
 out2:
     rcu_unlock_domain(d);
 out1:
@@ -2391,10 +2879,10 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
 {
     struct domain *d = rcu_lock_current_domain();
     struct grant_table *gt = d->grant_table;
-    struct active_grant_entry *act;
+    struct active_grant_entry *act_a = NULL, *act_b = NULL;
     s16 rc = GNTST_okay;
 
-    spin_lock(&gt->lock);
+    read_lock(&gt->lock);
 
     /* Bounds check on the grant refs */
     if ( unlikely(ref_a >= nr_grant_entries(d->grant_table)))
@@ -2402,12 +2890,26 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     if ( unlikely(ref_b >= nr_grant_entries(d->grant_table)))
         PIN_FAIL(out, GNTST_bad_gntref, "Bad ref-b (%d).\n", ref_b);
 
-    act = &active_entry(gt, ref_a);
-    if ( act->pin )
+    /* Swapping a ref with itself is a no-op. */
+    if ( ref_a == ref_b )
+        goto out;
+
+    /* Lock the two entries in a fixed order to avoid deadlock. */
+    if ( ref_a < ref_b )
+    {
+        act_a = active_entry_acquire(gt, ref_a);
+        act_b = active_entry_acquire(gt, ref_b);
+    }
+    else
+    {
+        act_b = active_entry_acquire(gt, ref_b);
+        act_a = active_entry_acquire(gt, ref_a);
+    }
+
+    if ( act_a->pin )
         PIN_FAIL(out, GNTST_eagain, "ref a %ld busy\n", (long)ref_a);
 
-    act = &active_entry(gt, ref_b);
-    if ( act->pin )
+    if ( act_b->pin )
         PIN_FAIL(out, GNTST_eagain, "ref b %ld busy\n", (long)ref_b);
 
     if ( gt->gt_version == 1 )
@@ -2434,7 +2936,11 @@ __gnttab_swap_grant_ref(grant_ref_t ref_a, grant_ref_t ref_b)
     }
 
 out:
-    spin_unlock(&gt->lock);
+    if ( act_b != NULL )
+        active_entry_release(act_b);
+    if ( act_a != NULL )
+        active_entry_release(act_a);
+    read_unlock(&gt->lock);
 
     rcu_unlock_domain(d);
 
@@ -2591,6 +3097,9 @@ do_grant_table_op(
         }
         break;
     }
+    case GNTTABOP_flush_unmaps:
+        rc = gnttab_flush_unmaps();
+        break;
     default:
         rc = -ENOSYS;
         break;
@@ -2622,7 +3131,10 @@ grant_table_create(
         goto no_mem_0;
 
     /* Simple stuff. */
-    spin_lock_init(&t->lock);
+    rwlock_init(&t->lock);
+    spin_lock_init(&t->maptrack_lock);
+    spin_lock_init(&t->unmap_lock);
+    init_timer(&t->unmap_timer, gnttab_unmap_timer_fn, d, 0);
     t->nr_grant_frames = INITIAL_NR_GRANT_FRAMES;
 
     /* Active grant table. */
@@ -2634,20 +3146,13 @@ grant_table_create(
     {
         if ( (t->active[i] = alloc_xenheap_page()) == NULL )
             goto no_mem_2;
-        clear_page(t->active[i]);
+        init_active_frame(t->active[i]);
     }
 
     /* Tracking of mapped foreign frames table */
     if ( (t->maptrack = xzalloc_array(struct grant_mapping *,
                                       max_nr_maptrack_frames())) == NULL )
         goto no_mem_2;
-    if ( (t->maptrack[0] = alloc_xenheap_page()) == NULL )
-        goto no_mem_3;
-    clear_page(t->maptrack[0]);
-    t->maptrack_limit = MAPTRACK_PER_PAGE;
-    for ( i = 1; i < MAPTRACK_PER_PAGE; i++ )
-        t->maptrack[0][i - 1].ref = i;
-    t->maptrack[0][i - 1].ref = MAPTRACK_TAIL;
 
     /* Shared grant table. */
     if ( (t->shared_raw = xzalloc_array(void *, max_nr_grant_frames)) == NULL )
@@ -2679,7 +3184,6 @@ grant_table_create(
         free_xenheap_page(t->shared_raw[i]);
     xfree(t->shared_raw);
  no_mem_3:
-    free_xenheap_page(t->maptrack[0]);
     xfree(t->maptrack);
  no_mem_2:
     for ( i = 0;
@@ -2692,6 +3196,14 @@ grant_table_create(
     return -ENOMEM;
 }
 
+void
+grant_table_init_vcpu(
+    struct vcpu *v)
+{
+    spin_lock_init(&v->maptrack_freelist_lock);
+    v->maptrack_head = MAPTRACK_TAIL;
+}
+
 void
 gnttab_release_mappings(
     struct domain *d)
@@ -2708,6 +3220,15 @@ gnttab_release_mappings(
 
     BUG_ON(!d->is_dying);
 
+    /* Deferred unmaps hold page references the loop below won't see. */
+    spin_lock(&gt->unmap_lock);
+    if ( gt->nr_deferred_unmaps )
+    {
+        gnttab_flush_tlb(d);
+        gnttab_complete_deferred_unmaps(d);
+    }
+    spin_unlock(&gt->unmap_lock);
+
     for ( handle = 0; handle < gt->maptrack_limit; handle++ )
     {
         map = &maptrack_entry(gt, handle);
@@ -2729,9 +3250,9 @@ gnttab_release_mappings(
         }
 
         rgt = rd->grant_table;
-        spin_lock(&rgt->lock);
+        read_lock(&rgt->lock);
 
-        act = &active_entry(rgt, ref);
+        act = active_entry_acquire(rgt, ref);
         sha = shared_entry_header(rgt, ref);
         if (rgt->gt_version == 1)
             status = &sha->flags;
@@ -2789,7 +3310,8 @@ gnttab_release_mappings(
         if ( act->pin == 0 )
             gnttab_clear_flag(_GTF_reading, status);
 
-        spin_unlock(&rgt->lock);
+        active_entry_release(act);
+        read_unlock(&rgt->lock);
 
         rcu_unlock_domain(rd);
 
@@ -2807,7 +3329,9 @@ grant_table_destroy(
 
     if ( t == NULL )
         return;
-    
+
+    kill_timer(&t->unmap_timer);
+
     for ( i = 0; i < nr_grant_frames(t); i++ )
         free_xenheap_page(t->shared_raw[i]);
     xfree(t->shared_raw);
@@ -2824,6 +3348,9 @@ grant_table_destroy(
         free_xenheap_page(t->status[i]);
     xfree(t->status);
 
+    ASSERT(!t->nr_deferred_unmaps);
+    xfree(t->deferred_unmaps);
+
     xfree(t);
     d->grant_table = NULL;
 }
@@ -2837,7 +3364,7 @@ static void gnttab_usage_print(struct domain *rd)
     printk("      -------- active --------       -------- shared --------\n");
     printk("[ref] localdom mfn      pin          localdom gmfn     flags\n");
 
-    spin_lock(&gt->lock);
+    read_lock(&gt->lock);
 
     if ( gt->gt_version == 0 )
         goto out;
@@ -2851,9 +3378,12 @@ static void gnttab_usage_print(struct domain *rd)
         uint16_t status;
         uint64_t frame;
 
-        act = &active_entry(gt, ref);
+        act = active_entry_acquire(gt, ref);
         if ( !act->pin )
+        {
+            active_entry_release(act);
             continue;
+        }
 
         sha = shared_entry_header(gt, ref);
 
@@ -2883,10 +3413,11 @@ static void gnttab_usage_print(struct domain *rd)
         printk("[%3d]    %5d 0x%06lx 0x%08x      %5d 0x%06"PRIx64" 0x%02x\n",
                ref, act->domid, act->frame, act->pin,
                sha->domid, frame, status);
+        active_entry_release(act);
     }
 
  out:
-    spin_unlock(&gt->lock);
+    read_unlock(&gt->lock);
 
     if ( first )
         printk("grant-table for remote domain:%5d ... "
@@ -29,6 +29,7 @@
 #include <xen/spinlock.h>
 #include <xen/mm.h>
 #include <xen/irq.h>
+#include <xen/cpu.h>
 #include <xen/softirq.h>
 #include <xen/domain_page.h>
 #include <xen/keyhandler.h>
@@ -277,6 +278,10 @@ static long midsize_alloc_zone_pages;
 static DEFINE_SPINLOCK(heap_lock);
 static long outstanding_claims; /* total outstanding claims by all domains */
 
+/* Free pages may also sit in the per-CPU page caches (see below). */
+static bool_t page_cache_drain_all(void);
+static unsigned long page_cache_pages(void);
+
 unsigned long domain_adjust_tot_pages(struct domain *d, long pages)
 {
     long dom_before, dom_after, dom_claimed, sys_before, sys_after;
@@ -315,6 +320,10 @@ int domain_set_outstanding_pages(struct domain *d, unsigned long pages)
     int ret = -ENOMEM;
     unsigned long claim, avail_pages;
 
+    /* Let the claim see cached pages; no more are cached while it lasts. */
+    if ( pages )
+        page_cache_drain_all();
+
     /*
      * take the domain's page_alloc_lock, else all d->tot_page adjustments
      * must always take the global heap_lock rather than only in the much
@@ -384,7 +393,7 @@ void get_outstanding_claims(uint64_t *free_pages, uint64_t *outstanding_pages)
 {
     spin_lock(&heap_lock);
     *outstanding_pages = outstanding_claims;
-    *free_pages =  avail_domheap_pages();
+    *free_pages =  avail_domheap_pages() + page_cache_pages();
     spin_unlock(&heap_lock);
 }
 
@@ -528,6 +537,10 @@ static void check_low_mem_virq(void)
     unsigned long avail_pages = total_avail_pages +
         (opt_tmem ? tmem_freeable_pages() : 0) - outstanding_claims;
 
+    /* Summing the caches takes a while, so only do it when near the limit. */
+    if ( unlikely(avail_pages <= low_mem_virq_th) )
+        avail_pages += page_cache_pages();
+
     if ( unlikely(avail_pages <= low_mem_virq_th) )
     {
         send_global_virq(VIRQ_ENOMEM);
@@ -557,13 +570,109 @@ static void check_low_mem_virq(void)
     }
 }
 
-/* Allocate 2^@order contiguous pages. */
-static struct page_info *alloc_heap_pages(
+/*
+ * Take a free 2^@order block off @node's heap, from the highest zone in
+ * [@zone_lo, @zone_hi] that has one.  Caller must hold heap_lock.
+ */
+static struct page_info *take_heap_block(
+    unsigned int node, unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order)
+{
+    unsigned int i, j, zone = zone_hi;
+    unsigned long request = 1UL << order;
+    struct page_info *pg;
+
+    ASSERT(spin_is_locked(&heap_lock));
+
+    do {
+        /* Check if target node can support the allocation. */
+        if ( !avail[node] || (avail[node][zone] < request) )
+            continue;
+
+        /* Find smallest order which can satisfy the request. */
+        for ( j = order; j <= MAX_ORDER; j++ )
+            if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
+                goto found;
+    } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+
+    return NULL;
+
+ found: 
+    /* We may have to halve the chunk a number of times. */
+    while ( j != order )
+    {
+        PFN_ORDER(pg) = --j;
+        page_list_add_tail(pg, &heap(node, zone, j));
+        pg += 1 << j;
+    }
+
+    ASSERT(avail[node][zone] >= request);
+    avail[node][zone] -= request;
+    total_avail_pages -= request;
+    ASSERT(total_avail_pages >= 0);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* Reference count must continuously be zero for free pages. */
+        BUG_ON(pg[i].count_info != PGC_state_free);
+        pg[i].count_info = PGC_state_inuse;
+    }
+
+    return pg;
+}
+
+/*
+ * Get a block just taken off the heap or a page cache ready for use,
+ * noting in @need_tlbflush and @tlbflush_timestamp whether any of its
+ * pages may still be in a TLB.
+ */
+static void prepare_alloc_pages(
+    struct page_info *pg, unsigned int order,
+    bool_t *need_tlbflush, uint32_t *tlbflush_timestamp)
+{
+    unsigned int i;
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        if ( pg[i].u.free.need_tlbflush &&
+             (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
+             (!*need_tlbflush ||
+              (pg[i].tlbflush_timestamp > *tlbflush_timestamp)) )
+        {
+            *need_tlbflush = 1;
+            *tlbflush_timestamp = pg[i].tlbflush_timestamp;
+        }
+
+        /* Initialise fields which have other uses for free pages. */
+        pg[i].u.inuse.type_info = 0;
+        page_set_owner(&pg[i], NULL);
+
+        /* Ensure cache and RAM are consistent for platforms where the
+         * guest can control its own visibility of/through the cache.
+         */
+        flush_page_to_ram(page_to_mfn(&pg[i]));
+    }
+}
+
+static void alloc_tlbflush(uint32_t tlbflush_timestamp)
+{
+    cpumask_t mask = cpu_online_map;
+
+    tlbflush_filter(mask, tlbflush_timestamp);
+    if ( !cpumask_empty(&mask) )
+    {
+        perfc_incr(need_flush_tlb_flush);
+        flush_tlb_mask(&mask);
+    }
+}
+
+/* Allocate 2^@order contiguous pages from the heap. */
+static struct page_info *__alloc_heap_pages(
     unsigned int zone_lo, unsigned int zone_hi,
     unsigned int order, unsigned int memflags,
     struct domain *d)
 {
-    unsigned int first_node, i, j, zone = 0, nodemask_retry = 0;
+    unsigned int first_node, nodemask_retry = 0;
     unsigned int node = (uint8_t)((memflags >> _MEMF_node) - 1);
     unsigned long request = 1UL << order;
     struct page_info *pg;
@@ -621,17 +730,8 @@ static struct page_info *alloc_heap_pages(
      */
     for ( ; ; )
     {
-        zone = zone_hi;
-        do {
-            /* Check if target node can support the allocation. */
-            if ( !avail[node] || (avail[node][zone] < request) )
-                continue;
-
-            /* Find smallest order which can satisfy the request. */
-            for ( j = order; j <= MAX_ORDER; j++ )
-                if ( (pg = page_list_remove_head(&heap(node, zone, j))) )
-                    goto found;
-        } while ( zone-- > zone_lo ); /* careful: unsigned zone may wrap */
+        if ( (pg = take_heap_block(node, zone_lo, zone_hi, order)) != NULL )
+            goto found;
 
         if ( memflags & MEMF_exact_node )
             goto not_found;
@@ -674,61 +774,17 @@ static struct page_info *alloc_heap_pages(
     return NULL;
 
  found: 
-    /* We may have to halve the chunk a number of times. */
-    while ( j != order )
-    {
-        PFN_ORDER(pg) = --j;
-        page_list_add_tail(pg, &heap(node, zone, j));
-        pg += 1 << j;
-    }
-
-    ASSERT(avail[node][zone] >= request);
-    avail[node][zone] -= request;
-    total_avail_pages -= request;
-    ASSERT(total_avail_pages >= 0);
-
     check_low_mem_virq();
 
     if ( d != NULL )
         d->last_alloc_node = node;
 
-    for ( i = 0; i < (1 << order); i++ )
-    {
-        /* Reference count must continuously be zero for free pages. */
-        BUG_ON(pg[i].count_info != PGC_state_free);
-        pg[i].count_info = PGC_state_inuse;
-
-        if ( pg[i].u.free.need_tlbflush &&
-             (pg[i].tlbflush_timestamp <= tlbflush_current_time()) &&
-             (!need_tlbflush ||
-              (pg[i].tlbflush_timestamp > tlbflush_timestamp)) )
-        {
-            need_tlbflush = 1;
-            tlbflush_timestamp = pg[i].tlbflush_timestamp;
-        }
-
-        /* Initialise fields which have other uses for free pages. */
-        pg[i].u.inuse.type_info = 0;
-        page_set_owner(&pg[i], NULL);
-
-        /* Ensure cache and RAM are consistent for platforms where the
-         * guest can control its own visibility of/through the cache.
-         */
-        flush_page_to_ram(page_to_mfn(&pg[i]));
-    }
+    prepare_alloc_pages(pg, order, &need_tlbflush, &tlbflush_timestamp);
 
     spin_unlock(&heap_lock);
 
     if ( need_tlbflush )
-    {
-        cpumask_t mask = cpu_online_map;
-        tlbflush_filter(mask, tlbflush_timestamp);
-        if ( !cpumask_empty(&mask) )
-        {
-            perfc_incr(need_flush_tlb_flush);
-            flush_tlb_mask(&mask);
-        }
-    }
+        alloc_tlbflush(tlbflush_timestamp);
 
     return pg;
 }
@@ -808,18 +864,36 @@ static int reserve_offlined_page(struct page_info *head)
     return count;
 }
 
-/* Free 2^@order set of pages. */
-static void free_heap_pages(
+/*
+ * Forget the owner of a page being freed, noting whether it needs a TLB
+ * flush before it is reused.
+ */
+static void release_page_owner(struct page_info *pg)
+{
+    /* If a page has no owner it will need no safety TLB flush. */
+    pg->u.free.need_tlbflush = (page_get_owner(pg) != NULL);
+    if ( pg->u.free.need_tlbflush )
+        pg->tlbflush_timestamp = tlbflush_current_time();
+
+    /* This page is not a guest frame any more. */
+    page_set_owner(pg, NULL); /* set_gpfn_from_mfn snoops pg owner */
+    set_gpfn_from_mfn(page_to_mfn(pg), INVALID_M2P_ENTRY);
+}
+
+/*
+ * Put 2^@order set of pages, whose owner has already been released, back on
+ * the heap.  Caller must hold heap_lock.
+ */
+static void merge_heap_pages(
     struct page_info *pg, unsigned int order)
 {
-    unsigned long mask, mfn = page_to_mfn(pg);
+    unsigned long mask;
     unsigned int i, node = phys_to_nid(page_to_maddr(pg)), tainted = 0;
     unsigned int zone = page_to_zone(pg);
 
     ASSERT(order <= MAX_ORDER);
     ASSERT(node >= 0);
-
-    spin_lock(&heap_lock);
+    ASSERT(spin_is_locked(&heap_lock));
 
     for ( i = 0; i < (1 << order); i++ )
     {
@@ -841,15 +915,6 @@ static void free_heap_pages(
               ? PGC_state_offlined : PGC_state_free));
         if ( page_state_is(&pg[i], offlined) )
             tainted = 1;
-
-        /* If a page has no owner it will need no safety TLB flush. */
-        pg[i].u.free.need_tlbflush = (page_get_owner(&pg[i]) != NULL);
-        if ( pg[i].u.free.need_tlbflush )
-            pg[i].tlbflush_timestamp = tlbflush_current_time();
-
-        /* This page is not a guest frame any more. */
-        page_set_owner(&pg[i], NULL); /* set_gpfn_from_mfn snoops pg owner */
-        set_gpfn_from_mfn(mfn + i, INVALID_M2P_ENTRY);
     }
 
     avail[node][zone] += 1 << order;
@@ -894,6 +959,362 @@ static void free_heap_pages(
 
     if ( tainted )
         reserve_offlined_page(pg);
+}
+
+/*
+ * PER-CPU PAGE CACHES
+ *
+ * Single pages are by far the most common allocation (p2m and shadow
+ * pages, ballooning, PoD sweeps, domain construction), and taking heap_lock
+ * for each of them serialises every CPU on large hosts.  Each CPU therefore
+ * keeps a few free blocks of each order below PAGE_CACHE_ORDERS from its
+ * own node.  Allocations and frees on that node are served from the cache
+ * under a per-CPU lock; the cache is refilled from, and trimmed back to,
+ * the heap PAGE_CACHE_BATCH pages at a time under one acquisition of
+ * heap_lock.
+ *
+ * As far as the heap is concerned cached pages are in use: they are in
+ * state PGC_state_inuse (with their u.free fields maintained as for free
+ * pages), are not on the buddy lists and are not counted in avail[] or
+ * total_avail_pages.  Reports of free memory add them back in (see
+ * page_cache_pages()).  An attempt to offline one is treated as for any
+ * other anonymous page, and takes effect when the page leaves the cache.
+ * The caches are drained when their CPU goes offline, before a claim is
+ * staked, and before an allocation is allowed to fail.  They are bypassed
+ * while claims are outstanding, and never hold pages from the DMA zones.
+ */
+#define PAGE_CACHE_ORDERS 3
+#define PAGE_CACHE_HIGH   32 /* Pages of each order kept by each CPU. */
+#define PAGE_CACHE_BATCH  16 /* Pages moved to or from the heap at once. */
+
+struct page_cache {
+    spinlock_t lock;
+    unsigned int count[PAGE_CACHE_ORDERS];        /* blocks in list[] */
+    struct page_list_head list[PAGE_CACHE_ORDERS];
+};
+
+static DEFINE_PER_CPU(struct page_cache, page_cache);
+
+/* Caches are only used once boot-time scrubbing is done. */
+static bool_t __read_mostly page_cache_enabled;
+
+/* Boot-time option to disable the per-CPU page caches. */
+static bool_t __initdata opt_page_cache = 1;
+boolean_param("page_cache", opt_page_cache);
+
+/* Return a list of cached 2^@order blocks to the heap. */
+static void page_cache_release(struct page_list_head *list, unsigned int order)
+{
+    struct page_info *pg;
+
+    spin_lock(&heap_lock);
+    while ( (pg = page_list_remove_head(list)) != NULL )
+        merge_heap_pages(pg, order);
+    spin_unlock(&heap_lock);
+}
+
+/*
+ * Move up to @nr of the least recently cached 2^@order blocks of @pc to
+ * @list.  Caller must hold pc->lock.
+ */
+static unsigned int page_cache_take(
+    struct page_cache *pc, unsigned int order, unsigned int nr,
+    struct page_list_head *list)
+{
+    struct page_info *pg, *tmp;
+    unsigned int taken = 0;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    page_list_for_each_safe_reverse ( pg, tmp, &pc->list[order] )
+    {
+        if ( taken == nr )
+            break;
+        page_list_del(pg, &pc->list[order]);
+        page_list_add(pg, list);
+        taken++;
+    }
+    pc->count[order] -= taken;
+
+    return taken;
+}
+
+/* Return all of @cpu's cached blocks to the heap. */
+static bool_t page_cache_drain(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+    bool_t drained = 0;
+
+    for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+    {
+        PAGE_LIST_HEAD(list);
+
+        spin_lock(&pc->lock);
+        if ( page_cache_take(pc, order, pc->count[order], &list) )
+            drained = 1;
+        spin_unlock(&pc->lock);
+
+        if ( !page_list_empty(&list) )
+        {
+            perfc_incr(page_cache_drains);
+            page_cache_release(&list, order);
+        }
+    }
+
+    return drained;
+}
+
+/* Number of pages in all CPUs' caches: a snapshot, as nothing is locked. */
+static unsigned long page_cache_pages(void)
+{
+    unsigned int cpu, order;
+    unsigned long pages = 0;
+
+    if ( !page_cache_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+            pages += (unsigned long)
+                read_atomic(&per_cpu(page_cache, cpu).count[order]) << order;
+
+    return pages;
+}
+
+/* Is memory in @zone kept for DMA, and so out of the caches? */
+static bool_t page_cache_dma_zone(unsigned int zone)
+{
+    return dma_bitsize && zone <= bits_to_zone(dma_bitsize);
+}
+
+static bool_t page_cache_drain_all(void)
+{
+    unsigned int cpu;
+    bool_t drained = 0;
+
+    if ( !page_cache_enabled )
+        return 0;
+
+    for_each_online_cpu ( cpu )
+        drained |= page_cache_drain(cpu);
+
+    return drained;
+}
+
+/*
+ * Refill @pc's list of 2^@order blocks from @node's heap.  Caller must hold
+ * pc->lock.
+ */
+static void page_cache_refill(
+    struct page_cache *pc, unsigned int node,
+    unsigned int zone_lo, unsigned int zone_hi, unsigned int order)
+{
+    struct page_info *pg;
+    unsigned int n;
+
+    ASSERT(spin_is_locked(&pc->lock));
+
+    spin_lock(&heap_lock);
+
+    for ( n = 0; n < (PAGE_CACHE_BATCH >> order); n++ )
+    {
+        if ( (pg = take_heap_block(node, zone_lo, zone_hi, order)) == NULL )
+            break;
+        page_list_add_tail(pg, &pc->list[order]);
+        pc->count[order]++;
+    }
+
+    if ( n )
+        check_low_mem_virq();
+
+    spin_unlock(&heap_lock);
+
+    perfc_incr(page_cache_refills);
+}
+
+/*
+ * Try to allocate a 2^@order block from the local CPU's cache.  Returns
+ * NULL if the request can't be served that way, e.g. because it asks for
+ * another node or there are outstanding claims.
+ */
+static struct page_info *page_cache_alloc(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    unsigned int i, cpu = smp_processor_id(), node = cpu_to_node(cpu);
+    unsigned int req_node = (uint8_t)((memflags >> _MEMF_node) - 1);
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    struct page_info *pg;
+    bool_t need_tlbflush = 0;
+    uint32_t tlbflush_timestamp = 0;
+
+    if ( !page_cache_enabled || order >= PAGE_CACHE_ORDERS || opt_tmem ||
+         zone_lo == MEMZONE_XEN || read_atomic(&outstanding_claims) )
+        return NULL;
+
+    if ( req_node != NUMA_NO_NODE ? req_node != node
+                                  : d && !node_isset(node, d->node_affinity) )
+        return NULL;
+
+    spin_lock(&pc->lock);
+
+    /* Requests which may use DMA memory are served but don't refill. */
+    if ( !pc->count[order] && !page_cache_dma_zone(zone_lo) )
+        page_cache_refill(pc, node, zone_lo, zone_hi, order);
+
+    pg = page_list_first(&pc->list[order]);
+    if ( !pc->count[order] || page_to_zone(pg) < zone_lo ||
+         page_to_zone(pg) > zone_hi )
+    {
+        spin_unlock(&pc->lock);
+        return NULL;
+    }
+    page_list_del(pg, &pc->list[order]);
+    pc->count[order]--;
+
+    spin_unlock(&pc->lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+    {
+        /* Pages to be offlined go back to the heap to be reserved. */
+        if ( unlikely(pg[i].count_info != PGC_state_inuse) )
+        {
+            PAGE_LIST_HEAD(list);
+
+            page_list_add(pg, &list);
+            page_cache_release(&list, order);
+            return NULL;
+        }
+    }
+
+    if ( d != NULL )
+        d->last_alloc_node = node;
+
+    prepare_alloc_pages(pg, order, &need_tlbflush, &tlbflush_timestamp);
+
+    if ( need_tlbflush )
+        alloc_tlbflush(tlbflush_timestamp);
+
+    return pg;
+}
+
+/*
+ * Try to free a 2^@order block to the local CPU's cache, trimming the cache
+ * back to the heap if it grows too large.  Returns whether the block was
+ * taken.
+ */
+static bool_t page_cache_free(struct page_info *pg, unsigned int order)
+{
+    unsigned int i, cpu = smp_processor_id();
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    PAGE_LIST_HEAD(excess);
+
+    if ( !page_cache_enabled || order >= PAGE_CACHE_ORDERS || opt_tmem ||
+         page_to_zone(pg) == MEMZONE_XEN ||
+         page_cache_dma_zone(page_to_zone(pg)) ||
+         read_atomic(&outstanding_claims) ||
+         phys_to_nid(page_to_maddr(pg)) != cpu_to_node(cpu) )
+        return 0;
+
+    /* Leave broken pages, or pages being offlined, to the heap. */
+    for ( i = 0; i < (1 << order); i++ )
+        if ( pg[i].count_info != PGC_state_inuse )
+            return 0;
+
+    for ( i = 0; i < (1 << order); i++ )
+        release_page_owner(&pg[i]);
+
+    spin_lock(&pc->lock);
+    page_list_add(pg, &pc->list[order]);
+    if ( ++pc->count[order] > (PAGE_CACHE_HIGH >> order) )
+        page_cache_take(pc, order, PAGE_CACHE_BATCH >> order, &excess);
+    spin_unlock(&pc->lock);
+
+    if ( !page_list_empty(&excess) )
+    {
+        perfc_incr(page_cache_drains);
+        page_cache_release(&excess, order);
+    }
+
+    return 1;
+}
+
+static void page_cache_init(unsigned int cpu)
+{
+    struct page_cache *pc = &per_cpu(page_cache, cpu);
+    unsigned int order;
+
+    spin_lock_init(&pc->lock);
+    for ( order = 0; order < PAGE_CACHE_ORDERS; order++ )
+    {
+        pc->count[order] = 0;
+        INIT_PAGE_LIST_HEAD(&pc->list[order]);
+    }
+}
+
+static int cpu_page_cache_callback(
+    struct notifier_block *nfb, unsigned long action, void *hcpu)
+{
+    unsigned int cpu = (unsigned long)hcpu;
+
+    switch ( action )
+    {
+    case CPU_UP_PREPARE:
+        page_cache_init(cpu);
+        break;
+    case CPU_UP_CANCELED:
+    case CPU_DEAD:
+        page_cache_drain(cpu);
+        break;
+    default:
+        break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block cpu_page_cache_nfb = {
+    .notifier_call = cpu_page_cache_callback
+};
+
+/* Allocate 2^@order contiguous pages. */
+static struct page_info *alloc_heap_pages(
+    unsigned int zone_lo, unsigned int zone_hi,
+    unsigned int order, unsigned int memflags,
+    struct domain *d)
+{
+    struct page_info *pg;
+
+    pg = page_cache_alloc(zone_lo, zone_hi, order, memflags, d);
+    if ( pg == NULL )
+        pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    /* Free memory may be sitting in the CPUs' page caches. */
+    if ( pg == NULL && page_cache_drain_all() )
+        pg = __alloc_heap_pages(zone_lo, zone_hi, order, memflags, d);
+
+    return pg;
+}
+
+/* Free 2^@order set of pages. */
+static void free_heap_pages(
+    struct page_info *pg, unsigned int order)
+{
+    unsigned int i;
+
+    ASSERT(order <= MAX_ORDER);
+
+    if ( page_cache_free(pg, order) )
+        return;
+
+    spin_lock(&heap_lock);
+
+    for ( i = 0; i < (1 << order); i++ )
+        release_page_owner(&pg[i]);
+
+    merge_heap_pages(pg, order);
 
     spin_unlock(&heap_lock);
 }
@@ -1211,7 +1632,7 @@ static unsigned long avail_heap_pages(
 
 unsigned long total_free_pages(void)
 {
-    return total_avail_pages - midsize_alloc_zone_pages;
+    return total_avail_pages + page_cache_pages() - midsize_alloc_zone_pages;
 }
 
 void __init end_boot_allocator(void)
@@ -1238,6 +1659,9 @@ void __init end_boot_allocator(void)
     }
     init_heap_pages(virt_to_page(bootmem_region_list), 1);
 
+    page_cache_init(smp_processor_id());
+    register_cpu_notifier(&cpu_page_cache_nfb);
+
     if ( !dma_bitsize && (num_online_nodes() > 1) )
     {
 #ifdef CONFIG_X86
@@ -1267,7 +1691,7 @@ void __init scrub_heap_pages(void)
     struct page_info *pg;
 
     if ( !opt_bootscrub )
-        return;
+        goto out;
 
     printk("Scrubbing Free RAM: ");
 
@@ -1299,6 +1723,10 @@ void __init scrub_heap_pages(void)
     /* Now that the heap is initialized, run checks and set bounds
      * for the low mem virq algorithm. */
     setup_low_mem_virq();
+
+ out:
+    /* Free pages are clean now, so they may be handed out of the caches. */
+    page_cache_enabled = opt_page_cache;
 }
 
 
@@ -1679,6 +2107,7 @@ static void dump_heap(unsigned char key)
 {
     s_time_t      now = NOW();
     int           i, j;
+    unsigned int  cpu;
 
     printk("'%c' pressed -> dumping heap info (now-0x%X:%08X)\n", key,
            (u32)(now>>32), (u32)now);
@@ -1691,6 +2120,19 @@ static void dump_heap(unsigned char key)
             printk("heap[node=%d][zone=%d] -> %lu pages\n",
                    i, j, avail[i][j]);
     }
+
+    if ( !page_cache_enabled )
+        return;
+
+    for_each_online_cpu ( cpu )
+    {
+        struct page_cache *pc = &per_cpu(page_cache, cpu);
+
+        printk("page_cache[cpu=%u][node=%u] ->", cpu, cpu_to_node(cpu));
+        for ( j = 0; j < PAGE_CACHE_ORDERS; j++ )
+            printk(" %u", pc->count[j]);
+        printk(" blocks of order 0-%d\n", PAGE_CACHE_ORDERS - 1);
+    }
 }
 
 static struct keyhandler dump_heap_keyhandler = {
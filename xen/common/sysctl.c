@@ -113,6 +113,93 @@ long do_sysctl(XEN_GUEST_HANDLE_PARAM(xen_sysctl_t) u_sysctl)
     }
     break;
 
+    case XEN_SYSCTL_getdomainstats:
+    {
+        struct xen_sysctl_getdomainstats *gds = &op->u.getdomainstats;
+        struct xen_sysctl_domainstats dstats;
+        struct xen_sysctl_vcpustats vstats;
+        struct vcpu_runstate_info runstate;
+        struct domain *d;
+        struct vcpu *v;
+        u32 num_domains = 0, num_vcpus = 0;
+        domid_t next_domain = DOMID_INVALID;
+
+        rcu_read_lock(&domlist_read_lock);
+
+        for_each_domain ( d )
+        {
+            if ( d->domain_id < gds->first_domain )
+                continue;
+            if ( num_domains == gds->max_domains ||
+                 d->max_vcpus > gds->max_vcpus - num_vcpus )
+            {
+                if ( num_domains == 0 )
+                    ret = -ENOBUFS;
+                next_domain = d->domain_id;
+                break;
+            }
+
+            if ( xsm_getdomaininfo(XSM_HOOK, d) )
+                continue;
+
+            getdomaininfo(d, &dstats.info);
+            dstats.first_vcpu = num_vcpus;
+            dstats.nr_vcpus = 0;
+
+            /* vCPU details need the same permission as getvcpuinfo. */
+            if ( !xsm_domctl(XSM_OTHER, d, XEN_DOMCTL_getvcpuinfo) )
+                for_each_vcpu ( d, v )
+                {
+                    vcpu_runstate_get(v, &runstate);
+
+                    vstats.vcpu = v->vcpu_id;
+                    vstats.cpu = v->processor;
+                    vstats.flags =
+                        (!test_bit(_VPF_down, &v->pause_flags) ?
+                         XEN_VCPUSTATS_online : 0) |
+                        ((v->pause_flags & VPF_blocked) ?
+                         XEN_VCPUSTATS_blocked : 0) |
+                        (v->is_running ? XEN_VCPUSTATS_running : 0);
+                    vstats.state = runstate.state;
+                    BUILD_BUG_ON(ARRAY_SIZE(vstats.time) !=
+                                 ARRAY_SIZE(runstate.time));
+                    memcpy(vstats.time, runstate.time, sizeof(vstats.time));
+
+                    if ( copy_to_guest_offset(gds->vcpus,
+                                              num_vcpus + dstats.nr_vcpus,
+                                              &vstats, 1) )
+                    {
+                        ret = -EFAULT;
+                        break;
+                    }
+                    dstats.nr_vcpus++;
+                }
+
+            if ( ret )
+                break;
+
+            if ( copy_to_guest_offset(gds->domains, num_domains,
+                                      &dstats, 1) )
+            {
+                ret = -EFAULT;
+                break;
+            }
+
+            num_vcpus += dstats.nr_vcpus;
+            num_domains++;
+        }
+
+        rcu_read_unlock(&domlist_read_lock);
+
+        if ( ret != 0 )
+            break;
+
+        gds->num_domains = num_domains;
+        gds->num_vcpus = num_vcpus;
+        gds->next_domain = next_domain;
+    }
+    break;
+
 #ifdef PERF_COUNTERS
     case XEN_SYSCTL_perfc_op:
         ret = perfc_control(&op->u.perfc_op);
@@ -75,6 +75,13 @@ static cpumask_t tb_cpu_mask;
 /* which tracing events are enabled */
 static u32 tb_event_mask = TRC_ALL;
 
+/* which domains/vcpus tracing is enabled for (all, if there are no filters) */
+static struct {
+    domid_t domid;
+    unsigned int vcpu;
+} tb_filters[XEN_SYSCTL_TBUF_MAX_FILTERS];
+static unsigned int tb_nr_filters;
+
 /* Return the number of elements _type necessary to store at least _x bytes of data
  * i.e., sizeof(_type) * ans >= _x. */
 #define fit_to_type(_type, _x) (((_x)+sizeof(_type)-1) / sizeof(_type))
@@ -306,6 +313,30 @@ static int tb_set_size(unsigned int pages)
     return alloc_trace_bufs(pages);
 }
 
+/*
+ * Does the vcpu running on this cpu pass the domain/vcpu filters?  The
+ * filters are only appended to (or all dropped at once) under tb_control()'s
+ * lock, so a racing reader sees either the old or the new set.
+ */
+static inline bool_t tb_filter_current(void)
+{
+    const struct vcpu *v = current;
+    unsigned int i, nr = read_atomic(&tb_nr_filters);
+
+    if ( likely(nr == 0) )
+        return 1;
+
+    smp_rmb(); /* Read tb_nr_filters /before/ the entries it covers. */
+
+    for ( i = 0; i < nr; i++ )
+        if ( tb_filters[i].domid == v->domain->domain_id &&
+             (tb_filters[i].vcpu == XEN_SYSCTL_TBUF_ANY_VCPU ||
+              tb_filters[i].vcpu == v->vcpu_id) )
+            return 1;
+
+    return 0;
+}
+
 int trace_will_trace_event(u32 event)
 {
     if ( !tb_init_done )
@@ -329,6 +360,9 @@ int trace_will_trace_event(u32 event)
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return 0;
 
+    if ( !tb_filter_current() )
+        return 0;
+
     return 1;
 }
 
@@ -398,6 +432,20 @@ int tb_control(xen_sysctl_tbuf_op_t *tbc)
     case XEN_SYSCTL_TBUFOP_set_size:
         rc = tb_set_size(tbc->size);
         break;
+    case XEN_SYSCTL_TBUFOP_add_filter:
+        if ( tb_nr_filters >= ARRAY_SIZE(tb_filters) )
+        {
+            rc = -ENOSPC;
+            break;
+        }
+        tb_filters[tb_nr_filters].domid = tbc->filter_domid;
+        tb_filters[tb_nr_filters].vcpu = tbc->filter_vcpu;
+        smp_wmb(); /* Entry must be visible before it is counted. */
+        write_atomic(&tb_nr_filters, tb_nr_filters + 1);
+        break;
+    case XEN_SYSCTL_TBUFOP_clear_filters:
+        write_atomic(&tb_nr_filters, 0);
+        break;
     case XEN_SYSCTL_TBUFOP_enable:
         /* Enable trace buffers. Check buffers are already allocated. */
         if ( opt_tbuf_size == 0 ) 
@@ -717,6 +765,9 @@ void __trace_var(u32 event, bool_t cycles, unsigned int extra,
     if ( !cpumask_test_cpu(smp_processor_id(), &tb_cpu_mask) )
         return;
 
+    if ( !tb_filter_current() )
+        return;
+
     /* Read tb_init_done /before/ t_bufs. */
     smp_rmb();
 
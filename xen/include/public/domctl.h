@@ -36,7 +36,7 @@
 #include "grant_table.h"
 #include "hvm/save.h"
 
-#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000a
+#define XEN_DOMCTL_INTERFACE_VERSION 0x0000000b
 
 /*
  * NB. xen_domctl.domain is an IN/OUT parameter for this operation.
@@ -192,6 +192,13 @@ struct xen_domctl_getpageframeinfo3 {
 #define XEN_DOMCTL_SHADOW_OP_CLEAN       11
  /* Return the bitmap but do not modify internal copy. */
 #define XEN_DOMCTL_SHADOW_OP_PEEK        12
+ /*
+  * As CLEAN and PEEK, but return the dirty pfns below 'pages' as extents in
+  * dirty_ranges rather than as a bitmap.  Once there is room for only one
+  * more extent, it covers all of the pfns left, dirty or not.
+  */
+#define XEN_DOMCTL_SHADOW_OP_CLEAN_RANGES 13
+#define XEN_DOMCTL_SHADOW_OP_PEEK_RANGES  14
 
 /* Memory allocation accessors. */
 #define XEN_DOMCTL_SHADOW_OP_GET_ALLOCATION   30
@@ -233,6 +240,13 @@ struct xen_domctl_shadow_op_stats {
 typedef struct xen_domctl_shadow_op_stats xen_domctl_shadow_op_stats_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_stats_t);
 
+struct xen_domctl_shadow_op_range {
+    uint64_aligned_t first_pfn;
+    uint64_aligned_t nr_pfns;
+};
+typedef struct xen_domctl_shadow_op_range xen_domctl_shadow_op_range_t;
+DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_range_t);
+
 struct xen_domctl_shadow_op {
     /* IN variables. */
     uint32_t       op;       /* XEN_DOMCTL_SHADOW_OP_* */
@@ -247,6 +261,10 @@ struct xen_domctl_shadow_op {
     XEN_GUEST_HANDLE_64(uint8) dirty_bitmap;
     uint64_aligned_t pages; /* Size of buffer. Updated with actual size. */
     struct xen_domctl_shadow_op_stats stats;
+
+    /* OP_PEEK_RANGES / OP_CLEAN_RANGES */
+    XEN_GUEST_HANDLE_64(xen_domctl_shadow_op_range_t) dirty_ranges;
+    uint32_t       nr_ranges; /* Size of buffer. Updated with extents used. */
 };
 typedef struct xen_domctl_shadow_op xen_domctl_shadow_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_domctl_shadow_op_t);
@@ -309,6 +309,7 @@ typedef uint16_t grant_status_t;
 #define GNTTABOP_get_status_frames    9
 #define GNTTABOP_get_version          10
 #define GNTTABOP_swap_grant_ref	      11
+#define GNTTABOP_flush_unmaps         12
 #endif /* __XEN_INTERFACE_VERSION__ */
 /* ` } */
 
@@ -357,7 +358,8 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_map_grant_ref_t);
  *  1. The call may fail in an undefined manner if either mapping is not
  *     tracked by <handle>.
  *  3. After executing a batch of unmaps, it is guaranteed that no stale
- *     mappings will remain in the device or host TLBs.
+ *     mappings will remain in the device or host TLBs, except for host
+ *     mappings created with GNTMAP_defer_unmap (see below).
  */
 struct gnttab_unmap_grant_ref {
     /* IN parameters. */
@@ -452,7 +454,7 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_transfer_t);
 
 struct gnttab_copy {
     /* IN parameters. */
-    struct {
+    struct gnttab_copy_ptr {
         union {
             grant_ref_t ref;
             xen_pfn_t   gmfn;
@@ -574,6 +576,13 @@ struct gnttab_swap_grant_ref {
 typedef struct gnttab_swap_grant_ref gnttab_swap_grant_ref_t;
 DEFINE_XEN_GUEST_HANDLE(gnttab_swap_grant_ref_t);
 
+/*
+ * GNTTABOP_flush_unmaps: Complete all of the calling domain's deferred
+ * unmaps (see GNTMAP_defer_unmap), flushing the TLBs as necessary.  On
+ * return the granting domains see all those grants as released.  The
+ * argument and count are ignored.
+ */
+
 #endif /* __XEN_INTERFACE_VERSION__ */
 
 /*
@@ -607,6 +616,19 @@ DEFINE_XEN_GUEST_HANDLE(gnttab_swap_grant_ref_t);
 #define _GNTMAP_can_fail        (5)
 #define GNTMAP_can_fail         (1<<_GNTMAP_can_fail)
 
+ /*
+  * GNTMAP_host_map subflag:
+  *  0 => Unmapping flushes the host TLBs before returning.
+  *  1 => Unmapping removes the PTE but may defer the TLB flush, so stale
+  *       translations can remain until a later unmap batch,
+  *       GNTTABOP_flush_unmaps, or a few milliseconds have passed.
+  *       Until then the grant stays in use: the granting domain still
+  *       sees GTF_reading/GTF_writing set and the mapping's handle is not
+  *       reused.  Ignored for domains whose mappings live in the p2m.
+  */
+#define _GNTMAP_defer_unmap     (6)
+#define GNTMAP_defer_unmap      (1<<_GNTMAP_defer_unmap)
+
 /*
  * Bits to be placed in guest kernel available PTE bits (architecture
  * dependent; only supported when XENFEAT_gnttab_map_avail_bits is set).
@@ -371,6 +371,7 @@ typedef struct xen_pod_target xen_pod_target_t;
 #define XENMEM_paging_op_nominate           0
 #define XENMEM_paging_op_evict              1
 #define XENMEM_paging_op_prep               2
+#define XENMEM_paging_op_absent             3
 
 struct xen_mem_event_op {
     uint8_t     op;         /* XENMEM_*_op_* */
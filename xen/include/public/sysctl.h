@@ -34,7 +34,7 @@
 #include "xen.h"
 #include "domctl.h"
 
-#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000B
+#define XEN_SYSCTL_INTERFACE_VERSION 0x0000000C
 
 /*
  * Read console content from Xen buffer ring.
@@ -69,6 +69,15 @@ struct xen_sysctl_tbuf_op {
 #define XEN_SYSCTL_TBUFOP_set_size     3
 #define XEN_SYSCTL_TBUFOP_enable       4
 #define XEN_SYSCTL_TBUFOP_disable      5
+/*
+ * Only record events raised while a vCPU matching one of the filters is
+ * running.  With no filters installed (the default) everything is traced.
+ * Events raised from the idle vCPU can be kept by adding a DOMID_IDLE
+ * filter.  add_filter fails with -ENOSPC once XEN_SYSCTL_TBUF_MAX_FILTERS
+ * filters are installed.
+ */
+#define XEN_SYSCTL_TBUFOP_add_filter    6
+#define XEN_SYSCTL_TBUFOP_clear_filters 7
     uint32_t cmd;
     /* IN/OUT variables */
     struct xenctl_bitmap cpu_mask;
@@ -76,6 +85,12 @@ struct xen_sysctl_tbuf_op {
     /* OUT variables */
     uint64_aligned_t buffer_mfn;
     uint32_t size;  /* Also an IN variable! */
+    /* IN variables: used by add_filter only */
+#define XEN_SYSCTL_TBUF_MAX_FILTERS     8
+#define XEN_SYSCTL_TBUF_ANY_VCPU        (~0U)
+    domid_t  filter_domid;
+    uint16_t pad;
+    uint32_t filter_vcpu;   /* vCPU ID, or XEN_SYSCTL_TBUF_ANY_VCPU */
 };
 typedef struct xen_sysctl_tbuf_op xen_sysctl_tbuf_op_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_tbuf_op_t);
@@ -161,6 +176,54 @@ struct xen_sysctl_getdomaininfolist {
 typedef struct xen_sysctl_getdomaininfolist xen_sysctl_getdomaininfolist_t;
 DEFINE_XEN_GUEST_HANDLE(xen_sysctl_getdomaininfolist_t);
 
+/*
+ * XEN_SYSCTL_getdomainstats
+ *
+ * Snapshot of the domain information of every domain with an ID of at
+ * least first_domain, together with the runstate of each of their
+ * vCPUs, in one call.  A domain is only returned if records for all
+ * of its vCPUs fit in the vcpus buffer; -ENOBUFS is returned if not
+ * even the first domain fits.  next_domain is where a further call
+ * should continue from, or DOMID_INVALID if all domains were returned.
+ * A domain whose vCPU information the caller may not see (see
+ * XEN_DOMCTL_getvcpuinfo) is returned with no vCPU records.
+ */
+struct xen_sysctl_vcpustats {
+    uint32_t vcpu;
+    uint32_t cpu;                /* physical CPU last run on */
+#define XEN_VCPUSTATS_online   (1U<<0)
+#define XEN_VCPUSTATS_blocked  (1U<<1)
+#define XEN_VCPUSTATS_running  (1U<<2)
+    uint32_t flags;
+    int32_t  state;              /* RUNSTATE_* */
+    uint64_aligned_t time[4];    /* ns spent in each RUNSTATE_* */
+};
+typedef struct xen_sysctl_vcpustats xen_sysctl_vcpustats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_vcpustats_t);
+
+struct xen_sysctl_domainstats {
+    struct xen_domctl_getdomaininfo info;
+    uint32_t first_vcpu;         /* index of the domain's first vCPU record */
+    uint32_t nr_vcpus;
+};
+typedef struct xen_sysctl_domainstats xen_sysctl_domainstats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_domainstats_t);
+
+struct xen_sysctl_getdomainstats {
+    /* IN variables. */
+    domid_t               first_domain;
+    uint32_t              max_domains;
+    uint32_t              max_vcpus;
+    XEN_GUEST_HANDLE_64(xen_sysctl_domainstats_t) domains;
+    XEN_GUEST_HANDLE_64(xen_sysctl_vcpustats_t) vcpus;
+    /* OUT variables. */
+    uint32_t              num_domains;
+    uint32_t              num_vcpus;
+    domid_t               next_domain;
+};
+typedef struct xen_sysctl_getdomainstats xen_sysctl_getdomainstats_t;
+DEFINE_XEN_GUEST_HANDLE(xen_sysctl_getdomainstats_t);
+
 /* Inject debug keys into Xen. */
 /* XEN_SYSCTL_debug_keys */
 struct xen_sysctl_debug_keys {
@@ -658,6 +721,7 @@ struct xen_sysctl {
 #define XEN_SYSCTL_cpupool_op                    18
 #define XEN_SYSCTL_scheduler_op                  19
 #define XEN_SYSCTL_coverage_op                   20
+#define XEN_SYSCTL_getdomainstats                21
     uint32_t interface_version; /* XEN_SYSCTL_INTERFACE_VERSION */
     union {
         struct xen_sysctl_readconsole       readconsole;
@@ -679,6 +743,7 @@ struct xen_sysctl {
         struct xen_sysctl_cpupool_op        cpupool_op;
         struct xen_sysctl_scheduler_op      scheduler_op;
         struct xen_sysctl_coverage_op       coverage_op;
+        struct xen_sysctl_getdomainstats    getdomainstats;
         uint8_t                             pad[128];
     } u;
 };
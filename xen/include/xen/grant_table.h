@@ -24,6 +24,7 @@
 #ifndef __XEN_GRANT_TABLE_H__
 #define __XEN_GRANT_TABLE_H__
 
+#include <xen/timer.h>
 #include <public/grant_table.h>
 #include <asm/page.h>
 #include <asm/grant_table.h>
@@ -60,8 +61,10 @@ extern unsigned int max_nr_grant_frames;
  */
 struct grant_mapping {
     u32      ref;           /* grant ref */
-    u16      flags;         /* 0-4: GNTMAP_* ; 5-15: unused */
+    u16      flags;         /* 0-6: GNTMAP_* ; 7-15: unused */
     domid_t  domid;         /* granting domain */
+    u32      vcpu;          /* vcpu whose free list owns this handle */
+    u32      pad;           /* round size to a power of 2 */
 };
 
 /* Per-domain grant information. */
@@ -82,10 +85,25 @@ struct grant_table {
     struct active_grant_entry **active;
     /* Mapping tracking table. */
     struct grant_mapping **maptrack;
-    unsigned int          maptrack_head;
     unsigned int          maptrack_limit;
-    /* Lock protecting updates to active and shared grant tables. */
-    spinlock_t            lock;
+    /* Lock serialising growth of the maptrack table. */
+    spinlock_t            maptrack_lock;
+    /*
+     * Lock protecting the table's size and version.  Taken for reading
+     * by operations on individual entries, which then lock the active
+     * entry they work on, and for writing to grow or switch the table.
+     */
+    rwlock_t              lock;
+    /*
+     * Unmaps of GNTMAP_defer_unmap mappings waiting for a TLB flush, the
+     * TLB flush clock when the newest of them was queued, and a timer
+     * bounding how long the oldest may wait.
+     */
+    spinlock_t            unmap_lock;
+    struct gnttab_unmap_common *deferred_unmaps;
+    unsigned int          nr_deferred_unmaps;
+    u32                   deferred_unmap_stamp;
+    struct timer          unmap_timer;
     /* The defined versions are 1 and 2.  Set to 0 if we don't know
        what version to use yet. */
     unsigned              gt_version;
@@ -96,6 +114,8 @@ int grant_table_create(
     struct domain *d);
 void grant_table_destroy(
     struct domain *d);
+void grant_table_init_vcpu(
+    struct vcpu *v);
 
 /* Domain death release of granted mappings of other domains' memory. */
 void
@@ -103,7 +123,7 @@ gnttab_release_mappings(
     struct domain *d);
 
 /* Increase the size of a domain's grant table.
- * Caller must hold d's grant table lock.
+ * Caller must hold d's grant table write lock.
  */
 int
 gnttab_grow_table(struct domain *d, unsigned int req_nr_frames);
@@ -52,5 +52,18 @@ PERFCOUNTER(migrate_kicked_away,    "csched: migrate_kicked_away")
 PERFCOUNTER(vcpu_hot,               "csched: vcpu_hot")
 
 PERFCOUNTER(need_flush_tlb_flush,   "PG_need_flush tlb flushes")
+PERFCOUNTER(page_cache_refills,     "page cache refills")
+PERFCOUNTER(page_cache_drains,      "page cache drains")
+
+/* grant table counters */
+PERFCOUNTER(gnttab_copy_batches,    "gnttab: copy batches")
+PERFCOUNTER_ARRAY(gnttab_copy_batch_size, "gnttab: copy batch size (log2)", 8)
+PERFCOUNTER(gnttab_copy_ops,        "gnttab: copy ops")
+PERFCOUNTER(gnttab_copy_domain_locks, "gnttab: copy domain lookups")
+PERFCOUNTER(gnttab_copy_buf_claims, "gnttab: copy frames claimed")
+PERFCOUNTER(gnttab_copy_buf_reuses, "gnttab: copy frames reused")
+PERFCOUNTER(gnttab_unmap_deferred,  "gnttab: unmaps deferred")
+PERFCOUNTER(gnttab_unmap_flush_ipi, "gnttab: deferred unmap flush IPIs")
+PERFCOUNTER(gnttab_unmap_flush_elided, "gnttab: deferred unmap flushes elided")
 
 /*#endif*/ /* __XEN_PERFC_DEFN_H__ */
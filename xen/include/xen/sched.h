@@ -241,6 +241,10 @@ struct vcpu
 
     struct evtchn_fifo_vcpu *evtchn_fifo;
 
+    /* Free maptrack handles owned by this VCPU (see grant_table.c). */
+    unsigned int     maptrack_head;
+    spinlock_t       maptrack_freelist_lock;
+
     struct arch_vcpu arch;
 };
 
@@ -728,6 +728,7 @@ static int flask_sysctl(int cmd)
     /* These have individual XSM hooks */
     case XEN_SYSCTL_readconsole:
     case XEN_SYSCTL_getdomaininfolist:
+    case XEN_SYSCTL_getdomainstats:
     case XEN_SYSCTL_page_offline_op:
     case XEN_SYSCTL_scheduler_op:
 #ifdef CONFIG_X86
@@ -1206,6 +1207,8 @@ static int flask_shadow_control(struct domain *d, uint32_t op)
     case XEN_DOMCTL_SHADOW_OP_ENABLE_LOGDIRTY:
     case XEN_DOMCTL_SHADOW_OP_PEEK:
     case XEN_DOMCTL_SHADOW_OP_CLEAN:
+    case XEN_DOMCTL_SHADOW_OP_PEEK_RANGES:
+    case XEN_DOMCTL_SHADOW_OP_CLEAN_RANGES:
         perm = SHADOW__LOGDIRTY;
         break;
     default: